@@ -0,0 +1,230 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "camera_encode_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+
+/* BITMAPFILEHEADER followed by BITMAPINFOHEADER */
+#define BMP_HEADER_LEN 54
+#define BMP_INFO_HEADER_LEN 40
+/* 72 dpi */
+#define BMP_PIXELS_PER_METER 2835
+
+/** Pool state. */
+struct camera_encode_pool
+{
+    /** Protects @c free and @c stats. */
+    portMUX_TYPE lock;
+    /** All buffers, one after the other. */
+    uint8_t *base;
+    /** Size of each buffer. */
+    size_t size;
+    /** Bit set for every free buffer. */
+    uint32_t free;
+    struct camera_encode_pool_stats stats;
+};
+
+/** Output of the JPEG encoder into a buffer from the pool. */
+struct pool_writer
+{
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+};
+
+esp_err_t camera_encode_pool_create(uint32_t count, size_t size, camera_encode_pool_handle_t *pool)
+{
+    assert(count > 0 && count <= CAMERA_ENCODE_POOL_MAX_BUFFERS && size > 0 && pool != NULL);
+
+    struct camera_encode_pool *new_pool = calloc(1, sizeof(*new_pool));
+    if (new_pool == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* One block for all buffers, allocated before the heap has been used for frames. */
+    new_pool->base = heap_caps_malloc_prefer(count * size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+                                             MALLOC_CAP_DEFAULT);
+    if (new_pool->base == NULL)
+    {
+        free(new_pool);
+        return ESP_ERR_NO_MEM;
+    }
+
+    portMUX_INITIALIZE(&new_pool->lock);
+    new_pool->size = size;
+    new_pool->free = count == 32 ? UINT32_MAX : (1UL << count) - 1;
+    new_pool->stats.count = count;
+    new_pool->stats.size = size;
+    *pool = new_pool;
+    return ESP_OK;
+}
+
+uint8_t *camera_encode_pool_acquire(camera_encode_pool_handle_t pool)
+{
+    uint8_t *buf = NULL;
+    int64_t start = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&pool->lock);
+    if (pool->free != 0)
+    {
+        unsigned index = __builtin_ctz(pool->free);
+        pool->free &= ~(1UL << index);
+        buf = pool->base + index * pool->size;
+
+        pool->stats.acquired++;
+        if (++pool->stats.in_use > pool->stats.high_water)
+        {
+            pool->stats.high_water = pool->stats.in_use;
+        }
+    }
+    else
+    {
+        pool->stats.exhausted++;
+    }
+    int64_t acquire_us = esp_timer_get_time() - start;
+    if (acquire_us > pool->stats.acquire_max_us)
+    {
+        pool->stats.acquire_max_us = acquire_us;
+    }
+    taskEXIT_CRITICAL(&pool->lock);
+
+    return buf;
+}
+
+void camera_encode_pool_release(camera_encode_pool_handle_t pool, uint8_t *buf)
+{
+    if (buf == NULL)
+    {
+        return;
+    }
+
+    size_t offset = buf - pool->base;
+    unsigned index = offset / pool->size;
+    assert(buf >= pool->base && offset % pool->size == 0 && index < pool->stats.count);
+
+    taskENTER_CRITICAL(&pool->lock);
+    assert((pool->free & (1UL << index)) == 0);
+    pool->free |= 1UL << index;
+    pool->stats.in_use--;
+    taskEXIT_CRITICAL(&pool->lock);
+}
+
+size_t camera_encode_pool_buffer_size(camera_encode_pool_handle_t pool)
+{
+    return pool->size;
+}
+
+void camera_encode_pool_get_stats(camera_encode_pool_handle_t pool,
+                                  struct camera_encode_pool_stats *stats)
+{
+    taskENTER_CRITICAL(&pool->lock);
+    *stats = pool->stats;
+    taskEXIT_CRITICAL(&pool->lock);
+}
+
+size_t camera_encode_pool_jpeg_size(framesize_t framesize)
+{
+    return (size_t)resolution[framesize].width * resolution[framesize].height / 2;
+}
+
+size_t camera_encode_pool_bmp_size(framesize_t framesize)
+{
+    return BMP_HEADER_LEN + (size_t)resolution[framesize].width * resolution[framesize].height * 3;
+}
+
+/* frame2jpg_cb output callback, appending to the buffer */
+static size_t pool_write(void *arg, size_t index, const void *data, size_t len)
+{
+    struct pool_writer *writer = arg;
+
+    if (len > writer->size - writer->len)
+    {
+        /* Stops the encoder */
+        return 0;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+    return len;
+}
+
+bool camera_encode_pool_jpeg(camera_fb_t *fb, uint8_t quality, uint8_t *buf, size_t size,
+                             size_t *len)
+{
+    if (fb->format == PIXFORMAT_JPEG)
+    {
+        if (fb->len > size)
+        {
+            return false;
+        }
+        memcpy(buf, fb->buf, fb->len);
+        *len = fb->len;
+        return true;
+    }
+
+    struct pool_writer writer = {.buf = buf, .size = size};
+    if (!frame2jpg_cb(fb, quality, pool_write, &writer))
+    {
+        return false;
+    }
+    *len = writer.len;
+    return true;
+}
+
+static void put_le16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+    put_le16(p, value);
+    put_le16(p + 2, value >> 16);
+}
+
+bool camera_encode_pool_bmp(camera_fb_t *fb, uint8_t *buf, size_t size, size_t *len)
+{
+    /* Rows are not padded, which every frame size's width allows */
+    size_t pixels_len = fb->width * fb->height * 3;
+    if (BMP_HEADER_LEN + pixels_len > size)
+    {
+        return false;
+    }
+
+    memset(buf, 0, BMP_HEADER_LEN);
+    buf[0] = 'B';
+    buf[1] = 'M';
+    put_le32(buf + 2, BMP_HEADER_LEN + pixels_len);
+    put_le32(buf + 10, BMP_HEADER_LEN);
+    put_le32(buf + 14, BMP_INFO_HEADER_LEN);
+    put_le32(buf + 18, fb->width);
+    /* Negative height for rows stored top down, as the camera produces them */
+    put_le32(buf + 22, -(int32_t)fb->height);
+    put_le16(buf + 26, 1);
+    put_le16(buf + 28, 24);
+    put_le32(buf + 34, pixels_len);
+    put_le32(buf + 38, BMP_PIXELS_PER_METER);
+    put_le32(buf + 42, BMP_PIXELS_PER_METER);
+
+    /* Produces BGR, the order BMP stores pixels in */
+    if (!fmt2rgb888(fb->buf, fb->len, fb->format, buf + BMP_HEADER_LEN))
+    {
+        return false;
+    }
+    *len = BMP_HEADER_LEN + pixels_len;
+    return true;
+}
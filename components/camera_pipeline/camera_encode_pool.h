@@ -0,0 +1,140 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Fixed pool of buffers for encoded frames.
+ *
+ * @c frame2jpg and @c frame2bmp allocate a buffer for every frame they encode, up to a megabyte for
+ * a VGA bitmap, which is freed once the frame has been sent. On a node running for weeks, the
+ * smaller allocations made in between split PSRAM up until no free block is large enough for the
+ * next frame. A pool allocates its buffers once, as a single block, and hands them out and back
+ * without touching the heap again.
+ *
+ * The encode functions here write into a buffer from a pool instead of allocating one. Buffers are
+ * sized for the largest frame, see @ref camera_encode_pool_jpeg_size and
+ * @ref camera_encode_pool_bmp_size, so the frame size may be lowered but not raised once the pool
+ * has been created.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+#include "esp_err.h"
+
+/** Maximum number of buffers in a pool. */
+#define CAMERA_ENCODE_POOL_MAX_BUFFERS 32
+
+/** Pool of encode buffers. */
+typedef struct camera_encode_pool *camera_encode_pool_handle_t;
+
+/** Pool statistics since creation. */
+struct camera_encode_pool_stats
+{
+    /** Number of buffers. */
+    uint32_t count;
+    /** Size of each buffer in bytes. */
+    size_t size;
+    /** Buffers currently acquired. */
+    uint32_t in_use;
+    /** Most buffers acquired at once. */
+    uint32_t high_water;
+    /** Successful acquisitions. */
+    uint32_t acquired;
+    /** Acquisitions that failed because every buffer was in use. */
+    uint32_t exhausted;
+    /** Longest an acquisition took, in microseconds. */
+    int64_t acquire_max_us;
+};
+
+/**
+ * Create a pool, allocating all its buffers, in PSRAM when there is some.
+ *
+ * @param[in] count Number of buffers, at most @ref CAMERA_ENCODE_POOL_MAX_BUFFERS.
+ * @param[in] size Size of each buffer in bytes.
+ * @param[out] pool The new pool.
+ * @return ESP_OK, or ESP_ERR_NO_MEM if the buffers could not be allocated.
+ */
+esp_err_t camera_encode_pool_create(uint32_t count, size_t size, camera_encode_pool_handle_t *pool);
+
+/**
+ * Take a free buffer from the pool, without waiting.
+ *
+ * @param[in] pool Pool to take the buffer from.
+ * @return The buffer, or NULL if every buffer is in use.
+ */
+uint8_t *camera_encode_pool_acquire(camera_encode_pool_handle_t pool);
+
+/**
+ * Give a buffer back to the pool.
+ *
+ * @param[in] pool Pool the buffer was taken from.
+ * @param[in] buf Buffer to give back, may be NULL.
+ */
+void camera_encode_pool_release(camera_encode_pool_handle_t pool, uint8_t *buf);
+
+/**
+ * Size of each buffer in the pool.
+ *
+ * @param[in] pool Pool.
+ * @return Buffer size in bytes.
+ */
+size_t camera_encode_pool_buffer_size(camera_encode_pool_handle_t pool);
+
+/**
+ * Get the pool statistics.
+ *
+ * @param[in] pool Pool.
+ * @param[out] stats Statistics since the pool was created.
+ */
+void camera_encode_pool_get_stats(camera_encode_pool_handle_t pool,
+                                  struct camera_encode_pool_stats *stats);
+
+/**
+ * Buffer size for JPEG frames of a frame size, whether encoded by the sensor or in software.
+ *
+ * This allows 4 bits per pixel, more than the camera driver reserves for sensor JPEG frames and
+ * than software encoding produces below quality 90 for camera images.
+ *
+ * @param[in] framesize Largest frame size the buffers will hold.
+ * @return Size in bytes.
+ */
+size_t camera_encode_pool_jpeg_size(framesize_t framesize);
+
+/**
+ * Buffer size for 24 bit BMP frames of a frame size.
+ *
+ * @param[in] framesize Largest frame size the buffers will hold.
+ * @return Size in bytes.
+ */
+size_t camera_encode_pool_bmp_size(framesize_t framesize);
+
+/**
+ * Encode a frame as JPEG into a buffer, copying it if the sensor already encoded it.
+ *
+ * @param[in] fb Camera frame.
+ * @param[in] quality JPEG quality for frames encoded in software, 1 (smallest) to 100 (best).
+ * @param[out] buf Buffer to encode into.
+ * @param[in] size Size of @p buf.
+ * @param[out] len Length of the encoded frame.
+ * @return true on success, false if encoding failed or the frame did not fit.
+ */
+bool camera_encode_pool_jpeg(camera_fb_t *fb, uint8_t quality, uint8_t *buf, size_t size,
+                             size_t *len);
+
+/**
+ * Encode a frame as a 24 bit BMP into a buffer.
+ *
+ * @param[in] fb Camera frame.
+ * @param[out] buf Buffer to encode into.
+ * @param[in] size Size of @p buf.
+ * @param[out] len Length of the encoded frame.
+ * @return true on success, false if conversion failed or the frame did not fit.
+ */
+bool camera_encode_pool_bmp(camera_fb_t *fb, uint8_t *buf, size_t size, size_t *len);
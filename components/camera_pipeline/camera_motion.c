@@ -0,0 +1,362 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "camera_motion.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+/* Pixels per side of a block */
+#define BLOCK_PIXELS (CAMERA_MOTION_CELL_SIZE * CAMERA_MOTION_BLOCK_CELLS)
+/* Width of the vector registers, which the block buffers are aligned to */
+#define VECTOR_ALIGN 16
+/* Times the kernels are run when comparing their speed */
+#define BENCHMARK_RUNS 16
+
+/** Detector state. */
+struct camera_motion
+{
+    /** Background model, its frame blocks followed in one allocation by those of the background. */
+    struct camera_motion_model model;
+    /** Protects @c stats. */
+    portMUX_TYPE lock;
+    struct camera_motion_stats stats;
+    /** Luma sums of a row of cells, while averaging uncompressed frames. */
+    uint16_t *row_sums;
+    /** Blocks across and in all, for the largest frame size. */
+    uint32_t max_cols;
+    uint32_t max_blocks;
+};
+
+/** JPEG frame being decoded into a grid. */
+struct motion_jpeg
+{
+    const camera_fb_t *fb;
+    const struct camera_motion_grid *grid;
+};
+
+static const char *TAG = "camera_motion";
+
+#if CONFIG_CAMERA_MOTION_SIMD
+/* camera_motion_sad_esp32s3.S */
+void camera_motion_block_sad_esp32s3(const uint8_t *cur, const uint8_t *bg, uint16_t *sad,
+                                     size_t blocks);
+
+/* Cleared if the vector kernel disagrees with the reference */
+static bool simd_ok = true;
+#endif
+
+void camera_motion_block_sad(const uint8_t *cur, const uint8_t *bg, uint16_t *sad, size_t blocks)
+{
+#if CONFIG_CAMERA_MOTION_SIMD
+    if (simd_ok)
+    {
+        camera_motion_block_sad_esp32s3(cur, bg, sad, blocks);
+        return;
+    }
+#endif
+    camera_motion_block_sad_ref(cur, bg, sad, blocks);
+}
+
+/* BT.601 luma of 8 bit components */
+static uint8_t rgb_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    return (77 * r + 150 * g + 29 * b) >> 8;
+}
+
+/**
+ * Luma of a pixel of an uncompressed frame.
+ *
+ * @param[in] buf Frame data.
+ * @param[in] format Grayscale, YUV422 or RGB565.
+ * @param[in] i Pixel index.
+ * @return 8 bit luma.
+ */
+static uint8_t pixel_luma(const uint8_t *buf, pixformat_t format, size_t i)
+{
+    switch (format)
+    {
+    case PIXFORMAT_GRAYSCALE:
+        return buf[i];
+    case PIXFORMAT_YUV422:
+        /* YUYV, luma every other byte */
+        return buf[2 * i];
+    default:
+    {
+        /* RGB565, high byte first */
+        uint8_t hi = buf[2 * i];
+        uint8_t lo = buf[2 * i + 1];
+        return rgb_luma(hi & 0xf8, ((hi & 0x07) << 5) | ((lo & 0xe0) >> 3), (lo & 0x1f) << 3);
+    }
+    }
+}
+
+/**
+ * Average the cells of an uncompressed frame into a grid, a row of cells at a time.
+ *
+ * @param[in] motion Detector, for its row buffer.
+ * @param[in] fb Grayscale, YUV422 or RGB565 frame.
+ * @param[in] grid Grid to write into.
+ */
+static void motion_cells_raw(struct camera_motion *motion, const camera_fb_t *fb,
+                             const struct camera_motion_grid *grid)
+{
+    uint32_t cells_x = grid->cols * CAMERA_MOTION_BLOCK_CELLS;
+    uint32_t cells_y = grid->rows * CAMERA_MOTION_BLOCK_CELLS;
+
+    for (uint32_t cy = 0; cy < cells_y; cy++)
+    {
+        memset(motion->row_sums, 0, cells_x * sizeof(motion->row_sums[0]));
+        for (uint32_t y = cy * CAMERA_MOTION_CELL_SIZE; y < (cy + 1) * CAMERA_MOTION_CELL_SIZE; y++)
+        {
+            size_t i = y * fb->width;
+            for (uint32_t cx = 0; cx < cells_x; cx++)
+            {
+                for (uint32_t x = 0; x < CAMERA_MOTION_CELL_SIZE; x++)
+                {
+                    motion->row_sums[cx] += pixel_luma(fb->buf, fb->format, i++);
+                }
+            }
+        }
+
+        /* The average of the 64 pixels, halved to 7 bits */
+        for (uint32_t cx = 0; cx < cells_x; cx++)
+        {
+            camera_motion_grid_put(grid, cx, cy, motion->row_sums[cx] >> 7);
+        }
+    }
+}
+
+/* esp_jpg_decode() input callback, reading from the frame buffer */
+static size_t motion_jpeg_read(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+    const struct motion_jpeg *jpeg = arg;
+
+    /* Without a buffer the decoder is skipping data */
+    if (buf != NULL)
+    {
+        memcpy(buf, jpeg->fb->buf + index, len);
+    }
+    return len;
+}
+
+/* esp_jpg_decode() output callback, taking the RGB888 pixels of the decoded rectangle as cells */
+static bool motion_jpeg_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                              uint8_t *data)
+{
+    const struct motion_jpeg *jpeg = arg;
+
+    /* Called without data at the start and the end of the image */
+    if (data == NULL)
+    {
+        return true;
+    }
+
+    for (uint16_t j = 0; j < h; j++)
+    {
+        for (uint16_t i = 0; i < w; i++)
+        {
+            const uint8_t *rgb = data + (j * w + i) * 3;
+            camera_motion_grid_put(jpeg->grid, x + i, y + j, rgb_luma(rgb[0], rgb[1], rgb[2]) >> 1);
+        }
+    }
+    return true;
+}
+
+#if CONFIG_CAMERA_MOTION_SIMD
+/**
+ * Check the vector kernel against the reference on pseudo-random blocks and log how long each
+ * takes, falling back to the reference if they disagree.
+ *
+ * @param[in] motion Detector, whose buffers are used.
+ */
+static void motion_self_check(struct camera_motion *motion)
+{
+    size_t blocks = motion->max_blocks;
+    uint16_t *expected = malloc(blocks * sizeof(*expected));
+    if (expected == NULL)
+    {
+        ESP_LOGW(TAG, "No memory to check the vector kernel");
+        return;
+    }
+
+    /* Includes the extremes, 0 against 127 and 127 against 0 */
+    uint32_t state = 1;
+    for (size_t i = 0; i < blocks * CAMERA_MOTION_BLOCK_LEN; i++)
+    {
+        state = state * 1664525 + 1013904223;
+        motion->model.cur[i] = i < CAMERA_MOTION_BLOCK_LEN ? (i & 1) * 127 : (state >> 24) & 0x7f;
+        motion->model.bg[i] = i < CAMERA_MOTION_BLOCK_LEN ? (~i & 1) * 127 : (state >> 16) & 0x7f;
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int run = 0; run < BENCHMARK_RUNS; run++)
+    {
+        camera_motion_block_sad_ref(motion->model.cur, motion->model.bg, expected, blocks);
+    }
+    int64_t ref_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int run = 0; run < BENCHMARK_RUNS; run++)
+    {
+        camera_motion_block_sad_esp32s3(motion->model.cur, motion->model.bg, motion->model.sad,
+                                        blocks);
+    }
+    int64_t simd_us = esp_timer_get_time() - start;
+
+    if (memcmp(expected, motion->model.sad, blocks * sizeof(*expected)) != 0)
+    {
+        ESP_LOGE(TAG, "Vector kernel disagrees with the reference, using the reference");
+        simd_ok = false;
+    }
+    else
+    {
+        ESP_LOGI(TAG, "SAD of %lu blocks: vector %.1f us, scalar %.1f us", (unsigned long)blocks,
+                 (double)simd_us / BENCHMARK_RUNS, (double)ref_us / BENCHMARK_RUNS);
+    }
+    free(expected);
+}
+#endif
+
+esp_err_t camera_motion_create(const struct camera_motion_config *config, framesize_t framesize,
+                               camera_motion_handle_t *motion)
+{
+    assert(config != NULL && motion != NULL);
+
+    uint32_t cols = resolution[framesize].width / BLOCK_PIXELS;
+    uint32_t rows = resolution[framesize].height / BLOCK_PIXELS;
+    if (config->block_threshold == 0 || config->area_percent < 1 || config->area_percent > 100
+        || config->background_shift > 7 || cols == 0 || rows == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct camera_motion *new_motion = calloc(1, sizeof(*new_motion));
+    if (new_motion == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    new_motion->max_cols = cols;
+    new_motion->max_blocks = cols * rows;
+    struct camera_motion_model *model = &new_motion->model;
+    model->cur = heap_caps_aligned_calloc(VECTOR_ALIGN, 2 * new_motion->max_blocks,
+                                          CAMERA_MOTION_BLOCK_LEN, MALLOC_CAP_8BIT);
+    model->sad = malloc(new_motion->max_blocks * sizeof(model->sad[0]));
+    new_motion->row_sums =
+        malloc(cols * CAMERA_MOTION_BLOCK_CELLS * sizeof(new_motion->row_sums[0]));
+    if (model->cur == NULL || model->sad == NULL || new_motion->row_sums == NULL)
+    {
+        heap_caps_free(model->cur);
+        free(model->sad);
+        free(new_motion->row_sums);
+        free(new_motion);
+        return ESP_ERR_NO_MEM;
+    }
+
+    model->bg = model->cur + new_motion->max_blocks * CAMERA_MOTION_BLOCK_LEN;
+    model->config = *config;
+    model->block_sad = camera_motion_block_sad;
+    portMUX_INITIALIZE(&new_motion->lock);
+
+#if CONFIG_CAMERA_MOTION_SIMD
+    motion_self_check(new_motion);
+#endif
+
+    ESP_LOGI(TAG, "Created: up to %lux%lu blocks, threshold %u, area %u%%, keyframe every %lu ms",
+             (unsigned long)cols, (unsigned long)rows, config->block_threshold,
+             config->area_percent, (unsigned long)config->keyframe_interval_ms);
+    *motion = new_motion;
+    return ESP_OK;
+}
+
+bool camera_motion_check(camera_motion_handle_t motion, const camera_fb_t *fb,
+                         struct camera_motion_result *result)
+{
+    int64_t start = esp_timer_get_time();
+    struct camera_motion_result outcome = {0};
+    struct camera_motion_grid grid = {
+        .blocks = motion->model.cur,
+        .cols = fb->width / BLOCK_PIXELS,
+        .rows = fb->height / BLOCK_PIXELS,
+    };
+    size_t blocks = grid.cols * grid.rows;
+    bool ok = blocks > 0 && grid.cols <= motion->max_cols && blocks <= motion->max_blocks;
+
+    if (ok)
+    {
+        switch (fb->format)
+        {
+        case PIXFORMAT_JPEG:
+        {
+            /* Decoding at an eighth of the size gives one pixel per cell */
+            struct motion_jpeg jpeg = {.fb = fb, .grid = &grid};
+            ok = esp_jpg_decode(fb->len, JPG_SCALE_8X, motion_jpeg_read, motion_jpeg_write, &jpeg)
+                 == ESP_OK;
+            break;
+        }
+        case PIXFORMAT_GRAYSCALE:
+        case PIXFORMAT_YUV422:
+        case PIXFORMAT_RGB565:
+            motion_cells_raw(motion, fb, &grid);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    bool pass = true;
+    if (ok)
+    {
+        pass = camera_motion_model_check(&motion->model, grid.cols, grid.rows, start, &outcome);
+    }
+    else
+    {
+        motion->model.last_pass_us = start;
+    }
+    outcome.check_us = esp_timer_get_time() - start;
+
+    taskENTER_CRITICAL(&motion->lock);
+    motion->stats.checked++;
+    motion->stats.busy_us += outcome.check_us;
+    if (!ok)
+    {
+        motion->stats.failed++;
+    }
+    else if (outcome.motion)
+    {
+        motion->stats.motion++;
+    }
+    else if (outcome.keyframe)
+    {
+        motion->stats.keyframes++;
+    }
+    taskEXIT_CRITICAL(&motion->lock);
+
+    if (result != NULL)
+    {
+        *result = outcome;
+    }
+    return pass;
+}
+
+void camera_motion_get_stats(camera_motion_handle_t motion, struct camera_motion_stats *stats)
+{
+    taskENTER_CRITICAL(&motion->lock);
+    *stats = motion->stats;
+    taskEXIT_CRITICAL(&motion->lock);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Motion detector deciding which camera frames are worth sending.
+ *
+ * A camera watching an empty scene sends the same image over and over. The detector reduces each
+ * frame to the average luma of every 8x8 pixel cell, groups the cells into blocks of 4x4 and sums
+ * the absolute differences (SAD) of every block against a background model. A frame shows motion
+ * when enough blocks differ by more than a threshold; otherwise it is only passed once a keyframe
+ * interval has gone by without a frame passed, so that consumers still see the scene now and then.
+ *
+ * The background follows the frames slowly, so lighting that changes over minutes is absorbed
+ * without counting as motion, while a change between two frames is not.
+ *
+ * Frames from sensors that encode JPEG are decoded at an eighth of their size, which only needs
+ * the DC coefficient of each 8x8 block and gives the cell averages directly. Grayscale, YUV422 and
+ * RGB565 frames are averaged. Luma is kept as 7 bits so the differences fit signed 8 bit vector
+ * lanes; on the ESP32-S3 the SAD uses its vector instructions, @c CONFIG_CAMERA_MOTION_SIMD,
+ * checked against the scalar reference when the detector is created.
+ *
+ * The background model itself is in camera_motion_model.h, which does not depend on the camera
+ * driver.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_motion_model.h"
+#include "esp_camera.h"
+#include "esp_err.h"
+
+/** Motion detector. */
+typedef struct camera_motion *camera_motion_handle_t;
+
+/** Detector statistics since creation. */
+struct camera_motion_stats
+{
+    /** Frames checked. */
+    uint32_t checked;
+    /** Frames passed because they showed motion. */
+    uint32_t motion;
+    /** Frames passed as keyframes. */
+    uint32_t keyframes;
+    /** Frames that could not be checked, passed anyway. */
+    uint32_t failed;
+    /** Time spent checking, in microseconds. */
+    int64_t busy_us;
+};
+
+/**
+ * Create a detector, allocating its buffers.
+ *
+ * @param[in] config Configuration, copied.
+ * @param[in] framesize Largest frame size that will be checked.
+ * @param[out] motion The new detector.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if the configuration is out of range or the frame size has no
+ *         whole block, or ESP_ERR_NO_MEM.
+ */
+esp_err_t camera_motion_create(const struct camera_motion_config *config, framesize_t framesize,
+                               camera_motion_handle_t *motion);
+
+/**
+ * Check a frame against the background and update the background with it.
+ *
+ * The first frame, and the first after a change of frame size, sets the background and is passed as
+ * a keyframe. Frames in a format that cannot be checked are passed.
+ *
+ * @param[in] motion Detector.
+ * @param[in] fb Camera frame, no larger than the frame size the detector was created for.
+ * @param[out] result Outcome, may be NULL.
+ * @return Whether the frame should be sent.
+ */
+bool camera_motion_check(camera_motion_handle_t motion, const camera_fb_t *fb,
+                         struct camera_motion_result *result);
+
+/**
+ * Get the detector statistics.
+ *
+ * @param[in] motion Detector.
+ * @param[out] stats Statistics since the detector was created.
+ */
+void camera_motion_get_stats(camera_motion_handle_t motion, struct camera_motion_stats *stats);
+
+/**
+ * Sum of absolute differences of each block, with the vector instructions when available.
+ *
+ * @param[in] cur Blocks of the frame, @ref CAMERA_MOTION_BLOCK_LEN bytes of 7 bit luma each,
+ *            16 byte aligned.
+ * @param[in] bg Blocks of the background, the same way.
+ * @param[out] sad SAD of each block.
+ * @param[in] blocks Number of blocks.
+ */
+void camera_motion_block_sad(const uint8_t *cur, const uint8_t *bg, uint16_t *sad, size_t blocks);
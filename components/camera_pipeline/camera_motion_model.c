@@ -0,0 +1,103 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "camera_motion_model.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void camera_motion_block_sad_ref(const uint8_t *cur, const uint8_t *bg, uint16_t *sad,
+                                 size_t blocks)
+{
+    for (size_t block = 0; block < blocks; block++)
+    {
+        uint16_t sum = 0;
+        for (size_t i = 0; i < CAMERA_MOTION_BLOCK_LEN; i++)
+        {
+            sum += abs(cur[i] - bg[i]);
+        }
+        sad[block] = sum;
+        cur += CAMERA_MOTION_BLOCK_LEN;
+        bg += CAMERA_MOTION_BLOCK_LEN;
+    }
+}
+
+void camera_motion_grid_put(const struct camera_motion_grid *grid, uint32_t cx, uint32_t cy,
+                            uint8_t luma)
+{
+    if (cx >= grid->cols * CAMERA_MOTION_BLOCK_CELLS
+        || cy >= grid->rows * CAMERA_MOTION_BLOCK_CELLS)
+    {
+        return;
+    }
+
+    size_t block = (cy / CAMERA_MOTION_BLOCK_CELLS) * grid->cols + cx / CAMERA_MOTION_BLOCK_CELLS;
+    size_t cell = (cy % CAMERA_MOTION_BLOCK_CELLS) * CAMERA_MOTION_BLOCK_CELLS
+                  + cx % CAMERA_MOTION_BLOCK_CELLS;
+    grid->blocks[block * CAMERA_MOTION_BLOCK_LEN + cell] = luma;
+}
+
+void camera_motion_background_update(uint8_t *bg, const uint8_t *cur, size_t len, uint8_t shift)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        int diff = cur[i] - bg[i];
+        int step = diff / (1 << shift);
+        if (step == 0 && diff != 0)
+        {
+            step = diff > 0 ? 1 : -1;
+        }
+        bg[i] += step;
+    }
+}
+
+bool camera_motion_model_check(struct camera_motion_model *model, uint32_t cols, uint32_t rows,
+                               int64_t now_us, struct camera_motion_result *result)
+{
+    size_t blocks = cols * rows;
+    bool pass = true;
+
+    result->motion = false;
+    result->keyframe = false;
+    result->changed = 0;
+    result->blocks = blocks;
+
+    if (cols != model->cols || rows != model->rows)
+    {
+        /* First frame, or the frame size changed: start over from this one. */
+        memcpy(model->bg, model->cur, blocks * CAMERA_MOTION_BLOCK_LEN);
+        model->cols = cols;
+        model->rows = rows;
+        result->keyframe = true;
+    }
+    else
+    {
+        model->block_sad(model->cur, model->bg, model->sad, blocks);
+
+        /* A block's SAD over its 16 cells of 7 bit luma is 8 times its average 8 bit difference. */
+        uint32_t limit = model->config.block_threshold * (CAMERA_MOTION_BLOCK_LEN / 2);
+        for (size_t i = 0; i < blocks; i++)
+        {
+            result->changed += model->sad[i] > limit;
+        }
+
+        result->motion = result->changed > 0
+                         && result->changed * 100 >= model->config.area_percent * blocks;
+        result->keyframe =
+            !result->motion && model->config.keyframe_interval_ms > 0
+            && now_us - model->last_pass_us >= model->config.keyframe_interval_ms * 1000LL;
+        pass = result->motion || result->keyframe;
+
+        camera_motion_background_update(model->bg, model->cur, blocks * CAMERA_MOTION_BLOCK_LEN,
+                                        model->config.background_shift);
+    }
+
+    if (pass)
+    {
+        model->last_pass_us = now_us;
+    }
+    return pass;
+}
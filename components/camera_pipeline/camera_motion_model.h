@@ -0,0 +1,140 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Background model of the motion detector, independent of the camera driver.
+ *
+ * Holds the part of @ref camera_motion_check that works on frames already reduced to blocks of 7
+ * bit cell luma: comparing them with the background, deciding on motion and keyframes and updating
+ * the background. It is plain C, so the same code can be built and tested on a host, see
+ * host_test/.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Pixels per side of the cells frames are averaged over. */
+#define CAMERA_MOTION_CELL_SIZE 8
+/** Cells per side of the blocks compared with the background. */
+#define CAMERA_MOTION_BLOCK_CELLS 4
+/** Bytes per block: one per cell. */
+#define CAMERA_MOTION_BLOCK_LEN (CAMERA_MOTION_BLOCK_CELLS * CAMERA_MOTION_BLOCK_CELLS)
+
+/** Detector configuration. */
+struct camera_motion_config
+{
+    /** Average luma difference from the background, 1 to 255, over which a block has changed. */
+    uint8_t block_threshold;
+    /** Share of the blocks, 1 to 100 percent, that must change for a frame to show motion. */
+    uint8_t area_percent;
+    /** Longest time between frames passed, in milliseconds, 0 to pass only frames with motion. */
+    uint32_t keyframe_interval_ms;
+    /** The background moves 1/2^background_shift of the way to each frame, 0 to 7. */
+    uint8_t background_shift;
+};
+
+/** Outcome of checking a frame. */
+struct camera_motion_result
+{
+    /** Whether enough blocks changed. */
+    bool motion;
+    /** Whether the frame is passed as a keyframe: the interval expired or the background was
+     * reset. */
+    bool keyframe;
+    /** Blocks that changed. */
+    uint32_t changed;
+    /** Blocks compared. */
+    uint32_t blocks;
+    /** Time taken by the check, in microseconds. */
+    int64_t check_us;
+};
+
+/**
+ * Sum of absolute differences of each block.
+ *
+ * @param[in] cur Blocks of the frame, @ref CAMERA_MOTION_BLOCK_LEN bytes of 7 bit luma each.
+ * @param[in] bg Blocks of the background, the same way.
+ * @param[out] sad SAD of each block.
+ * @param[in] blocks Number of blocks.
+ */
+typedef void (*camera_motion_sad_fn_t)(const uint8_t *cur, const uint8_t *bg, uint16_t *sad,
+                                       size_t blocks);
+
+/** Blocks a frame's cells are written into. */
+struct camera_motion_grid
+{
+    uint8_t *blocks;
+    /** Blocks across and down. Cells beyond the last whole block are left out. */
+    uint32_t cols;
+    uint32_t rows;
+};
+
+/** Background model, with the buffers it works in. */
+struct camera_motion_model
+{
+    struct camera_motion_config config;
+    /** Blocks of the frame being checked and of the background. */
+    uint8_t *cur;
+    uint8_t *bg;
+    /** SAD of each block. */
+    uint16_t *sad;
+    /** Blocks across and down of the background, 0 until the first frame. */
+    uint32_t cols;
+    uint32_t rows;
+    /** Time the last frame was passed, in microseconds. */
+    int64_t last_pass_us;
+    /** SAD kernel. */
+    camera_motion_sad_fn_t block_sad;
+};
+
+/**
+ * Sum of absolute differences of each block, in plain C.
+ *
+ * The reference @ref camera_motion_block_sad is checked against. Parameters as for
+ * @ref camera_motion_sad_fn_t.
+ */
+void camera_motion_block_sad_ref(const uint8_t *cur, const uint8_t *bg, uint16_t *sad,
+                                 size_t blocks);
+
+/**
+ * Write the 7 bit luma of a cell into its block.
+ *
+ * @param[in] grid Grid to write into.
+ * @param[in] cx Cell column.
+ * @param[in] cy Cell row.
+ * @param[in] luma Luma, 0 to 127.
+ */
+void camera_motion_grid_put(const struct camera_motion_grid *grid, uint32_t cx, uint32_t cy,
+                            uint8_t luma);
+
+/**
+ * Move the background towards the frame by a fraction of the difference, at least one step.
+ *
+ * @param[in,out] bg Background blocks.
+ * @param[in] cur Frame blocks.
+ * @param[in] len Bytes in either.
+ * @param[in] shift The fraction is 1/2^shift.
+ */
+void camera_motion_background_update(uint8_t *bg, const uint8_t *cur, size_t len, uint8_t shift);
+
+/**
+ * Check the frame in @c cur against the background and update the background with it.
+ *
+ * The first frame, and the first after a change of grid size, sets the background and is passed as
+ * a keyframe.
+ *
+ * @param[in,out] model Model, with the frame's blocks in @c cur.
+ * @param[in] cols Blocks across of the frame.
+ * @param[in] rows Blocks down of the frame.
+ * @param[in] now_us Time of the check, in microseconds.
+ * @param[out] result Outcome, @c check_us left unchanged.
+ * @return Whether the frame should be sent.
+ */
+bool camera_motion_model_check(struct camera_motion_model *model, uint32_t cols, uint32_t rows,
+                               int64_t now_us, struct camera_motion_result *result);
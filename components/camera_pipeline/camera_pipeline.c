@@ -0,0 +1,643 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "camera_pipeline.h"
+#include "camera_encode_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+#include "sdkconfig.h"
+
+/* Capture mostly waits for the camera's DMA and send for the network stack, which runs on the first
+ * core, so the encoder gets the second core to itself. */
+#define CAPTURE_CORE 0
+#define SEND_CORE 0
+#if CONFIG_FREERTOS_UNICORE
+#define ENCODE_CORE 0
+#else
+#define ENCODE_CORE 1
+#endif
+
+/* Capture runs above the others so frames are taken on time; send above encode so a finished frame
+ * leaves before the next one is encoded. */
+#define CAPTURE_PRIORITY 6
+#define ENCODE_PRIORITY 4
+#define SEND_PRIORITY 5
+
+#define CAPTURE_STACK_SIZE 3072
+#define ENCODE_STACK_SIZE 4096
+#define SEND_STACK_SIZE 4096
+
+/** Frame with the camera frame buffer it is encoded from. */
+struct pipeline_frame
+{
+    /** The frame seen by consumers, must be first. */
+    struct camera_frame frame;
+    /** Camera frame buffer, until the frame is encoded. */
+    camera_fb_t *fb;
+};
+
+/** Collects the encoder's output into chunks for the stream callback. */
+struct pipeline_chunker
+{
+    /** Frame being streamed. */
+    const struct camera_frame *frame;
+    /** Bytes in the chunk buffer. */
+    size_t len;
+    /** Bytes handed to the callback so far. */
+    size_t sent;
+    /** Time spent in the callback, in microseconds. */
+    int64_t send_us;
+    /** Whether the callback abandoned the frame. */
+    bool abandoned;
+};
+
+/** Pipeline state. */
+static struct camera_pipeline
+{
+    /** Configuration, @c interval_ms, @c quality and @c paused protected by @c lock. */
+    struct camera_pipeline_config config;
+    /** Protects the configuration, the statistics and frame reference counts. */
+    portMUX_TYPE lock;
+    /** Statistics, @c elapsed_us is filled in on read. */
+    struct camera_pipeline_stats stats;
+    /** Time the pipeline was started, in microseconds. */
+    int64_t start_us;
+    /** Captured frames waiting to be encoded. */
+    QueueHandle_t encode_queue;
+    /** Encoded frames waiting to be sent. */
+    QueueHandle_t send_queue;
+    /** Capture task, notified when the interval or pause changes. */
+    TaskHandle_t capture_task;
+    /** Buffers frames are encoded into. */
+    camera_encode_pool_handle_t pool;
+    /** Chunk being filled for the stream callback, used only by the send stage. */
+    uint8_t *chunk;
+    /** Timer for the utilization report. */
+    esp_timer_handle_t report_timer;
+    /** Statistics at the last report. */
+    struct camera_pipeline_stats reported;
+} pipeline = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+static const char *TAG = "camera_pipeline";
+
+void camera_frame_ref(struct camera_frame *frame)
+{
+    taskENTER_CRITICAL(&pipeline.lock);
+    frame->refs++;
+    taskEXIT_CRITICAL(&pipeline.lock);
+}
+
+void camera_frame_release(struct camera_frame *frame)
+{
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    taskENTER_CRITICAL(&pipeline.lock);
+    assert(frame->refs > 0);
+    bool last = --frame->refs == 0;
+    taskEXIT_CRITICAL(&pipeline.lock);
+
+    if (last)
+    {
+        struct pipeline_frame *entry = (struct pipeline_frame *)frame;
+        if (entry->fb != NULL)
+        {
+            esp_camera_fb_return(entry->fb);
+        }
+        camera_encode_pool_release(pipeline.pool, frame->buf);
+        free(entry);
+    }
+}
+
+/**
+ * Queue a frame for the next stage, dropping the oldest queued frame if the queue is full.
+ *
+ * Each queue has a single producer, so once a frame has been taken out there is room.
+ *
+ * @param[in] queue Queue of the next stage.
+ * @param[in] entry Frame to queue, whose reference passes to the queue.
+ */
+static void pipeline_queue_push(QueueHandle_t queue, struct pipeline_frame *entry)
+{
+    while (xQueueSend(queue, &entry, 0) != pdTRUE)
+    {
+        struct pipeline_frame *oldest;
+        if (xQueueReceive(queue, &oldest, 0) == pdTRUE)
+        {
+            taskENTER_CRITICAL(&pipeline.lock);
+            pipeline.stats.dropped++;
+            taskEXIT_CRITICAL(&pipeline.lock);
+            camera_frame_release(&oldest->frame);
+        }
+    }
+}
+
+static void capture_task(void *arg)
+{
+    uint32_t seq = 0;
+    TickType_t last_capture = xTaskGetTickCount() - pdMS_TO_TICKS(pipeline.config.interval_ms);
+
+    for (;;)
+    {
+        taskENTER_CRITICAL(&pipeline.lock);
+        TickType_t interval = pdMS_TO_TICKS(pipeline.config.interval_ms);
+        bool paused = pipeline.config.paused;
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        /* Wait out the rest of the interval, without catching up on intervals missed while a
+         * capture was slow. A change of interval or pause wakes the task to look again. */
+        TickType_t elapsed = xTaskGetTickCount() - last_capture;
+        if (paused || elapsed < interval)
+        {
+            ulTaskNotifyTake(pdTRUE, paused ? portMAX_DELAY : interval - elapsed);
+            continue;
+        }
+        last_capture = xTaskGetTickCount();
+
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        int64_t capture_us = esp_timer_get_time() - start;
+
+        struct pipeline_frame *entry = NULL;
+        if (fb != NULL)
+        {
+            entry = calloc(1, sizeof(*entry));
+            if (entry == NULL)
+            {
+                esp_camera_fb_return(fb);
+            }
+        }
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.capture_busy_us += capture_us;
+        if (entry != NULL)
+        {
+            pipeline.stats.captured++;
+        }
+        else
+        {
+            pipeline.stats.failed++;
+        }
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        if (entry == NULL)
+        {
+            ESP_LOGW(TAG, "Capture failed");
+            continue;
+        }
+
+        entry->fb = fb;
+        entry->frame.refs = 1;
+        entry->frame.seq = ++seq;
+        entry->frame.timestamp = fb->timestamp;
+        entry->frame.capture_us = capture_us;
+        pipeline_queue_push(pipeline.encode_queue, entry);
+    }
+}
+
+/**
+ * Take an encode buffer, dropping the oldest frames waiting to be sent to free one if needed.
+ *
+ * Frames held beyond the send callback keep their buffers, so this can still fail.
+ *
+ * @return The buffer, or NULL if none is free.
+ */
+static uint8_t *pipeline_buffer_acquire(void)
+{
+    uint8_t *buf = camera_encode_pool_acquire(pipeline.pool);
+    struct pipeline_frame *oldest;
+
+    while (buf == NULL && xQueueReceive(pipeline.send_queue, &oldest, 0) == pdTRUE)
+    {
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.dropped++;
+        taskEXIT_CRITICAL(&pipeline.lock);
+        camera_frame_release(&oldest->frame);
+
+        buf = camera_encode_pool_acquire(pipeline.pool);
+    }
+    return buf;
+}
+
+static void encode_task(void *arg)
+{
+    for (;;)
+    {
+        struct pipeline_frame *entry;
+        xQueueReceive(pipeline.encode_queue, &entry, portMAX_DELAY);
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        uint8_t quality = pipeline.config.quality;
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        struct camera_frame *frame = &entry->frame;
+        camera_fb_t *fb = entry->fb;
+        int64_t start = esp_timer_get_time();
+        bool ok;
+
+        if (pipeline.config.filter != NULL
+            && !pipeline.config.filter(fb, frame, pipeline.config.arg))
+        {
+            taskENTER_CRITICAL(&pipeline.lock);
+            pipeline.stats.encode_busy_us += esp_timer_get_time() - start;
+            pipeline.stats.skipped++;
+            taskEXIT_CRITICAL(&pipeline.lock);
+            camera_frame_release(frame);
+            continue;
+        }
+
+        if (pipeline.config.stream != NULL && pipeline.config.format == CAMERA_PIPELINE_JPEG
+            && fb->format != PIXFORMAT_JPEG)
+        {
+            /* Encoded by the send stage, straight into the chunks it sends. */
+            pipeline_queue_push(pipeline.send_queue, entry);
+            continue;
+        }
+
+        /* Sensor JPEG frames are copied too, so the frame buffer goes back to the driver before
+         * the frame is sent. */
+        frame->buf = pipeline_buffer_acquire();
+        if (frame->buf == NULL)
+        {
+            /* Every buffer is held by a frame being sent, so this one could not be anyway. */
+            taskENTER_CRITICAL(&pipeline.lock);
+            pipeline.stats.dropped++;
+            taskEXIT_CRITICAL(&pipeline.lock);
+            ESP_LOGD(TAG, "No buffer for frame %lu", (unsigned long)frame->seq);
+            camera_frame_release(frame);
+            continue;
+        }
+
+        size_t size = camera_encode_pool_buffer_size(pipeline.pool);
+        if (pipeline.config.format == CAMERA_PIPELINE_BMP)
+        {
+            ok = camera_encode_pool_bmp(fb, frame->buf, size, &frame->len);
+        }
+        else
+        {
+            ok = camera_encode_pool_jpeg(fb, quality, frame->buf, size, &frame->len);
+        }
+
+        esp_camera_fb_return(fb);
+        entry->fb = NULL;
+        frame->encode_us = esp_timer_get_time() - start;
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.encode_busy_us += frame->encode_us;
+        if (ok)
+        {
+            pipeline.stats.encoded++;
+        }
+        else
+        {
+            pipeline.stats.failed++;
+        }
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        if (!ok)
+        {
+            ESP_LOGE(TAG, "Encoding frame %lu failed", (unsigned long)frame->seq);
+            camera_frame_release(frame);
+            continue;
+        }
+
+        pipeline_queue_push(pipeline.send_queue, entry);
+    }
+}
+
+/**
+ * Hand the chunk buffer to the stream callback.
+ *
+ * @param[in,out] chunker Chunker holding the chunk.
+ * @param[in] last Whether this is the last chunk of the frame.
+ * @return The callback's result.
+ */
+static bool chunker_flush(struct pipeline_chunker *chunker, bool last)
+{
+    int64_t start = esp_timer_get_time();
+    bool ok = pipeline.config.stream(chunker->frame, pipeline.chunk, chunker->len, last,
+                                     pipeline.config.arg);
+    chunker->send_us += esp_timer_get_time() - start;
+    chunker->sent += chunker->len;
+    chunker->len = 0;
+    chunker->abandoned = !ok;
+    return ok;
+}
+
+/**
+ * Encoder output callback, collecting the output into chunks.
+ *
+ * A full chunk is only handed over once more output follows it, so that the last chunk of the frame
+ * can be marked as such.
+ *
+ * @param[in] arg The chunker.
+ * @param[in] index Offset of @p data in the encoded image.
+ * @param[in] data Encoder output.
+ * @param[in] len Length of @p data.
+ * @return @p len, or 0 to stop the encoder if the callback abandoned the frame.
+ */
+static size_t chunker_write(void *arg, size_t index, const void *data, size_t len)
+{
+    struct pipeline_chunker *chunker = arg;
+    const uint8_t *next = data;
+    size_t left = len;
+
+    while (left > 0)
+    {
+        if (chunker->len == CONFIG_CAMERA_PIPELINE_CHUNK_SIZE && !chunker_flush(chunker, false))
+        {
+            return 0;
+        }
+
+        size_t n = CONFIG_CAMERA_PIPELINE_CHUNK_SIZE - chunker->len;
+        n = n < left ? n : left;
+        memcpy(pipeline.chunk + chunker->len, next, n);
+        chunker->len += n;
+        next += n;
+        left -= n;
+    }
+    return len;
+}
+
+/**
+ * Hand a frame to the stream callback in chunks, encoding it first if it has not been.
+ *
+ * A frame the callback abandons is counted as such rather than as an encode failure, even though
+ * it stops the encoder.
+ *
+ * @param[in] entry Frame to stream.
+ * @param[out] send_us Time spent in the callback, in microseconds.
+ * @return true if the whole frame was handed to the callback.
+ */
+static bool send_stream(struct pipeline_frame *entry, int64_t *send_us)
+{
+    struct camera_frame *frame = &entry->frame;
+    struct pipeline_chunker chunker = {.frame = frame};
+    int64_t start = esp_timer_get_time();
+    bool ok;
+
+    if (entry->fb != NULL)
+    {
+        taskENTER_CRITICAL(&pipeline.lock);
+        uint8_t quality = pipeline.config.quality;
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        ok = frame2jpg_cb(entry->fb, quality, chunker_write, &chunker);
+        esp_camera_fb_return(entry->fb);
+        entry->fb = NULL;
+        frame->len = chunker.sent + chunker.len;
+        frame->encode_us = esp_timer_get_time() - start - chunker.send_us;
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.encode_busy_us += frame->encode_us;
+        if (ok)
+        {
+            pipeline.stats.encoded++;
+        }
+        else if (!chunker.abandoned)
+        {
+            pipeline.stats.failed++;
+        }
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        if (!ok && !chunker.abandoned)
+        {
+            ESP_LOGW(TAG, "Frame %lu failed to encode", (unsigned long)frame->seq);
+        }
+    }
+    else
+    {
+        ok = chunker_write(&chunker, 0, frame->buf, frame->len) == frame->len;
+    }
+
+    if (ok && chunker.len > 0)
+    {
+        ok = chunker_flush(&chunker, true);
+    }
+    if (chunker.abandoned)
+    {
+        ESP_LOGW(TAG, "Frame %lu abandoned after %u bytes", (unsigned long)frame->seq,
+                 (unsigned)chunker.sent);
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.abandoned++;
+        taskEXIT_CRITICAL(&pipeline.lock);
+    }
+
+    *send_us = chunker.send_us;
+    return ok;
+}
+
+static void send_task(void *arg)
+{
+    for (;;)
+    {
+        struct pipeline_frame *entry;
+        xQueueReceive(pipeline.send_queue, &entry, portMAX_DELAY);
+
+        int64_t send_us;
+        bool sent = true;
+        if (pipeline.config.stream != NULL)
+        {
+            sent = send_stream(entry, &send_us);
+        }
+        else
+        {
+            int64_t start = esp_timer_get_time();
+            pipeline.config.send(&entry->frame, pipeline.config.arg);
+            send_us = esp_timer_get_time() - start;
+        }
+
+        ESP_LOGD(TAG, "Frame %lu: %u bytes, capture %lld ms, encode %lld ms, send %lld ms",
+                 (unsigned long)entry->frame.seq, (unsigned)entry->frame.len,
+                 entry->frame.capture_us / 1000, entry->frame.encode_us / 1000, send_us / 1000);
+
+        taskENTER_CRITICAL(&pipeline.lock);
+        pipeline.stats.send_busy_us += send_us;
+        if (sent)
+        {
+            pipeline.stats.sent++;
+        }
+        taskEXIT_CRITICAL(&pipeline.lock);
+
+        camera_frame_release(&entry->frame);
+    }
+}
+
+/**
+ * Percentage of @p elapsed_us spent busy.
+ *
+ * @param[in] busy_us Busy time in microseconds.
+ * @param[in] elapsed_us Elapsed time in microseconds.
+ * @return Utilization in percent.
+ */
+static unsigned utilization(int64_t busy_us, int64_t elapsed_us)
+{
+    return elapsed_us > 0 ? (unsigned)(busy_us * 100 / elapsed_us) : 0;
+}
+
+/**
+ * Timer callback logging the frame rate and utilization since the last report.
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void report_timer_callback(void *arg)
+{
+    struct camera_pipeline_stats now;
+    camera_pipeline_get_stats(&now);
+    const struct camera_pipeline_stats *last = &pipeline.reported;
+
+    int64_t elapsed_us = now.elapsed_us - last->elapsed_us;
+    uint32_t sent = now.sent - last->sent;
+
+    ESP_LOGI(TAG,
+             "%lu frames sent (%.2f fps), %lu skipped, %lu dropped, %lu abandoned, %lu failed; "
+             "busy: capture %u%%, encode %u%%, send %u%%",
+             (unsigned long)sent, elapsed_us > 0 ? sent * 1e6 / elapsed_us : 0.0,
+             (unsigned long)(now.skipped - last->skipped),
+             (unsigned long)(now.dropped - last->dropped),
+             (unsigned long)(now.abandoned - last->abandoned),
+             (unsigned long)(now.failed - last->failed),
+             utilization(now.capture_busy_us - last->capture_busy_us, elapsed_us),
+             utilization(now.encode_busy_us - last->encode_busy_us, elapsed_us),
+             utilization(now.send_busy_us - last->send_busy_us, elapsed_us));
+    ESP_LOGI(TAG,
+             "buffers: %lu of %lu in use, high water %lu, %lu exhausted, acquire max %lld us; "
+             "PSRAM free %u kB, largest block %u kB",
+             (unsigned long)now.buffers.in_use, (unsigned long)now.buffers.count,
+             (unsigned long)now.buffers.high_water,
+             (unsigned long)(now.buffers.exhausted - last->buffers.exhausted),
+             now.buffers.acquire_max_us, heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024,
+             heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024);
+
+    pipeline.reported = now;
+}
+
+esp_err_t camera_pipeline_start(const struct camera_pipeline_config *config)
+{
+    /* This shall only ever be started once. */
+    assert(pipeline.capture_task == NULL);
+    assert(config != NULL && (config->send != NULL || config->stream != NULL));
+
+    pipeline.config = *config;
+    pipeline.start_us = esp_timer_get_time();
+    pipeline.encode_queue = xQueueCreate(CONFIG_CAMERA_PIPELINE_QUEUE_DEPTH,
+                                         sizeof(struct pipeline_frame *));
+    pipeline.send_queue = xQueueCreate(CONFIG_CAMERA_PIPELINE_QUEUE_DEPTH,
+                                       sizeof(struct pipeline_frame *));
+    if (pipeline.encode_queue == NULL || pipeline.send_queue == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* Sized for the frame size the camera was started with, the largest it can be set to. */
+    sensor_t *sensor = esp_camera_sensor_get();
+    assert(sensor != NULL);
+    framesize_t framesize = sensor->status.framesize;
+    size_t buffer_size = config->format == CAMERA_PIPELINE_BMP
+                             ? camera_encode_pool_bmp_size(framesize)
+                             : camera_encode_pool_jpeg_size(framesize);
+    if (camera_encode_pool_create(CONFIG_CAMERA_PIPELINE_ENCODE_BUFFERS, buffer_size,
+                                  &pipeline.pool)
+        != ESP_OK)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (config->stream != NULL)
+    {
+        pipeline.chunk = malloc(CONFIG_CAMERA_PIPELINE_CHUNK_SIZE);
+        if (pipeline.chunk == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (xTaskCreatePinnedToCore(send_task, "cam_send", SEND_STACK_SIZE, NULL, SEND_PRIORITY, NULL,
+                                SEND_CORE)
+            != pdPASS
+        || xTaskCreatePinnedToCore(encode_task, "cam_encode", ENCODE_STACK_SIZE, NULL,
+                                   ENCODE_PRIORITY, NULL, ENCODE_CORE)
+               != pdPASS
+        || xTaskCreatePinnedToCore(capture_task, "cam_capture", CAPTURE_STACK_SIZE, NULL,
+                                   CAPTURE_PRIORITY, &pipeline.capture_task, CAPTURE_CORE)
+               != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (CONFIG_CAMERA_PIPELINE_REPORT_INTERVAL_MS > 0)
+    {
+        const esp_timer_create_args_t timer_args = {.callback = &report_timer_callback,
+                                                    .name = "pipeline_report"};
+
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &pipeline.report_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(
+            pipeline.report_timer, (uint64_t)CONFIG_CAMERA_PIPELINE_REPORT_INTERVAL_MS * 1000));
+    }
+
+    ESP_LOGI(TAG, "Started: %s, every %lu ms, %d buffers of %u kB%s%s",
+             config->format == CAMERA_PIPELINE_BMP ? "BMP" : "JPEG",
+             (unsigned long)config->interval_ms, CONFIG_CAMERA_PIPELINE_ENCODE_BUFFERS,
+             (unsigned)(buffer_size / 1024), config->stream != NULL ? ", streamed" : "",
+             config->paused ? ", paused" : "");
+    return ESP_OK;
+}
+
+void camera_pipeline_set_interval(uint32_t interval_ms)
+{
+    taskENTER_CRITICAL(&pipeline.lock);
+    pipeline.config.interval_ms = interval_ms;
+    taskEXIT_CRITICAL(&pipeline.lock);
+
+    if (pipeline.capture_task != NULL)
+    {
+        xTaskNotifyGive(pipeline.capture_task);
+    }
+}
+
+void camera_pipeline_set_quality(uint8_t quality)
+{
+    taskENTER_CRITICAL(&pipeline.lock);
+    pipeline.config.quality = quality;
+    taskEXIT_CRITICAL(&pipeline.lock);
+}
+
+void camera_pipeline_set_paused(bool paused)
+{
+    taskENTER_CRITICAL(&pipeline.lock);
+    pipeline.config.paused = paused;
+    taskEXIT_CRITICAL(&pipeline.lock);
+
+    if (pipeline.capture_task != NULL)
+    {
+        xTaskNotifyGive(pipeline.capture_task);
+    }
+}
+
+void camera_pipeline_get_stats(struct camera_pipeline_stats *stats)
+{
+    taskENTER_CRITICAL(&pipeline.lock);
+    *stats = pipeline.stats;
+    taskEXIT_CRITICAL(&pipeline.lock);
+
+    stats->elapsed_us = esp_timer_get_time() - pipeline.start_us;
+    camera_encode_pool_get_stats(pipeline.pool, &stats->buffers);
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Three stage capture, encode and send pipeline for the camera.
+ *
+ * Capturing a frame, encoding it and sending it one after the other leaves the camera idle while
+ * the frame is encoded and sent, and the network idle while the next one is captured and encoded.
+ * Here each stage runs in its own task, so they overlap:
+ *
+ * - Capture takes frames from the camera driver at no more than one per configured interval.
+ * - Encode converts them to JPEG or BMP, or copies frames the sensor already encoded as JPEG, and
+ *   returns the camera's frame buffer straight away. It is the CPU heavy stage and runs on the
+ *   second core when there is one.
+ * - Send hands each encoded frame to the application's callback.
+ *
+ * With a @c stream callback the send stage hands frames over in chunks of
+ * @c CONFIG_CAMERA_PIPELINE_CHUNK_SIZE bytes instead. Frames encoded in software are then encoded
+ * by the send stage straight into those chunks, as the callback sends them. No buffer for the
+ * whole encoded frame is allocated and the first bytes leave as soon as the encoder produces them,
+ * at the cost of no longer overlapping the encode with sending the previous frame.
+ *
+ * A @c filter callback is asked about every frame before it is encoded, for example to skip frames
+ * without motion, see camera_motion.h. Skipped frames cost only the filter's time.
+ *
+ * Frames are encoded into a fixed pool of @c CONFIG_CAMERA_PIPELINE_ENCODE_BUFFERS buffers sized
+ * for the camera's frame size, see camera_encode_pool.h, so the heap is not used for frames once
+ * started. When every buffer is in use the oldest frame waiting to be sent is dropped for its
+ * buffer.
+ *
+ * Stages are connected by queues of @c CONFIG_CAMERA_PIPELINE_QUEUE_DEPTH frames. A stage that
+ * finds the next queue full drops the oldest frame in it, so a slow stage lowers the frame rate
+ * instead of building up latency. Encoded frames are reference counted, so a consumer can keep one
+ * beyond the callback, for example to send it to several clients.
+ *
+ * The time each stage spends working is measured, see @ref camera_pipeline_get_stats, and logged
+ * as a utilization every @c CONFIG_CAMERA_PIPELINE_REPORT_INTERVAL_MS. The busiest stage is the one
+ * limiting the frame rate. There is a single pipeline per application.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "camera_encode_pool.h"
+#include "esp_err.h"
+
+/** Encoded frame. */
+struct camera_frame
+{
+    /** Sequence number, counting every frame captured from 1, including those dropped. */
+    uint32_t seq;
+    /** Capture time from the camera driver. */
+    struct timeval timestamp;
+    /** Encoded image, NULL for frames encoded while streaming. */
+    uint8_t *buf;
+    /** Length of the encoded image in bytes, for frames encoded while streaming once complete. */
+    size_t len;
+    /** Time spent waiting for the frame from the camera, in microseconds. */
+    int64_t capture_us;
+    /** Time spent encoding or copying it, in microseconds. */
+    int64_t encode_us;
+    /** References held, see @ref camera_frame_ref. */
+    uint32_t refs;
+};
+
+/** Format frames are encoded in. */
+enum camera_pipeline_format
+{
+    CAMERA_PIPELINE_JPEG,
+    CAMERA_PIPELINE_BMP,
+};
+
+/**
+ * Callback the send stage hands every encoded frame to.
+ *
+ * The frame is released when the callback returns; take a reference with @ref camera_frame_ref to
+ * keep it longer.
+ *
+ * @param[in] frame Encoded frame.
+ * @param[in] arg @c arg from the configuration.
+ */
+typedef void (*camera_pipeline_send_cb_t)(struct camera_frame *frame, void *arg);
+
+/**
+ * Callback the send stage hands every encoded frame to in chunks, in order.
+ *
+ * @param[in] frame Frame the chunk belongs to.
+ * @param[in] data Chunk of the encoded image.
+ * @param[in] len Length of @p data, @c CONFIG_CAMERA_PIPELINE_CHUNK_SIZE except for the last chunk.
+ * @param[in] last Whether this is the last chunk of the frame.
+ * @param[in] arg @c arg from the configuration.
+ * @return true to carry on, false to abandon the rest of the frame.
+ */
+typedef bool (*camera_pipeline_stream_cb_t)(const struct camera_frame *frame, const uint8_t *data,
+                                            size_t len, bool last, void *arg);
+
+/**
+ * Callback the encode stage asks whether to keep each captured frame, before encoding it.
+ *
+ * @param[in] fb Camera frame buffer of the frame.
+ * @param[in] frame Frame, not encoded yet.
+ * @param[in] arg @c arg from the configuration.
+ * @return true to encode and send the frame, false to skip it.
+ */
+typedef bool (*camera_pipeline_filter_cb_t)(const camera_fb_t *fb, const struct camera_frame *frame,
+                                            void *arg);
+
+/** Pipeline configuration. */
+struct camera_pipeline_config
+{
+    /** Format to encode frames in. */
+    enum camera_pipeline_format format;
+    /** Shortest time between captures in milliseconds. */
+    uint32_t interval_ms;
+    /** JPEG quality, 1 (smallest) to 100 (best), for frames the sensor does not encode itself. */
+    uint8_t quality;
+    /** Start without capturing, until @ref camera_pipeline_set_paused clears it. */
+    bool paused;
+    /** Called by the send stage with every encoded frame, unless @c stream is set. */
+    camera_pipeline_send_cb_t send;
+    /** Called by the send stage with every encoded frame in chunks, instead of @c send. */
+    camera_pipeline_stream_cb_t stream;
+    /** Called by the encode stage with every frame before encoding it, NULL to keep them all. */
+    camera_pipeline_filter_cb_t filter;
+    /** Passed to @c send, @c stream and @c filter. */
+    void *arg;
+};
+
+/** Pipeline statistics since start. */
+struct camera_pipeline_stats
+{
+    /** Frames taken from the camera. */
+    uint32_t captured;
+    /** Frames encoded. */
+    uint32_t encoded;
+    /** Frames handed to the send callback, or to the stream callback in full. */
+    uint32_t sent;
+    /** Frames the stream callback abandoned part way. */
+    uint32_t abandoned;
+    /** Frames the filter skipped. */
+    uint32_t skipped;
+    /** Frames dropped from a full queue. */
+    uint32_t dropped;
+    /** Captures or encodes that failed, not counting frames the stream callback abandoned. */
+    uint32_t failed;
+    /** Time spent capturing, in microseconds. */
+    int64_t capture_busy_us;
+    /** Time spent encoding, in microseconds. */
+    int64_t encode_busy_us;
+    /** Time spent in the send or stream callback, in microseconds. */
+    int64_t send_busy_us;
+    /** Time since the pipeline was started, in microseconds. */
+    int64_t elapsed_us;
+    /** Encode buffer pool. */
+    struct camera_encode_pool_stats buffers;
+};
+
+/**
+ * Start the pipeline tasks.
+ *
+ * The camera must have been initialised. Must be called only once.
+ *
+ * @param[in] config Configuration, copied.
+ * @return ESP_OK, or ESP_ERR_NO_MEM if the tasks, queues or buffers could not be created.
+ */
+esp_err_t camera_pipeline_start(const struct camera_pipeline_config *config);
+
+/**
+ * Change the shortest time between captures.
+ *
+ * @param[in] interval_ms Interval in milliseconds.
+ */
+void camera_pipeline_set_interval(uint32_t interval_ms);
+
+/**
+ * Change the JPEG quality frames are encoded with.
+ *
+ * @param[in] quality Quality, 1 (smallest) to 100 (best).
+ */
+void camera_pipeline_set_quality(uint8_t quality);
+
+/**
+ * Stop or resume capturing. Frames already captured still go through the pipeline.
+ *
+ * @param[in] paused Whether to stop capturing.
+ */
+void camera_pipeline_set_paused(bool paused);
+
+/**
+ * Get the pipeline statistics.
+ *
+ * @param[out] stats Statistics since the pipeline was started.
+ */
+void camera_pipeline_get_stats(struct camera_pipeline_stats *stats);
+
+/**
+ * Take a reference to a frame, keeping it until a matching @ref camera_frame_release.
+ *
+ * @param[in] frame Frame to keep.
+ */
+void camera_frame_ref(struct camera_frame *frame);
+
+/**
+ * Release a reference to a frame, freeing it with the last one.
+ *
+ * @param[in] frame Frame to release, may be NULL.
+ */
+void camera_frame_release(struct camera_frame *frame);
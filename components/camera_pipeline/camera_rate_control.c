@@ -0,0 +1,319 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "camera_rate_control.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "camera_pipeline.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+/* Frames averaged between two decisions */
+#define CONTROL_FRAMES 4
+/* Frames ignored after a change of frame size, which the sensor takes a frame or two to apply */
+#define SETTLE_FRAMES 2
+
+#define QUALITY_STEP 5
+/* Send time, as a fraction of the target, under which quality or frame size is raised. Well below
+ * the target, so that a raise that overshoots a little is not undone straight away. */
+#define RAISE_RATIO 0.7
+
+/** A change decided on, logged once the lock is released. */
+struct rate_control_change
+{
+    double ratio;
+    struct camera_rate_control_state before;
+};
+
+/* Frame sizes stepped through, smallest first */
+static const framesize_t ladder[] = {
+    FRAMESIZE_QQVGA, FRAMESIZE_QVGA, FRAMESIZE_CIF,  FRAMESIZE_VGA,  FRAMESIZE_SVGA,
+    FRAMESIZE_XGA,   FRAMESIZE_HD,   FRAMESIZE_SXGA, FRAMESIZE_UXGA,
+};
+
+#define LADDER_LEN (sizeof(ladder) / sizeof(ladder[0]))
+
+/** Controller state. */
+static struct camera_rate_control
+{
+    /** Configuration, the maximums protected by @c lock. */
+    struct camera_rate_control_config config;
+    /** Protects everything but the configuration's minimums. */
+    portMUX_TYPE lock;
+    struct camera_rate_control_state state;
+    /** Ladder index of the smallest, largest and current frame size. */
+    unsigned min_step;
+    unsigned max_step;
+    unsigned step;
+    /** Frames averaged since the last decision. */
+    uint32_t frames;
+    /** Frames still to ignore after a change of frame size. */
+    uint32_t settle;
+    /** Time of the last report and average time between reports, in microseconds. */
+    int64_t last_report_us;
+    int64_t period_us;
+    bool started;
+} control = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+static const char *TAG = "rate_control";
+
+/**
+ * Ladder index of the largest frame size in the ladder no larger than @p framesize.
+ *
+ * @param[in] framesize Frame size.
+ * @return Ladder index.
+ */
+static unsigned ladder_step(framesize_t framesize)
+{
+    unsigned step = 0;
+    while (step + 1 < LADDER_LEN && ladder[step + 1] <= framesize)
+    {
+        step++;
+    }
+    return step;
+}
+
+static uint32_t ladder_area(unsigned step)
+{
+    return (uint32_t)resolution[ladder[step]].width * resolution[ladder[step]].height;
+}
+
+/* Moving average giving the latest sample a quarter of the weight */
+static int64_t average(int64_t avg, int64_t sample, uint32_t samples)
+{
+    return samples == 0 ? sample : avg + (sample - avg) / 4;
+}
+
+/**
+ * Apply a quality and frame size to the sensor and the pipeline.
+ *
+ * @param[in] quality Quality, 1 (smallest) to 100 (best).
+ * @param[in] framesize Frame size.
+ */
+static void rate_control_apply(uint8_t quality, framesize_t framesize)
+{
+    sensor_t *s = esp_camera_sensor_get();
+
+    if (s->status.framesize != framesize && s->set_framesize(s, framesize) != 0)
+    {
+        ESP_LOGW(TAG, "Failed to set frame size %u", framesize);
+    }
+
+    /* Sensors encoding JPEG take 0 as best and 63 as worst */
+    if (s->pixformat == PIXFORMAT_JPEG)
+    {
+        s->set_quality(s, (100 - quality) * 63 / 100);
+    }
+    camera_pipeline_set_quality(quality);
+}
+
+/**
+ * Decide on the quality and frame size from the averaged measurements.
+ *
+ * Must be called with the lock held.
+ *
+ * @param[out] change The measurements the change was decided on, if there was one.
+ * @return Whether either changed.
+ */
+static bool rate_control_decide(struct rate_control_change *change)
+{
+    struct camera_rate_control_state *state = &control.state;
+    double ratio = (double)state->frame_us / (control.config.target_frame_ms * 1000.0);
+
+    if (control.config.budget_bytes_per_s > 0 && control.period_us > 0)
+    {
+        double rate = state->frame_bytes * 1e6 / control.period_us;
+        double budget_ratio = rate / control.config.budget_bytes_per_s;
+        ratio = budget_ratio > ratio ? budget_ratio : ratio;
+    }
+
+    uint8_t quality = state->quality;
+    unsigned step = control.step;
+
+    if (ratio > 1.0)
+    {
+        if (quality > control.config.min_quality)
+        {
+            /* Larger steps the further over, to get back under quickly */
+            int decrease = ratio > 2.0 ? 3 * QUALITY_STEP : QUALITY_STEP;
+            quality = quality - control.config.min_quality > decrease
+                          ? quality - decrease
+                          : control.config.min_quality;
+        }
+        else if (step > control.min_step)
+        {
+            step--;
+        }
+    }
+    else if (ratio < RAISE_RATIO)
+    {
+        /* Frames grow roughly with their area, so only step up if they would still fit. */
+        if (step < control.max_step
+            && ratio * ladder_area(step + 1) / ladder_area(step) < RAISE_RATIO)
+        {
+            step++;
+        }
+        else if (quality < control.config.max_quality)
+        {
+            quality = control.config.max_quality - quality > QUALITY_STEP
+                          ? quality + QUALITY_STEP
+                          : control.config.max_quality;
+        }
+    }
+
+    if (quality == state->quality && step == control.step)
+    {
+        return false;
+    }
+
+    change->ratio = ratio;
+    change->before = *state;
+
+    if (step != control.step)
+    {
+        /* Measurements at the old size say little about the new one. */
+        control.frames = 0;
+        control.settle = SETTLE_FRAMES;
+    }
+    state->quality = quality;
+    state->framesize = ladder[step];
+    state->changes++;
+    control.step = step;
+    return true;
+}
+
+esp_err_t camera_rate_control_start(const struct camera_rate_control_config *config)
+{
+    /* This shall only ever be started once. */
+    assert(!control.started);
+    assert(config != NULL && config->target_frame_ms > 0);
+
+    if (config->min_quality < 1 || config->min_quality > config->max_quality
+        || config->max_quality > 100 || config->min_framesize > config->max_framesize)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    control.config = *config;
+    control.min_step = ladder_step(config->min_framesize);
+    control.max_step = ladder_step(config->max_framesize);
+    control.step = control.max_step;
+    control.state.quality = config->max_quality;
+    control.state.framesize = ladder[control.step];
+    control.settle = SETTLE_FRAMES;
+    control.started = true;
+
+    rate_control_apply(control.state.quality, control.state.framesize);
+
+    ESP_LOGI(TAG,
+             "Started: target %lu ms per frame, budget %lu B/s, quality %u-%u, frame size %u-%u",
+             (unsigned long)config->target_frame_ms, (unsigned long)config->budget_bytes_per_s,
+             config->min_quality, config->max_quality, ladder[control.min_step],
+             ladder[control.max_step]);
+    return ESP_OK;
+}
+
+void camera_rate_control_set_limits(uint8_t max_quality, framesize_t max_framesize)
+{
+    assert(control.started);
+
+    taskENTER_CRITICAL(&control.lock);
+    control.config.max_quality =
+        max_quality > control.config.min_quality ? max_quality : control.config.min_quality;
+    unsigned max_step = ladder_step(max_framesize);
+    control.max_step = max_step > control.min_step ? max_step : control.min_step;
+
+    if (control.state.quality > control.config.max_quality)
+    {
+        control.state.quality = control.config.max_quality;
+    }
+    if (control.step > control.max_step)
+    {
+        control.step = control.max_step;
+        control.state.framesize = ladder[control.step];
+        control.frames = 0;
+        control.settle = SETTLE_FRAMES;
+    }
+    uint8_t quality = control.state.quality;
+    framesize_t framesize = control.state.framesize;
+    taskEXIT_CRITICAL(&control.lock);
+
+    rate_control_apply(quality, framesize);
+}
+
+void camera_rate_control_frame_sent(size_t len, int64_t send_us)
+{
+    if (!control.started)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    struct rate_control_change change;
+    bool changed = false;
+
+    taskENTER_CRITICAL(&control.lock);
+    struct camera_rate_control_state *state = &control.state;
+
+    if (control.last_report_us != 0)
+    {
+        control.period_us = average(control.period_us, now - control.last_report_us,
+                                    control.period_us == 0 ? 0 : 1);
+    }
+    control.last_report_us = now;
+
+    if (control.settle > 0)
+    {
+        control.settle--;
+    }
+    else
+    {
+        state->frame_us = average(state->frame_us, send_us, control.frames);
+        state->frame_bytes = average(state->frame_bytes, len, control.frames);
+        if (send_us > 0)
+        {
+            state->throughput_bytes_per_s = average(state->throughput_bytes_per_s,
+                                                    len * 1000000LL / send_us, control.frames);
+        }
+
+        if (++control.frames >= CONTROL_FRAMES)
+        {
+            changed = rate_control_decide(&change);
+            /* Keep averaging across decisions, unless the frame size changed. */
+            if (control.settle == 0)
+            {
+                control.frames = 1;
+            }
+        }
+    }
+    uint8_t quality = state->quality;
+    framesize_t framesize = state->framesize;
+    taskEXIT_CRITICAL(&control.lock);
+
+    if (changed)
+    {
+        ESP_LOGI(TAG,
+                 "%.2f of target (%lld ms, %lu bytes per frame, %lu B/s): quality %u -> %u, "
+                 "frame size %u -> %u",
+                 change.ratio, change.before.frame_us / 1000,
+                 (unsigned long)change.before.frame_bytes,
+                 (unsigned long)change.before.throughput_bytes_per_s, change.before.quality,
+                 quality, change.before.framesize, framesize);
+        rate_control_apply(quality, framesize);
+    }
+}
+
+void camera_rate_control_get_state(struct camera_rate_control_state *state)
+{
+    taskENTER_CRITICAL(&control.lock);
+    *state = control.state;
+    taskEXIT_CRITICAL(&control.lock);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * JPEG quality and frame size controller driven by the measured send time of frames.
+ *
+ * HaLow throughput varies from hundreds of kbit/s to several Mbit/s as the link adapts its MCS, so
+ * fixed settings either leave most of a good link unused or take seconds per frame on a poor one.
+ * The application reports how long each frame took to send and the controller adjusts the quality,
+ * on the sensor for sensors that encode JPEG and in the pipeline otherwise, to bring the send time
+ * to a target and the data rate under an optional budget.
+ *
+ * Quality is lowered first. Only once it is at its minimum is the frame size stepped down, and it
+ * is stepped back up once the frames at the current size would still be within the target after
+ * growing with the frame area. Quality is then raised again up to its maximum. Decisions are made
+ * every few frames from averaged measurements, and after a change of frame size the first frames
+ * are ignored while the sensor switches over.
+ *
+ * There is a single controller per application. Frame sizes above the one the camera was started
+ * with cannot be used, as the frame buffers are sized for it.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+#include "esp_err.h"
+
+/** Controller configuration. */
+struct camera_rate_control_config
+{
+    /** Time a frame should take to send, in milliseconds. */
+    uint32_t target_frame_ms;
+    /** Data rate not to exceed, in bytes per second, 0 for none. */
+    uint32_t budget_bytes_per_s;
+    /** Lowest quality to use, 1 (smallest) to 100 (best). */
+    uint8_t min_quality;
+    /** Highest quality to use, and the one to start with. */
+    uint8_t max_quality;
+    /** Smallest frame size to use. */
+    framesize_t min_framesize;
+    /** Largest frame size to use, and the one to start with. */
+    framesize_t max_framesize;
+};
+
+/** Controller state. */
+struct camera_rate_control_state
+{
+    /** Quality in use. */
+    uint8_t quality;
+    /** Frame size in use. */
+    framesize_t framesize;
+    /** Average time to send a frame, in microseconds. */
+    int64_t frame_us;
+    /** Average size of a frame, in bytes. */
+    uint32_t frame_bytes;
+    /** Average send throughput, in bytes per second. */
+    uint32_t throughput_bytes_per_s;
+    /** Number of changes of quality or frame size made. */
+    uint32_t changes;
+};
+
+/**
+ * Start the controller, applying the highest quality and frame size.
+ *
+ * The camera must have been initialised. Must be called only once.
+ *
+ * @param[in] config Configuration, copied.
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG if the ranges are empty.
+ */
+esp_err_t camera_rate_control_start(const struct camera_rate_control_config *config);
+
+/**
+ * Change the highest quality and frame size, for example when the user changes the settings.
+ *
+ * The current settings are lowered to them if above, and the controller may raise them that far.
+ *
+ * @param[in] max_quality Highest quality, 1 (smallest) to 100 (best).
+ * @param[in] max_framesize Largest frame size.
+ */
+void camera_rate_control_set_limits(uint8_t max_quality, framesize_t max_framesize);
+
+/**
+ * Report a frame sent, feeding the controller.
+ *
+ * @param[in] len Size of the frame in bytes.
+ * @param[in] send_us Time it took to send, in microseconds.
+ */
+void camera_rate_control_frame_sent(size_t len, int64_t send_us);
+
+/**
+ * Get the controller state.
+ *
+ * @param[out] state Current state.
+ */
+void camera_rate_control_get_state(struct camera_rate_control_state *state);
@@ -0,0 +1,309 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Host test of the motion detector's background model.
+ *
+ * Checks the SAD reference and the background update on hand-computed cases, then replays frames
+ * already reduced to one 8 bit luma pixel per cell (PGM, as written by motion_replay.py export)
+ * through camera_motion_model_check() and compares the SAD of every block and the decision on
+ * every frame with those pinned in expected.csv:
+ *
+ *     config,<threshold>,<area percent>,<keyframe interval ms>,<background shift>
+ *     <frame>,<time ms>,<pass>,<motion>,<keyframe>,<changed>,<SAD of each block>
+ *
+ * Run with -u to rewrite the frame lines of expected.csv from the current code, after checking the
+ * change in results is intended.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera_motion_model.h"
+
+/* Largest frame replayed, in blocks: UXGA */
+#define MAX_BLOCKS (50 * 37)
+#define MAX_FRAMES 256
+#define LINE_LEN 8192
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                 \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                              \
+            fprintf(stderr, __VA_ARGS__);                                                \
+            fprintf(stderr, "\n");                                                       \
+            failures++;                                                                  \
+        }                                                                                \
+    } while (0)
+
+/* A frame line of expected.csv */
+struct expected_frame
+{
+    char name[64];
+    long long time_ms;
+    /* The rest of the line, compared as text */
+    char results[LINE_LEN];
+};
+
+static void test_block_sad(void)
+{
+    uint8_t cur[2 * CAMERA_MOTION_BLOCK_LEN];
+    uint8_t bg[2 * CAMERA_MOTION_BLOCK_LEN];
+    uint16_t sad[2];
+
+    /* The extremes of 7 bit luma in both directions, then a single cell */
+    for (int i = 0; i < CAMERA_MOTION_BLOCK_LEN; i++)
+    {
+        cur[i] = (i & 1) * 127;
+        bg[i] = (~i & 1) * 127;
+        cur[CAMERA_MOTION_BLOCK_LEN + i] = 40;
+        bg[CAMERA_MOTION_BLOCK_LEN + i] = i == 5 ? 43 : 40;
+    }
+
+    camera_motion_block_sad_ref(cur, bg, sad, 2);
+    CHECK(sad[0] == 16 * 127, "SAD of opposite extremes is %u", sad[0]);
+    CHECK(sad[1] == 3, "SAD of one cell 3 apart is %u", sad[1]);
+}
+
+static void test_background_update(void)
+{
+    static const struct
+    {
+        uint8_t bg;
+        uint8_t cur;
+        uint8_t shift;
+        uint8_t expected;
+    } cases[] = {
+        /* Half the difference, rounded towards the background */
+        {10, 20, 1, 15},
+        {20, 10, 1, 15},
+        {10, 13, 1, 11},
+        {13, 10, 1, 12},
+        /* At least one step towards the frame */
+        {10, 11, 1, 11},
+        {10, 9, 1, 9},
+        {10, 12, 3, 11},
+        /* Shift 0 takes the frame */
+        {10, 100, 0, 100},
+        {50, 50, 2, 50},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        uint8_t bg = cases[i].bg;
+        camera_motion_background_update(&bg, &cases[i].cur, 1, cases[i].shift);
+        CHECK(bg == cases[i].expected, "bg %u towards %u with shift %u gave %u, expected %u",
+              cases[i].bg, cases[i].cur, cases[i].shift, bg, cases[i].expected);
+    }
+}
+
+/**
+ * Read a binary PGM into the grid, halving luma to 7 bits as the device does.
+ *
+ * @return true on success.
+ */
+static bool pgm_read(const char *path, struct camera_motion_grid *grid)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned width;
+    unsigned height;
+    unsigned maxval;
+    bool ok = false;
+
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    if (fscanf(f, "P5 %u %u %u", &width, &height, &maxval) == 3 && maxval == 255
+        && fgetc(f) != EOF)
+    {
+        grid->cols = width / CAMERA_MOTION_BLOCK_CELLS;
+        grid->rows = height / CAMERA_MOTION_BLOCK_CELLS;
+        ok = grid->cols * grid->rows <= MAX_BLOCKS;
+        for (unsigned y = 0; ok && y < height; y++)
+        {
+            for (unsigned x = 0; ok && x < width; x++)
+            {
+                int luma = fgetc(f);
+                ok = luma != EOF;
+                camera_motion_grid_put(grid, x, y, luma >> 1);
+            }
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Format the results of a frame as in expected.csv, after the time.
+ */
+static void format_results(char *out, size_t size, bool pass,
+                           const struct camera_motion_result *result, const uint16_t *sad,
+                           bool compared)
+{
+    int len = snprintf(out, size, "%d,%d,%d,%u,", pass, result->motion, result->keyframe,
+                       (unsigned)result->changed);
+
+    for (uint32_t i = 0; compared && i < result->blocks && len < (int)size; i++)
+    {
+        len += snprintf(out + len, size - len, i == 0 ? "%u" : " %u", sad[i]);
+    }
+}
+
+static void test_replay(const char *dir, bool update)
+{
+    static struct expected_frame frames[MAX_FRAMES];
+    static uint8_t blocks[2 * MAX_BLOCKS * CAMERA_MOTION_BLOCK_LEN];
+    static uint16_t sad[MAX_BLOCKS];
+    char path[512];
+    char line[LINE_LEN];
+    char config_line[LINE_LEN] = "";
+    size_t count = 0;
+    unsigned threshold;
+    unsigned area;
+    unsigned keyframe_ms;
+    unsigned shift;
+
+    snprintf(path, sizeof(path), "%s/expected.csv", dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        CHECK(false, "cannot open %s", path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+        {
+            continue;
+        }
+        if (config_line[0] == '\0')
+        {
+            snprintf(config_line, sizeof(config_line), "%s", line);
+            continue;
+        }
+        if (count == MAX_FRAMES)
+        {
+            break;
+        }
+
+        struct expected_frame *frame = &frames[count];
+        int offset = 0;
+        if (sscanf(line, "%63[^,],%lld,%n", frame->name, &frame->time_ms, &offset) == 2
+            && offset > 0)
+        {
+            snprintf(frame->results, sizeof(frame->results), "%s", line + offset);
+            count++;
+        }
+    }
+    fclose(f);
+
+    if (sscanf(config_line, "config,%u,%u,%u,%u", &threshold, &area, &keyframe_ms, &shift) != 4)
+    {
+        CHECK(false, "%s has no config line", path);
+        return;
+    }
+    CHECK(count > 0, "%s lists no frames", path);
+
+    struct camera_motion_model model = {
+        .config = {.block_threshold = threshold,
+                   .area_percent = area,
+                   .keyframe_interval_ms = keyframe_ms,
+                   .background_shift = shift},
+        .cur = blocks,
+        .bg = blocks + MAX_BLOCKS * CAMERA_MOTION_BLOCK_LEN,
+        .sad = sad,
+        .block_sad = camera_motion_block_sad_ref,
+    };
+    uint32_t passed = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct expected_frame *frame = &frames[i];
+        struct camera_motion_grid grid = {.blocks = model.cur};
+        struct camera_motion_result result;
+        char results[LINE_LEN];
+
+        snprintf(path, sizeof(path), "%s/%s", dir, frame->name);
+        if (!pgm_read(path, &grid))
+        {
+            CHECK(false, "cannot read %s", path);
+            return;
+        }
+
+        /* The background is reset, and no SAD computed, when the grid size changes */
+        bool compared = grid.cols == model.cols && grid.rows == model.rows;
+        bool pass =
+            camera_motion_model_check(&model, grid.cols, grid.rows, frame->time_ms * 1000, &result);
+        format_results(results, sizeof(results), pass, &result, sad, compared);
+        passed += pass;
+
+        if (update)
+        {
+            snprintf(frame->results, sizeof(frame->results), "%s", results);
+        }
+        else
+        {
+            CHECK(strcmp(results, frame->results) == 0, "%s: got\n  %s\nexpected\n  %s",
+                  frame->name, results, frame->results);
+        }
+    }
+
+    if (update)
+    {
+        snprintf(path, sizeof(path), "%s/expected.csv", dir);
+        f = fopen(path, "w");
+        CHECK(f != NULL, "cannot write %s", path);
+        if (f != NULL)
+        {
+            fprintf(f, "# threshold,area percent,keyframe interval ms,background shift\n%s\n",
+                    config_line);
+            fprintf(f, "# frame,time ms,pass,motion,keyframe,changed blocks,SAD of each block\n");
+            for (size_t i = 0; i < count; i++)
+            {
+                fprintf(f, "%s,%lld,%s\n", frames[i].name, frames[i].time_ms, frames[i].results);
+            }
+            fclose(f);
+        }
+    }
+
+    printf("Replayed %zu frames, %u passed\n", count, (unsigned)passed);
+}
+
+int main(int argc, char **argv)
+{
+    bool update = argc > 2 && strcmp(argv[1], "-u") == 0;
+    const char *dir = argv[argc - 1];
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s [-u] <frames directory>\n", argv[0]);
+        return 2;
+    }
+
+    test_block_sad();
+    test_background_update();
+    test_replay(dir, update);
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
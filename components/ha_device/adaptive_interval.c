@@ -0,0 +1,72 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "adaptive_interval.h"
+
+/**
+ * Clamp a value between a lower and upper bound.
+ *
+ * @param x Value to clamp.
+ * @param low Minimum allowable value.
+ * @param high Maximum allowable value.
+ *
+ * @return Clamped value.
+ */
+#define CLAMP(x, low, high) ((x) < (low) ? (low) : ((x) > (high) ? (high) : (x)))
+
+/** Maximum factor the interval is stretched by for repeated connection errors. */
+#define RETRY_STRETCH_MAX 8
+
+uint32_t adaptive_interval_target(const struct adaptive_interval_config *config,
+                                  const struct adaptive_interval_inputs *inputs)
+{
+    uint64_t target_ms = config->base_ms;
+
+    /* Stretch linearly from 1x at the low threshold up to battery_stretch when empty */
+    if (inputs->battery_percent != ADAPTIVE_INTERVAL_BATTERY_UNKNOWN
+        && inputs->battery_percent < config->battery_low_percent)
+    {
+        uint32_t depleted = config->battery_low_percent - CLAMP(inputs->battery_percent, 0, 100);
+        target_ms += target_ms * (config->battery_stretch - 1) * depleted
+                     / config->battery_low_percent;
+    }
+
+    /* A weak link costs more airtime per report through lower MCS and retransmissions */
+    if (inputs->rssi_dbm != INT32_MIN && inputs->rssi_dbm < config->rssi_poor_dbm)
+    {
+        target_ms *= 2;
+    }
+
+    if (inputs->retries > 0)
+    {
+        target_ms *= CLAMP(inputs->retries + 1, 1, RETRY_STRETCH_MAX);
+    }
+
+    return CLAMP(target_ms, config->min_ms, config->max_ms);
+}
+
+uint32_t adaptive_interval_next(const struct adaptive_interval_config *config, uint32_t current_ms,
+                                const struct adaptive_interval_inputs *inputs)
+{
+    uint32_t target_ms = adaptive_interval_target(config, inputs);
+    uint64_t next_ms;
+
+    if (inputs->changed)
+    {
+        next_ms = (current_ms < target_ms ? current_ms : target_ms) / 2;
+    }
+    else if (current_ms < target_ms)
+    {
+        next_ms = (uint64_t)current_ms * 2;
+        next_ms = next_ms < target_ms ? next_ms : target_ms;
+    }
+    else
+    {
+        next_ms = target_ms;
+    }
+
+    return CLAMP(next_ms, config->min_ms, config->max_ms);
+}
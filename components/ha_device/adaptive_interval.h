@@ -0,0 +1,76 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Adaptive update interval calculation.
+ *
+ * Works out the next update interval from the battery level, the link quality and whether the
+ * sensor values are changing. A low battery or a poor link stretches the interval towards the
+ * configured maximum, while fast changing values pull it back towards the minimum.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Battery level to report when it is not known. */
+#define ADAPTIVE_INTERVAL_BATTERY_UNKNOWN (-1)
+
+/** Limits and thresholds for the adaptive interval. */
+struct adaptive_interval_config
+{
+    /** Interval used with a healthy battery and link, in milliseconds. */
+    uint32_t base_ms;
+    /** Shortest allowed interval in milliseconds. */
+    uint32_t min_ms;
+    /** Longest allowed interval in milliseconds. */
+    uint32_t max_ms;
+    /** Battery level (in percent) below which the interval starts to stretch. */
+    int battery_low_percent;
+    /** Factor the interval is stretched by when the battery is empty. */
+    uint32_t battery_stretch;
+    /** RSSI (in dBm) below which the link is considered poor. */
+    int32_t rssi_poor_dbm;
+};
+
+/** Measurements feeding into the adaptive interval. */
+struct adaptive_interval_inputs
+{
+    /** Battery level in percent, or @ref ADAPTIVE_INTERVAL_BATTERY_UNKNOWN. */
+    int battery_percent;
+    /** Link RSSI in dBm, or @c INT32_MIN if unknown. */
+    int32_t rssi_dbm;
+    /** Number of connection errors and failed publishes since the last update. */
+    uint32_t retries;
+    /** Whether any sensor moved by more than its deadband since it was last reported. */
+    bool changed;
+};
+
+/**
+ * Calculate the interval the device is aiming for when values are steady.
+ *
+ * @param[in] config Adaptive interval configuration.
+ * @param[in] inputs Current measurements.
+ * @return Target interval in milliseconds, clamped to the configured limits.
+ */
+uint32_t adaptive_interval_target(const struct adaptive_interval_config *config,
+                                  const struct adaptive_interval_inputs *inputs);
+
+/**
+ * Calculate the next update interval.
+ *
+ * When values are changing the interval is halved (down to the minimum) so changes are tracked
+ * closely. Otherwise it doubles back up towards the target, or drops straight to it if the target
+ * has fallen.
+ *
+ * @param[in] config Adaptive interval configuration.
+ * @param[in] current_ms Interval currently in use, in milliseconds.
+ * @param[in] inputs Current measurements.
+ * @return Next interval in milliseconds.
+ */
+uint32_t adaptive_interval_next(const struct adaptive_interval_config *config, uint32_t current_ms,
+                                const struct adaptive_interval_inputs *inputs);
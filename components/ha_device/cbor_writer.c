@@ -0,0 +1,142 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include "cbor_writer.h"
+
+/** CBOR major types (RFC 8949 section 3.1). */
+enum cbor_major_type
+{
+    CBOR_MAJOR_UINT = 0,
+    CBOR_MAJOR_NEGINT = 1,
+    CBOR_MAJOR_BYTES = 2,
+    CBOR_MAJOR_TEXT = 3,
+    CBOR_MAJOR_ARRAY = 4,
+    CBOR_MAJOR_MAP = 5,
+};
+
+/** Additional information values selecting the size of the argument that follows. */
+#define CBOR_ARG_1_BYTE 24
+#define CBOR_ARG_2_BYTES 25
+#define CBOR_ARG_4_BYTES 26
+#define CBOR_ARG_8_BYTES 27
+
+/**
+ * Append raw bytes to the output, marking the writer as overflowed if they do not fit.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] data Bytes to append.
+ * @param[in] len Number of bytes.
+ */
+static void cbor_put(struct cbor_writer *writer, const uint8_t *data, size_t len)
+{
+    if (writer->overflow || len > writer->size - writer->len)
+    {
+        writer->overflow = true;
+        return;
+    }
+
+    memcpy(&writer->buf[writer->len], data, len);
+    writer->len += len;
+}
+
+/**
+ * Encode an item header using the shortest form for its argument.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] major Major type of the item.
+ * @param[in] arg Argument (value, length or count) of the item.
+ */
+static void cbor_encode_head(struct cbor_writer *writer, enum cbor_major_type major, uint64_t arg)
+{
+    uint8_t head[9];
+    size_t arg_len;
+
+    if (arg < CBOR_ARG_1_BYTE)
+    {
+        head[0] = (major << 5) | arg;
+        arg_len = 0;
+    }
+    else if (arg <= UINT8_MAX)
+    {
+        head[0] = (major << 5) | CBOR_ARG_1_BYTE;
+        arg_len = 1;
+    }
+    else if (arg <= UINT16_MAX)
+    {
+        head[0] = (major << 5) | CBOR_ARG_2_BYTES;
+        arg_len = 2;
+    }
+    else if (arg <= UINT32_MAX)
+    {
+        head[0] = (major << 5) | CBOR_ARG_4_BYTES;
+        arg_len = 4;
+    }
+    else
+    {
+        head[0] = (major << 5) | CBOR_ARG_8_BYTES;
+        arg_len = 8;
+    }
+
+    /* Arguments are big-endian */
+    for (size_t i = 0; i < arg_len; i++)
+    {
+        head[1 + i] = arg >> (8 * (arg_len - 1 - i));
+    }
+
+    cbor_put(writer, head, 1 + arg_len);
+}
+
+void cbor_writer_init(struct cbor_writer *writer, uint8_t *buf, size_t size)
+{
+    writer->buf = buf;
+    writer->size = size;
+    writer->len = 0;
+    writer->overflow = false;
+}
+
+void cbor_encode_uint(struct cbor_writer *writer, uint64_t value)
+{
+    cbor_encode_head(writer, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_encode_int(struct cbor_writer *writer, int64_t value)
+{
+    if (value >= 0)
+    {
+        cbor_encode_head(writer, CBOR_MAJOR_UINT, value);
+    }
+    else
+    {
+        /* Negative integers are encoded as -1 - n */
+        cbor_encode_head(writer, CBOR_MAJOR_NEGINT, -1 - value);
+    }
+}
+
+void cbor_encode_map(struct cbor_writer *writer, size_t count)
+{
+    cbor_encode_head(writer, CBOR_MAJOR_MAP, count);
+}
+
+void cbor_encode_array(struct cbor_writer *writer, size_t count)
+{
+    cbor_encode_head(writer, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_encode_bytes(struct cbor_writer *writer, const uint8_t *data, size_t len)
+{
+    cbor_encode_head(writer, CBOR_MAJOR_BYTES, len);
+    cbor_put(writer, data, len);
+}
+
+void cbor_encode_text(struct cbor_writer *writer, const char *str)
+{
+    size_t len = strlen(str);
+
+    cbor_encode_head(writer, CBOR_MAJOR_TEXT, len);
+    cbor_put(writer, (const uint8_t *)str, len);
+}
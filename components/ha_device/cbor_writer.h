@@ -0,0 +1,102 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Minimal CBOR (RFC 8949) encoder.
+ *
+ * Only the subset needed for compact telemetry is supported: unsigned and negative integers, maps,
+ * arrays, byte strings and text strings. Items are written into a caller provided buffer, so no
+ * allocation takes place. If the buffer runs out the writer is marked as overflowed and all further
+ * writes are ignored; check @ref cbor_writer_ok once encoding is complete.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** CBOR writer state. */
+struct cbor_writer
+{
+    /** Output buffer. */
+    uint8_t *buf;
+    /** Size of the output buffer in bytes. */
+    size_t size;
+    /** Number of bytes written so far. */
+    size_t len;
+    /** Set if an item did not fit in the buffer. */
+    bool overflow;
+};
+
+/**
+ * Initialize a CBOR writer.
+ *
+ * @param[out] writer Writer to initialize.
+ * @param[in] buf Output buffer.
+ * @param[in] size Size of @p buf in bytes.
+ */
+void cbor_writer_init(struct cbor_writer *writer, uint8_t *buf, size_t size);
+
+/**
+ * Check whether everything written so far fitted in the buffer.
+ *
+ * @param[in] writer CBOR writer.
+ * @return true if no item has overflowed the buffer.
+ */
+static inline bool cbor_writer_ok(const struct cbor_writer *writer)
+{
+    return !writer->overflow;
+}
+
+/**
+ * Encode an unsigned integer.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] value Value to encode.
+ */
+void cbor_encode_uint(struct cbor_writer *writer, uint64_t value);
+
+/**
+ * Encode a signed integer, using the negative integer major type where needed.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] value Value to encode.
+ */
+void cbor_encode_int(struct cbor_writer *writer, int64_t value);
+
+/**
+ * Start a map of definite length. Must be followed by @p count key/value pairs.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] count Number of key/value pairs in the map.
+ */
+void cbor_encode_map(struct cbor_writer *writer, size_t count);
+
+/**
+ * Start an array of definite length. Must be followed by @p count items.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] count Number of items in the array.
+ */
+void cbor_encode_array(struct cbor_writer *writer, size_t count);
+
+/**
+ * Encode a byte string.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] data Bytes to encode.
+ * @param[in] len Number of bytes.
+ */
+void cbor_encode_bytes(struct cbor_writer *writer, const uint8_t *data, size_t len);
+
+/**
+ * Encode a null terminated text string.
+ *
+ * @param[in,out] writer CBOR writer.
+ * @param[in] str String to encode.
+ */
+void cbor_encode_text(struct cbor_writer *writer, const char *str);
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Transport the device publishes over, private to the ha_device component.
+ *
+ * Each transport implements these functions in its own file, and only the one selected by
+ * @c CONFIG_DEVICE_TRANSPORT is compiled:
+ *
+ * - device_transport_mqtt.c connects to the broker with esp-mqtt, optionally over the mqtt_tls
+ *   transport and through the mqtt_outbox, and receives Home Assistant status messages and
+ *   configuration commands.
+ * - device_transport_mqttsn.c publishes through an MQTT-SN gateway over UDP, registering the
+ *   topics once per session and sleeping between reports.
+ *
+ * Publishing and idling are called from the device event task only.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+/** Topics the device publishes on. */
+enum device_topic
+{
+    DEVICE_TOPIC_DISCOVERY, /**< Home Assistant discovery topic */
+    DEVICE_TOPIC_STATE,     /**< State topic, JSON or CBOR depending on the encoding */
+    DEVICE_TOPIC_KEYS,      /**< Key list for decoding CBOR state messages */
+#if CONFIG_AGGREGATION_BATCH
+    DEVICE_TOPIC_BATCH, /**< Compressed samples of each aggregation window */
+#endif
+    DEVICE_TOPIC_COUNT,
+};
+
+/** Link events the transport reports to the device, from the transport's own task. */
+struct device_transport_callbacks
+{
+    /** The device can report: the transport connected, or Home Assistant came online. */
+    void (*connected)(void);
+    /** The device should stop reporting: the transport disconnected, or Home Assistant went
+     * offline. */
+    void (*disconnected)(void);
+    /** A connection attempt or request failed, counted when adapting the update interval. */
+    void (*link_error)(void);
+#if CONFIG_DEVICE_COMMANDS
+    /**
+     * A configuration command was received.
+     *
+     * @param[in] data Command, not null-terminated.
+     * @param[in] len Length of @p data in bytes.
+     */
+    void (*command)(const char *data, size_t len);
+#endif
+};
+
+/** Transport configuration. */
+struct device_transport_config
+{
+    /** Device ID, used as client ID and topic prefix. */
+    const char *device_id;
+    /** Topic names, indexed by @ref device_topic. */
+    const char *topics[DEVICE_TOPIC_COUNT];
+    /** Link events. */
+    struct device_transport_callbacks callbacks;
+};
+
+/**
+ * Start the transport.
+ *
+ * Must be called once. @ref device_transport_callbacks.connected is called once the device can
+ * report.
+ *
+ * @param[in] config Transport configuration. Strings must remain valid while the device runs.
+ */
+void device_transport_start(const struct device_transport_config *config);
+
+/**
+ * Publish a message on one of the device topics.
+ *
+ * @param[in] topic Topic to publish on
+ * @param[in] data Message payload
+ * @param[in] len Length of @p data in bytes
+ * @param[in] retain Ask the broker to retain the message
+ * @return Message ID (0 for QoS 0 or when queued) on success, -1 on failure
+ */
+int device_transport_publish(enum device_topic topic, const void *data, size_t len, bool retain);
+
+/**
+ * Let the transport idle until the next update, after the messages of an update were published.
+ */
+void device_transport_idle(void);
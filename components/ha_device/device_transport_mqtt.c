@@ -0,0 +1,276 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "mqtt_client.h"
+
+#include "device_transport.h"
+#include "mqtt_metrics.h"
+#include "mqtt_outbox.h"
+#include "mqtt_tls.h"
+#include "report_schedule.h"
+
+static const char *TAG = "ha_device";
+
+/** Home Assistant status topic for birth and last will messages. */
+#define HA_STATUS_TOPIC "homeassistant/status"
+
+/** MQTT topic format used to report publish latency and delivery metrics. */
+#define DIAGNOSTICS_TOPIC_FORMAT "%s/diagnostics"
+
+/** MQTT topic format the device receives configuration commands on. */
+#define COMMAND_TOPIC_FORMAT "%s/set"
+
+/** MQTT transport state. */
+static struct device_transport
+{
+    /** Transport configuration. */
+    struct device_transport_config config;
+    /** MQTT client handle. */
+    esp_mqtt_client_handle_t client;
+    /** MQTT client configuration, kept to update the reconnect delay at runtime. */
+    esp_mqtt_client_config_t mqtt_cfg;
+    /** Failed connection attempts since the client was last connected. */
+    uint32_t reconnect_attempt;
+    /** MQTT topic publish metrics are reported on. */
+    char diagnostics_topic[64];
+#if CONFIG_DEVICE_COMMANDS
+    /** MQTT topic configuration commands are received on. */
+    char command_topic[64];
+#endif
+} transport = {};
+
+/** Reconnect backoff limits from configuration. */
+static const struct report_backoff_config backoff_config = {
+    .min_ms = CONFIG_RECONNECT_BACKOFF_MIN_MS,
+    .max_ms = CONFIG_RECONNECT_BACKOFF_MAX_MS,
+};
+
+/**
+ * Set the delay before the client's next reconnect attempt
+ *
+ * The delay grows with each failed attempt and is randomised, so devices that lost their
+ * connection together do not all reconnect together. The client checks the delay while it waits to
+ * reconnect, so a delay set from the disconnected event applies to the attempt that follows.
+ *
+ * @param[in] client MQTT client handle
+ */
+static void reconnect_backoff_update(esp_mqtt_client_handle_t client)
+{
+    transport.mqtt_cfg.network.reconnect_timeout_ms =
+        report_schedule_backoff_ms(&backoff_config, transport.reconnect_attempt, esp_random());
+    ESP_LOGD(TAG, "Reconnect delay %d ms after %lu failed attempts",
+             transport.mqtt_cfg.network.reconnect_timeout_ms, transport.reconnect_attempt);
+
+    ESP_ERROR_CHECK(esp_mqtt_set_config(client, &transport.mqtt_cfg));
+}
+
+/**
+ * Log an error message if the error code is non-zero
+ *
+ * Helper function that logs error messages using ESP's logging system. Only logs
+ * if the provided error code is non-zero. The error is logged at the ERROR level
+ * with both a descriptive message and the hexadecimal error code.
+ *
+ * @param[in] message Descriptive message about where/what the error is
+ * @param[in] error_code The error code to check and potentially log
+ */
+static void log_error_if_nonzero(const char *message, int error_code)
+{
+    if (error_code != 0)
+    {
+        ESP_LOGE(TAG, "Last error %s: 0x%x", message, error_code);
+    }
+}
+
+/**
+ * Event handler registered to receive MQTT events
+ *
+ * This function is called by the MQTT client event loop and handles various
+ * MQTT events such as connection, disconnection, subscription, and data reception.
+ *
+ * @param[in] handler_args User data registered to the event
+ * @param[in] base Event base for the handler (always MQTT Base in this example)
+ * @param[in] event_id The id for the received event
+ * @param[in] event_data The data for the event, esp_mqtt_event_handle_t
+ */
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                               void *event_data)
+{
+    ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
+    esp_mqtt_event_handle_t event = event_data;
+    esp_mqtt_client_handle_t client = event->client;
+    const struct device_transport_callbacks *callbacks = &transport.config.callbacks;
+
+    switch ((esp_mqtt_event_id_t)event_id)
+    {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        transport.reconnect_attempt = 0;
+        reconnect_backoff_update(client);
+
+        /* Subscribe to Home Assistant status topic */
+        int msg_id = esp_mqtt_client_subscribe(client, HA_STATUS_TOPIC, 0);
+        ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", HA_STATUS_TOPIC, msg_id);
+
+#if CONFIG_DEVICE_COMMANDS
+        /* At QoS 1 so that, with a persistent session, commands sent while offline are kept */
+        msg_id = esp_mqtt_client_subscribe(client, transport.command_topic, 1);
+        ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", transport.command_topic, msg_id);
+#endif
+
+        /* Let the device publish discovery and start its timers */
+        callbacks->connected();
+        break;
+
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        callbacks->link_error();
+        transport.reconnect_attempt++;
+        reconnect_backoff_update(client);
+
+        /* Let the device stop its timers. With the outbox the device keeps reporting instead,
+         * and the telemetry is queued until the client reconnects. */
+#if !CONFIG_MQTT_OUTBOX
+        callbacks->disconnected();
+#endif
+        break;
+
+    case MQTT_EVENT_SUBSCRIBED:
+        ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        break;
+
+    case MQTT_EVENT_UNSUBSCRIBED:
+        ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+        break;
+
+    case MQTT_EVENT_PUBLISHED:
+        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        break;
+
+    case MQTT_EVENT_DATA:
+        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+        ESP_LOGI(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
+        ESP_LOGI(TAG, "DATA=%.*s", event->data_len, event->data);
+
+        /* Check if this is a message from Home Assistant status topic */
+        if (event->topic_len == strlen(HA_STATUS_TOPIC)
+            && strncmp(event->topic, HA_STATUS_TOPIC, event->topic_len) == 0)
+        {
+
+            /* Handle 'online' message */
+            if (event->data_len == 6 && strncmp(event->data, "online", 6) == 0)
+            {
+                ESP_LOGI(TAG, "Home Assistant is online");
+                callbacks->connected();
+            }
+            /* Handle 'offline' message */
+            else if (event->data_len == 7 && strncmp(event->data, "offline", 7) == 0)
+            {
+                ESP_LOGI(TAG, "Home Assistant is offline");
+                callbacks->disconnected();
+            }
+        }
+#if CONFIG_DEVICE_COMMANDS
+        else if ((size_t)event->topic_len == strlen(transport.command_topic)
+                 && strncmp(event->topic, transport.command_topic, event->topic_len) == 0)
+        {
+            /* A command split over several events is not reassembled */
+            if (event->data_len != event->total_data_len)
+            {
+                ESP_LOGW(TAG, "Ignoring command of %d bytes", event->total_data_len);
+                break;
+            }
+
+            callbacks->command(event->data, event->data_len);
+        }
+#endif
+        break;
+
+    case MQTT_EVENT_ERROR:
+        ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+        callbacks->link_error();
+        if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT)
+        {
+            log_error_if_nonzero("reported from esp-tls",
+                                 event->error_handle->esp_tls_last_esp_err);
+            log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
+            log_error_if_nonzero("captured as transport's socket errno",
+                                 event->error_handle->esp_transport_sock_errno);
+            ESP_LOGI(TAG, "Last errno string (%s)",
+                     strerror(event->error_handle->esp_transport_sock_errno));
+        }
+        break;
+
+    default:
+        ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+        break;
+    }
+}
+
+void device_transport_start(const struct device_transport_config *config)
+{
+    assert(transport.client == NULL);
+
+    transport.config = *config;
+    snprintf(transport.diagnostics_topic, sizeof(transport.diagnostics_topic),
+             DIAGNOSTICS_TOPIC_FORMAT, config->device_id);
+#if CONFIG_DEVICE_COMMANDS
+    snprintf(transport.command_topic, sizeof(transport.command_topic), COMMAND_TOPIC_FORMAT,
+             config->device_id);
+#endif
+
+    transport.mqtt_cfg = (esp_mqtt_client_config_t){
+        .broker.address.uri = CONFIG_BROKER_URL,
+        .credentials.username = CONFIG_BROKER_USERNAME,
+        .credentials.authentication.password = CONFIG_BROKER_PASSWORD,
+        .network.reconnect_timeout_ms =
+            report_schedule_backoff_ms(&backoff_config, 0, esp_random()),
+#if CONFIG_MQTT_OUTBOX_PERSISTENT_SESSION
+        .session.disable_clean_session = true,
+#endif
+    };
+#if CONFIG_MQTT_TLS
+    transport.mqtt_cfg.network.transport = mqtt_tls_transport_create();
+#endif
+
+    transport.client = esp_mqtt_client_init(&transport.mqtt_cfg);
+    assert(transport.client);
+
+    esp_mqtt_client_register_event(transport.client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    mqtt_metrics_init(transport.client);
+#if CONFIG_MQTT_OUTBOX
+    mqtt_outbox_init(transport.client);
+#endif
+    mqtt_metrics_start_reporting(transport.diagnostics_topic);
+    esp_mqtt_client_start(transport.client);
+}
+
+int device_transport_publish(enum device_topic topic, const void *data, size_t len, bool retain)
+{
+    const char *name = transport.config.topics[topic];
+
+#if CONFIG_MQTT_OUTBOX
+    /* Retained discovery and key messages are republished on every connect, so they stay QoS 0.
+     * Telemetry is queued in the outbox and delivered at QoS 1. */
+    if (!retain)
+    {
+        return mqtt_outbox_publish(name, data, len, false) == ESP_OK ? 0 : -1;
+    }
+#endif
+    return mqtt_metrics_publish(transport.client, name, data, len, 0, retain);
+}
+
+void device_transport_idle(void)
+{
+    /* The client keeps the connection alive with its own pings */
+}
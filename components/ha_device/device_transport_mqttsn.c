@@ -0,0 +1,146 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+
+#include "esp_log.h"
+
+#include "device_transport.h"
+#include "mqttsn_client.h"
+
+static const char *TAG = "ha_device";
+
+/** MQTT-SN transport state. */
+static struct device_transport
+{
+    /** Transport configuration. */
+    struct device_transport_config config;
+    /** MQTT-SN client. */
+    struct mqttsn_client mqttsn;
+    /** Whether @c topic_ids are valid for the current MQTT-SN session. */
+    bool registered;
+    /** Topic IDs registered with the gateway, indexed by @ref device_topic. */
+    uint16_t topic_ids[DEVICE_TOPIC_COUNT];
+} transport = {};
+
+/**
+ * Start a new MQTT-SN session and register every topic the device publishes on.
+ *
+ * @return ESP_OK on success, or the error from the failed connect or register request
+ */
+static esp_err_t mqttsn_session_start(void)
+{
+    transport.registered = false;
+
+    esp_err_t err = mqttsn_client_connect(&transport.mqttsn, true);
+    for (int i = 0; err == ESP_OK && i < DEVICE_TOPIC_COUNT; i++)
+    {
+        err = mqttsn_client_register(&transport.mqttsn, transport.config.topics[i],
+                                     &transport.topic_ids[i]);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to start MQTT-SN session: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    transport.registered = true;
+    ESP_LOGI(TAG, "MQTT-SN session started");
+    return ESP_OK;
+}
+
+/**
+ * Make sure the MQTT-SN client is active, waking it from sleep if needed.
+ *
+ * A sleeping client resumes its session, keeping the registered topic IDs. If the gateway no longer
+ * accepts the session, or rejected a publish because it no longer knows the topic IDs (it
+ * restarted and accepted the resumed session without them), a new session is started and the
+ * topics are registered again.
+ *
+ * @return ESP_OK if the client is active with all topics registered
+ */
+static esp_err_t mqttsn_wake(void)
+{
+    mqttsn_client_poll(&transport.mqttsn);
+    if (transport.registered && transport.mqttsn.topics_invalid)
+    {
+        ESP_LOGW(TAG, "MQTT-SN gateway lost the registered topics");
+        transport.config.callbacks.link_error();
+        transport.registered = false;
+    }
+
+    if (transport.registered && transport.mqttsn.state == MQTTSN_STATE_ACTIVE)
+    {
+        return ESP_OK;
+    }
+
+    if (transport.registered && transport.mqttsn.state == MQTTSN_STATE_ASLEEP
+        && mqttsn_client_connect(&transport.mqttsn, false) == ESP_OK)
+    {
+        return ESP_OK;
+    }
+
+    return mqttsn_session_start();
+}
+
+void device_transport_start(const struct device_transport_config *config)
+{
+    assert(transport.config.device_id == NULL);
+
+    transport.config = *config;
+
+    const struct mqttsn_client_config mqttsn_cfg = {
+        .host = CONFIG_MQTTSN_GATEWAY_HOST,
+        .port = CONFIG_MQTTSN_GATEWAY_PORT,
+        .client_id = config->device_id,
+        .keepalive_s = CONFIG_MQTTSN_KEEPALIVE_S,
+        .timeout_ms = CONFIG_MQTTSN_TIMEOUT_MS,
+        .retries = CONFIG_MQTTSN_RETRIES,
+    };
+
+    ESP_ERROR_CHECK(mqttsn_client_init(&transport.mqttsn, &mqttsn_cfg));
+
+    /* There is no connection event over UDP; the session is started by the first publish */
+    transport.config.callbacks.connected();
+}
+
+int device_transport_publish(enum device_topic topic, const void *data, size_t len, bool retain)
+{
+    esp_err_t err;
+
+#if CONFIG_MQTTSN_STATE_TOPIC_ID > 0
+    /* State messages to a predefined topic ID are published at QoS -1, which needs no connection */
+    if (topic == DEVICE_TOPIC_STATE)
+    {
+        err = mqttsn_client_publish(&transport.mqttsn, CONFIG_MQTTSN_STATE_TOPIC_ID,
+                                    MQTTSN_TOPIC_PREDEFINED, true, retain, data, len);
+        return err == ESP_OK ? 0 : -1;
+    }
+#endif
+
+    err = mqttsn_wake();
+    if (err == ESP_OK)
+    {
+        err = mqttsn_client_publish(&transport.mqttsn, transport.topic_ids[topic],
+                                    MQTTSN_TOPIC_NORMAL, false, retain, data, len);
+    }
+    return err == ESP_OK ? 0 : -1;
+}
+
+void device_transport_idle(void)
+{
+#if CONFIG_MQTTSN_SLEEP
+    /* The gateway keeps the session without expecting keep alive pings while the client sleeps */
+    if (transport.mqttsn.state == MQTTSN_STATE_ACTIVE
+        && mqttsn_client_sleep(&transport.mqttsn, CONFIG_MQTTSN_SLEEP_DURATION_S) != ESP_OK)
+    {
+        transport.config.callbacks.link_error();
+    }
+#endif
+    ESP_LOGD(TAG, "MQTT-SN packets: tx=%lu, rx=%lu", transport.mqttsn.tx_packets,
+             transport.mqttsn.rx_packets);
+}
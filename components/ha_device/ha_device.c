@@ -0,0 +1,2136 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#if CONFIG_DEVICE_COMMANDS
+#include "nvs.h"
+#endif
+
+#include "adaptive_interval.h"
+#include "cbor_writer.h"
+#include "device_transport.h"
+#include "ha_device.h"
+#include "report_schedule.h"
+#include "ts_codec.h"
+#include "window_stats.h"
+
+static const char *TAG = "ha_device";
+
+/* Macro for cJSON error checking */
+#define CJSON_CHECK(x)                                                 \
+    do                                                                 \
+    {                                                                  \
+        if ((x) == NULL)                                               \
+        {                                                              \
+            ESP_LOGE(TAG, "cJSON error at %s:%d", __FILE__, __LINE__); \
+            goto exit;                                                 \
+        }                                                              \
+    } while (0)
+
+/** Publish interval (in milliseconds) from configuration */
+#define UPDATE_INTERVAL_MS CONFIG_UPDATE_INTERVAL_MS
+
+/** MQTT discovery topic format used for Home Assistant integration. */
+#define DISCOVERY_TOPIC_FORMAT "homeassistant/device/%s/config"
+
+/** MQTT state topic format used to publish sensor data. */
+#define STATE_TOPIC_FORMAT "%s/state"
+
+/** MQTT topic format used to publish CBOR encoded sensor data. */
+#define STATE_CBOR_TOPIC_FORMAT "%s/state/cbor"
+
+/** MQTT topic format used to publish the key list for decoding CBOR sensor data. */
+#define STATE_KEYS_TOPIC_FORMAT "%s/state/keys"
+
+/** MQTT topic format used to publish the samples of each aggregation window. */
+#define STATE_BATCH_TOPIC_FORMAT "%s/state/batch"
+
+/** NVS namespace the update interval and power profile are kept in. */
+#define SETTINGS_NVS_NAMESPACE "ha_device"
+
+/** NVS namespace the deadbands are kept in, keyed by sensor name. */
+#define DEADBAND_NVS_NAMESPACE "ha_deadband"
+
+/** Longest NVS key, excluding the null terminator. Longer sensor names are truncated. */
+#define NVS_KEY_MAX_LEN 15
+
+/** Update interval limits (in milliseconds) accepted by command, as in the Kconfig range. */
+#define COMMAND_INTERVAL_MIN_MS 1000
+#define COMMAND_INTERVAL_MAX_MS 3600000
+
+#if CONFIG_AGGREGATION
+/** Window statistics published alongside the mean of each sensor. */
+enum window_stat
+{
+    WINDOW_STAT_MIN,    /**< Smallest sample in the window */
+    WINDOW_STAT_MAX,    /**< Largest sample in the window */
+    WINDOW_STAT_STDDEV, /**< Standard deviation of the samples in the window */
+    WINDOW_STAT_COUNT,
+};
+
+/** Suffixes appended to the sensor name for each @ref window_stat. */
+static const char *const window_stat_suffixes[WINDOW_STAT_COUNT] = {"min", "max", "stddev"};
+#endif
+
+#if CONFIG_AGGREGATION_BATCH
+/** Encoding of the values in a batch, from configuration. */
+#if CONFIG_AGGREGATION_BATCH_VALUES_XOR
+#define BATCH_VALUES TS_CODEC_VALUES_XOR
+#else
+#define BATCH_VALUES TS_CODEC_VALUES_VARINT
+#endif
+
+/** Room in a batch message for its header and each sensor's name and sample count. */
+#define BATCH_OVERHEAD_LEN 16
+#endif
+
+/** Size of the buffer used to encode CBOR state messages. */
+#define STATE_CBOR_MAX_LEN 256
+
+/** Number of times each encoding is repeated when benchmarking, to average out timer jitter. */
+#define BENCHMARK_ROUNDS 10
+
+/** PHY rate used for the airtime estimate: 1 MHz channel at MCS0. */
+#define BENCHMARK_PHY_RATE_BPS 300000
+
+/** Bytes added to every state message: 802.11 MAC/LLC, IPv4, TCP and MQTT fixed headers. */
+#define BENCHMARK_FRAME_OVERHEAD (36 + 20 + 20 + 4)
+
+/** Length of the device ID string including the null terminator. */
+#define DEVICE_ID_LEN 13
+
+/** Default maximum silence (in milliseconds) from configuration */
+#define MAX_SILENCE_MS CONFIG_MAX_SILENCE_MS
+
+/** Time to wait for space in the device event queue when posting from outside the timer. */
+#define DEVICE_EVENT_POST_TIMEOUT_MS 100
+
+/** Stack size of the device event task, which encodes and publishes all messages. */
+#define DEVICE_EVENT_TASK_STACK_SIZE 4096
+
+/** Priority of the device event task. */
+#define DEVICE_EVENT_TASK_PRIORITY 5
+
+/** Delay before retrying to post the first report when the device event queue is full. */
+#define PHASE_RETRY_MS 100
+
+/** Runtime reporting state kept for each registered sensor. */
+struct sensor_state
+{
+    /** Value read during the current update pass. */
+    float value;
+    /** Whether @c value is valid for the current update pass. */
+    bool valid;
+    /** Whether the sensor has been reported since the device connected. */
+    bool reported;
+    /** Last value reported to the broker. */
+    float last_value;
+    /** Time (in microseconds) the sensor was last reported. */
+    int64_t last_report_us;
+    /** Report policy in use, from the configuration unless changed over the command topic. */
+    struct ha_report_policy policy;
+#if CONFIG_AGGREGATION
+    /** Statistics of the samples taken in the current window. */
+    struct window_stats window;
+#endif
+#if CONFIG_AGGREGATION_BATCH
+    /** Samples taken in the current window, encoded into @c series_buf. */
+    struct ts_encoder series;
+    /** Buffer holding the encoded samples. */
+    uint8_t series_buf[CONFIG_AGGREGATION_BATCH_MAX_LEN];
+#endif
+};
+
+/** Device state structure. */
+static struct ha_device
+{
+    /** Set once @ref ha_device_init has been called. */
+    bool started;
+    /** Device configuration provided by the application. */
+    const struct ha_device_config *config;
+    /** Reporting state, one entry per sensor in the configuration. */
+    struct sensor_state *sensor_states;
+    /** Unique device ID string derived from the MAC address. */
+    char device_id[DEVICE_ID_LEN];
+    /** MQTT state topic Home Assistant reads JSON state from. */
+    char state_topic[64];
+    /** Topic names, indexed by @ref device_topic. */
+    char topics[DEVICE_TOPIC_COUNT][64];
+    /** Whether the discovery message has been published since the device last connected. */
+    bool announced;
+    /** Timer handle for periodic updates. */
+    esp_timer_handle_t update_timer;
+    /** One-shot timer delaying the first report after connecting by the device's phase offset. */
+    esp_timer_handle_t phase_timer;
+    /** One-shot timer calling the prepare callback ahead of the next update. */
+    esp_timer_handle_t prepare_timer;
+#if CONFIG_AGGREGATION
+    /** Timer handle for sampling within an aggregation window. */
+    esp_timer_handle_t sample_timer;
+    /** Set while a sample event is queued, so that further timer expiries are coalesced. */
+    atomic_bool sample_pending;
+#endif
+#if CONFIG_AGGREGATION_BATCH
+    /** Samples left out of the current batch because they did not fit. */
+    uint32_t batch_dropped;
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    /** Time spent encoding the samples of the current batch, in microseconds. */
+    int64_t batch_encode_us;
+    /** Size the samples of the current batch would take as JSON [time, value] pairs. */
+    size_t batch_json_len;
+#endif
+#endif
+    /** Salt for the phase offset, changed to move to a new phase after a reconnect storm. */
+    uint32_t phase_salt;
+    /** Start of the current reconnect storm detection window, in microseconds. */
+    int64_t storm_start_us;
+    /** Connections within the current reconnect storm detection window. */
+    uint32_t storm_count;
+    /** Event loop, with its own task, that device events are posted to and handled on. */
+    esp_event_loop_handle_t event_loop;
+    /** Set while an update event is queued, so that further timer expiries are coalesced. */
+    atomic_bool update_pending;
+    /** Number of events posted but not yet handled. */
+    atomic_uint event_depth;
+    /** Event loop statistics, protected by @ref event_stats_lock. */
+    struct ha_device_event_stats event_stats;
+    /** Update interval currently in use, in milliseconds. */
+    uint32_t interval_ms;
+    /** Connection errors and failed publishes since the interval was last adapted. */
+    atomic_uint link_retries;
+} device = {};
+
+/** Protects @c device.event_stats, which is updated from the timer, MQTT and device event tasks. */
+static portMUX_TYPE event_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Forward declarations */
+static void update_timer_start(void);
+static void update_timer_stop(void);
+static void phase_timer_start(void);
+static void prepare_timer_schedule(uint32_t update_in_ms);
+
+#if CONFIG_ADAPTIVE_INTERVAL
+/** Adaptive interval limits from configuration. The base interval can be changed by command. */
+static struct adaptive_interval_config interval_config = {
+    .base_ms = UPDATE_INTERVAL_MS,
+    .min_ms = CONFIG_UPDATE_INTERVAL_MIN_MS,
+    .max_ms = CONFIG_UPDATE_INTERVAL_MAX_MS,
+    .battery_low_percent = CONFIG_ADAPTIVE_BATTERY_LOW_PERCENT,
+    .battery_stretch = CONFIG_ADAPTIVE_BATTERY_STRETCH,
+    .rssi_poor_dbm = CONFIG_ADAPTIVE_RSSI_POOR_DBM,
+};
+
+/**
+ * Read the update interval currently in use.
+ *
+ * @param[in] arg User data (unused)
+ * @param[out] value Update interval in milliseconds
+ * @return ESP_OK
+ */
+static esp_err_t read_update_interval(void *arg, float *value)
+{
+    *value = device.interval_ms;
+    return ESP_OK;
+}
+
+/** Diagnostic entity reporting the adaptive update interval. */
+static const struct ha_sensor update_interval_sensor = {
+    .name = "update_interval",
+    .device_class = "duration",
+    .unit = "ms",
+    .entity_category = "diagnostic",
+    .read = read_update_interval,
+};
+#endif
+
+/**
+ * Get the device ID string. Generates a 12-character uppercase hex string without separators.
+ *
+ * @param[out] device_id_buf Buffer to store the device ID.
+ * @param[in] buf_len Length of the buffer; must be >= 13 bytes.
+ */
+static void get_device_id(char *device_id_buf, size_t buf_len)
+{
+    assert(buf_len >= DEVICE_ID_LEN);
+
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_efuse_mac_get_default(mac));
+
+    snprintf(device_id_buf, buf_len, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3],
+             mac[4], mac[5]);
+}
+
+/**
+ * Add a single sensor to the discovery components.
+ *
+ * @param[in,out] cmps The "cmps" cJSON object to add the sensor to.
+ * @param[in] sensor Sensor descriptor.
+ * @return ESP_OK on success, ESP_FAIL on error
+ */
+static esp_err_t add_sensor_component(cJSON *cmps, const struct ha_sensor *sensor)
+{
+    char name_buf[64];
+    char template_buf[64];
+    cJSON *component = NULL;
+
+    snprintf(name_buf, sizeof(name_buf), "%s_%s", device.device_id, sensor->name);
+    snprintf(template_buf, sizeof(template_buf), "{{ value_json.%s }}", sensor->name);
+
+    component = cJSON_CreateObject();
+    CJSON_CHECK(component);
+    cJSON_AddItemToObject(cmps, sensor->name, component);
+
+    CJSON_CHECK(cJSON_AddStringToObject(component, "p", "sensor"));
+    if (sensor->device_class != NULL)
+    {
+        CJSON_CHECK(cJSON_AddStringToObject(component, "device_class", sensor->device_class));
+    }
+    if (sensor->unit != NULL)
+    {
+        CJSON_CHECK(cJSON_AddStringToObject(component, "unit_of_measurement", sensor->unit));
+    }
+    if (sensor->entity_category != NULL)
+    {
+        CJSON_CHECK(
+            cJSON_AddStringToObject(component, "entity_category", sensor->entity_category));
+    }
+    CJSON_CHECK(cJSON_AddStringToObject(component, "value_template", template_buf));
+    CJSON_CHECK(
+        cJSON_AddNumberToObject(component, "suggested_display_precision", sensor->precision));
+    CJSON_CHECK(cJSON_AddStringToObject(component, "unique_id", name_buf));
+    CJSON_CHECK(cJSON_AddStringToObject(component, "object_id", name_buf));
+
+    return ESP_OK;
+
+exit:
+    /* No cleanup needed here as the parent object (cmps) will handle deletion */
+    ESP_LOGE(TAG, "Failed to generate component %s", sensor->name);
+    return ESP_FAIL;
+}
+
+#if CONFIG_AGGREGATION
+/**
+ * Add the window statistics of a sensor to the discovery components.
+ *
+ * The minimum and maximum are described like the sensor itself. The standard deviation is a
+ * spread rather than a reading, so it has no device class (which would let Home Assistant convert
+ * it like an absolute value) and is a diagnostic entity.
+ *
+ * @param[in,out] cmps The "cmps" cJSON object to add the components to.
+ * @param[in] sensor Sensor descriptor.
+ * @return ESP_OK on success, ESP_FAIL on error
+ */
+static esp_err_t add_window_stats_components(cJSON *cmps, const struct ha_sensor *sensor)
+{
+    char name_buf[64];
+
+    for (int i = 0; i < WINDOW_STAT_COUNT; i++)
+    {
+        struct ha_sensor stat = *sensor;
+
+        snprintf(name_buf, sizeof(name_buf), "%s_%s", sensor->name, window_stat_suffixes[i]);
+        stat.name = name_buf;
+        if (i == WINDOW_STAT_STDDEV)
+        {
+            stat.device_class = NULL;
+            stat.entity_category = "diagnostic";
+        }
+
+        if (add_sensor_component(cmps, &stat) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * Get a statistic of a window.
+ *
+ * @param[in] window Statistics of the window.
+ * @param[in] stat Statistic to get.
+ * @return Value of the statistic.
+ */
+static float window_stat_value(const struct window_stats *window, enum window_stat stat)
+{
+    switch (stat)
+    {
+    case WINDOW_STAT_MIN:
+        return window->min;
+    case WINDOW_STAT_MAX:
+        return window->max;
+    default:
+        return window_stats_stddev(window);
+    }
+}
+#endif
+
+/**
+ * Publish MQTT discovery message for Home Assistant auto-discovery
+ *
+ * Creates and publishes a JSON message containing device metadata and sensor
+ * configurations to the Home Assistant discovery topic. This enables automatic
+ * integration of the device's sensors into Home Assistant.
+ *
+ * @return ESP_OK if the message was published, ESP_FAIL on error
+ */
+static esp_err_t publish_discovery_message(void)
+{
+    const struct ha_device_config *config = device.config;
+    const char *discovery_topic = device.topics[DEVICE_TOPIC_DISCOVERY];
+    char *data_buf = NULL;
+    int msg_id = -1;
+
+    /* Create JSON root */
+    cJSON *root = cJSON_CreateObject();
+    CJSON_CHECK(root);
+
+    /* "dev" section (device metadata) */
+    cJSON *dev = cJSON_CreateObject();
+    CJSON_CHECK(dev);
+    cJSON_AddItemToObject(root, "dev", dev);
+
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "ids", device.device_id));
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "name", config->name));
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "mf", "Carey Co."));
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "sn", device.device_id));
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "sa", "Kitchen"));
+    CJSON_CHECK(cJSON_AddStringToObject(dev, "sw", config->sw_version));
+
+    /* "o" section (origin info) */
+    cJSON *o = cJSON_CreateObject();
+    CJSON_CHECK(o);
+    cJSON_AddItemToObject(root, "o", o);
+
+    CJSON_CHECK(cJSON_AddStringToObject(o, "name", "ESP HaLow Sensor"));
+    CJSON_CHECK(
+        cJSON_AddStringToObject(o, "url", "https://github.com/RobertWCarey/esp-halow-examples"));
+
+    /* "cmps" section (components) */
+    cJSON *cmps = cJSON_CreateObject();
+    CJSON_CHECK(cmps);
+    cJSON_AddItemToObject(root, "cmps", cmps);
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        if (add_sensor_component(cmps, &config->sensors[i]) != ESP_OK)
+        {
+            goto exit;
+        }
+#if CONFIG_AGGREGATION
+        if (add_window_stats_components(cmps, &config->sensors[i]) != ESP_OK)
+        {
+            goto exit;
+        }
+#endif
+    }
+
+#if CONFIG_ADAPTIVE_INTERVAL
+    if (add_sensor_component(cmps, &update_interval_sensor) != ESP_OK)
+    {
+        goto exit;
+    }
+#endif
+
+    /* Global state topic */
+    CJSON_CHECK(cJSON_AddStringToObject(root, "state_topic", device.state_topic));
+
+    /* Serialize JSON */
+    data_buf = cJSON_PrintUnformatted(root);
+    CJSON_CHECK(data_buf);
+
+    /* Publish */
+    msg_id = device_transport_publish(DEVICE_TOPIC_DISCOVERY, data_buf, strlen(data_buf), true);
+    ESP_LOGI(TAG, "Published discovery message: topic=%s, msg_id=%d", discovery_topic, msg_id);
+
+exit:
+    /* Cleanup */
+    if (root != NULL)
+    {
+        cJSON_Delete(root);
+    }
+
+    if (data_buf != NULL)
+    {
+        free(data_buf);
+    }
+
+    return msg_id < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * Check whether a sensor has moved far enough from its last reported value to be reported.
+ *
+ * @param[in] policy Report policy of the sensor.
+ * @param[in] state Reporting state of the sensor.
+ * @return true if the change exceeds the configured deadband, or if no deadband is configured.
+ */
+static bool sensor_exceeds_deadband(const struct ha_report_policy *policy,
+                                    const struct sensor_state *state)
+{
+    float delta = fabsf(state->value - state->last_value);
+
+    if (policy->deadband_abs <= 0 && policy->deadband_rel <= 0)
+    {
+        return true;
+    }
+
+    if (policy->deadband_abs > 0 && delta > policy->deadband_abs)
+    {
+        return true;
+    }
+
+    if (policy->deadband_rel > 0 && delta > policy->deadband_rel * fabsf(state->last_value))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Check whether a sensor has moved by more than its deadband since it was last reported.
+ *
+ * Sensors without a deadband are never considered to be changing, as every reading would count.
+ *
+ * @param[in] policy Report policy of the sensor.
+ * @param[in] state Reporting state of the sensor, with the value for this pass filled in.
+ * @return true if the sensor is changing.
+ */
+static bool sensor_changed(const struct ha_report_policy *policy, const struct sensor_state *state)
+{
+    if (!state->reported || (policy->deadband_abs <= 0 && policy->deadband_rel <= 0))
+    {
+        return false;
+    }
+
+    return sensor_exceeds_deadband(policy, state);
+}
+
+#if CONFIG_ADAPTIVE_INTERVAL || CONFIG_DEVICE_COMMANDS
+/**
+ * Change the update interval, restarting the update timer if it is running.
+ *
+ * @param[in] interval_ms New update interval in milliseconds.
+ */
+static void update_interval_set(uint32_t interval_ms)
+{
+    device.interval_ms = interval_ms;
+
+    if (esp_timer_is_active(device.update_timer))
+    {
+        ESP_ERROR_CHECK(esp_timer_restart(device.update_timer, (uint64_t)interval_ms * 1000));
+#if !CONFIG_AGGREGATION
+        prepare_timer_schedule(interval_ms);
+#endif
+    }
+}
+#endif
+
+/**
+ * Recalculate the update interval and apply it to the update timer.
+ *
+ * @param[in] changed Whether any sensor is changing in this update pass.
+ */
+static void update_interval_adapt(bool changed)
+{
+#if CONFIG_ADAPTIVE_INTERVAL
+    const struct ha_device_config *config = device.config;
+    struct adaptive_interval_inputs inputs = {
+        .battery_percent = ADAPTIVE_INTERVAL_BATTERY_UNKNOWN,
+        .rssi_dbm = INT32_MIN,
+        .retries = atomic_exchange(&device.link_retries, 0),
+        .changed = changed,
+    };
+
+    if (config->get_battery_level != NULL)
+    {
+        int level = config->get_battery_level();
+        inputs.battery_percent = level < 0 ? ADAPTIVE_INTERVAL_BATTERY_UNKNOWN : level;
+    }
+
+    if (config->get_link_rssi != NULL)
+    {
+        inputs.rssi_dbm = config->get_link_rssi();
+    }
+
+    uint32_t next_ms = adaptive_interval_next(&interval_config, device.interval_ms, &inputs);
+    if (next_ms == device.interval_ms)
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Update interval %lu -> %lu ms (battery=%d%%, rssi=%ld dBm, retries=%lu%s)",
+             device.interval_ms, next_ms, inputs.battery_percent, inputs.rssi_dbm, inputs.retries,
+             changed ? ", changing" : "");
+    update_interval_set(next_ms);
+#endif
+}
+
+/**
+ * Check whether a sensor is due to be reported.
+ *
+ * @param[in] policy Report policy of the sensor.
+ * @param[in] state Reporting state of the sensor, with the value for this pass filled in.
+ * @param[in] now_us Current time in microseconds.
+ * @return true if the sensor should be reported.
+ */
+static bool sensor_report_due(const struct ha_report_policy *policy,
+                              const struct sensor_state *state, int64_t now_us)
+{
+    if (!state->reported)
+    {
+        return true;
+    }
+
+    int64_t elapsed_ms = (now_us - state->last_report_us) / 1000;
+    uint32_t max_silence_ms = policy->max_silence_ms ? policy->max_silence_ms : MAX_SILENCE_MS;
+
+    if (elapsed_ms >= max_silence_ms)
+    {
+        return true;
+    }
+
+    return elapsed_ms >= policy->min_interval_ms && sensor_exceeds_deadband(policy, state);
+}
+
+#if !CONFIG_STATE_ENCODING_CBOR || CONFIG_STATE_ENCODING_BENCHMARK
+/**
+ * Round a value to the given number of decimal places.
+ *
+ * Keeps the serialized state message short, cJSON would otherwise print the full float expansion
+ * (e.g. 23.450000762939453).
+ *
+ * @param[in] value Value to round.
+ * @param[in] precision Number of decimal places to keep.
+ * @return The rounded value.
+ */
+static double round_to_precision(float value, uint8_t precision)
+{
+    double scale = pow(10, precision);
+    return round(value * scale) / scale;
+}
+
+/**
+ * Encode the readings from the current update pass as a JSON state message.
+ *
+ * Each sensor is keyed by its name, e.g. `{"temperature":23.45,"humidity":45.12}`. With windowed
+ * aggregation the value is the mean of the window, and `<name>_min`, `<name>_max` and
+ * `<name>_stddev` are added.
+ *
+ * @return Null terminated JSON string which must be freed by the caller, or NULL on error.
+ */
+static char *encode_state_json(void)
+{
+    const struct ha_device_config *config = device.config;
+    cJSON *root = NULL;
+    char *data_buf = NULL;
+
+    root = cJSON_CreateObject();
+    CJSON_CHECK(root);
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct ha_sensor *sensor = &config->sensors[i];
+        const struct sensor_state *state = &device.sensor_states[i];
+
+        if (!state->valid)
+        {
+            continue;
+        }
+
+        CJSON_CHECK(cJSON_AddNumberToObject(root, sensor->name,
+                                            round_to_precision(state->value, sensor->precision)));
+
+#if CONFIG_AGGREGATION
+        for (int j = 0; j < WINDOW_STAT_COUNT; j++)
+        {
+            char key[64];
+
+            snprintf(key, sizeof(key), "%s_%s", sensor->name, window_stat_suffixes[j]);
+            CJSON_CHECK(cJSON_AddNumberToObject(
+                root, key,
+                round_to_precision(window_stat_value(&state->window, j), sensor->precision)));
+        }
+#endif
+    }
+
+#if CONFIG_ADAPTIVE_INTERVAL
+    CJSON_CHECK(cJSON_AddNumberToObject(root, update_interval_sensor.name, device.interval_ms));
+#endif
+
+    data_buf = cJSON_PrintUnformatted(root);
+    CJSON_CHECK(data_buf);
+
+exit:
+    /* Cleanup */
+    if (root != NULL)
+    {
+        cJSON_Delete(root);
+    }
+
+    return data_buf;
+}
+#endif
+
+#if CONFIG_STATE_ENCODING_CBOR || CONFIG_STATE_ENCODING_BENCHMARK
+/**
+ * Encode the readings from the current update pass as a CBOR state message.
+ *
+ * The message is a map keyed by the sensor's index in the key list published on the keys topic
+ * (see @ref publish_cbor_keys). Values are integers scaled by 10^precision, so 23.45 with a
+ * precision of 2 is sent as 2345. With windowed aggregation the window statistics follow under the
+ * keys after the sensors (and the update interval), in sensor order.
+ *
+ * @param[out] buf Buffer to encode into.
+ * @param[in] size Size of @p buf in bytes.
+ * @return Number of bytes written, or 0 if the message did not fit.
+ */
+static size_t encode_state_cbor(uint8_t *buf, size_t size)
+{
+    const struct ha_device_config *config = device.config;
+    struct cbor_writer writer;
+    size_t count = 0;
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        count += device.sensor_states[i].valid;
+    }
+#if CONFIG_ADAPTIVE_INTERVAL
+    count++;
+#endif
+#if CONFIG_AGGREGATION
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        count += device.sensor_states[i].valid * WINDOW_STAT_COUNT;
+    }
+#endif
+
+    cbor_writer_init(&writer, buf, size);
+    cbor_encode_map(&writer, count);
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct ha_sensor *sensor = &config->sensors[i];
+        const struct sensor_state *state = &device.sensor_states[i];
+
+        if (state->valid)
+        {
+            cbor_encode_uint(&writer, i);
+            cbor_encode_int(&writer, llround(state->value * pow(10, sensor->precision)));
+        }
+    }
+
+#if CONFIG_ADAPTIVE_INTERVAL
+    cbor_encode_uint(&writer, config->num_sensors);
+    cbor_encode_uint(&writer, device.interval_ms);
+#endif
+
+#if CONFIG_AGGREGATION
+    size_t key = config->num_sensors;
+#if CONFIG_ADAPTIVE_INTERVAL
+    key++;
+#endif
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct ha_sensor *sensor = &config->sensors[i];
+        const struct sensor_state *state = &device.sensor_states[i];
+
+        for (int j = 0; j < WINDOW_STAT_COUNT; j++, key++)
+        {
+            if (state->valid)
+            {
+                cbor_encode_uint(&writer, key);
+                cbor_encode_int(&writer, llround(window_stat_value(&state->window, j)
+                                                 * pow(10, sensor->precision)));
+            }
+        }
+    }
+#endif
+
+    if (!cbor_writer_ok(&writer))
+    {
+        ESP_LOGE(TAG, "CBOR state message does not fit in %u bytes", size);
+        return 0;
+    }
+
+    return writer.len;
+}
+#endif
+
+#if CONFIG_STATE_ENCODING_CBOR
+/**
+ * Publish the key list used to decode CBOR state messages.
+ *
+ * The list is a retained JSON array on `<device_id>/state/keys`, where the index of each entry is
+ * the integer key used in the CBOR state message. Each entry carries the sensor name and the
+ * precision its value was scaled by, e.g. `[{"n":"temperature","p":2},{"n":"humidity","p":2}]`.
+ */
+static void publish_cbor_keys(void)
+{
+    const struct ha_device_config *config = device.config;
+    cJSON *root = NULL;
+    char *data_buf = NULL;
+
+    root = cJSON_CreateArray();
+    CJSON_CHECK(root);
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        cJSON *key = cJSON_CreateObject();
+        CJSON_CHECK(key);
+        cJSON_AddItemToArray(root, key);
+
+        CJSON_CHECK(cJSON_AddStringToObject(key, "n", config->sensors[i].name));
+        CJSON_CHECK(cJSON_AddNumberToObject(key, "p", config->sensors[i].precision));
+    }
+
+#if CONFIG_ADAPTIVE_INTERVAL
+    cJSON *key = cJSON_CreateObject();
+    CJSON_CHECK(key);
+    cJSON_AddItemToArray(root, key);
+
+    CJSON_CHECK(cJSON_AddStringToObject(key, "n", update_interval_sensor.name));
+    CJSON_CHECK(cJSON_AddNumberToObject(key, "p", 0));
+#endif
+
+#if CONFIG_AGGREGATION
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        for (int j = 0; j < WINDOW_STAT_COUNT; j++)
+        {
+            char name_buf[64];
+
+            cJSON *stat_key = cJSON_CreateObject();
+            CJSON_CHECK(stat_key);
+            cJSON_AddItemToArray(root, stat_key);
+
+            snprintf(name_buf, sizeof(name_buf), "%s_%s", config->sensors[i].name,
+                     window_stat_suffixes[j]);
+            CJSON_CHECK(cJSON_AddStringToObject(stat_key, "n", name_buf));
+            CJSON_CHECK(cJSON_AddNumberToObject(stat_key, "p", config->sensors[i].precision));
+        }
+    }
+#endif
+
+    data_buf = cJSON_PrintUnformatted(root);
+    CJSON_CHECK(data_buf);
+
+    int msg_id = device_transport_publish(DEVICE_TOPIC_KEYS, data_buf, strlen(data_buf), true);
+    ESP_LOGI(TAG, "Published CBOR keys: topic=%s, msg_id=%d", device.topics[DEVICE_TOPIC_KEYS],
+             msg_id);
+
+exit:
+    /* Cleanup */
+    if (root != NULL)
+    {
+        cJSON_Delete(root);
+    }
+
+    if (data_buf != NULL)
+    {
+        free(data_buf);
+    }
+}
+#endif
+
+#if CONFIG_STATE_ENCODING_BENCHMARK
+/**
+ * Estimate the time on air of a state message.
+ *
+ * Adds the MQTT, TCP/IP and 802.11 header overhead to the payload and converts to microseconds at
+ * @ref BENCHMARK_PHY_RATE_BPS. The PHY preamble is not included as it is the same for both
+ * encodings.
+ *
+ * @param[in] topic_len Length of the MQTT topic.
+ * @param[in] payload_len Length of the MQTT payload.
+ * @return Estimated airtime in microseconds.
+ */
+static uint32_t estimate_airtime_us(size_t topic_len, size_t payload_len)
+{
+    size_t frame_len = BENCHMARK_FRAME_OVERHEAD + topic_len + payload_len;
+    return (uint64_t)frame_len * 8 * 1000000 / BENCHMARK_PHY_RATE_BPS;
+}
+
+/**
+ * Encode the readings about to be published with both encodings and log size, encode time and
+ * airtime. With aggregation this must be called before the window is reset.
+ */
+static void log_encoding_benchmark(void)
+{
+    uint8_t cbor_buf[STATE_CBOR_MAX_LEN];
+    size_t cbor_len = 0;
+    size_t json_len = 0;
+    int64_t start_us;
+
+    start_us = esp_timer_get_time();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++)
+    {
+        char *json = encode_state_json();
+        if (json == NULL)
+        {
+            return;
+        }
+        json_len = strlen(json);
+        free(json);
+    }
+    int64_t json_us = esp_timer_get_time() - start_us;
+
+    start_us = esp_timer_get_time();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++)
+    {
+        cbor_len = encode_state_cbor(cbor_buf, sizeof(cbor_buf));
+    }
+    int64_t cbor_us = esp_timer_get_time() - start_us;
+
+    ESP_LOGI(TAG, "Encoding benchmark: JSON %u bytes, %.1f us encode, ~%lu us airtime", json_len,
+             (double)json_us / BENCHMARK_ROUNDS,
+             estimate_airtime_us(strlen(device.state_topic), json_len));
+    ESP_LOGI(TAG, "Encoding benchmark: CBOR %u bytes, %.1f us encode, ~%lu us airtime", cbor_len,
+             (double)cbor_us / BENCHMARK_ROUNDS,
+             estimate_airtime_us(snprintf(NULL, 0, STATE_CBOR_TOPIC_FORMAT, device.device_id),
+                                 cbor_len));
+}
+#endif
+
+#if CONFIG_AGGREGATION_BATCH
+/**
+ * Add the last reading of a sensor to its batch.
+ *
+ * @param[in,out] state State of the sensor.
+ * @param[in] now_ms Time of the reading in milliseconds since boot.
+ */
+static void batch_add(struct sensor_state *state, int64_t now_ms)
+{
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    int64_t start_us = esp_timer_get_time();
+#endif
+
+    if (!ts_encoder_add(&state->series, now_ms, state->value))
+    {
+        device.batch_dropped++;
+        return;
+    }
+
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    device.batch_encode_us += esp_timer_get_time() - start_us;
+    device.batch_json_len += snprintf(NULL, 0, "[%lld,%.*f],", now_ms, state->series.precision,
+                                      state->value);
+#endif
+}
+#endif
+
+/**
+ * Sample every registered sensor in a single pass.
+ *
+ * With windowed aggregation each valid reading is also added to the sensor's window, and to its
+ * batch if enabled.
+ */
+static void sample_sensors(void)
+{
+    const struct ha_device_config *config = device.config;
+
+    if (config->sample != NULL)
+    {
+        config->sample(config->sample_arg);
+    }
+
+#if CONFIG_AGGREGATION_BATCH
+    int64_t now_ms = esp_timer_get_time() / 1000;
+#endif
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct ha_sensor *sensor = &config->sensors[i];
+        struct sensor_state *state = &device.sensor_states[i];
+
+        esp_err_t err = sensor->read(sensor->arg, &state->value);
+        state->valid = (err == ESP_OK);
+        if (!state->valid)
+        {
+            ESP_LOGW(TAG, "Failed to read %s: %s", sensor->name, esp_err_to_name(err));
+            continue;
+        }
+
+#if CONFIG_AGGREGATION
+        window_stats_add(&state->window, state->value);
+#endif
+#if CONFIG_AGGREGATION_BATCH
+        batch_add(state, now_ms);
+#endif
+    }
+}
+
+#if CONFIG_AGGREGATION
+/**
+ * Prepare the window statistics of every sensor for publishing.
+ *
+ * Each sensor's value becomes the mean of its window, and it is valid if the window has at least
+ * one sample. If no sensor has any, e.g. for the first report after connecting, a sample is taken
+ * first.
+ */
+static void window_close(void)
+{
+    const struct ha_device_config *config = device.config;
+    bool empty = true;
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        empty &= device.sensor_states[i].window.count == 0;
+    }
+
+    if (empty)
+    {
+        sample_sensors();
+    }
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        struct sensor_state *state = &device.sensor_states[i];
+
+        state->valid = state->window.count > 0;
+        state->value = state->window.mean;
+        ESP_LOGD(TAG, "%s: %lu samples, mean %f", config->sensors[i].name, state->window.count,
+                 state->window.mean);
+    }
+}
+
+/**
+ * Start a new, empty window for every sensor.
+ */
+static void window_reset(void)
+{
+    for (size_t i = 0; i < device.config->num_sensors; i++)
+    {
+        struct sensor_state *state = &device.sensor_states[i];
+
+        window_stats_reset(&state->window);
+#if CONFIG_AGGREGATION_BATCH
+        ts_encoder_init(&state->series, state->series_buf, sizeof(state->series_buf), BATCH_VALUES,
+                        device.config->sensors[i].precision);
+#endif
+    }
+
+#if CONFIG_AGGREGATION_BATCH
+    device.batch_dropped = 0;
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    device.batch_encode_us = 0;
+    device.batch_json_len = 0;
+#endif
+#endif
+}
+#endif
+
+#if CONFIG_AGGREGATION_BATCH
+/**
+ * Publish the samples of the current window.
+ *
+ * The message is a CBOR array of the uptime in milliseconds, against which the sample times can
+ * be placed, and a map of sensor name to an array of the sample count and the encoded series.
+ * Sensors without samples are left out.
+ */
+static void publish_window_batch(void)
+{
+    const struct ha_device_config *config = device.config;
+    size_t size = BATCH_OVERHEAD_LEN;
+    size_t count = 0;
+    uint32_t samples = 0;
+    struct cbor_writer writer;
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct sensor_state *state = &device.sensor_states[i];
+
+        if (state->series.count > 0)
+        {
+            size += BATCH_OVERHEAD_LEN + strlen(config->sensors[i].name)
+                    + ts_encoder_len(&state->series);
+            samples += state->series.count;
+            count++;
+        }
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint8_t *buf = malloc(size);
+    if (buf == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %u byte batch", size);
+        return;
+    }
+
+    cbor_writer_init(&writer, buf, size);
+    cbor_encode_array(&writer, 2);
+    cbor_encode_uint(&writer, esp_timer_get_time() / 1000);
+    cbor_encode_map(&writer, count);
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct sensor_state *state = &device.sensor_states[i];
+
+        if (state->series.count > 0)
+        {
+            cbor_encode_text(&writer, config->sensors[i].name);
+            cbor_encode_array(&writer, 2);
+            cbor_encode_uint(&writer, state->series.count);
+            cbor_encode_bytes(&writer, state->series_buf, ts_encoder_len(&state->series));
+        }
+    }
+
+    if (cbor_writer_ok(&writer))
+    {
+        int msg_id = device_transport_publish(DEVICE_TOPIC_BATCH, buf, writer.len, false);
+        ESP_LOGI(TAG, "Published batch: topic=%s, msg_id=%d, samples=%lu, len=%u",
+                 device.topics[DEVICE_TOPIC_BATCH], msg_id, samples, writer.len);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Batch does not fit in %u bytes", size);
+    }
+
+    if (device.batch_dropped > 0)
+    {
+        ESP_LOGW(TAG, "%lu samples did not fit in the batch", device.batch_dropped);
+    }
+
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    ESP_LOGI(TAG, "Batch benchmark: %lu samples, %u bytes (JSON %u bytes, %.1fx), %.2f us/sample",
+             samples, writer.len, device.batch_json_len,
+             (double)device.batch_json_len / writer.len, (double)device.batch_encode_us / samples);
+#endif
+
+    free(buf);
+}
+#endif
+
+/**
+ * Publish current sensor data to MQTT
+ *
+ * Samples every registered sensor in a single pass. If any sensor is due to be reported according
+ * to its report policy, or @p force is set, all readings are published together as one message on
+ * the device's state topic. Otherwise nothing is transmitted.
+ *
+ * With windowed aggregation the sensors have already been sampled throughout the window. Every
+ * window is published, carrying the window statistics and preceded by its samples if batches are
+ * enabled, and a new window is started.
+ *
+ * @param[in] force Publish regardless of the sensors' report policies
+ */
+static void publish_state_data(bool force)
+{
+    const struct ha_device_config *config = device.config;
+    int64_t now_us = esp_timer_get_time();
+    bool due = force;
+    bool changed = false;
+    char *data_buf = NULL;
+    size_t data_len;
+    const char *topic = device.topics[DEVICE_TOPIC_STATE];
+    int msg_id;
+
+#if CONFIG_AGGREGATION
+    window_close();
+    due = true;
+#if CONFIG_AGGREGATION_BATCH
+    publish_window_batch();
+#endif
+#else
+    sample_sensors();
+#endif
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        const struct ha_sensor *sensor = &config->sensors[i];
+        struct sensor_state *state = &device.sensor_states[i];
+
+        if (!state->valid)
+        {
+            continue;
+        }
+
+        if (!due && sensor_report_due(&state->policy, state, now_us))
+        {
+            ESP_LOGD(TAG, "%s due for report", sensor->name);
+            due = true;
+        }
+
+        changed |= sensor_changed(&state->policy, state);
+    }
+
+    update_interval_adapt(changed);
+
+    if (!due)
+    {
+        ESP_LOGD(TAG, "No sensor due for report, skipping publish");
+        return;
+    }
+
+#if CONFIG_STATE_ENCODING_BENCHMARK
+    /* Before the window is reset, so both encodings carry the statistics being published */
+    log_encoding_benchmark();
+#endif
+
+#if CONFIG_STATE_ENCODING_CBOR
+    uint8_t cbor_buf[STATE_CBOR_MAX_LEN];
+
+    data_len = encode_state_cbor(cbor_buf, sizeof(cbor_buf));
+#if CONFIG_AGGREGATION
+    window_reset();
+#endif
+    if (data_len == 0)
+    {
+        return;
+    }
+
+    msg_id = device_transport_publish(DEVICE_TOPIC_STATE, cbor_buf, data_len, false);
+#else
+    data_buf = encode_state_json();
+#if CONFIG_AGGREGATION
+    window_reset();
+#endif
+    if (data_buf == NULL)
+    {
+        return;
+    }
+    data_len = strlen(data_buf);
+
+    msg_id = device_transport_publish(DEVICE_TOPIC_STATE, data_buf, data_len, false);
+    ESP_LOGD(TAG, "%s", data_buf);
+#endif
+    ESP_LOGI(TAG, "Published data: topic=%s, msg_id=%d, len=%d", topic, msg_id, data_len);
+
+    if (msg_id < 0)
+    {
+        atomic_fetch_add(&device.link_retries, 1);
+    }
+    else
+    {
+        for (size_t i = 0; i < config->num_sensors; i++)
+        {
+            struct sensor_state *state = &device.sensor_states[i];
+
+            if (state->valid)
+            {
+                state->reported = true;
+                state->last_value = state->value;
+                state->last_report_us = now_us;
+            }
+        }
+    }
+
+    free(data_buf);
+}
+
+/**
+ * Publish the discovery message, and the CBOR key list if enabled.
+ */
+static void device_announce(void)
+{
+    device.announced = (publish_discovery_message() == ESP_OK);
+#if CONFIG_STATE_ENCODING_CBOR
+    publish_cbor_keys();
+#endif
+}
+
+#if CONFIG_DEVICE_COMMANDS
+/** Names of the power profiles in commands, indexed by @ref ha_power_profile. */
+static const char *const power_profile_names[] = {
+    [HA_POWER_PROFILE_PERFORMANCE] = "performance",
+    [HA_POWER_PROFILE_LOW_POWER] = "low_power",
+};
+
+/** Deadband of a sensor as kept in NVS. */
+struct deadband_setting
+{
+    /** Absolute deadband, see @ref ha_report_policy. */
+    float abs;
+    /** Relative deadband, see @ref ha_report_policy. */
+    float rel;
+};
+
+/**
+ * Write a setting to NVS.
+ *
+ * Failures are logged; the setting still applies until the next reset.
+ *
+ * @param[in] namespace NVS namespace.
+ * @param[in] key Key of the setting.
+ * @param[in] value Value to store.
+ * @param[in] len Length of @p value in bytes.
+ */
+static void settings_store(const char *namespace, const char *key, const void *value, size_t len)
+{
+    nvs_handle_t handle;
+
+    esp_err_t err = nvs_open(namespace, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, key, value, len);
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store %s/%s: %s", namespace, key, esp_err_to_name(err));
+    }
+}
+
+/**
+ * Read a setting from NVS.
+ *
+ * @param[in] handle Open NVS handle.
+ * @param[in] key Key of the setting.
+ * @param[out] value Value read.
+ * @param[in] len Length of @p value in bytes.
+ * @return true if the setting was found with the expected length.
+ */
+static bool settings_read(nvs_handle_t handle, const char *key, void *value, size_t len)
+{
+    size_t stored_len = len;
+
+    return nvs_get_blob(handle, key, value, &stored_len) == ESP_OK && stored_len == len;
+}
+
+/**
+ * Get the NVS key a sensor's deadband is kept under, the sensor name truncated to fit.
+ *
+ * @param[in] sensor Sensor to get the key of.
+ * @param[out] key Buffer of NVS_KEY_MAX_LEN + 1 bytes.
+ */
+static void deadband_key(const struct ha_sensor *sensor, char *key)
+{
+    snprintf(key, NVS_KEY_MAX_LEN + 1, "%.*s", NVS_KEY_MAX_LEN, sensor->name);
+}
+
+/**
+ * Change the base update interval, which the adaptive interval then works from.
+ *
+ * @param[in] interval_ms New update interval in milliseconds.
+ */
+static void interval_base_set(uint32_t interval_ms)
+{
+#if CONFIG_ADAPTIVE_INTERVAL
+    interval_config.base_ms = interval_ms;
+#endif
+    update_interval_set(interval_ms);
+}
+
+/**
+ * Switch the power profile through the application's callback.
+ *
+ * @param[in] profile Profile to switch to.
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the application has no callback, or the
+ *         error returned by the callback.
+ */
+static esp_err_t power_profile_set(enum ha_power_profile profile)
+{
+    if (device.config->set_power_profile == NULL)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    esp_err_t err = device.config->set_power_profile(profile);
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Power profile %s", power_profile_names[profile]);
+    }
+
+    return err;
+}
+
+/**
+ * Load the settings kept in NVS and apply them. Settings not in NVS keep their configured values.
+ */
+static void settings_load(void)
+{
+    nvs_handle_t handle;
+    uint32_t interval_ms;
+    uint8_t profile;
+
+    if (nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        if (settings_read(handle, "interval", &interval_ms, sizeof(interval_ms)))
+        {
+            ESP_LOGI(TAG, "Update interval %lu ms from NVS", interval_ms);
+            interval_base_set(interval_ms);
+        }
+
+        if (settings_read(handle, "power", &profile, sizeof(profile))
+            && profile < sizeof(power_profile_names) / sizeof(power_profile_names[0]))
+        {
+            power_profile_set(profile);
+        }
+
+        nvs_close(handle);
+    }
+
+    if (nvs_open(DEADBAND_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        for (size_t i = 0; i < device.config->num_sensors; i++)
+        {
+            struct sensor_state *state = &device.sensor_states[i];
+            struct deadband_setting deadband;
+            char key[NVS_KEY_MAX_LEN + 1];
+
+            deadband_key(&device.config->sensors[i], key);
+            if (settings_read(handle, key, &deadband, sizeof(deadband)))
+            {
+                state->policy.deadband_abs = deadband.abs;
+                state->policy.deadband_rel = deadband.rel;
+            }
+        }
+
+        nvs_close(handle);
+    }
+}
+
+/**
+ * Apply the update interval of a command.
+ *
+ * @param[in] item "interval_ms" member of the command.
+ */
+static void command_apply_interval(const cJSON *item)
+{
+    if (!cJSON_IsNumber(item) || item->valuedouble < COMMAND_INTERVAL_MIN_MS
+        || item->valuedouble > COMMAND_INTERVAL_MAX_MS)
+    {
+        ESP_LOGW(TAG, "interval_ms must be between %d and %d", COMMAND_INTERVAL_MIN_MS,
+                 COMMAND_INTERVAL_MAX_MS);
+        return;
+    }
+
+    uint32_t interval_ms = item->valuedouble;
+    ESP_LOGI(TAG, "Update interval %lu -> %lu ms by command", device.interval_ms, interval_ms);
+    interval_base_set(interval_ms);
+    settings_store(SETTINGS_NVS_NAMESPACE, "interval", &interval_ms, sizeof(interval_ms));
+}
+
+/**
+ * Apply the power profile of a command.
+ *
+ * @param[in] item "power_profile" member of the command.
+ */
+static void command_apply_power_profile(const cJSON *item)
+{
+    for (uint8_t profile = 0;
+         profile < sizeof(power_profile_names) / sizeof(power_profile_names[0]); profile++)
+    {
+        if (cJSON_IsString(item) && strcmp(item->valuestring, power_profile_names[profile]) == 0)
+        {
+            esp_err_t err = power_profile_set(profile);
+            if (err != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Failed to set power profile %s: %s", item->valuestring,
+                         esp_err_to_name(err));
+                return;
+            }
+
+            settings_store(SETTINGS_NVS_NAMESPACE, "power", &profile, sizeof(profile));
+            return;
+        }
+    }
+
+    ESP_LOGW(TAG, "Unknown power profile");
+}
+
+/**
+ * Apply the deadbands of a command.
+ *
+ * Each member is named after a sensor and holds either the absolute deadband, or an object with
+ * "abs" and/or "rel". Deadbands left out keep their current value.
+ *
+ * @param[in] item "deadband" member of the command.
+ */
+static void command_apply_deadbands(const cJSON *item)
+{
+    const cJSON *child;
+
+    cJSON_ArrayForEach(child, item)
+    {
+        size_t i = 0;
+        while (i < device.config->num_sensors
+               && strcmp(device.config->sensors[i].name, child->string) != 0)
+        {
+            i++;
+        }
+
+        if (i == device.config->num_sensors)
+        {
+            ESP_LOGW(TAG, "No sensor %s", child->string);
+            continue;
+        }
+
+        struct sensor_state *state = &device.sensor_states[i];
+        struct deadband_setting deadband = {
+            .abs = state->policy.deadband_abs,
+            .rel = state->policy.deadband_rel,
+        };
+
+        const cJSON *abs = cJSON_IsObject(child) ? cJSON_GetObjectItem(child, "abs") : child;
+        const cJSON *rel = cJSON_IsObject(child) ? cJSON_GetObjectItem(child, "rel") : NULL;
+        if ((abs != NULL && (!cJSON_IsNumber(abs) || abs->valuedouble < 0))
+            || (rel != NULL && (!cJSON_IsNumber(rel) || rel->valuedouble < 0)))
+        {
+            ESP_LOGW(TAG, "Deadband of %s must be a non-negative number", child->string);
+            continue;
+        }
+
+        if (abs != NULL)
+        {
+            deadband.abs = abs->valuedouble;
+        }
+        if (rel != NULL)
+        {
+            deadband.rel = rel->valuedouble;
+        }
+
+        ESP_LOGI(TAG, "Deadband of %s abs=%g rel=%g by command", child->string, deadband.abs,
+                 deadband.rel);
+        state->policy.deadband_abs = deadband.abs;
+        state->policy.deadband_rel = deadband.rel;
+
+        char key[NVS_KEY_MAX_LEN + 1];
+        deadband_key(&device.config->sensors[i], key);
+        settings_store(DEADBAND_NVS_NAMESPACE, key, &deadband, sizeof(deadband));
+    }
+}
+
+/**
+ * Apply a configuration command received on the command topic and keep the new settings in NVS.
+ *
+ * Each setting is checked on its own, so an invalid one is logged and skipped without affecting
+ * the others.
+ *
+ * @param[in] command Null terminated JSON command.
+ */
+static void device_command_apply(const char *command)
+{
+    const cJSON *item;
+
+    cJSON *root = cJSON_Parse(command);
+    if (!cJSON_IsObject(root))
+    {
+        ESP_LOGW(TAG, "Ignoring malformed command: %s", command);
+        cJSON_Delete(root);
+        return;
+    }
+
+    item = cJSON_GetObjectItem(root, "interval_ms");
+    if (item != NULL)
+    {
+        command_apply_interval(item);
+    }
+
+    item = cJSON_GetObjectItem(root, "power_profile");
+    if (item != NULL)
+    {
+        command_apply_power_profile(item);
+    }
+
+    item = cJSON_GetObjectItem(root, "deadband");
+    if (cJSON_IsObject(item))
+    {
+        command_apply_deadbands(item);
+    }
+
+    cJSON_Delete(root);
+}
+#endif
+
+ESP_EVENT_DEFINE_BASE(DEVICE_EVENT);
+
+/** Enumeration of device events */
+typedef enum
+{
+    DEVICE_EVENT_UPDATE_STATE,  /**< Event to update device state */
+    DEVICE_EVENT_CONNECTED,     /**< Event when the link is up or Home Assistant is online */
+    DEVICE_EVENT_DISCONNECTED,  /**< Event when the link is down or Home Assistant is offline */
+    DEVICE_EVENT_PHASE_ELAPSED, /**< Event when the phase offset after connecting has elapsed */
+    DEVICE_EVENT_SAMPLE,        /**< Event to sample the sensors within an aggregation window */
+    DEVICE_EVENT_COMMAND,       /**< Event carrying a configuration command */
+} device_event_t;
+
+/** Start of the data of every device event */
+struct device_event_header
+{
+    /** Time (in microseconds) the event was posted, to measure how long it waited in the queue */
+    int64_t posted_us;
+};
+
+#if CONFIG_DEVICE_COMMANDS
+/** Data of @ref DEVICE_EVENT_COMMAND, posted up to the end of the command */
+struct device_command_event
+{
+    struct device_event_header header;
+    /** Null-terminated command */
+    char command[CONFIG_DEVICE_COMMAND_MAX_LEN];
+};
+#endif
+
+/**
+ * Post a device event with a payload to the device event loop.
+ *
+ * The event loop copies the data into its queue, so the header and the payload after it are posted
+ * straight from the caller's buffer.
+ *
+ * @param[in] event_id Event to post
+ * @param[in,out] event Event data, starting with the header, whose posting time is set here
+ * @param[in] len Length of @p event in bytes, header included
+ * @param[in] timeout Ticks to wait for space in the queue, 0 to never block
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the queue was full, ESP_ERR_NO_MEM if the event
+ *         could not be allocated
+ */
+static esp_err_t device_event_post_data(device_event_t event_id, struct device_event_header *event,
+                                        size_t len, TickType_t timeout)
+{
+    int64_t posted_us = esp_timer_get_time();
+
+    event->posted_us = posted_us;
+
+    /* Count the event before posting, the handler may run before esp_event_post_to returns */
+    uint32_t depth = atomic_fetch_add(&device.event_depth, 1) + 1;
+    esp_err_t err =
+        esp_event_post_to(device.event_loop, DEVICE_EVENT, event_id, event, len, timeout);
+    uint32_t post_us = esp_timer_get_time() - posted_us;
+
+    if (err != ESP_OK)
+    {
+        atomic_fetch_sub(&device.event_depth, 1);
+    }
+
+    taskENTER_CRITICAL(&event_stats_lock);
+    if (err == ESP_OK)
+    {
+        device.event_stats.posted++;
+        if (depth > device.event_stats.depth_max)
+        {
+            device.event_stats.depth_max = depth;
+        }
+    }
+    else
+    {
+        device.event_stats.dropped++;
+    }
+    if (timeout == 0 && post_us > device.event_stats.timer_post_max_us)
+    {
+        device.event_stats.timer_post_max_us = post_us;
+    }
+    taskEXIT_CRITICAL(&event_stats_lock);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to post device event %d: %s", event_id, esp_err_to_name(err));
+    }
+
+    return err;
+}
+
+/**
+ * Post a device event to the device event loop.
+ *
+ * @param[in] event_id Event to post
+ * @param[in] timeout Ticks to wait for space in the queue, 0 to never block
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the queue was full
+ */
+static esp_err_t device_event_post(device_event_t event_id, TickType_t timeout)
+{
+    struct device_event_header event;
+
+    return device_event_post_data(event_id, &event, sizeof(event), timeout);
+}
+
+/**
+ * Record how long a device event waited in the queue.
+ *
+ * @param[in] posted_us Time (in microseconds) the event was posted
+ */
+static void device_event_record_dwell(int64_t posted_us)
+{
+    uint32_t dwell_us = esp_timer_get_time() - posted_us;
+
+    atomic_fetch_sub(&device.event_depth, 1);
+
+    taskENTER_CRITICAL(&event_stats_lock);
+    device.event_stats.handled++;
+    device.event_stats.dwell_total_us += dwell_us;
+    if (dwell_us > device.event_stats.dwell_max_us)
+    {
+        device.event_stats.dwell_max_us = dwell_us;
+    }
+    taskEXIT_CRITICAL(&event_stats_lock);
+}
+
+/**
+ * Log the device event loop statistics at debug level.
+ */
+static void log_event_stats(void)
+{
+    struct ha_device_event_stats stats;
+
+    ha_device_get_event_stats(&stats);
+    ESP_LOGD(TAG,
+             "Event loop: depth_max=%lu, dwell_max=%lu us, timer_post_max=%lu us, coalesced=%lu, "
+             "dropped=%lu",
+             stats.depth_max, stats.dwell_max_us, stats.timer_post_max_us, stats.coalesced,
+             stats.dropped);
+}
+
+/**
+ * Event handler for device events
+ *
+ * Handles device-specific events such as state updates. When a state update event
+ * is received, it publishes the current sensor data to the MQTT broker.
+ *
+ * @param[in] handler_args User data registered to the event (unused)
+ * @param[in] base Event base for the handler
+ * @param[in] event_id The id for the received event
+ * @param[in] event_data The event's @ref device_event_header, followed by the payload of events
+ *                       posted with @ref device_event_post_data
+ */
+static void device_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                                 void *event_data)
+{
+    device_event_record_dwell(((const struct device_event_header *)event_data)->posted_us);
+
+    switch (event_id)
+    {
+    case DEVICE_EVENT_UPDATE_STATE:
+        ESP_LOGD(TAG, "Received state update event");
+        /* Allow the next timer expiry to queue another update while this one is handled */
+        atomic_store(&device.update_pending, false);
+        /* Retry the announcement if the broker or gateway was unreachable when the device
+         * connected */
+        if (!device.announced)
+        {
+            device_announce();
+        }
+        publish_state_data(false);
+        device_transport_idle();
+        log_event_stats();
+        break;
+
+    case DEVICE_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Received device connected event");
+        update_timer_stop();
+        phase_timer_start();
+        break;
+
+    case DEVICE_EVENT_PHASE_ELAPSED:
+        ESP_LOGD(TAG, "Received phase elapsed event");
+        device_announce();
+        publish_state_data(true);
+        device_transport_idle();
+        update_timer_start();
+        break;
+
+    case DEVICE_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "Received device disconnected event");
+        update_timer_stop();
+        break;
+
+#if CONFIG_AGGREGATION
+    case DEVICE_EVENT_SAMPLE:
+        atomic_store(&device.sample_pending, false);
+        sample_sensors();
+        break;
+#endif
+
+#if CONFIG_DEVICE_COMMANDS
+    case DEVICE_EVENT_COMMAND:
+        device_command_apply(((const struct device_command_event *)event_data)->command);
+        break;
+#endif
+
+    default:
+        ESP_LOGW(TAG, "Unhandled device event: %ld", event_id);
+        break;
+    }
+}
+
+/**
+ * Timer callback function that posts an update state event
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void update_timer_callback(void *arg)
+{
+#if !CONFIG_AGGREGATION
+    prepare_timer_schedule(device.interval_ms);
+#endif
+
+    /* The timer task is shared with every other esp_timer, so never block it */
+    if (atomic_exchange(&device.update_pending, true))
+    {
+        /* An update is already queued and will sample the sensors anyway */
+        taskENTER_CRITICAL(&event_stats_lock);
+        device.event_stats.coalesced++;
+        taskEXIT_CRITICAL(&event_stats_lock);
+        return;
+    }
+
+    if (device_event_post(DEVICE_EVENT_UPDATE_STATE, 0) != ESP_OK)
+    {
+        atomic_store(&device.update_pending, false);
+    }
+}
+
+#if CONFIG_AGGREGATION
+/**
+ * Timer callback function that posts a sample event
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void sample_timer_callback(void *arg)
+{
+    prepare_timer_schedule(CONFIG_AGGREGATION_SAMPLE_INTERVAL_MS);
+
+    if (atomic_exchange(&device.sample_pending, true))
+    {
+        /* A sample is already queued, taking two at once would not add anything */
+        taskENTER_CRITICAL(&event_stats_lock);
+        device.event_stats.coalesced++;
+        taskEXIT_CRITICAL(&event_stats_lock);
+        return;
+    }
+
+    if (device_event_post(DEVICE_EVENT_SAMPLE, 0) != ESP_OK)
+    {
+        atomic_store(&device.sample_pending, false);
+    }
+}
+#endif
+
+/**
+ * Timer callback function that calls the prepare callback
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void prepare_timer_callback(void *arg)
+{
+    device.config->prepare(device.config->prepare_arg);
+}
+
+/**
+ * Schedule the prepare callback ahead of an update, if there is one
+ *
+ * Called from both the timer task and the device event task. If they race, either schedule is
+ * close enough, so failures to stop or start the timer are ignored.
+ *
+ * @param[in] update_in_ms Time until the update in milliseconds.
+ */
+static void prepare_timer_schedule(uint32_t update_in_ms)
+{
+    uint32_t lead_ms = device.config->prepare_lead_ms;
+
+    if (device.config->prepare == NULL)
+    {
+        return;
+    }
+
+    esp_timer_stop(device.prepare_timer);
+    esp_timer_start_once(device.prepare_timer,
+                         (uint64_t)(update_in_ms > lead_ms ? update_in_ms - lead_ms : 0) * 1000);
+}
+
+/**
+ * Timer callback function that posts the phase elapsed event
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void phase_timer_callback(void *arg)
+{
+    if (device_event_post(DEVICE_EVENT_PHASE_ELAPSED, 0) != ESP_OK)
+    {
+        /* The first report must not be lost, try again shortly */
+        ESP_ERROR_CHECK(esp_timer_start_once(device.phase_timer, PHASE_RETRY_MS * 1000));
+    }
+}
+
+/**
+ * Start the phase timer, delaying the first report after connecting by the device's phase offset
+ *
+ * Devices that connect together, e.g. after an access point or broker restart, would otherwise
+ * report together on every interval. The offset is derived from the device ID so it is spread
+ * across the fleet and stable across reconnects. If the device connects
+ * CONFIG_RECONNECT_STORM_COUNT times within CONFIG_RECONNECT_STORM_WINDOW_MS it is likely
+ * colliding with another device, and a new random phase is chosen.
+ */
+static void phase_timer_start(void)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    if (now_us - device.storm_start_us > (int64_t)CONFIG_RECONNECT_STORM_WINDOW_MS * 1000)
+    {
+        device.storm_start_us = now_us;
+        device.storm_count = 0;
+    }
+
+    if (++device.storm_count >= CONFIG_RECONNECT_STORM_COUNT)
+    {
+        ESP_LOGW(TAG, "%lu connections within %d ms, choosing a new reporting phase",
+                 device.storm_count, CONFIG_RECONNECT_STORM_WINDOW_MS);
+        device.phase_salt = esp_random();
+        device.storm_count = 0;
+    }
+
+    uint32_t window_ms = device.interval_ms < CONFIG_STAGGER_WINDOW_MS ? device.interval_ms
+                                                                       : CONFIG_STAGGER_WINDOW_MS;
+    uint32_t phase_ms = report_schedule_phase_ms(device.device_id, device.phase_salt, window_ms);
+
+    ESP_LOGI(TAG, "First report in %lu ms", phase_ms);
+    prepare_timer_schedule(phase_ms);
+    if (esp_timer_is_active(device.phase_timer))
+    {
+        ESP_ERROR_CHECK(esp_timer_stop(device.phase_timer));
+    }
+    ESP_ERROR_CHECK(esp_timer_start_once(device.phase_timer, (uint64_t)phase_ms * 1000));
+}
+
+/**
+ * Start the update timer if it's not already running
+ */
+static void update_timer_start(void)
+{
+    if (esp_timer_is_active(device.update_timer) == false)
+    {
+        ESP_LOGI(TAG, "Starting update timer");
+        ESP_ERROR_CHECK(
+            esp_timer_start_periodic(device.update_timer, (uint64_t)device.interval_ms * 1000));
+#if CONFIG_AGGREGATION
+        ESP_ERROR_CHECK(esp_timer_start_periodic(
+            device.sample_timer, (uint64_t)CONFIG_AGGREGATION_SAMPLE_INTERVAL_MS * 1000));
+        prepare_timer_schedule(CONFIG_AGGREGATION_SAMPLE_INTERVAL_MS);
+#else
+        prepare_timer_schedule(device.interval_ms);
+#endif
+    }
+}
+
+/**
+ * Stop the update timer if it's running
+ */
+static void update_timer_stop(void)
+{
+    if (esp_timer_is_active(device.phase_timer))
+    {
+        ESP_ERROR_CHECK(esp_timer_stop(device.phase_timer));
+    }
+
+    /* May race with the update timer rescheduling it; not running is fine */
+    esp_timer_stop(device.prepare_timer);
+
+    if (esp_timer_is_active(device.update_timer))
+    {
+        ESP_LOGI(TAG, "Stopping update timer");
+        ESP_ERROR_CHECK(esp_timer_stop(device.update_timer));
+    }
+
+#if CONFIG_AGGREGATION
+    if (esp_timer_is_active(device.sample_timer))
+    {
+        ESP_ERROR_CHECK(esp_timer_stop(device.sample_timer));
+    }
+
+    /* Samples from before a disconnect would be published as part of the next window */
+    window_reset();
+#endif
+}
+
+/**
+ * Let the device report once the transport is connected, or Home Assistant is online.
+ */
+static void transport_connected(void)
+{
+    device_event_post(DEVICE_EVENT_CONNECTED, pdMS_TO_TICKS(DEVICE_EVENT_POST_TIMEOUT_MS));
+}
+
+/**
+ * Stop reporting once the transport is disconnected, or Home Assistant is offline.
+ */
+static void transport_disconnected(void)
+{
+    device_event_post(DEVICE_EVENT_DISCONNECTED, pdMS_TO_TICKS(DEVICE_EVENT_POST_TIMEOUT_MS));
+}
+
+/**
+ * Count a connection error or failed request for the adaptive update interval.
+ */
+static void transport_link_error(void)
+{
+    atomic_fetch_add(&device.link_retries, 1);
+}
+
+#if CONFIG_DEVICE_COMMANDS
+/**
+ * Pass a configuration command received by the transport to the device event task, which owns the
+ * timers and sensors.
+ *
+ * @param[in] data Command, not null-terminated
+ * @param[in] len Length of @p data in bytes
+ */
+static void transport_command(const char *data, size_t len)
+{
+    /* Only the transport's task posts commands, and the event loop copies the event before the
+     * post returns, so one buffer off the task's stack serves every command */
+    static struct device_command_event command_event;
+
+    if (len >= CONFIG_DEVICE_COMMAND_MAX_LEN)
+    {
+        ESP_LOGW(TAG, "Ignoring command of %u bytes", (unsigned)len);
+        return;
+    }
+
+    memcpy(command_event.command, data, len);
+    command_event.command[len] = '\0';
+    device_event_post_data(DEVICE_EVENT_COMMAND, &command_event.header,
+                           offsetof(struct device_command_event, command) + len + 1,
+                           pdMS_TO_TICKS(DEVICE_EVENT_POST_TIMEOUT_MS));
+}
+#endif
+
+void ha_device_init(const struct ha_device_config *config)
+{
+    /* This shall only ever be initialised once. */
+    assert(device.started == false);
+    assert(config != NULL);
+    assert(config->sensors != NULL || config->num_sensors == 0);
+    device.started = true;
+    device.config = config;
+    device.interval_ms = UPDATE_INTERVAL_MS;
+
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        assert(config->sensors[i].name != NULL);
+        assert(config->sensors[i].read != NULL);
+    }
+
+    device.sensor_states = calloc(config->num_sensors, sizeof(*device.sensor_states));
+    assert(device.sensor_states != NULL || config->num_sensors == 0);
+    for (size_t i = 0; i < config->num_sensors; i++)
+    {
+        device.sensor_states[i].policy = config->sensors[i].policy;
+    }
+#if CONFIG_AGGREGATION
+    window_reset();
+#endif
+
+    get_device_id(device.device_id, sizeof(device.device_id));
+    snprintf(device.state_topic, sizeof(device.state_topic), STATE_TOPIC_FORMAT, device.device_id);
+    snprintf(device.topics[DEVICE_TOPIC_DISCOVERY], sizeof(device.topics[0]),
+             DISCOVERY_TOPIC_FORMAT, device.device_id);
+#if CONFIG_STATE_ENCODING_CBOR
+    snprintf(device.topics[DEVICE_TOPIC_STATE], sizeof(device.topics[0]), STATE_CBOR_TOPIC_FORMAT,
+             device.device_id);
+#else
+    snprintf(device.topics[DEVICE_TOPIC_STATE], sizeof(device.topics[0]), STATE_TOPIC_FORMAT,
+             device.device_id);
+#endif
+    snprintf(device.topics[DEVICE_TOPIC_KEYS], sizeof(device.topics[0]), STATE_KEYS_TOPIC_FORMAT,
+             device.device_id);
+#if CONFIG_AGGREGATION_BATCH
+    snprintf(device.topics[DEVICE_TOPIC_BATCH], sizeof(device.topics[0]), STATE_BATCH_TOPIC_FORMAT,
+             device.device_id);
+#endif
+
+    /* Device events get their own loop and task so a slow publish never holds up the default
+     * event loop, and a bounded queue so posting never blocks the timer task */
+    const esp_event_loop_args_t loop_args = {
+        .queue_size = CONFIG_DEVICE_EVENT_QUEUE_SIZE,
+        .task_name = "device_event",
+        .task_priority = DEVICE_EVENT_TASK_PRIORITY,
+        .task_stack_size = DEVICE_EVENT_TASK_STACK_SIZE,
+        .task_core_id = tskNO_AFFINITY,
+    };
+
+    ESP_ERROR_CHECK(esp_event_loop_create(&loop_args, &device.event_loop));
+
+    /* Register the device event handler */
+    ESP_ERROR_CHECK(esp_event_handler_register_with(device.event_loop, DEVICE_EVENT,
+                                                    ESP_EVENT_ANY_ID, device_event_handler, NULL));
+
+    /* Configure the timer for periodic updates (but don't start it yet) */
+    const esp_timer_create_args_t timer_args = {.callback = &update_timer_callback,
+                                                .name = "update_timer"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &device.update_timer));
+
+    const esp_timer_create_args_t phase_timer_args = {.callback = &phase_timer_callback,
+                                                      .name = "phase_timer"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&phase_timer_args, &device.phase_timer));
+
+    const esp_timer_create_args_t prepare_timer_args = {.callback = &prepare_timer_callback,
+                                                        .name = "prepare_timer"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&prepare_timer_args, &device.prepare_timer));
+
+#if CONFIG_AGGREGATION
+    const esp_timer_create_args_t sample_timer_args = {.callback = &sample_timer_callback,
+                                                       .name = "sample_timer"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&sample_timer_args, &device.sample_timer));
+#endif
+
+    ESP_LOGI(TAG, "%s initialized with %u sensors and %d ms update interval", config->name,
+             config->num_sensors, UPDATE_INTERVAL_MS);
+}
+
+void ha_device_start(void)
+{
+    assert(device.started);
+
+#if CONFIG_DEVICE_COMMANDS
+    settings_load();
+#endif
+
+    struct device_transport_config transport_cfg = {
+        .device_id = device.device_id,
+        .callbacks =
+            {
+                .connected = transport_connected,
+                .disconnected = transport_disconnected,
+                .link_error = transport_link_error,
+#if CONFIG_DEVICE_COMMANDS
+                .command = transport_command,
+#endif
+            },
+    };
+    for (int i = 0; i < DEVICE_TOPIC_COUNT; i++)
+    {
+        transport_cfg.topics[i] = device.topics[i];
+    }
+
+    device_transport_start(&transport_cfg);
+}
+
+void ha_device_get_event_stats(struct ha_device_event_stats *stats)
+{
+    assert(device.started);
+    assert(stats != NULL);
+
+    taskENTER_CRITICAL(&event_stats_lock);
+    *stats = device.event_stats;
+    taskEXIT_CRITICAL(&event_stats_lock);
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Home Assistant MQTT device helper.
+ *
+ * Handles the parts common to every sensor example: connecting to the MQTT broker, publishing the
+ * Home Assistant discovery message, tracking the Home Assistant birth/last-will status and
+ * periodically publishing state updates.
+ *
+ * Applications describe their sensors declaratively with a table of @ref ha_sensor entries. On
+ * every update all registered sensors are sampled in one pass and published together in a single
+ * combined state message on `<device_id>/state`, so a node carrying several sensors sends one
+ * packet per interval regardless of how many sensors it has. Each sensor may also carry a
+ * @ref ha_report_policy so that unchanged readings are not transmitted at all.
+ *
+ * With @c CONFIG_DEVICE_COMMANDS the update interval, the deadbands and the power profile can be
+ * changed at runtime by publishing JSON to `<device_id>/set`. Changes apply without a reboot and
+ * are kept in NVS:
+ *
+ * @code{.json}
+ * {"interval_ms": 60000, "power_profile": "low_power",
+ *  "deadband": {"temperature": 0.2, "humidity": {"abs": 0, "rel": 0.05}}}
+ * @endcode
+ *
+ * @code{.c}
+ * static const struct ha_sensor sensors[] = {
+ *     {.name = "temperature", .device_class = "temperature", .unit = "°C", .precision = 2,
+ *      .read = read_temperature, .policy = {.deadband_abs = 0.1f}},
+ *     {.name = "battery_level", .device_class = "battery", .unit = "%", .read = read_level},
+ * };
+ *
+ * static const struct ha_device_config config = {
+ *     .name = "Temperature Sensor",
+ *     .sw_version = APP_VERSION,
+ *     .sensors = sensors,
+ *     .num_sensors = sizeof(sensors) / sizeof(sensors[0]),
+ * };
+ *
+ * ha_device_init(&config);
+ * ha_device_start();
+ * @endcode
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Sensor read callback.
+ *
+ * @param[in] arg User argument from the sensor descriptor.
+ * @param[out] value Location to store the current sensor value.
+ * @return ESP_OK on success. On any other value the sensor is left out of the state update.
+ */
+typedef esp_err_t (*ha_sensor_read_cb_t)(void *arg, float *value);
+
+/**
+ * Device sample callback.
+ *
+ * Called once at the start of every update pass, before any @ref ha_sensor_read_cb_t. Drivers that
+ * measure several quantities in a single transaction (e.g. temperature and humidity) should take
+ * the measurement here and have their read callbacks return the cached results.
+ *
+ * @param[in] arg User argument from the device configuration.
+ */
+typedef void (*ha_device_sample_cb_t)(void *arg);
+
+/**
+ * Report-on-change policy for a sensor.
+ *
+ * Sensors are sampled on every update, but a state message is only published when at least one
+ * sensor is due to report. A sensor is due when its value has moved by more than its deadband and
+ * at least @c min_interval_ms has passed since it was last reported, or when it has been silent for
+ * @c max_silence_ms. When a state message is published it carries every sensor's current value.
+ *
+ * A zero-initialized policy reports on every update.
+ */
+struct ha_report_policy
+{
+    /** Absolute change required before a new value is reported, 0 to disable. */
+    float deadband_abs;
+    /** Change relative to the last reported value (e.g. 0.05 for 5%) required, 0 to disable. */
+    float deadband_rel;
+    /** Minimum time between change triggered reports in milliseconds. */
+    uint32_t min_interval_ms;
+    /**
+     * Maximum time without a report before a heartbeat is forced in milliseconds. 0 uses
+     * @c CONFIG_MAX_SILENCE_MS.
+     */
+    uint32_t max_silence_ms;
+};
+
+/** Power profiles selectable over the command topic. */
+enum ha_power_profile
+{
+    /** Keep the radio awake for the lowest latency. */
+    HA_POWER_PROFILE_PERFORMANCE,
+    /** Let the radio sleep between packets. */
+    HA_POWER_PROFILE_LOW_POWER,
+};
+
+/**
+ * Power profile callback.
+ *
+ * @param[in] profile Profile to switch to.
+ * @return ESP_OK on success.
+ */
+typedef esp_err_t (*ha_device_power_profile_cb_t)(enum ha_power_profile profile);
+
+/** Declarative description of a single Home Assistant sensor entity. */
+struct ha_sensor
+{
+    /** Key used in the state message, also used to build the entity unique ID. */
+    const char *name;
+    /** Home Assistant device class (e.g. "temperature"), or NULL to omit. */
+    const char *device_class;
+    /** Unit of measurement (e.g. "°C"), or NULL to omit. */
+    const char *unit;
+    /** Number of decimal places published and suggested for display. */
+    uint8_t precision;
+    /** Callback used to read the current value. */
+    ha_sensor_read_cb_t read;
+    /** User argument passed to @c read. */
+    void *arg;
+    /** Home Assistant entity category (e.g. "diagnostic"), or NULL for a primary entity. */
+    const char *entity_category;
+    /** Report-on-change policy. */
+    struct ha_report_policy policy;
+};
+
+/** Device configuration. */
+struct ha_device_config
+{
+    /** Human readable device name shown in Home Assistant. */
+    const char *name;
+    /** Application version string reported in the discovery message. */
+    const char *sw_version;
+    /** Table of sensors exposed by this device. */
+    const struct ha_sensor *sensors;
+    /** Number of entries in @c sensors. */
+    size_t num_sensors;
+    /** Optional callback invoked once before the sensors are read, may be NULL. */
+    ha_device_sample_cb_t sample;
+    /** User argument passed to @c sample. */
+    void *sample_arg;
+    /**
+     * Optional callback invoked @c prepare_lead_ms before each update, may be NULL. Drivers with a
+     * conversion time can start a measurement here so @c sample only has to collect the result.
+     * Runs in the esp_timer task and must not block.
+     */
+    ha_device_sample_cb_t prepare;
+    /** User argument passed to @c prepare. */
+    void *prepare_arg;
+    /** Time in milliseconds between @c prepare and the update it prepares for. */
+    uint32_t prepare_lead_ms;
+    /**
+     * Optional callback returning the battery level in percent, or a negative value if unknown.
+     * Used by the adaptive update interval (@c CONFIG_ADAPTIVE_INTERVAL), may be NULL.
+     */
+    int (*get_battery_level)(void);
+    /**
+     * Optional callback returning the link RSSI in dBm, or @c INT32_MIN if unknown. Used by the
+     * adaptive update interval (@c CONFIG_ADAPTIVE_INTERVAL), may be NULL.
+     */
+    int32_t (*get_link_rssi)(void);
+    /**
+     * Optional callback switching the power profile, called at startup with the profile kept in NVS
+     * and whenever it is changed over the command topic (@c CONFIG_DEVICE_COMMANDS), may be NULL.
+     */
+    ha_device_power_profile_cb_t set_power_profile;
+};
+
+/** Statistics of the device event loop, see @ref ha_device_get_event_stats. */
+struct ha_device_event_stats
+{
+    /** Events queued. */
+    uint32_t posted;
+    /** Events handled. */
+    uint32_t handled;
+    /** Update events not queued because one was already waiting. */
+    uint32_t coalesced;
+    /** Events dropped because the queue was full. */
+    uint32_t dropped;
+    /** Largest number of events waiting at once. */
+    uint32_t depth_max;
+    /** Longest time (in microseconds) the update timer spent posting an event. */
+    uint32_t timer_post_max_us;
+    /** Longest time (in microseconds) an event waited before being handled. */
+    uint32_t dwell_max_us;
+    /** Total time (in microseconds) events waited before being handled. */
+    uint64_t dwell_total_us;
+};
+
+/**
+ * Initialize the device.
+ *
+ * Creates the device event loop and its task, registers the device event handler and creates the
+ * update timer. The timer is not started until the MQTT client connects.
+ *
+ * @param[in] config Device configuration. Must remain valid for the lifetime of the application.
+ *
+ * @warning This can only be called once, after the default event loop has been created.
+ */
+void ha_device_init(const struct ha_device_config *config);
+
+/**
+ * Create and start the MQTT client using the broker settings from project configuration.
+ *
+ * @warning @ref ha_device_init must be called first.
+ */
+void ha_device_start(void);
+
+/**
+ * Get statistics of the device event loop.
+ *
+ * The update timer never blocks when posting: if an update is already queued the new one is
+ * coalesced into it, and if the queue is full it is dropped. These counters show how often that
+ * happens, how deep the queue gets and how long events wait before they are handled.
+ *
+ * @param[out] stats Current statistics.
+ *
+ * @warning @ref ha_device_init must be called first.
+ */
+void ha_device_get_event_stats(struct ha_device_event_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* Host stand-in for ESP-IDF logging: errors, warnings and info go to stderr, debug is dropped */
+#pragma once
+
+#include <stdio.h>
+
+#define ESP_HOST_LOG(level, tag, format, ...)                                            \
+    fprintf(stderr, level " (%s) " format "\n", tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) ESP_HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_HOST_LOG("I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)                                                       \
+    do                                                                                   \
+    {                                                                                    \
+        if (0)                                                                           \
+        {                                                                                \
+            ESP_HOST_LOG("D", tag, format, ##__VA_ARGS__);                               \
+        }                                                                                \
+    } while (0)
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Host test of the MQTT-SN client against the test gateway in tools/mqttsn_gateway.
+ *
+ * Starts the gateway on a free local port and runs the client through a session: connect, register,
+ * publish, sleep and resume. It then restarts the gateway while the client sleeps and checks that
+ * the rejected publish sets topics_invalid, and that a publish larger than a few kilobytes reaches
+ * the gateway in one piece.
+ *
+ * A publish gets no reply, so each one is followed by a request: the gateway handles packets in
+ * order, and a rejection of the publish is received while waiting for the reply.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mqttsn_client.h"
+
+/* Predefined topic ID the gateway is started with */
+#define PREDEFINED_TOPIC_ID 1
+/* Topic ID the gateway never assigns in this test */
+#define UNKNOWN_TOPIC_ID 0x7FFF
+/* Larger than the gateway's receive buffer used to be, and than any reply of the client */
+#define LARGE_PAYLOAD_LEN 4000
+/* Connection attempts while the gateway starts, 100 ms apart */
+#define GATEWAY_START_ATTEMPTS 50
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                 \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                              \
+            fprintf(stderr, __VA_ARGS__);                                                \
+            fprintf(stderr, "\n");                                                       \
+            failures++;                                                                  \
+        }                                                                                \
+    } while (0)
+
+/* Gateway process */
+static struct
+{
+    const char *python;
+    const char *script;
+    char port[6];
+    pid_t pid;
+} gateway = {.pid = -1};
+
+/**
+ * Find a UDP port on the loopback interface that is free now.
+ */
+static uint16_t free_udp_port(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0)
+    {
+        perror("free_udp_port");
+        exit(2);
+    }
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+static void gateway_start(void)
+{
+    char predefined[32];
+
+    snprintf(predefined, sizeof(predefined), "%d=test/state", PREDEFINED_TOPIC_ID);
+    gateway.pid = fork();
+    if (gateway.pid == 0)
+    {
+        execl(gateway.python, gateway.python, gateway.script, "--bind", "127.0.0.1", "--port",
+              gateway.port, "--predefined", predefined, (char *)NULL);
+        perror("exec gateway");
+        _exit(127);
+    }
+    CHECK(gateway.pid > 0, "cannot start the gateway");
+}
+
+static void gateway_stop(void)
+{
+    if (gateway.pid > 0)
+    {
+        kill(gateway.pid, SIGTERM);
+        waitpid(gateway.pid, NULL, 0);
+        gateway.pid = -1;
+    }
+}
+
+/**
+ * Connect to a gateway that may still be starting. Until it listens, the client's requests are
+ * refused and fail at once, so they are repeated here rather than by the client.
+ */
+static esp_err_t connect_starting(struct mqttsn_client *client, bool clean_session)
+{
+    esp_err_t err = ESP_FAIL;
+
+    for (int i = 0; i < GATEWAY_START_ATTEMPTS && err != ESP_OK; i++)
+    {
+        if (i > 0)
+        {
+            usleep(100 * 1000);
+        }
+        err = mqttsn_client_connect(client, clean_session);
+    }
+    return err;
+}
+
+static void test_session(struct mqttsn_client *client, uint16_t topic_ids[2])
+{
+    static const char payload[] = "{\"temperature\":21.5}";
+
+    CHECK(connect_starting(client, true) == ESP_OK, "connect failed");
+    CHECK(client->state == MQTTSN_STATE_ACTIVE, "state %d after connect", client->state);
+
+    CHECK(mqttsn_client_register(client, "test/a", &topic_ids[0]) == ESP_OK, "register failed");
+    CHECK(mqttsn_client_register(client, "test/b", &topic_ids[1]) == ESP_OK, "register failed");
+    CHECK(topic_ids[0] != 0 && topic_ids[1] != 0 && topic_ids[0] != topic_ids[1],
+          "topic IDs %u and %u", topic_ids[0], topic_ids[1]);
+
+    CHECK(mqttsn_client_publish(client, topic_ids[0], MQTTSN_TOPIC_NORMAL, false, false, payload,
+                                sizeof(payload) - 1)
+              == ESP_OK,
+          "publish failed");
+    CHECK(mqttsn_client_publish(client, topic_ids[0], MQTTSN_TOPIC_NORMAL, true, false, payload,
+                                sizeof(payload) - 1)
+              == ESP_ERR_INVALID_ARG,
+          "QoS -1 publish to a normal topic ID accepted");
+
+    CHECK(mqttsn_client_sleep(client, 60) == ESP_OK, "sleep failed");
+    CHECK(client->state == MQTTSN_STATE_ASLEEP, "state %d after sleep", client->state);
+    CHECK(!client->topics_invalid, "publish to a registered topic rejected");
+    CHECK(mqttsn_client_publish(client, topic_ids[1], MQTTSN_TOPIC_NORMAL, false, false, payload,
+                                sizeof(payload) - 1)
+              == ESP_ERR_INVALID_STATE,
+          "QoS 0 publish accepted while asleep");
+
+    /* Resume the session, keeping the topic IDs */
+    CHECK(mqttsn_client_connect(client, false) == ESP_OK, "resume failed");
+    CHECK(mqttsn_client_publish(client, topic_ids[1], MQTTSN_TOPIC_NORMAL, false, false, payload,
+                                sizeof(payload) - 1)
+              == ESP_OK,
+          "publish after resume failed");
+    CHECK(mqttsn_client_sleep(client, 60) == ESP_OK, "sleep failed");
+    CHECK(!client->topics_invalid, "publish to a topic of the resumed session rejected");
+}
+
+static void test_gateway_restart(struct mqttsn_client *client, const uint16_t topic_ids[2])
+{
+    static const char payload[] = "{\"temperature\":21.6}";
+
+    /* The new gateway accepts the resumed session without the topics */
+    gateway_stop();
+    gateway_start();
+    CHECK(connect_starting(client, false) == ESP_OK, "resume after restart failed");
+    CHECK(mqttsn_client_publish(client, topic_ids[0], MQTTSN_TOPIC_NORMAL, false, false, payload,
+                                sizeof(payload) - 1)
+              == ESP_OK,
+          "publish failed");
+    CHECK(mqttsn_client_sleep(client, 60) == ESP_OK, "sleep failed");
+    CHECK(client->topics_invalid, "publish to a topic the gateway lost not rejected");
+
+    /* A new session clears it */
+    CHECK(mqttsn_client_connect(client, true) == ESP_OK, "connect failed");
+    CHECK(!client->topics_invalid, "topics_invalid kept by a clean session");
+}
+
+static void test_large_publish(struct mqttsn_client *client)
+{
+    static char payload[LARGE_PAYLOAD_LEN];
+    uint16_t topic_id;
+
+    /* The gateway only rejects the unknown topic ID if it received the whole datagram */
+    memset(payload, 'x', sizeof(payload));
+    CHECK(mqttsn_client_publish(client, UNKNOWN_TOPIC_ID, MQTTSN_TOPIC_NORMAL, false, false,
+                                payload, sizeof(payload))
+              == ESP_OK,
+          "large publish failed");
+    CHECK(mqttsn_client_register(client, "test/large", &topic_id) == ESP_OK, "register failed");
+    CHECK(client->topics_invalid, "large publish to an unknown topic ID not rejected");
+}
+
+static void test_qos_neg1(struct mqttsn_client *client)
+{
+    static const char payload[] = "{\"temperature\":21.7}";
+
+    CHECK(mqttsn_client_disconnect(client) == ESP_OK, "disconnect failed");
+    CHECK(client->state == MQTTSN_STATE_DISCONNECTED, "state %d after disconnect",
+          client->state);
+    CHECK(mqttsn_client_publish(client, PREDEFINED_TOPIC_ID, MQTTSN_TOPIC_PREDEFINED, true, false,
+                                payload, sizeof(payload) - 1)
+              == ESP_OK,
+          "QoS -1 publish failed");
+}
+
+int main(int argc, char **argv)
+{
+    struct mqttsn_client client;
+    uint16_t topic_ids[2] = {0};
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <python> <mqttsn_gateway.py>\n", argv[0]);
+        return 2;
+    }
+
+    gateway.python = argv[1];
+    gateway.script = argv[2];
+    snprintf(gateway.port, sizeof(gateway.port), "%u", free_udp_port());
+    gateway_start();
+
+    const struct mqttsn_client_config config = {
+        .host = "127.0.0.1",
+        .port = atoi(gateway.port),
+        .client_id = "host_test",
+        .keepalive_s = 60,
+        .timeout_ms = 500,
+        .retries = 2,
+    };
+    CHECK(mqttsn_client_init(&client, &config) == ESP_OK, "init failed");
+
+    test_session(&client, topic_ids);
+    test_gateway_restart(&client, topic_ids);
+    test_large_publish(&client);
+    test_qos_neg1(&client);
+
+    printf("%lu packets sent, %lu received\n", (unsigned long)client.tx_packets,
+           (unsigned long)client.rx_packets);
+    mqttsn_client_deinit(&client);
+    gateway_stop();
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
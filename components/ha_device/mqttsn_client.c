@@ -0,0 +1,528 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "mqttsn_client.h"
+
+static const char *TAG = "mqttsn";
+
+/** MQTT-SN message types (MQTT-SN v1.2 section 5.2.2). */
+enum mqttsn_msg_type
+{
+    MQTTSN_CONNECT = 0x04,
+    MQTTSN_CONNACK = 0x05,
+    MQTTSN_REGISTER = 0x0A,
+    MQTTSN_REGACK = 0x0B,
+    MQTTSN_PUBLISH = 0x0C,
+    MQTTSN_PUBACK = 0x0D,
+    MQTTSN_PINGREQ = 0x16,
+    MQTTSN_PINGRESP = 0x17,
+    MQTTSN_DISCONNECT = 0x18,
+};
+
+/** PUBLISH/CONNECT flag bits (MQTT-SN v1.2 section 5.3.4). */
+#define MQTTSN_FLAG_QOS_NEG1 (0x3 << 5)
+#define MQTTSN_FLAG_RETAIN (1 << 4)
+#define MQTTSN_FLAG_CLEAN_SESSION (1 << 2)
+
+/** Protocol ID sent in CONNECT. */
+#define MQTTSN_PROTOCOL_ID 0x01
+
+/** Return code for an accepted request. */
+#define MQTTSN_RC_ACCEPTED 0x00
+
+/** Return code for a PUBLISH to a topic ID the gateway does not know. */
+#define MQTTSN_RC_INVALID_TOPIC_ID 0x02
+
+/** Maximum client ID length allowed by the specification. */
+#define MQTTSN_CLIENT_ID_MAX_LEN 23
+
+/** Largest packet expected from the gateway; replies used here are all a few bytes. */
+#define MQTTSN_RX_BUF_LEN 64
+
+/** Packet lengths below this use the single byte length field. */
+#define MQTTSN_SHORT_LEN_MAX 255
+
+/**
+ * Allocate the next message ID. Zero is reserved, so the ID wraps from 0xFFFF to 1.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @return Message ID to use for the next request.
+ */
+static uint16_t next_msg_id(struct mqttsn_client *client)
+{
+    if (++client->next_msg_id == 0)
+    {
+        client->next_msg_id = 1;
+    }
+    return client->next_msg_id;
+}
+
+/**
+ * Write a big-endian 16-bit value.
+ *
+ * @param[out] buf Destination.
+ * @param[in] value Value to write.
+ */
+static void put_u16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value & 0xFF;
+}
+
+/**
+ * Read a big-endian 16-bit value.
+ *
+ * @param[in] buf Source.
+ * @return Value read.
+ */
+static uint16_t get_u16(const uint8_t *buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+/**
+ * Write the packet header.
+ *
+ * @param[out] buf Destination, at least 4 bytes.
+ * @param[in] type Message type.
+ * @param[in] body_len Length of the message after the header.
+ * @return Length of the header written.
+ */
+static size_t put_header(uint8_t *buf, enum mqttsn_msg_type type, size_t body_len)
+{
+    if (body_len + 2 <= MQTTSN_SHORT_LEN_MAX)
+    {
+        buf[0] = body_len + 2;
+        buf[1] = type;
+        return 2;
+    }
+
+    /* Three byte length: 0x01 followed by the 16-bit total length */
+    buf[0] = 0x01;
+    put_u16(&buf[1], body_len + 4);
+    buf[3] = type;
+    return 4;
+}
+
+/**
+ * Send a packet to the gateway.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] buf Packet to send.
+ * @param[in] len Length of the packet.
+ * @return ESP_OK on success, ESP_FAIL on error.
+ */
+static esp_err_t send_packet(struct mqttsn_client *client, const uint8_t *buf, size_t len)
+{
+    if (send(client->sock, buf, len, 0) != (ssize_t)len)
+    {
+        ESP_LOGE(TAG, "Failed to send packet type 0x%02x: errno %d", buf[len > 255 ? 3 : 1],
+                 errno);
+        return ESP_FAIL;
+    }
+
+    client->tx_packets++;
+    return ESP_OK;
+}
+
+/**
+ * Handle a packet that is not the reply being waited for.
+ *
+ * A PUBACK rejecting a PUBLISH for an invalid topic ID means the gateway no longer holds the topics
+ * registered by the client, typically because it restarted while the client was asleep. Other
+ * packets, e.g. messages buffered by the gateway, are discarded.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] type Message type.
+ * @param[in] body Message body after the header.
+ * @param[in] body_len Length of @p body.
+ */
+static void handle_unsolicited(struct mqttsn_client *client, uint8_t type, const uint8_t *body,
+                               size_t body_len)
+{
+    /* PUBACK: TopicId(2) MsgId(2) ReturnCode(1) */
+    if (type == MQTTSN_PUBACK && body_len >= 5 && body[4] == MQTTSN_RC_INVALID_TOPIC_ID)
+    {
+        ESP_LOGW(TAG, "Gateway rejected topic ID %u, topics must be registered again",
+                 get_u16(&body[0]));
+        client->topics_invalid = true;
+        return;
+    }
+
+    ESP_LOGD(TAG, "Ignoring packet type 0x%02x of %u bytes", type, (unsigned)body_len);
+}
+
+/**
+ * Receive a packet from the gateway.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] flags Flags passed to recv(), e.g. MSG_DONTWAIT.
+ * @param[out] type Message type.
+ * @param[out] body Buffer receiving the message body after the header.
+ * @param[in] body_size Size of @p body.
+ * @param[out] body_len Length of the body received, truncated to @p body_size.
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if no packet arrived in time, ESP_ERR_INVALID_SIZE if
+ *         the packet was malformed.
+ */
+static esp_err_t recv_packet(struct mqttsn_client *client, int flags, uint8_t *type, uint8_t *body,
+                             size_t body_size, size_t *body_len)
+{
+    uint8_t buf[MQTTSN_RX_BUF_LEN];
+
+    ssize_t len = recv(client->sock, buf, sizeof(buf), flags);
+    if (len < 0)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    client->rx_packets++;
+
+    size_t header_len = (len >= 1 && buf[0] == 0x01) ? 4 : 2;
+    if ((size_t)len < header_len)
+    {
+        ESP_LOGD(TAG, "Ignoring packet of %d bytes", (int)len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *type = buf[header_len - 1];
+    *body_len = len - header_len;
+    if (*body_len > body_size)
+    {
+        *body_len = body_size;
+    }
+    memcpy(body, &buf[header_len], *body_len);
+    return ESP_OK;
+}
+
+/**
+ * Wait for a reply of the given type.
+ *
+ * Packets of other types are passed to @ref handle_unsolicited.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] type Expected message type.
+ * @param[out] body Buffer receiving the message body after the header.
+ * @param[in] body_size Size of @p body.
+ * @param[out] body_len Length of the body received.
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if no matching reply arrived in time.
+ */
+static esp_err_t recv_reply(struct mqttsn_client *client, enum mqttsn_msg_type type, uint8_t *body,
+                            size_t body_size, size_t *body_len)
+{
+    uint8_t other[MQTTSN_RX_BUF_LEN];
+
+    while (true)
+    {
+        uint8_t received;
+        size_t len;
+
+        esp_err_t err = recv_packet(client, 0, &received, other, sizeof(other), &len);
+        if (err == ESP_ERR_TIMEOUT)
+        {
+            return err;
+        }
+        if (err != ESP_OK)
+        {
+            continue;
+        }
+
+        if (received != type)
+        {
+            handle_unsolicited(client, received, other, len);
+            continue;
+        }
+
+        *body_len = len < body_size ? len : body_size;
+        memcpy(body, other, *body_len);
+        return ESP_OK;
+    }
+}
+
+/**
+ * Send a request and wait for its reply, retransmitting on timeout.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] req Request packet.
+ * @param[in] req_len Length of the request packet.
+ * @param[in] reply_type Expected reply message type.
+ * @param[in] min_len Minimum length of the reply body; shorter replies are ignored.
+ * @param[in] msg_id Message ID the reply must carry at @p msg_id_offset, or 0 to not check.
+ * @param[in] msg_id_offset Offset of the message ID in the reply body, within @p min_len.
+ * @param[out] body Buffer receiving the reply body.
+ * @param[in] body_size Size of @p body.
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the gateway did not reply, ESP_FAIL on error.
+ */
+static esp_err_t request(struct mqttsn_client *client, const uint8_t *req, size_t req_len,
+                         enum mqttsn_msg_type reply_type, size_t min_len, uint16_t msg_id,
+                         size_t msg_id_offset, uint8_t *body, size_t body_size)
+{
+    assert(min_len <= body_size);
+    assert(msg_id == 0 || msg_id_offset + 2 <= min_len);
+
+    for (int attempt = 0; attempt <= client->config.retries; attempt++)
+    {
+        size_t body_len;
+
+        if (send_packet(client, req, req_len) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+
+        while (recv_reply(client, reply_type, body, body_size, &body_len) == ESP_OK)
+        {
+            if (body_len < min_len)
+            {
+                ESP_LOGW(TAG, "Ignoring short reply of type 0x%02x (%u bytes)", reply_type,
+                         (unsigned)body_len);
+                continue;
+            }
+            if (msg_id == 0 || get_u16(&body[msg_id_offset]) == msg_id)
+            {
+                return ESP_OK;
+            }
+        }
+
+        ESP_LOGW(TAG, "No reply of type 0x%02x, attempt %d/%d", reply_type, attempt + 1,
+                 client->config.retries + 1);
+    }
+
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t mqttsn_client_init(struct mqttsn_client *client,
+                             const struct mqttsn_client_config *config)
+{
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *res = NULL;
+    char port[6];
+
+    memset(client, 0, sizeof(*client));
+    client->sock = -1;
+    client->config = *config;
+    client->state = MQTTSN_STATE_DISCONNECTED;
+
+    snprintf(port, sizeof(port), "%u", config->port);
+    if (getaddrinfo(config->host, port, &hints, &res) != 0 || res == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to resolve gateway %s", config->host);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    client->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (client->sock < 0 || connect(client->sock, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        freeaddrinfo(res);
+        mqttsn_client_deinit(client);
+        return ESP_FAIL;
+    }
+    freeaddrinfo(res);
+
+    struct timeval timeout = {
+        .tv_sec = config->timeout_ms / 1000,
+        .tv_usec = (config->timeout_ms % 1000) * 1000,
+    };
+    setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    return ESP_OK;
+}
+
+void mqttsn_client_deinit(struct mqttsn_client *client)
+{
+    if (client->sock >= 0)
+    {
+        close(client->sock);
+        client->sock = -1;
+    }
+    client->state = MQTTSN_STATE_DISCONNECTED;
+}
+
+esp_err_t mqttsn_client_connect(struct mqttsn_client *client, bool clean_session)
+{
+    uint8_t req[4 + 4 + MQTTSN_CLIENT_ID_MAX_LEN];
+    uint8_t body[1];
+    size_t id_len = strlen(client->config.client_id);
+
+    if (id_len == 0 || id_len > MQTTSN_CLIENT_ID_MAX_LEN)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t len = put_header(req, MQTTSN_CONNECT, 4 + id_len);
+    req[len++] = clean_session ? MQTTSN_FLAG_CLEAN_SESSION : 0;
+    req[len++] = MQTTSN_PROTOCOL_ID;
+    put_u16(&req[len], client->config.keepalive_s);
+    len += 2;
+    memcpy(&req[len], client->config.client_id, id_len);
+    len += id_len;
+
+    esp_err_t err = request(client, req, len, MQTTSN_CONNACK, 1, 0, 0, body, sizeof(body));
+    if (err != ESP_OK)
+    {
+        client->state = MQTTSN_STATE_DISCONNECTED;
+        return err;
+    }
+
+    if (body[0] != MQTTSN_RC_ACCEPTED)
+    {
+        ESP_LOGE(TAG, "Connection rejected: return code %u", body[0]);
+        client->state = MQTTSN_STATE_DISCONNECTED;
+        return ESP_FAIL;
+    }
+
+    client->state = MQTTSN_STATE_ACTIVE;
+    if (clean_session)
+    {
+        client->topics_invalid = false;
+    }
+    return ESP_OK;
+}
+
+void mqttsn_client_poll(struct mqttsn_client *client)
+{
+    uint8_t body[MQTTSN_RX_BUF_LEN];
+    uint8_t type;
+    size_t len;
+    esp_err_t err;
+
+    if (client->sock < 0)
+    {
+        return;
+    }
+
+    while ((err = recv_packet(client, MSG_DONTWAIT, &type, body, sizeof(body), &len))
+           != ESP_ERR_TIMEOUT)
+    {
+        if (err == ESP_OK)
+        {
+            handle_unsolicited(client, type, body, len);
+        }
+    }
+}
+
+esp_err_t mqttsn_client_register(struct mqttsn_client *client, const char *topic,
+                                 uint16_t *topic_id)
+{
+    size_t topic_len = strlen(topic);
+    uint8_t body[5];
+
+    if (client->state != MQTTSN_STATE_ACTIVE)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint8_t *req = malloc(4 + 4 + topic_len);
+    if (req == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint16_t msg_id = next_msg_id(client);
+    size_t len = put_header(req, MQTTSN_REGISTER, 4 + topic_len);
+    put_u16(&req[len], 0);
+    put_u16(&req[len + 2], msg_id);
+    len += 4;
+    memcpy(&req[len], topic, topic_len);
+    len += topic_len;
+
+    /* REGACK: TopicId(2) MsgId(2) ReturnCode(1) */
+    esp_err_t err = request(client, req, len, MQTTSN_REGACK, 5, msg_id, 2, body, sizeof(body));
+    free(req);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if (body[4] != MQTTSN_RC_ACCEPTED)
+    {
+        ESP_LOGE(TAG, "Registration of %s rejected: return code %u", topic, body[4]);
+        return ESP_FAIL;
+    }
+
+    *topic_id = get_u16(&body[0]);
+    ESP_LOGD(TAG, "Registered %s as topic ID %u", topic, *topic_id);
+    return ESP_OK;
+}
+
+esp_err_t mqttsn_client_publish(struct mqttsn_client *client, uint16_t topic_id,
+                                enum mqttsn_topic_type topic_type, bool qos_neg1, bool retain,
+                                const void *data, size_t len)
+{
+    if (qos_neg1 && topic_type == MQTTSN_TOPIC_NORMAL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!qos_neg1 && client->state != MQTTSN_STATE_ACTIVE)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint8_t *req = malloc(4 + 5 + len);
+    if (req == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* PUBLISH: Flags(1) TopicId(2) MsgId(2) Data, message ID is 0 for QoS 0 and -1 */
+    size_t pkt_len = put_header(req, MQTTSN_PUBLISH, 5 + len);
+    req[pkt_len++] =
+        (qos_neg1 ? MQTTSN_FLAG_QOS_NEG1 : 0) | (retain ? MQTTSN_FLAG_RETAIN : 0) | topic_type;
+    put_u16(&req[pkt_len], topic_id);
+    put_u16(&req[pkt_len + 2], 0);
+    pkt_len += 4;
+    memcpy(&req[pkt_len], data, len);
+    pkt_len += len;
+
+    esp_err_t err = send_packet(client, req, pkt_len);
+    free(req);
+    return err;
+}
+
+esp_err_t mqttsn_client_sleep(struct mqttsn_client *client, uint16_t duration_s)
+{
+    uint8_t req[4];
+    uint8_t body[1];
+
+    if (client->state != MQTTSN_STATE_ACTIVE)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t len = put_header(req, MQTTSN_DISCONNECT, 2);
+    put_u16(&req[len], duration_s);
+    len += 2;
+
+    esp_err_t err = request(client, req, len, MQTTSN_DISCONNECT, 0, 0, 0, body, sizeof(body));
+    if (err == ESP_OK)
+    {
+        client->state = MQTTSN_STATE_ASLEEP;
+    }
+    return err;
+}
+
+esp_err_t mqttsn_client_disconnect(struct mqttsn_client *client)
+{
+    uint8_t req[2];
+    uint8_t body[1];
+
+    size_t len = put_header(req, MQTTSN_DISCONNECT, 0);
+    esp_err_t err = request(client, req, len, MQTTSN_DISCONNECT, 0, 0, 0, body, sizeof(body));
+    client->state = MQTTSN_STATE_DISCONNECTED;
+    return err;
+}
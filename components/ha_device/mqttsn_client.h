@@ -0,0 +1,177 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Minimal MQTT-SN v1.2 client over UDP.
+ *
+ * Supports the subset needed by sleepy sensor nodes:
+ *
+ * - CONNECT / REGISTER to obtain topic IDs for normal topic names.
+ * - PUBLISH at QoS 0, or at QoS -1 to a predefined topic ID, which needs no connection at all.
+ * - Sleeping clients: @ref mqttsn_client_sleep sends DISCONNECT with a duration so the gateway keeps
+ *   the session, including registered topic IDs, while the device is asleep. Reconnecting with
+ *   @c clean_session false resumes it without registering again. A gateway that restarted in the
+ *   meantime accepts the resumed session without the topics, and rejects the next PUBLISH with
+ *   "invalid topic ID"; the client then sets @c topics_invalid so the topics are registered again.
+ *
+ * Every call blocks until the gateway has replied or the configured number of retries has expired.
+ * The client is not thread safe.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/** Connection state of the client as seen by the gateway. */
+enum mqttsn_state
+{
+    MQTTSN_STATE_DISCONNECTED, /**< No session, or the session was discarded */
+    MQTTSN_STATE_ACTIVE,       /**< Connected, may publish at QoS 0 */
+    MQTTSN_STATE_ASLEEP,       /**< Session held by the gateway while the client sleeps */
+};
+
+/** Topic ID types (MQTT-SN v1.2 section 5.3.4). */
+enum mqttsn_topic_type
+{
+    MQTTSN_TOPIC_NORMAL = 0,     /**< Topic ID obtained with REGISTER */
+    MQTTSN_TOPIC_PREDEFINED = 1, /**< Topic ID configured on the gateway in advance */
+    MQTTSN_TOPIC_SHORT = 2,      /**< Two character topic name */
+};
+
+/** Client configuration. */
+struct mqttsn_client_config
+{
+    /** Gateway host name or IP address. */
+    const char *host;
+    /** Gateway UDP port. */
+    uint16_t port;
+    /** Client ID, 1 to 23 characters. */
+    const char *client_id;
+    /** Keep alive duration in seconds sent with CONNECT. */
+    uint16_t keepalive_s;
+    /** Time to wait for a reply from the gateway in milliseconds. */
+    uint32_t timeout_ms;
+    /** Number of times a request is retransmitted before giving up. */
+    int retries;
+};
+
+/** Client state. */
+struct mqttsn_client
+{
+    /** UDP socket connected to the gateway, or -1. */
+    int sock;
+    /** Client configuration. */
+    struct mqttsn_client_config config;
+    /** Connection state. */
+    enum mqttsn_state state;
+    /** Set when the gateway rejected a PUBLISH for an invalid topic ID: every topic ID registered
+     * must be registered again. Cleared by connecting with a clean session. */
+    bool topics_invalid;
+    /** Message ID for the next request. */
+    uint16_t next_msg_id;
+    /** Number of packets sent to the gateway. */
+    uint32_t tx_packets;
+    /** Number of packets received from the gateway. */
+    uint32_t rx_packets;
+};
+
+/**
+ * Initialize the client and open the UDP socket.
+ *
+ * @param[out] client Client to initialize.
+ * @param[in] config Client configuration. Strings must remain valid while the client is in use.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the gateway could not be resolved, ESP_FAIL if
+ *         the socket could not be created.
+ */
+esp_err_t mqttsn_client_init(struct mqttsn_client *client,
+                             const struct mqttsn_client_config *config);
+
+/**
+ * Close the UDP socket. The gateway is not notified.
+ *
+ * @param[in,out] client MQTT-SN client.
+ */
+void mqttsn_client_deinit(struct mqttsn_client *client);
+
+/**
+ * Connect to the gateway (CONNECT/CONNACK).
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] clean_session Discard any session, and therefore registered topic IDs, held by the
+ *                          gateway, and clear @c topics_invalid.
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the gateway did not reply, ESP_FAIL if the
+ *         connection was rejected.
+ */
+esp_err_t mqttsn_client_connect(struct mqttsn_client *client, bool clean_session);
+
+/**
+ * Handle the packets the gateway sent since the last request, without waiting.
+ *
+ * Replies to publishes are only received here or while waiting for the reply to another request,
+ * so call this before relying on @c topics_invalid.
+ *
+ * @param[in,out] client MQTT-SN client.
+ */
+void mqttsn_client_poll(struct mqttsn_client *client);
+
+/**
+ * Register a topic name and obtain its topic ID (REGISTER/REGACK).
+ *
+ * @param[in,out] client MQTT-SN client, must be active.
+ * @param[in] topic Topic name.
+ * @param[out] topic_id Topic ID assigned by the gateway.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if not connected, ESP_ERR_TIMEOUT if the
+ *         gateway did not reply, ESP_FAIL if the registration was rejected.
+ */
+esp_err_t mqttsn_client_register(struct mqttsn_client *client, const char *topic,
+                                 uint16_t *topic_id);
+
+/**
+ * Publish a message.
+ *
+ * QoS 0 requires an active connection. QoS -1 (@p qos_neg1) may be used in any state but only with
+ * predefined or short topic IDs. Neither waits for a reply from the gateway: a rejection of the
+ * topic ID is received later, see @ref mqttsn_client_poll.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @param[in] topic_id Topic ID.
+ * @param[in] topic_type Type of @p topic_id.
+ * @param[in] qos_neg1 Publish at QoS -1 rather than QoS 0.
+ * @param[in] retain Ask the broker to retain the message.
+ * @param[in] data Message payload.
+ * @param[in] len Length of @p data in bytes.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if QoS 0 is used without an active connection,
+ *         ESP_ERR_INVALID_ARG for QoS -1 with a normal topic ID, ESP_ERR_NO_MEM or ESP_FAIL if the
+ *         packet could not be sent.
+ */
+esp_err_t mqttsn_client_publish(struct mqttsn_client *client, uint16_t topic_id,
+                                enum mqttsn_topic_type topic_type, bool qos_neg1, bool retain,
+                                const void *data, size_t len);
+
+/**
+ * Put the client to sleep (DISCONNECT with duration).
+ *
+ * The gateway keeps the session for @p duration_s seconds. Call @ref mqttsn_client_connect with
+ * @c clean_session false to become active again.
+ *
+ * @param[in,out] client MQTT-SN client, must be active.
+ * @param[in] duration_s Sleep duration in seconds.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if not connected, ESP_ERR_TIMEOUT if the
+ *         gateway did not reply.
+ */
+esp_err_t mqttsn_client_sleep(struct mqttsn_client *client, uint16_t duration_s);
+
+/**
+ * Disconnect from the gateway (DISCONNECT), discarding the session.
+ *
+ * @param[in,out] client MQTT-SN client.
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the gateway did not reply.
+ */
+esp_err_t mqttsn_client_disconnect(struct mqttsn_client *client);
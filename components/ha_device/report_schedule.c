@@ -0,0 +1,66 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "report_schedule.h"
+
+/** 32-bit FNV-1a offset basis. */
+#define FNV_OFFSET_BASIS 2166136261u
+
+/** 32-bit FNV-1a prime. */
+#define FNV_PRIME 16777619u
+
+/** Largest shift applied to the backoff ceiling, enough to reach any 32-bit maximum. */
+#define BACKOFF_SHIFT_MAX 32
+
+uint32_t report_schedule_phase_ms(const char *device_id, uint32_t salt, uint32_t window_ms)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    if (window_ms == 0)
+    {
+        return 0;
+    }
+
+    for (const char *c = device_id; *c != '\0'; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * FNV_PRIME;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        hash = (hash ^ ((salt >> (8 * i)) & 0xFF)) * FNV_PRIME;
+    }
+
+    /* Device IDs of one batch differ only in their last few characters; mix those into the high
+     * bits as well before reducing */
+    hash ^= hash >> 16;
+    hash *= 0x7FEB352Du;
+    hash ^= hash >> 15;
+
+    return hash % window_ms;
+}
+
+uint32_t report_schedule_backoff_ms(const struct report_backoff_config *config, uint32_t attempt,
+                                    uint32_t random)
+{
+    uint64_t ceiling_ms = config->min_ms;
+
+    /* Even the first attempt is jittered, between min_ms and twice that */
+    uint32_t shift = attempt < BACKOFF_SHIFT_MAX ? attempt + 1 : BACKOFF_SHIFT_MAX;
+
+    ceiling_ms <<= shift;
+    if (ceiling_ms > config->max_ms)
+    {
+        ceiling_ms = config->max_ms;
+    }
+
+    if (ceiling_ms <= config->min_ms)
+    {
+        return config->min_ms;
+    }
+
+    return config->min_ms + random % (uint32_t)(ceiling_ms - config->min_ms + 1);
+}
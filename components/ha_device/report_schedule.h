@@ -0,0 +1,58 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Reporting schedule helpers to keep a fleet of devices from transmitting at the same time.
+ *
+ * Devices that connect together, for example after an access point or broker restart, would
+ * otherwise start their update timers together and stay phase locked, so their reports collide on
+ * every interval. Each device instead delays its first report by a phase offset derived from its
+ * device ID, and reconnects after a randomised, exponentially growing backoff.
+ *
+ * The functions are pure, randomness is passed in, so the same calculations can be reproduced in
+ * the host side simulation (tools/report_sim).
+ */
+#pragma once
+
+#include <stdint.h>
+
+/** Reconnect backoff limits. */
+struct report_backoff_config
+{
+    /** Shortest backoff in milliseconds. */
+    uint32_t min_ms;
+    /** Longest backoff in milliseconds. */
+    uint32_t max_ms;
+};
+
+/**
+ * Calculate the phase offset of a device's reports.
+ *
+ * The offset is a hash of the device ID and @p salt, spread uniformly over @p window_ms. With a
+ * salt of 0 the offset is the same every time the device connects.
+ *
+ * @param[in] device_id Device ID string.
+ * @param[in] salt Value mixed into the hash; change it to move the device to a new phase.
+ * @param[in] window_ms Window to spread offsets over, in milliseconds.
+ * @return Phase offset in milliseconds, less than @p window_ms (0 if @p window_ms is 0).
+ */
+uint32_t report_schedule_phase_ms(const char *device_id, uint32_t salt, uint32_t window_ms);
+
+/**
+ * Calculate the delay before a reconnect attempt.
+ *
+ * The delay is drawn uniformly between @c min_ms and a ceiling ("full jitter"), so devices that
+ * lost their connection together spread their reconnects out. The ceiling starts at twice
+ * @c min_ms and doubles with each attempt, up to @c max_ms.
+ *
+ * @param[in] config Backoff limits.
+ * @param[in] attempt Number of failed attempts so far, starting at 0.
+ * @param[in] random Uniformly distributed random value.
+ * @return Delay in milliseconds.
+ */
+uint32_t report_schedule_backoff_ms(const struct report_backoff_config *config, uint32_t attempt,
+                                    uint32_t random);
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "ts_codec.h"
+
+/** Largest precision that keeps scaled values well within an int64_t. */
+#define TS_CODEC_MAX_PRECISION 9
+
+/** Marks the XOR window as not yet set, so the first non-zero XOR writes a new window. */
+#define XOR_WINDOW_NONE UINT8_MAX
+
+/**
+ * Append bits to the stream, marking the encoder as overflowed if they do not fit.
+ *
+ * @param[in,out] enc Encoder.
+ * @param[in] value Bits to append, in the low @p n bits.
+ * @param[in] n Number of bits, at most 64.
+ */
+static void put_bits(struct ts_encoder *enc, uint64_t value, unsigned int n)
+{
+    if (enc->overflow || n > enc->size * 8 - enc->bits)
+    {
+        enc->overflow = true;
+        return;
+    }
+
+    while (n > 0)
+    {
+        uint8_t *byte = &enc->buf[enc->bits / 8];
+        unsigned int room = 8 - enc->bits % 8;
+        unsigned int take = n < room ? n : room;
+        unsigned int shift = room - take;
+        uint8_t mask = ((1u << take) - 1) << shift;
+
+        *byte = (*byte & ~mask) | (((value >> (n - take)) << shift) & mask);
+        enc->bits += take;
+        n -= take;
+    }
+}
+
+/**
+ * Append an unsigned varint.
+ *
+ * @param[in,out] enc Encoder.
+ * @param[in] value Value to append.
+ */
+static void put_varint(struct ts_encoder *enc, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        put_bits(enc, (value & 0x7F) | 0x80, 8);
+        value >>= 7;
+    }
+    put_bits(enc, value, 8);
+}
+
+/**
+ * Append a signed value as a zigzag varint, so that small negative values stay short.
+ *
+ * @param[in,out] enc Encoder.
+ * @param[in] value Value to append.
+ */
+static void put_zigzag(struct ts_encoder *enc, int64_t value)
+{
+    put_varint(enc, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/**
+ * Append a value XORed with the previous one.
+ *
+ * @param[in,out] enc Encoder.
+ * @param[in] bits Bits of the value.
+ */
+static void put_xor(struct ts_encoder *enc, uint32_t bits)
+{
+    uint32_t xor = bits ^ enc->prev_bits;
+
+    if (xor == 0)
+    {
+        put_bits(enc, 0, 1);
+        return;
+    }
+
+    /* Non-zero, so the leading zeros fit in 5 bits */
+    uint8_t leading = __builtin_clz(xor);
+    uint8_t trailing = __builtin_ctz(xor);
+
+    if (enc->prev_leading != XOR_WINDOW_NONE && leading >= enc->prev_leading
+        && trailing >= enc->prev_trailing)
+    {
+        put_bits(enc, 0x2, 2);
+        put_bits(enc, xor >> enc->prev_trailing, 32 - enc->prev_leading - enc->prev_trailing);
+        return;
+    }
+
+    unsigned int len = 32 - leading - trailing;
+
+    put_bits(enc, 0x3, 2);
+    put_bits(enc, leading, 5);
+    put_bits(enc, len - 1, 5);
+    put_bits(enc, xor >> trailing, len);
+    enc->prev_leading = leading;
+    enc->prev_trailing = trailing;
+}
+
+void ts_encoder_init(struct ts_encoder *enc, uint8_t *buf, size_t size,
+                     enum ts_codec_values values, uint8_t precision)
+{
+    assert(size > 0);
+    assert(precision <= TS_CODEC_MAX_PRECISION);
+
+    memset(buf, 0, size);
+    *enc = (struct ts_encoder){
+        .buf = buf,
+        .size = size,
+        .values = values,
+        .precision = precision,
+        .prev_leading = XOR_WINDOW_NONE,
+    };
+
+    put_bits(enc, (values << 4) | precision, 8);
+}
+
+bool ts_encoder_add(struct ts_encoder *enc, int64_t timestamp_ms, float value)
+{
+    struct ts_encoder saved = *enc;
+
+    if (enc->count == 0)
+    {
+        put_varint(enc, timestamp_ms);
+    }
+    else
+    {
+        int64_t delta = timestamp_ms - enc->prev_ts;
+
+        put_zigzag(enc, delta - enc->prev_delta);
+        enc->prev_delta = delta;
+    }
+    enc->prev_ts = timestamp_ms;
+
+    if (enc->values == TS_CODEC_VALUES_VARINT)
+    {
+        int64_t scaled = llroundf(value * powf(10, enc->precision));
+
+        put_zigzag(enc, scaled - enc->prev_scaled);
+        enc->prev_scaled = scaled;
+    }
+    else
+    {
+        uint32_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        if (enc->count == 0)
+        {
+            put_bits(enc, bits, 32);
+        }
+        else
+        {
+            put_xor(enc, bits);
+        }
+        enc->prev_bits = bits;
+    }
+
+    if (enc->overflow)
+    {
+        *enc = saved;
+        /* Keep the padding of the last byte zero */
+        if (enc->bits % 8 != 0)
+        {
+            enc->buf[enc->bits / 8] &= 0xFF << (8 - enc->bits % 8);
+        }
+        return false;
+    }
+
+    enc->count++;
+    return true;
+}
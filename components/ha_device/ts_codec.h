@@ -0,0 +1,108 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Compact time-series encoder.
+ *
+ * Encodes a series of (timestamp, value) samples into a bit stream as they are taken, so the
+ * samples themselves never need to be stored:
+ *
+ * - A header byte holds the value encoding in the upper nibble and the precision in the lower.
+ * - The first timestamp is written as an unsigned varint of milliseconds. Every later timestamp is
+ *   written as the zigzag varint of its delta-of-delta, which is a single byte (usually 0) while
+ *   samples are evenly spaced.
+ * - With @ref TS_CODEC_VALUES_VARINT each value is scaled by 10^precision and rounded, the first
+ *   written as a zigzag varint and every later one as the zigzag varint of its difference from the
+ *   previous value.
+ * - With @ref TS_CODEC_VALUES_XOR the first value is written as its 32 raw bits. Every later value
+ *   is XORed with the previous one: a 0 bit if they are equal, otherwise a 1 bit followed by either
+ *   a 0 bit and the meaningful bits if they fall within the previous leading and trailing zeros,
+ *   or a 1 bit, 5 bits of leading zeros, 5 bits of (length - 1) and the meaningful bits.
+ *
+ * Varints are 7 bits per byte, least significant group first, with the top bit set on all but the
+ * last byte. The stream is written most significant bit first and padded with zeros to a whole
+ * byte. It does not hold the number of samples, which must be sent alongside it.
+ *
+ * Like the CBOR writer the output goes to a caller provided buffer. A sample that does not fit is
+ * rejected as a whole, leaving the samples already encoded intact.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Encoding of the values in a series. */
+enum ts_codec_values
+{
+    TS_CODEC_VALUES_VARINT = 0, /**< Deltas of values scaled by the precision, as zigzag varints */
+    TS_CODEC_VALUES_XOR = 1,    /**< XOR of the raw float with the previous value */
+};
+
+/** Time-series encoder state. */
+struct ts_encoder
+{
+    /** Output buffer. */
+    uint8_t *buf;
+    /** Size of the output buffer in bytes. */
+    size_t size;
+    /** Number of bits written so far. */
+    size_t bits;
+    /** Set while encoding a sample that did not fit in the buffer. */
+    bool overflow;
+    /** Encoding of the values. */
+    enum ts_codec_values values;
+    /** Number of decimal places kept by @ref TS_CODEC_VALUES_VARINT. */
+    uint8_t precision;
+    /** Number of samples encoded. */
+    uint32_t count;
+    /** Timestamp of the previous sample. */
+    int64_t prev_ts;
+    /** Difference between the timestamps of the previous two samples. */
+    int64_t prev_delta;
+    /** Previous value scaled by the precision, for @ref TS_CODEC_VALUES_VARINT. */
+    int64_t prev_scaled;
+    /** Bits of the previous value, for @ref TS_CODEC_VALUES_XOR. */
+    uint32_t prev_bits;
+    /** Leading zeros of the previous meaningful XOR bits. */
+    uint8_t prev_leading;
+    /** Trailing zeros of the previous meaningful XOR bits. */
+    uint8_t prev_trailing;
+};
+
+/**
+ * Initialize an encoder and write the series header.
+ *
+ * @param[out] enc Encoder to initialize.
+ * @param[in] buf Output buffer, at least one byte.
+ * @param[in] size Size of @p buf in bytes.
+ * @param[in] values Encoding of the values.
+ * @param[in] precision Number of decimal places kept by @ref TS_CODEC_VALUES_VARINT, at most 9.
+ */
+void ts_encoder_init(struct ts_encoder *enc, uint8_t *buf, size_t size,
+                     enum ts_codec_values values, uint8_t precision);
+
+/**
+ * Encode a sample.
+ *
+ * @param[in,out] enc Encoder.
+ * @param[in] timestamp_ms Time of the sample in milliseconds, not before the previous sample.
+ * @param[in] value Value of the sample.
+ * @return true if the sample was encoded, false if it did not fit in the buffer.
+ */
+bool ts_encoder_add(struct ts_encoder *enc, int64_t timestamp_ms, float value);
+
+/**
+ * Get the length of the encoded series.
+ *
+ * @param[in] enc Encoder.
+ * @return Number of bytes of the buffer in use, including the header.
+ */
+static inline size_t ts_encoder_len(const struct ts_encoder *enc)
+{
+    return (enc->bits + 7) / 8;
+}
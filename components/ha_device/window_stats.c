@@ -0,0 +1,42 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+
+#include "window_stats.h"
+
+void window_stats_reset(struct window_stats *stats)
+{
+    *stats = (struct window_stats){0};
+}
+
+void window_stats_add(struct window_stats *stats, float value)
+{
+    if (stats->count == 0 || value < stats->min)
+    {
+        stats->min = value;
+    }
+    if (stats->count == 0 || value > stats->max)
+    {
+        stats->max = value;
+    }
+
+    stats->count++;
+
+    float delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+}
+
+float window_stats_stddev(const struct window_stats *stats)
+{
+    if (stats->count < 2)
+    {
+        return 0.0f;
+    }
+
+    return sqrtf(stats->m2 / stats->count);
+}
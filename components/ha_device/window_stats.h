@@ -0,0 +1,55 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Streaming statistics over a window of samples.
+ *
+ * Keeps the count, minimum, maximum, mean and the sum of squared differences from the mean using
+ * Welford's algorithm, so the statistics of any number of samples fit in a fixed amount of memory
+ * and are numerically stable without storing the samples.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/** Statistics of the samples added since the window was last reset. */
+struct window_stats
+{
+    /** Number of samples. */
+    uint32_t count;
+    /** Smallest sample. */
+    float min;
+    /** Largest sample. */
+    float max;
+    /** Running mean of the samples. */
+    float mean;
+    /** Sum of squared differences from the mean. */
+    float m2;
+};
+
+/**
+ * Start a new, empty window.
+ *
+ * @param[out] stats Statistics to reset.
+ */
+void window_stats_reset(struct window_stats *stats);
+
+/**
+ * Add a sample to the window.
+ *
+ * @param[in,out] stats Statistics to update.
+ * @param[in] value Sample to add.
+ */
+void window_stats_add(struct window_stats *stats, float value);
+
+/**
+ * Calculate the population standard deviation of the samples.
+ *
+ * @param[in] stats Statistics of the window.
+ * @return Standard deviation, 0 if there are fewer than two samples.
+ */
+float window_stats_stddev(const struct window_stats *stats);
@@ -172,3 +172,14 @@ void app_wlan_stop(void)
     /* Shutdown wlan interface */
     mmwlan_shutdown();
 }
+
+int32_t app_wlan_get_rssi(void)
+{
+    return mmwlan_get_rssi();
+}
+
+bool app_wlan_set_power_save(bool enabled)
+{
+    return mmwlan_set_power_save_mode(enabled ? MMWLAN_PS_ENABLED : MMWLAN_PS_DISABLED)
+           == MMWLAN_SUCCESS;
+}
@@ -36,6 +36,9 @@
  * @ref MMCONFIG_PROGRAMMING instructions.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /**
  * Initializes the WLAN interface using settings specified in the config store.
  *
@@ -56,3 +59,19 @@ void app_wlan_start(void);
  * Disconnects from Wi-Fi and de-initializes the WLAN interface.
  */
 void app_wlan_stop(void);
+
+/**
+ * Gets the RSSI of the current connection.
+ *
+ * @returns The RSSI in dBm, or @c INT32_MIN if not connected.
+ */
+int32_t app_wlan_get_rssi(void);
+
+/**
+ * Enables or disables power save, letting the radio sleep between packets.
+ *
+ * @param enabled Whether power save is enabled.
+ *
+ * @returns @c true on success.
+ */
+bool app_wlan_set_power_save(bool enabled);
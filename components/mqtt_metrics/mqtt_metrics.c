@@ -0,0 +1,539 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mqtt_metrics.h"
+
+static const char *TAG = "mqtt_metrics";
+
+/* Macro for cJSON error checking */
+#define CJSON_CHECK(x)                                                 \
+    do                                                                 \
+    {                                                                  \
+        if ((x) == NULL)                                               \
+        {                                                              \
+            ESP_LOGE(TAG, "cJSON error at %s:%d", __FILE__, __LINE__); \
+            goto exit;                                                 \
+        }                                                              \
+    } while (0)
+
+/** A QoS 1/2 publish waiting for its acknowledgement. */
+struct in_flight_entry
+{
+    /** Whether the entry is in use. */
+    bool used;
+    /** Message ID returned by the publish call. */
+    int msg_id;
+    /** Time (in microseconds) the publish call was made. */
+    int64_t start_us;
+};
+
+/** Stack size of the task building and queueing the diagnostics report. */
+#define REPORT_TASK_STACK_SIZE 3072
+
+/** Priority of the report task, below the tasks publishing telemetry. */
+#define REPORT_TASK_PRIORITY 2
+
+/** Acknowledgements kept for publish calls that have not returned yet. */
+#define EARLY_ACKS 4
+
+/** An acknowledgement that arrived before the publish call it is for had returned. */
+struct early_ack
+{
+    /** Whether the entry is in use. */
+    bool used;
+    /** Message ID acknowledged. */
+    int msg_id;
+    /** Time (in microseconds) the acknowledgement was handled. */
+    int64_t ack_us;
+};
+
+/** Tracker state. */
+static struct mqtt_metrics_tracker
+{
+    /** MQTT client being tracked. */
+    esp_mqtt_client_handle_t client;
+    /** Protects @c metrics and @c in_flight. */
+    SemaphoreHandle_t lock;
+    /** Accumulated metrics. @c in_flight and @c outbox_bytes are filled in on read. */
+    struct mqtt_metrics metrics;
+    /** Publishes waiting for their acknowledgement. */
+    struct in_flight_entry in_flight[CONFIG_MQTT_METRICS_MAX_IN_FLIGHT];
+    /** Acknowledgements not matched yet, for the publishing task to pick up. */
+    struct early_ack early[EARLY_ACKS];
+    /** Timer for the periodic diagnostics report. */
+    esp_timer_handle_t report_timer;
+    /** Task building and queueing the diagnostics report, woken by @c report_timer. */
+    TaskHandle_t report_task;
+    /** Topic the diagnostics report is published on. */
+    const char *report_topic;
+} tracker = {};
+
+/**
+ * Add a sample to a latency histogram.
+ *
+ * @param[in,out] hist Histogram to update.
+ * @param[in] latency_us Latency in microseconds.
+ */
+static void histogram_add(struct mqtt_metrics_histogram *hist, int64_t latency_us)
+{
+    uint32_t latency_ms = latency_us / 1000;
+    int bucket = 0;
+
+    while (bucket < MQTT_METRICS_HIST_BUCKETS - 1 && latency_ms >= (1u << bucket))
+    {
+        bucket++;
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum_ms += latency_ms;
+    if (latency_ms > hist->max_ms)
+    {
+        hist->max_ms = latency_ms;
+    }
+}
+
+/**
+ * Find the in-flight entry for a message ID. Must be called with the lock held.
+ *
+ * @param[in] msg_id Message ID to look for.
+ * @return The entry, or NULL if the message is not tracked.
+ */
+static struct in_flight_entry *find_in_flight(int msg_id)
+{
+    for (int i = 0; i < CONFIG_MQTT_METRICS_MAX_IN_FLIGHT; i++)
+    {
+        if (tracker.in_flight[i].used && tracker.in_flight[i].msg_id == msg_id)
+        {
+            return &tracker.in_flight[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Remember a publish until it is acknowledged. Must be called with the lock held.
+ *
+ * If every entry is in use the oldest is forgotten and counted as untracked.
+ *
+ * @param[in] msg_id Message ID returned by the publish call.
+ * @param[in] start_us Time (in microseconds) the publish call was made.
+ */
+static void track_in_flight(int msg_id, int64_t start_us)
+{
+    struct in_flight_entry *entry = &tracker.in_flight[0];
+
+    for (int i = 0; i < CONFIG_MQTT_METRICS_MAX_IN_FLIGHT; i++)
+    {
+        if (!tracker.in_flight[i].used)
+        {
+            entry = &tracker.in_flight[i];
+            break;
+        }
+
+        if (tracker.in_flight[i].start_us < entry->start_us)
+        {
+            entry = &tracker.in_flight[i];
+        }
+    }
+
+    if (entry->used)
+    {
+        ESP_LOGW(TAG, "In-flight table full, forgetting msg_id=%d", entry->msg_id);
+        tracker.metrics.untracked++;
+    }
+
+    entry->used = true;
+    entry->msg_id = msg_id;
+    entry->start_us = start_us;
+}
+
+/**
+ * Keep an acknowledgement that matched no tracked publish. Must be called with the lock held.
+ *
+ * The MQTT task can handle the acknowledgement before the publish call has returned its message
+ * ID. The publishing task then picks it up with @ref take_early_ack. If every entry is in use the
+ * oldest is taken to be for a publish that was never tracked.
+ *
+ * @param[in] msg_id Message ID acknowledged.
+ * @param[in] ack_us Time (in microseconds) the acknowledgement was handled.
+ */
+static void keep_early_ack(int msg_id, int64_t ack_us)
+{
+    struct early_ack *early = &tracker.early[0];
+
+    for (int i = 0; i < EARLY_ACKS; i++)
+    {
+        if (!tracker.early[i].used)
+        {
+            early = &tracker.early[i];
+            break;
+        }
+
+        if (tracker.early[i].ack_us < early->ack_us)
+        {
+            early = &tracker.early[i];
+        }
+    }
+
+    if (early->used)
+    {
+        tracker.metrics.untracked++;
+    }
+
+    early->used = true;
+    early->msg_id = msg_id;
+    early->ack_us = ack_us;
+}
+
+/**
+ * Take the acknowledgement of a publish that arrived before its call returned. Must be called with
+ * the lock held.
+ *
+ * @param[in] msg_id Message ID returned by the publish call.
+ * @param[in] start_us Time (in microseconds) the publish call was made.
+ * @param[out] ack_us Time (in microseconds) the acknowledgement was handled.
+ * @return true if the acknowledgement had arrived.
+ */
+static bool take_early_ack(int msg_id, int64_t start_us, int64_t *ack_us)
+{
+    for (int i = 0; i < EARLY_ACKS; i++)
+    {
+        struct early_ack *early = &tracker.early[i];
+
+        /* An older acknowledgement is for an earlier use of the message ID */
+        if (early->used && early->msg_id == msg_id && early->ack_us >= start_us)
+        {
+            early->used = false;
+            *ack_us = early->ack_us;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Event handler registered to receive MQTT events
+ *
+ * Matches @c MQTT_EVENT_PUBLISHED and @c MQTT_EVENT_DELETED events to tracked publishes.
+ *
+ * @param[in] handler_args User data registered to the event (unused)
+ * @param[in] base Event base for the handler
+ * @param[in] event_id The id for the received event
+ * @param[in] event_data The data for the event, esp_mqtt_event_handle_t
+ */
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                               void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    int64_t now_us = esp_timer_get_time();
+
+    if (event_id != MQTT_EVENT_PUBLISHED && event_id != MQTT_EVENT_DELETED)
+    {
+        return;
+    }
+
+    xSemaphoreTake(tracker.lock, portMAX_DELAY);
+
+    struct in_flight_entry *entry = find_in_flight(event->msg_id);
+    if (event_id == MQTT_EVENT_PUBLISHED)
+    {
+        tracker.metrics.delivered++;
+        if (entry != NULL)
+        {
+            histogram_add(&tracker.metrics.ack, now_us - entry->start_us);
+        }
+        else
+        {
+            keep_early_ack(event->msg_id, now_us);
+        }
+    }
+    else
+    {
+        ESP_LOGW(TAG, "msg_id=%d deleted from outbox before delivery", event->msg_id);
+        tracker.metrics.dropped++;
+    }
+
+    if (entry != NULL)
+    {
+        entry->used = false;
+    }
+
+    xSemaphoreGive(tracker.lock);
+}
+
+/**
+ * Add a latency histogram to a JSON object.
+ *
+ * @param[in,out] parent Object to add the histogram to.
+ * @param[in] name Key of the histogram.
+ * @param[in] hist Histogram to add.
+ * @return ESP_OK on success, ESP_FAIL on error
+ */
+static esp_err_t add_histogram(cJSON *parent, const char *name,
+                               const struct mqtt_metrics_histogram *hist)
+{
+    cJSON *obj = cJSON_CreateObject();
+    CJSON_CHECK(obj);
+    cJSON_AddItemToObject(parent, name, obj);
+
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "count", hist->count));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "mean",
+                                        hist->count ? (double)hist->sum_ms / hist->count : 0));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "max", hist->max_ms));
+
+    cJSON *buckets = cJSON_CreateArray();
+    CJSON_CHECK(buckets);
+    cJSON_AddItemToObject(obj, "hist", buckets);
+
+    for (int i = 0; i < MQTT_METRICS_HIST_BUCKETS; i++)
+    {
+        cJSON *bucket = cJSON_CreateNumber(hist->buckets[i]);
+        CJSON_CHECK(bucket);
+        cJSON_AddItemToArray(buckets, bucket);
+    }
+
+    return ESP_OK;
+
+exit:
+    /* No cleanup needed here as the parent object will handle deletion */
+    return ESP_FAIL;
+}
+
+/**
+ * Add the application outbox occupancy to a JSON object.
+ *
+ * @param[in,out] parent Object to add the occupancy to.
+ * @param[in] outbox Occupancy to add.
+ * @return ESP_OK on success, ESP_FAIL on error
+ */
+static esp_err_t add_outbox(cJSON *parent, const struct mqtt_metrics_outbox *outbox)
+{
+    cJSON *obj = cJSON_CreateObject();
+    CJSON_CHECK(obj);
+    cJSON_AddItemToObject(parent, "outbox", obj);
+
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "capacity", outbox->capacity));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "entries", outbox->entries));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "bytes", outbox->bytes));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "peak_bytes", outbox->peak_bytes));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "dropped", outbox->dropped));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "coalesced", outbox->coalesced));
+    CJSON_CHECK(cJSON_AddNumberToObject(obj, "requeued", outbox->requeued));
+
+    return ESP_OK;
+
+exit:
+    /* No cleanup needed here as the parent object will handle deletion */
+    return ESP_FAIL;
+}
+
+/**
+ * Task that builds and queues the diagnostics report each time the report timer expires.
+ *
+ * Reading the outbox size and queueing the report take the client's lock, which the MQTT task
+ * holds while it connects and does network I/O, so this is kept off the shared timer task.
+ *
+ * @param[in] arg User data passed to the task (unused)
+ */
+static void report_task(void *arg)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        char *data_buf = mqtt_metrics_to_json();
+        if (data_buf == NULL)
+        {
+            continue;
+        }
+
+        int msg_id = esp_mqtt_client_enqueue(tracker.client, tracker.report_topic, data_buf, 0, 0,
+                                             0, true);
+        ESP_LOGD(TAG, "Queued diagnostics: topic=%s, msg_id=%d, %s", tracker.report_topic, msg_id,
+                 data_buf);
+        free(data_buf);
+    }
+}
+
+/**
+ * Timer callback that wakes the report task. Never blocks the timer task.
+ *
+ * A report still being built when the timer expires again is not repeated.
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void report_timer_callback(void *arg)
+{
+    xTaskNotifyGive(tracker.report_task);
+}
+
+void mqtt_metrics_init(esp_mqtt_client_handle_t client)
+{
+    /* This shall only ever be initialised once. */
+    assert(tracker.client == NULL);
+    assert(client != NULL);
+
+    tracker.client = client;
+    tracker.lock = xSemaphoreCreateMutex();
+    assert(tracker.lock != NULL);
+
+    ESP_ERROR_CHECK(
+        esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL));
+}
+
+int mqtt_metrics_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                         int len, int qos, int retain)
+{
+    assert(client == tracker.client);
+
+    int64_t start_us = esp_timer_get_time();
+    int msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    int64_t send_us = esp_timer_get_time() - start_us;
+
+    xSemaphoreTake(tracker.lock, portMAX_DELAY);
+
+    if (msg_id < 0)
+    {
+        tracker.metrics.dropped++;
+    }
+    else
+    {
+        tracker.metrics.published++;
+        histogram_add(&tracker.metrics.send, send_us);
+        if (qos > 0)
+        {
+            int64_t ack_us;
+
+            if (take_early_ack(msg_id, start_us, &ack_us))
+            {
+                histogram_add(&tracker.metrics.ack, ack_us - start_us);
+            }
+            else
+            {
+                track_in_flight(msg_id, start_us);
+            }
+        }
+    }
+
+    xSemaphoreGive(tracker.lock);
+
+    return msg_id;
+}
+
+void mqtt_metrics_set_outbox(const struct mqtt_metrics_outbox *outbox)
+{
+    assert(tracker.client != NULL);
+    assert(outbox != NULL);
+
+    xSemaphoreTake(tracker.lock, portMAX_DELAY);
+    tracker.metrics.outbox = *outbox;
+    xSemaphoreGive(tracker.lock);
+}
+
+void mqtt_metrics_get(struct mqtt_metrics *metrics)
+{
+    assert(tracker.client != NULL);
+
+    xSemaphoreTake(tracker.lock, portMAX_DELAY);
+
+    *metrics = tracker.metrics;
+    metrics->in_flight = 0;
+    for (int i = 0; i < CONFIG_MQTT_METRICS_MAX_IN_FLIGHT; i++)
+    {
+        metrics->in_flight += tracker.in_flight[i].used;
+    }
+
+    xSemaphoreGive(tracker.lock);
+
+    metrics->outbox_bytes = esp_mqtt_client_get_outbox_size(tracker.client);
+}
+
+char *mqtt_metrics_to_json(void)
+{
+    struct mqtt_metrics metrics;
+    char *data_buf = NULL;
+
+    mqtt_metrics_get(&metrics);
+
+    cJSON *root = cJSON_CreateObject();
+    CJSON_CHECK(root);
+
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "published", metrics.published));
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "delivered", metrics.delivered));
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "dropped", metrics.dropped));
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "untracked", metrics.untracked));
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "in_flight", metrics.in_flight));
+    CJSON_CHECK(cJSON_AddNumberToObject(root, "outbox_bytes", metrics.outbox_bytes));
+
+    if (metrics.outbox.capacity > 0 && add_outbox(root, &metrics.outbox) != ESP_OK)
+    {
+        goto exit;
+    }
+
+    if (add_histogram(root, "send_ms", &metrics.send) != ESP_OK
+        || add_histogram(root, "ack_ms", &metrics.ack) != ESP_OK)
+    {
+        goto exit;
+    }
+
+    data_buf = cJSON_PrintUnformatted(root);
+    CJSON_CHECK(data_buf);
+
+exit:
+    /* Cleanup */
+    if (root != NULL)
+    {
+        cJSON_Delete(root);
+    }
+
+    return data_buf;
+}
+
+void mqtt_metrics_start_reporting(const char *topic)
+{
+    assert(tracker.client != NULL);
+    assert(topic != NULL);
+
+    if (CONFIG_MQTT_METRICS_REPORT_INTERVAL_MS == 0 || tracker.report_timer != NULL)
+    {
+        return;
+    }
+
+    tracker.report_topic = topic;
+
+    if (xTaskCreate(report_task, "metrics_report", REPORT_TASK_STACK_SIZE, NULL,
+                    REPORT_TASK_PRIORITY, &tracker.report_task)
+        != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the report task, diagnostics disabled");
+        return;
+    }
+
+    const esp_timer_create_args_t timer_args = {.callback = &report_timer_callback,
+                                                .name = "metrics_report"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &tracker.report_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(tracker.report_timer,
+                                             (uint64_t)CONFIG_MQTT_METRICS_REPORT_INTERVAL_MS
+                                                 * 1000));
+
+    ESP_LOGI(TAG, "Publishing diagnostics on %s every %d ms", topic,
+             CONFIG_MQTT_METRICS_REPORT_INTERVAL_MS);
+}
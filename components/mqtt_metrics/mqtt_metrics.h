@@ -0,0 +1,143 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Publish latency and delivery metrics for an esp-mqtt client.
+ *
+ * Publishes made through @ref mqtt_metrics_publish are timed in two stages:
+ *
+ * - Send latency: time spent in @c esp_mqtt_client_publish, i.e. until the message has been written
+ *   to the TCP socket or queued in the outbox. A long send latency points at the device or the link.
+ * - Acknowledgement latency (QoS 1/2 only): time from the publish call until the matching
+ *   @c MQTT_EVENT_PUBLISHED event. A long acknowledgement latency with a short send latency points
+ *   at the broker or the path beyond the access point.
+ *
+ * Latencies are collected in histograms with power of two millisecond buckets. Counters for
+ * published, delivered and dropped messages, the number of messages in flight and the size of the
+ * client's outbox are kept alongside, as is the occupancy of an application outbox queueing
+ * messages ahead of the client. There is a single tracker per application.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "mqtt_client.h"
+
+/** Number of latency histogram buckets. Bucket i counts latencies below 2^i ms, the last the rest. */
+#define MQTT_METRICS_HIST_BUCKETS 12
+
+/** Latency histogram. */
+struct mqtt_metrics_histogram
+{
+    /** Sample counts per bucket. */
+    uint32_t buckets[MQTT_METRICS_HIST_BUCKETS];
+    /** Number of samples. */
+    uint32_t count;
+    /** Sum of all samples in milliseconds, for the mean. */
+    uint64_t sum_ms;
+    /** Largest sample in milliseconds. */
+    uint32_t max_ms;
+};
+
+/** Occupancy of an application level outbox, such as the one of the mqtt_outbox component. */
+struct mqtt_metrics_outbox
+{
+    /** Capacity in bytes, or 0 if no outbox has reported. */
+    uint32_t capacity;
+    /** Messages held, queued or in flight. */
+    uint32_t entries;
+    /** Bytes held. */
+    uint32_t bytes;
+    /** Largest number of bytes held since boot. */
+    uint32_t peak_bytes;
+    /** Messages dropped by the overflow policy. */
+    uint32_t dropped;
+    /** Queued messages replaced by a newer message on the same topic. */
+    uint32_t coalesced;
+    /** Messages queued again after the client deleted them or the broker lost the session. */
+    uint32_t requeued;
+};
+
+/** Snapshot of the publish metrics. */
+struct mqtt_metrics
+{
+    /** Publishes accepted by the client. */
+    uint32_t published;
+    /** QoS 1/2 publishes acknowledged by the broker. */
+    uint32_t delivered;
+    /** Publishes rejected by the client or deleted from the outbox before being delivered. */
+    uint32_t dropped;
+    /** Acknowledgements that could not be matched to a tracked publish. */
+    uint32_t untracked;
+    /** QoS 1/2 publishes waiting for an acknowledgement. */
+    uint32_t in_flight;
+    /** Bytes held in the client's outbox, or -1 if unknown. */
+    int outbox_bytes;
+    /** Occupancy of the application outbox, as last reported with @ref mqtt_metrics_set_outbox. */
+    struct mqtt_metrics_outbox outbox;
+    /** Time spent in the publish call. */
+    struct mqtt_metrics_histogram send;
+    /** Time from the publish call to the broker's acknowledgement. */
+    struct mqtt_metrics_histogram ack;
+};
+
+/**
+ * Initialize the tracker for an MQTT client and register for its events.
+ *
+ * Must be called once, before the first call to @ref mqtt_metrics_publish.
+ *
+ * @param[in] client MQTT client to track.
+ */
+void mqtt_metrics_init(esp_mqtt_client_handle_t client);
+
+/**
+ * Publish a message with @c esp_mqtt_client_publish and track it.
+ *
+ * Takes the same arguments and returns the same value as @c esp_mqtt_client_publish.
+ *
+ * @param[in] client MQTT client, as passed to @ref mqtt_metrics_init.
+ * @param[in] topic Topic to publish on.
+ * @param[in] data Message payload.
+ * @param[in] len Length of @p data, or 0 to use @c strlen.
+ * @param[in] qos Quality of service.
+ * @param[in] retain Retain flag.
+ * @return Message ID of the publish, 0 for QoS 0, -1 on failure.
+ */
+int mqtt_metrics_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                         int len, int qos, int retain);
+
+/**
+ * Report the occupancy of an application outbox, to be included in the metrics.
+ *
+ * @param[in] outbox Current occupancy.
+ */
+void mqtt_metrics_set_outbox(const struct mqtt_metrics_outbox *outbox);
+
+/**
+ * Take a snapshot of the metrics.
+ *
+ * @param[out] metrics Current metrics.
+ */
+void mqtt_metrics_get(struct mqtt_metrics *metrics);
+
+/**
+ * Format the metrics as a JSON object.
+ *
+ * @return Null terminated JSON string which the caller must free, or NULL on error.
+ */
+char *mqtt_metrics_to_json(void);
+
+/**
+ * Start publishing the metrics as JSON on @p topic every CONFIG_MQTT_METRICS_REPORT_INTERVAL_MS.
+ *
+ * Does nothing if the interval is 0. The timer only wakes a low priority task, which builds the
+ * report and queues it in the client's outbox at QoS 0, so a client busy reconnecting never holds
+ * up other esp_timer callbacks. Reports are not tracked themselves.
+ *
+ * @param[in] topic Diagnostics topic. Must remain valid while reporting.
+ */
+void mqtt_metrics_start_reporting(const char *topic);
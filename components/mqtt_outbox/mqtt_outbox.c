@@ -0,0 +1,411 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "mqtt_metrics.h"
+#include "mqtt_outbox.h"
+
+static const char *TAG = "mqtt_outbox";
+
+/** Message ID of an entry that is queued and not yet handed to the client. */
+#define MSG_ID_QUEUED 0
+
+/** Message ID of an entry that is being handed to the client. */
+#define MSG_ID_SENDING -1
+
+/** A message held in the outbox. */
+struct outbox_entry
+{
+    /** Link in @c outbox.entries. */
+    STAILQ_ENTRY(outbox_entry) link;
+    /** Message ID while in flight, @ref MSG_ID_QUEUED or @ref MSG_ID_SENDING. */
+    int msg_id;
+    /** Retain flag. */
+    bool retain;
+    /** Size of the entry counted against the capacity, including the topic and payload. */
+    size_t size;
+    /** Length of the payload in bytes. */
+    size_t len;
+    /** Null terminated topic, stored after the payload. */
+    char *topic;
+    /** Payload. */
+    char data[];
+};
+
+STAILQ_HEAD(outbox_list, outbox_entry);
+
+/** Outbox state. */
+static struct mqtt_outbox
+{
+    /** MQTT client messages are published with. */
+    esp_mqtt_client_handle_t client;
+    /** Protects everything below. Never held while calling into the client. */
+    SemaphoreHandle_t lock;
+    /** Messages in the order they were queued. */
+    struct outbox_list entries;
+    /** Whether the client is connected. */
+    bool connected;
+    /** Whether a task is handing messages to the client, see @ref outbox_flush. */
+    bool sending;
+    /** Message ID of an event that arrived for the message being handed to the client. */
+    int early_msg_id;
+    /** The event that arrived for @c early_msg_id. */
+    esp_mqtt_event_id_t early_event;
+    /** Occupancy, reported to the metrics tracker. */
+    struct mqtt_metrics_outbox stats;
+} outbox = {};
+
+/**
+ * Count the entries handed to the client. Must be called with the lock held.
+ *
+ * @return Number of entries in flight or being sent.
+ */
+static uint32_t in_flight_count(void)
+{
+    uint32_t count = 0;
+    struct outbox_entry *entry;
+
+    STAILQ_FOREACH(entry, &outbox.entries, link)
+    {
+        count += entry->msg_id != MSG_ID_QUEUED;
+    }
+
+    return count;
+}
+
+/**
+ * Find the oldest entry that has not been handed to the client. Must be called with the lock held.
+ *
+ * @param[in] topic Only consider entries on this topic, or NULL for any topic.
+ * @return The entry, or NULL if there is none.
+ */
+static struct outbox_entry *find_queued(const char *topic)
+{
+    struct outbox_entry *entry;
+
+    STAILQ_FOREACH(entry, &outbox.entries, link)
+    {
+        if (entry->msg_id == MSG_ID_QUEUED && (topic == NULL || strcmp(entry->topic, topic) == 0))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the entry in flight with a message ID. Must be called with the lock held.
+ *
+ * @param[in] msg_id Message ID to look for.
+ * @return The entry, or NULL if no message in flight has this ID.
+ */
+static struct outbox_entry *find_in_flight(int msg_id)
+{
+    struct outbox_entry *entry;
+
+    STAILQ_FOREACH(entry, &outbox.entries, link)
+    {
+        if (msg_id > 0 && entry->msg_id == msg_id)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Remove an entry from the outbox and free it. Must be called with the lock held.
+ *
+ * @param[in] entry Entry to remove.
+ */
+static void entry_remove(struct outbox_entry *entry)
+{
+    STAILQ_REMOVE(&outbox.entries, entry, outbox_entry, link);
+    outbox.stats.entries--;
+    outbox.stats.bytes -= entry->size;
+    heap_caps_free(entry);
+}
+
+/**
+ * Apply the client's verdict on a message in flight. Must be called with the lock held.
+ *
+ * @param[in] entry Entry the event is for.
+ * @param[in] event_id @c MQTT_EVENT_PUBLISHED to remove the entry, @c MQTT_EVENT_DELETED to queue
+ *                     it again.
+ */
+static void entry_settle(struct outbox_entry *entry, esp_mqtt_event_id_t event_id)
+{
+    if (event_id == MQTT_EVENT_PUBLISHED)
+    {
+        entry_remove(entry);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "msg_id=%d deleted by the client, queued again", entry->msg_id);
+        entry->msg_id = MSG_ID_QUEUED;
+        outbox.stats.requeued++;
+    }
+}
+
+/**
+ * Report the occupancy to the metrics tracker. Must be called with the lock held.
+ */
+static void stats_report(void)
+{
+    if (outbox.stats.bytes > outbox.stats.peak_bytes)
+    {
+        outbox.stats.peak_bytes = outbox.stats.bytes;
+    }
+
+    mqtt_metrics_set_outbox(&outbox.stats);
+}
+
+/**
+ * Hand queued messages to the client until the window is full.
+ *
+ * Only one task sends at a time. The lock is released around each publish, since the client
+ * dispatches its events, and so calls @ref mqtt_event_handler, with its own lock held. An
+ * acknowledgement can therefore be handled before the publish call has returned the message ID it
+ * is for; the handler keeps it in @c early_msg_id for the sending task to apply.
+ */
+static void outbox_flush(void)
+{
+    xSemaphoreTake(outbox.lock, portMAX_DELAY);
+
+    /* The task already sending picks up whatever has changed when it takes the lock again */
+    if (outbox.sending)
+    {
+        xSemaphoreGive(outbox.lock);
+        return;
+    }
+    outbox.sending = true;
+
+    struct outbox_entry *entry;
+    while (outbox.connected && in_flight_count() < CONFIG_MQTT_OUTBOX_WINDOW
+           && (entry = find_queued(NULL)) != NULL)
+    {
+        entry->msg_id = MSG_ID_SENDING;
+        outbox.early_msg_id = 0;
+        xSemaphoreGive(outbox.lock);
+
+        int msg_id = mqtt_metrics_publish(outbox.client, entry->topic, entry->data, entry->len, 1,
+                                          entry->retain);
+
+        xSemaphoreTake(outbox.lock, portMAX_DELAY);
+
+        if (msg_id <= 0)
+        {
+            /* Not connected any more, or the client's outbox is full. Retried on the next event */
+            ESP_LOGD(TAG, "Publish on %s failed, %d", entry->topic, msg_id);
+            entry->msg_id = MSG_ID_QUEUED;
+            break;
+        }
+
+        entry->msg_id = msg_id;
+        if (outbox.early_msg_id == msg_id)
+        {
+            entry_settle(entry, outbox.early_event);
+        }
+    }
+
+    outbox.sending = false;
+    stats_report();
+    xSemaphoreGive(outbox.lock);
+}
+
+/**
+ * Make room for an entry of @p size bytes according to the overflow policy. Must be called with
+ * the lock held.
+ *
+ * @param[in] topic Topic of the new entry.
+ * @param[in] size Size of the new entry.
+ * @return true if the entry fits.
+ */
+static bool outbox_make_room(const char *topic, size_t size)
+{
+    struct outbox_entry *victim;
+
+#if CONFIG_MQTT_OUTBOX_OVERFLOW_COALESCE
+    victim = find_queued(topic);
+    if (victim != NULL)
+    {
+        entry_remove(victim);
+        outbox.stats.coalesced++;
+    }
+#endif
+
+    while (outbox.stats.bytes + size > CONFIG_MQTT_OUTBOX_CAPACITY)
+    {
+#if CONFIG_MQTT_OUTBOX_OVERFLOW_DROP_NEWEST
+        victim = NULL;
+#else
+        victim = find_queued(NULL);
+#endif
+        if (victim == NULL)
+        {
+            return false;
+        }
+
+        ESP_LOGD(TAG, "Outbox full, dropping %u bytes on %s", victim->len, victim->topic);
+        entry_remove(victim);
+        outbox.stats.dropped++;
+    }
+
+    return true;
+}
+
+/**
+ * Event handler registered to receive MQTT events
+ *
+ * Tracks the connection and settles messages in flight on @c MQTT_EVENT_PUBLISHED and
+ * @c MQTT_EVENT_DELETED, then hands more messages to the client.
+ *
+ * @param[in] handler_args User data registered to the event (unused)
+ * @param[in] base Event base for the handler
+ * @param[in] event_id The id for the received event
+ * @param[in] event_data The data for the event, esp_mqtt_event_handle_t
+ */
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                               void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    struct outbox_entry *entry;
+
+    xSemaphoreTake(outbox.lock, portMAX_DELAY);
+
+    switch ((esp_mqtt_event_id_t)event_id)
+    {
+    case MQTT_EVENT_CONNECTED:
+        outbox.connected = true;
+        if (!event->session_present)
+        {
+            /* The broker has no record of the messages in flight, so send them again */
+            STAILQ_FOREACH(entry, &outbox.entries, link)
+            {
+                if (entry->msg_id > 0)
+                {
+                    entry->msg_id = MSG_ID_QUEUED;
+                    outbox.stats.requeued++;
+                }
+            }
+        }
+        ESP_LOGI(TAG, "Connected (session %s), %lu messages, %lu bytes queued",
+                 event->session_present ? "resumed" : "new", outbox.stats.entries,
+                 outbox.stats.bytes);
+        break;
+
+    case MQTT_EVENT_DISCONNECTED:
+        outbox.connected = false;
+        break;
+
+    case MQTT_EVENT_PUBLISHED:
+    case MQTT_EVENT_DELETED:
+        entry = find_in_flight(event->msg_id);
+        if (entry != NULL)
+        {
+            entry_settle(entry, event_id);
+        }
+        else if (outbox.sending)
+        {
+            outbox.early_msg_id = event->msg_id;
+            outbox.early_event = event_id;
+        }
+        break;
+
+    default:
+        xSemaphoreGive(outbox.lock);
+        return;
+    }
+
+    stats_report();
+    xSemaphoreGive(outbox.lock);
+
+    outbox_flush();
+}
+
+void mqtt_outbox_init(esp_mqtt_client_handle_t client)
+{
+    /* This shall only ever be initialised once. */
+    assert(outbox.client == NULL);
+    assert(client != NULL);
+
+    outbox.client = client;
+    outbox.lock = xSemaphoreCreateMutex();
+    assert(outbox.lock != NULL);
+    STAILQ_INIT(&outbox.entries);
+    outbox.stats.capacity = CONFIG_MQTT_OUTBOX_CAPACITY;
+    mqtt_metrics_set_outbox(&outbox.stats);
+
+    ESP_ERROR_CHECK(
+        esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL));
+
+    ESP_LOGI(TAG, "Outbox of %d bytes, %d messages in flight", CONFIG_MQTT_OUTBOX_CAPACITY,
+             CONFIG_MQTT_OUTBOX_WINDOW);
+}
+
+esp_err_t mqtt_outbox_publish(const char *topic, const void *data, size_t len, bool retain)
+{
+    assert(outbox.client != NULL);
+    assert(topic != NULL);
+
+    size_t topic_len = strlen(topic);
+    size_t size = sizeof(struct outbox_entry) + len + topic_len + 1;
+    if (size > CONFIG_MQTT_OUTBOX_CAPACITY)
+    {
+        ESP_LOGE(TAG, "Message of %u bytes on %s does not fit in the outbox", len, topic);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(outbox.lock, portMAX_DELAY);
+
+    struct outbox_entry *entry = NULL;
+    if (outbox_make_room(topic, size))
+    {
+        /* The capacity bounds PSRAM use; without PSRAM it bounds internal RAM use instead */
+        entry = heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+                                        MALLOC_CAP_DEFAULT);
+    }
+
+    if (entry == NULL)
+    {
+        ESP_LOGW(TAG, "Outbox full, dropping %u bytes on %s", len, topic);
+        outbox.stats.dropped++;
+        stats_report();
+        xSemaphoreGive(outbox.lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    entry->msg_id = MSG_ID_QUEUED;
+    entry->retain = retain;
+    entry->size = size;
+    entry->len = len;
+    entry->topic = entry->data + len;
+    memcpy(entry->data, data, len);
+    memcpy(entry->topic, topic, topic_len + 1);
+
+    STAILQ_INSERT_TAIL(&outbox.entries, entry, link);
+    outbox.stats.entries++;
+    outbox.stats.bytes += size;
+    stats_report();
+
+    xSemaphoreGive(outbox.lock);
+
+    outbox_flush();
+
+    return ESP_OK;
+}
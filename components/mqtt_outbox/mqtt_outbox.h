@@ -0,0 +1,55 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * Bounded outbox delivering messages at least once over an esp-mqtt client.
+ *
+ * esp-mqtt keeps every QoS 1 publish in its own outbox, in internal RAM, until it is
+ * acknowledged, and publishes made while disconnected either fail or pile up there with no limit.
+ * Over a long outage that exhausts the heap. This outbox holds messages in PSRAM, when available,
+ * up to a fixed capacity and hands at most @c CONFIG_MQTT_OUTBOX_WINDOW of them at a time to the
+ * client, published at QoS 1. A message leaves the outbox when the broker acknowledges it. If the
+ * client deletes it unacknowledged, or the broker did not keep the session over a reconnect, it is
+ * queued again, so it may be delivered more than once but is not lost unless the overflow policy
+ * drops it.
+ *
+ * Occupancy and drops are reported to the mqtt_metrics tracker, see @ref mqtt_metrics_outbox.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+ * Set up the outbox for an MQTT client and register for its events.
+ *
+ * Must be called once, after @c mqtt_metrics_init and before the client is started. With
+ * @c CONFIG_MQTT_OUTBOX_PERSISTENT_SESSION the client must have been configured with
+ * @c session.disable_clean_session set.
+ *
+ * @param[in] client MQTT client to publish with.
+ */
+void mqtt_outbox_init(esp_mqtt_client_handle_t client);
+
+/**
+ * Queue a message for delivery at QoS 1.
+ *
+ * The message is copied, and published straight away if the client is connected and fewer than
+ * @c CONFIG_MQTT_OUTBOX_WINDOW messages are in flight. Otherwise it is published once earlier
+ * messages have been acknowledged.
+ *
+ * @param[in] topic Topic to publish on.
+ * @param[in] data Message payload.
+ * @param[in] len Length of @p data in bytes.
+ * @param[in] retain Ask the broker to retain the message.
+ * @return ESP_OK if the message was queued, ESP_ERR_INVALID_SIZE if it is larger than the outbox,
+ *         ESP_ERR_NO_MEM if the overflow policy rejected it or it could not be allocated.
+ */
+esp_err_t mqtt_outbox_publish(const char *topic, const void *data, size_t len, bool retain);
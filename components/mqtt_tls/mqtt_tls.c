@@ -0,0 +1,833 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/ssl.h"
+#include "nvs.h"
+#if CONFIG_MQTT_TLS_VERIFY_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+
+#include "mqtt_tls.h"
+
+static const char *TAG = "mqtt_tls";
+
+/* Macro for mbedtls error checking during setup, which only fails on bad configuration */
+#define MBEDTLS_CHECK(x)                                                                \
+    do                                                                                  \
+    {                                                                                   \
+        int _ret = (x);                                                                 \
+        if (_ret != 0)                                                                  \
+        {                                                                               \
+            ESP_LOGE(TAG, "mbedtls error -0x%04x at %s:%d", -_ret, __FILE__, __LINE__); \
+            abort();                                                                    \
+        }                                                                               \
+    } while (0)
+
+/** Default port for MQTT over TLS. */
+#define MQTT_TLS_DEFAULT_PORT 8883
+
+/** Marks a valid entry in the session cache. */
+#define SESSION_CACHE_MAGIC 0x544c5353
+
+/** NVS namespace and key the session is stored under. */
+#define SESSION_NVS_NAMESPACE "mqtt_tls"
+#define SESSION_NVS_KEY "session"
+
+/** A serialized TLS session. */
+struct session_cache
+{
+    /** @ref SESSION_CACHE_MAGIC if the entry holds a session. */
+    uint32_t magic;
+    /** Length of @c data in bytes. */
+    uint32_t len;
+    /** CRC-32 of @c data, as RTC memory is not cleared on power up. */
+    uint32_t crc;
+    /** Session serialized with @c mbedtls_ssl_session_save. */
+    uint8_t data[CONFIG_MQTT_TLS_SESSION_MAX_LEN];
+};
+
+/** Connection state, the context data of the transport. */
+struct tls_conn
+{
+    /** Socket, or -1 if not connected. */
+    int fd;
+    /** Whether @c ssl has been set up and needs freeing. */
+    bool ssl_active;
+    /** TLS context of the connection. */
+    mbedtls_ssl_context ssl;
+    /** TLS configuration shared by every connection. */
+    mbedtls_ssl_config conf;
+#if CONFIG_MQTT_TLS_VERIFY_CA
+    /** CA certificate the broker's certificate must be signed by. */
+    mbedtls_x509_crt ca;
+#endif
+#if CONFIG_MQTT_TLS_AUTH_PSK
+    /** Pre-shared key, decoded from hex. */
+    uint8_t psk[64];
+#endif
+    /** Bytes sent on the socket since the connect. */
+    size_t tx_bytes;
+    /** Bytes received on the socket since the connect. */
+    size_t rx_bytes;
+};
+
+#if CONFIG_MQTT_TLS_SESSION_CACHE_RTC
+/** Session cache, kept across deep sleep and software resets. */
+static RTC_NOINIT_ATTR struct session_cache session_cache;
+#else
+/** Session cache, or the copy of the one in NVS. */
+static struct session_cache session_cache;
+#endif
+
+#if CONFIG_MQTT_TLS_SESSION_CACHE_NVS
+/** Whether @c session_cache has been loaded from NVS. */
+static bool session_cache_loaded;
+#endif
+
+/** Protects @c session_cache and @c stats. */
+static SemaphoreHandle_t lock;
+
+/** Handshake statistics. */
+static struct mqtt_tls_stats stats;
+
+#if CONFIG_MQTT_TLS_AUTH_PSK
+/** ECDHE-PSK cipher suites, preferring AES as the ESP32 accelerates it. */
+static const int psk_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_PSK_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+    0,
+};
+#endif
+
+#if CONFIG_MQTT_TLS_VERIFY_CA
+/** CA certificate, embedded from CONFIG_MQTT_TLS_CA_CERT_PATH. */
+extern const uint8_t ca_pem_start[] asm("_binary_mqtt_tls_ca_pem_start");
+extern const uint8_t ca_pem_end[] asm("_binary_mqtt_tls_ca_pem_end");
+#endif
+
+/**
+ * Check whether the session cache holds a session. Must be called with @c lock held.
+ *
+ * @return true if @c session_cache holds a session.
+ */
+static bool session_cache_valid(void)
+{
+#if CONFIG_MQTT_TLS_SESSION_CACHE_NVS
+    if (!session_cache_loaded)
+    {
+        nvs_handle_t nvs;
+        size_t len = sizeof(session_cache);
+
+        session_cache_loaded = true;
+        if (nvs_open(SESSION_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+        {
+            if (nvs_get_blob(nvs, SESSION_NVS_KEY, &session_cache, &len) != ESP_OK
+                || len != sizeof(session_cache))
+            {
+                session_cache.magic = 0;
+            }
+            nvs_close(nvs);
+        }
+    }
+#endif
+
+    return session_cache.magic == SESSION_CACHE_MAGIC
+           && session_cache.len <= sizeof(session_cache.data)
+           && esp_rom_crc32_le(0, session_cache.data, session_cache.len) == session_cache.crc;
+}
+
+/**
+ * Write the session cache back to NVS if that is where it is kept. Must be called with @c lock
+ * held.
+ */
+static void session_cache_commit(void)
+{
+#if CONFIG_MQTT_TLS_SESSION_CACHE_NVS
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(SESSION_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, SESSION_NVS_KEY, &session_cache, sizeof(session_cache));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store session in NVS: %s", esp_err_to_name(err));
+    }
+#endif
+}
+
+/** Length of a TLS 1.2 master secret. */
+#define SESSION_MASTER_LEN 48
+
+/**
+ * Check whether two sessions are the same negotiated session with the same means of resuming it.
+ *
+ * The session ID is not compared: when resuming from a ticket the client offers a fresh random ID
+ * that the server echoes (RFC 5077 section 3.4), so it changes on every handshake.
+ *
+ * @return true if @p a and @p b have the same master secret and ticket.
+ */
+static bool session_same(const mbedtls_ssl_session *a, const mbedtls_ssl_session *b)
+{
+    if (memcmp(a->MBEDTLS_PRIVATE(master), b->MBEDTLS_PRIVATE(master), SESSION_MASTER_LEN) != 0)
+    {
+        return false;
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+    size_t ticket_len = a->MBEDTLS_PRIVATE(ticket_len);
+
+    if (ticket_len != b->MBEDTLS_PRIVATE(ticket_len)
+        || (ticket_len > 0
+            && memcmp(a->MBEDTLS_PRIVATE(ticket), b->MBEDTLS_PRIVATE(ticket), ticket_len) != 0))
+    {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/**
+ * Load the cached session. Must be called with @c lock held.
+ *
+ * @param[out] session Initialised session to load into.
+ * @return true if a session was loaded.
+ */
+static bool session_cache_load(mbedtls_ssl_session *session)
+{
+    return session_cache_valid()
+           && mbedtls_ssl_session_load(session, session_cache.data, session_cache.len) == 0;
+}
+
+/**
+ * Offer the cached session, if any, on a new connection.
+ *
+ * @param[in,out] ssl TLS context, set up but before the handshake.
+ * @param[out] master Master secret of the session offered.
+ * @return true if a session was offered.
+ */
+static bool session_offer(mbedtls_ssl_context *ssl, unsigned char master[SESSION_MASTER_LEN])
+{
+    mbedtls_ssl_session session;
+    bool offered = false;
+
+    mbedtls_ssl_session_init(&session);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (session_cache_load(&session) && mbedtls_ssl_set_session(ssl, &session) == 0)
+    {
+        memcpy(master, session.MBEDTLS_PRIVATE(master), SESSION_MASTER_LEN);
+        offered = true;
+    }
+    xSemaphoreGive(lock);
+
+    mbedtls_ssl_session_free(&session);
+    return offered;
+}
+
+/**
+ * Cache the session of a connection after its handshake.
+ *
+ * A resumed handshake keeps the master secret of the session offered, whether it was resumed from
+ * the session ID or from a ticket. The cache is only written when the master secret or the ticket
+ * changed, so resumed handshakes do not wear the flash when it is kept in NVS, unless the broker
+ * issued a new ticket.
+ *
+ * @param[in] ssl TLS context, after a successful handshake.
+ * @param[in] offered_master Master secret of the session offered, NULL if none was offered.
+ * @return true if the handshake resumed the offered session.
+ */
+static bool session_store(mbedtls_ssl_context *ssl, const unsigned char *offered_master)
+{
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session cached;
+    bool resumed = false;
+    uint8_t *data = NULL;
+    size_t len;
+
+    mbedtls_ssl_session_init(&session);
+    mbedtls_ssl_session_init(&cached);
+    if (mbedtls_ssl_get_session(ssl, &session) != 0)
+    {
+        goto exit;
+    }
+
+    resumed = offered_master != NULL
+              && memcmp(session.MBEDTLS_PRIVATE(master), offered_master, SESSION_MASTER_LEN) == 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool unchanged = session_cache_load(&cached) && session_same(&session, &cached);
+    xSemaphoreGive(lock);
+    if (unchanged)
+    {
+        goto exit;
+    }
+
+    data = malloc(sizeof(session_cache.data));
+    if (data == NULL)
+    {
+        goto exit;
+    }
+
+    int ret = mbedtls_ssl_session_save(&session, data, sizeof(session_cache.data), &len);
+    if (ret == 0)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        memcpy(session_cache.data, data, len);
+        session_cache.len = len;
+        session_cache.crc = esp_rom_crc32_le(0, data, len);
+        session_cache.magic = SESSION_CACHE_MAGIC;
+        session_cache_commit();
+        xSemaphoreGive(lock);
+        ESP_LOGD(TAG, "Cached %u byte session", len);
+    }
+    else if (ret == MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL)
+    {
+        ESP_LOGW(TAG, "Session does not fit in %u bytes, not cached", sizeof(session_cache.data));
+    }
+
+exit:
+    if (data != NULL)
+    {
+        mbedtls_platform_zeroize(data, sizeof(session_cache.data));
+        free(data);
+    }
+    mbedtls_ssl_session_free(&cached);
+    mbedtls_ssl_session_free(&session);
+    return resumed;
+}
+
+void mqtt_tls_session_clear(void)
+{
+    assert(lock != NULL);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (session_cache_valid())
+    {
+        session_cache.magic = 0;
+        session_cache_commit();
+    }
+    xSemaphoreGive(lock);
+}
+
+/**
+ * Random number generator for mbedtls, using the hardware RNG.
+ */
+static int tls_random(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
+
+/**
+ * mbedtls send callback, counting the bytes sent.
+ */
+static int tls_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct tls_conn *conn = ctx;
+    int ret = send(conn->fd, buf, len, 0);
+
+    if (ret < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_TIMEOUT
+                                                          : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+
+    conn->tx_bytes += ret;
+    return ret;
+}
+
+/**
+ * mbedtls receive callback, counting the bytes received.
+ */
+static int tls_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    struct tls_conn *conn = ctx;
+    int ret = recv(conn->fd, buf, len, 0);
+
+    if (ret < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_TIMEOUT
+                                                          : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+
+    conn->rx_bytes += ret;
+    return ret;
+}
+
+/**
+ * Wait for a socket to become readable or writable.
+ *
+ * @param[in] fd Socket.
+ * @param[in] write Wait for writable rather than readable.
+ * @param[in] timeout_ms Time to wait in milliseconds, -1 to wait forever.
+ * @return 1 if ready, 0 on timeout, -1 on error.
+ */
+static int socket_poll(int fd, bool write, int timeout_ms)
+{
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    fd_set fds;
+    fd_set errfds;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    FD_ZERO(&errfds);
+    FD_SET(fd, &errfds);
+
+    int ret = select(fd + 1, write ? NULL : &fds, write ? &fds : NULL, &errfds,
+                     timeout_ms < 0 ? NULL : &tv);
+    if (ret > 0 && FD_ISSET(fd, &errfds))
+    {
+        return -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Open a TCP connection.
+ *
+ * @param[in] host Host name or address.
+ * @param[in] port Port.
+ * @param[in] timeout_ms Time allowed for the connect, also used for every later send and receive.
+ * @return Socket, or -1 on failure.
+ */
+static int tcp_connect(const char *host, int port, int timeout_ms)
+{
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res = NULL;
+    char port_str[6];
+    int fd = -1;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0 || res == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to resolve %s", host);
+        goto exit;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0)
+    {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d", errno);
+        goto exit;
+    }
+
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* Connect without blocking so the timeout applies */
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) != 0
+        && (errno != EINPROGRESS || socket_poll(fd, true, timeout_ms) <= 0
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0))
+    {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d: errno %d", host, port, err ? err : errno);
+        close(fd);
+        fd = -1;
+        goto exit;
+    }
+    fcntl(fd, F_SETFL, flags);
+
+exit:
+    if (res != NULL)
+    {
+        freeaddrinfo(res);
+    }
+    return fd;
+}
+
+/**
+ * Record the outcome of a connection attempt.
+ *
+ * @param[in] conn Connection.
+ * @param[in] ok Whether the handshake completed.
+ * @param[in] resumed Whether it resumed a cached session.
+ * @param[in] tcp_us Time taken by the TCP connect.
+ * @param[in] handshake_us Time taken by the handshake.
+ */
+static void stats_record(const struct tls_conn *conn, bool ok, bool resumed, int64_t tcp_us,
+                         int64_t handshake_us)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!ok)
+    {
+        stats.failed++;
+    }
+    else if (resumed)
+    {
+        stats.resumed++;
+        stats.resumed_us += handshake_us;
+    }
+    else
+    {
+        stats.full++;
+        stats.full_us += handshake_us;
+    }
+    stats.last_tcp_us = tcp_us;
+    stats.last_handshake_us = handshake_us;
+    stats.last_tx_bytes = conn->tx_bytes;
+    stats.last_rx_bytes = conn->rx_bytes;
+    xSemaphoreGive(lock);
+
+    if (ok)
+    {
+        ESP_LOGI(TAG, "%s handshake: %lld ms, tx %u bytes, rx %u bytes (TCP connect %lld ms)",
+                 resumed ? "Resumed" : "Full", handshake_us / 1000, conn->tx_bytes,
+                 conn->rx_bytes, tcp_us / 1000);
+    }
+}
+
+/**
+ * Close the connection. Safe to call when not connected.
+ */
+static int tls_close(esp_transport_handle_t t)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    if (conn->ssl_active)
+    {
+        if (conn->fd >= 0)
+        {
+            mbedtls_ssl_close_notify(&conn->ssl);
+        }
+        mbedtls_ssl_free(&conn->ssl);
+        conn->ssl_active = false;
+    }
+
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Check whether a handshake failed because the broker rejected it, rather than the link.
+ *
+ * Only then may the offered session be the cause. A timeout or socket error on a lossy link says
+ * nothing about the session, which can still be resumed on the next attempt.
+ *
+ * @param[in] ret Error returned by the handshake.
+ * @return true for a fatal alert from the broker or an SSL protocol error.
+ */
+static bool handshake_rejected(int ret)
+{
+    switch (ret)
+    {
+    case MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE:
+    case MBEDTLS_ERR_SSL_HANDSHAKE_FAILURE:
+    case MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE:
+    case MBEDTLS_ERR_SSL_INVALID_MAC:
+    case MBEDTLS_ERR_SSL_INVALID_RECORD:
+    case MBEDTLS_ERR_SSL_DECODE_ERROR:
+    case MBEDTLS_ERR_SSL_ILLEGAL_PARAMETER:
+    case MBEDTLS_ERR_SSL_BAD_PROTOCOL_VERSION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Connect to the broker and run the TLS handshake, offering the cached session.
+ */
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+    unsigned char offered_master[SESSION_MASTER_LEN];
+    bool offered;
+    bool resumed = false;
+    int ret;
+
+    tls_close(t);
+    conn->tx_bytes = 0;
+    conn->rx_bytes = 0;
+
+    int64_t start_us = esp_timer_get_time();
+    conn->fd = tcp_connect(host, port, timeout_ms);
+    int64_t tcp_us = esp_timer_get_time() - start_us;
+    if (conn->fd < 0)
+    {
+        stats_record(conn, false, false, tcp_us, 0);
+        return -1;
+    }
+
+    mbedtls_ssl_init(&conn->ssl);
+    conn->ssl_active = true;
+    ret = mbedtls_ssl_setup(&conn->ssl, &conn->conf);
+#if !CONFIG_MQTT_TLS_AUTH_PSK
+    if (ret == 0)
+    {
+        ret = mbedtls_ssl_set_hostname(&conn->ssl, host);
+    }
+#endif
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, "Failed to set up TLS: -0x%04x", -ret);
+        goto fail;
+    }
+    mbedtls_ssl_set_bio(&conn->ssl, conn, tls_send, tls_recv, NULL);
+
+    offered = session_offer(&conn->ssl, offered_master);
+
+    start_us = esp_timer_get_time();
+    ret = mbedtls_ssl_handshake(&conn->ssl);
+    int64_t handshake_us = esp_timer_get_time() - start_us;
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, "Handshake with %s:%d failed: -0x%04x", host, port, -ret);
+        if (offered && handshake_rejected(ret))
+        {
+            /* In case the cached session itself is the problem */
+            mqtt_tls_session_clear();
+        }
+        stats_record(conn, false, false, tcp_us, handshake_us);
+        goto fail;
+    }
+
+    resumed = session_store(&conn->ssl, offered ? offered_master : NULL);
+    mbedtls_platform_zeroize(offered_master, sizeof(offered_master));
+    stats_record(conn, true, resumed, tcp_us, handshake_us);
+    return 0;
+
+fail:
+    mbedtls_platform_zeroize(offered_master, sizeof(offered_master));
+    tls_close(t);
+    return -1;
+}
+
+/**
+ * Wait until the connection has data to read.
+ */
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    if (conn->fd < 0)
+    {
+        return -1;
+    }
+
+    /* Data already decrypted from a previous record is not visible on the socket */
+    if (mbedtls_ssl_get_bytes_avail(&conn->ssl) > 0)
+    {
+        return 1;
+    }
+
+    return socket_poll(conn->fd, false, timeout_ms);
+}
+
+/**
+ * Wait until the connection can be written to.
+ */
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    if (conn->fd < 0)
+    {
+        return -1;
+    }
+
+    return socket_poll(conn->fd, true, timeout_ms);
+}
+
+/**
+ * Read decrypted data.
+ *
+ * @return Bytes read, 0 or ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT if nothing arrived in time, or
+ *         ERR_TCP_TRANSPORT_CONNECTION_FAILED if the connection failed or was closed.
+ */
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    int poll = tls_poll_read(t, timeout_ms);
+    if (poll <= 0)
+    {
+        return poll;
+    }
+
+    int ret = mbedtls_ssl_read(&conn->ssl, (unsigned char *)buffer, len);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_TIMEOUT)
+    {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret <= 0)
+    {
+        /* Readable but no data is the broker closing the connection */
+        if (ret != 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+        {
+            ESP_LOGE(TAG, "Read failed: -0x%04x", -ret);
+        }
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    return ret;
+}
+
+/**
+ * Encrypt and write data.
+ *
+ * @return Bytes written, 0 if the connection could not be written to in time, or
+ *         ERR_TCP_TRANSPORT_CONNECTION_FAILED if the connection failed.
+ */
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    int poll = tls_poll_write(t, timeout_ms);
+    if (poll <= 0)
+    {
+        return poll;
+    }
+
+    int ret = mbedtls_ssl_write(&conn->ssl, (const unsigned char *)buffer, len);
+    if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ
+        || ret == MBEDTLS_ERR_SSL_TIMEOUT)
+    {
+        return 0;
+    }
+    if (ret < 0)
+    {
+        ESP_LOGE(TAG, "Write failed: -0x%04x", -ret);
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    return ret;
+}
+
+/**
+ * Close the connection and free the transport's context.
+ */
+static int tls_destroy(esp_transport_handle_t t)
+{
+    struct tls_conn *conn = esp_transport_get_context_data(t);
+
+    tls_close(t);
+    mbedtls_ssl_config_free(&conn->conf);
+#if CONFIG_MQTT_TLS_VERIFY_CA
+    mbedtls_x509_crt_free(&conn->ca);
+#endif
+    free(conn);
+
+    return 0;
+}
+
+#if CONFIG_MQTT_TLS_AUTH_PSK
+/**
+ * Decode the pre-shared key from its hex configuration.
+ *
+ * @param[out] key Decoded key.
+ * @param[in] size Size of @p key in bytes.
+ * @return Length of the key in bytes.
+ */
+static size_t psk_decode(uint8_t *key, size_t size)
+{
+    const char *hex = CONFIG_MQTT_TLS_PSK_KEY;
+    size_t len = strlen(hex) / 2;
+
+    assert(strlen(hex) % 2 == 0 && len > 0 && len <= size);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned int byte;
+
+        sscanf(&hex[i * 2], "%2x", &byte);
+        key[i] = byte;
+    }
+
+    return len;
+}
+#endif
+
+esp_transport_handle_t mqtt_tls_transport_create(void)
+{
+    struct tls_conn *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    conn->fd = -1;
+
+    if (lock == NULL)
+    {
+        lock = xSemaphoreCreateMutex();
+        assert(lock != NULL);
+    }
+
+    mbedtls_ssl_config_init(&conn->conf);
+    MBEDTLS_CHECK(mbedtls_ssl_config_defaults(&conn->conf, MBEDTLS_SSL_IS_CLIENT,
+                                              MBEDTLS_SSL_TRANSPORT_STREAM,
+                                              MBEDTLS_SSL_PRESET_DEFAULT));
+    mbedtls_ssl_conf_rng(&conn->conf, tls_random, NULL);
+    mbedtls_ssl_conf_max_tls_version(&conn->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+    mbedtls_ssl_conf_session_tickets(&conn->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+#if CONFIG_MQTT_TLS_AUTH_PSK
+    size_t psk_len = psk_decode(conn->psk, sizeof(conn->psk));
+    const char *identity = CONFIG_MQTT_TLS_PSK_IDENTITY;
+
+    MBEDTLS_CHECK(mbedtls_ssl_conf_psk(&conn->conf, conn->psk, psk_len,
+                                       (const unsigned char *)identity, strlen(identity)));
+    mbedtls_ssl_conf_ciphersuites(&conn->conf, psk_ciphersuites);
+#elif CONFIG_MQTT_TLS_VERIFY_CA
+    mbedtls_x509_crt_init(&conn->ca);
+    MBEDTLS_CHECK(mbedtls_x509_crt_parse(&conn->ca, ca_pem_start, ca_pem_end - ca_pem_start));
+    mbedtls_ssl_conf_ca_chain(&conn->conf, &conn->ca, NULL);
+    mbedtls_ssl_conf_authmode(&conn->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+#else
+    ESP_ERROR_CHECK(esp_crt_bundle_attach(&conn->conf));
+    mbedtls_ssl_conf_authmode(&conn->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+#endif
+
+    esp_transport_handle_t t = esp_transport_init();
+    assert(t != NULL);
+    esp_transport_set_context_data(t, conn);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read,
+                           tls_poll_write, tls_destroy);
+    esp_transport_set_default_port(t, MQTT_TLS_DEFAULT_PORT);
+
+    return t;
+}
+
+void mqtt_tls_get_stats(struct mqtt_tls_stats *out)
+{
+    assert(lock != NULL);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(lock);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * @file
+ * TLS transport for esp-mqtt with session resumption.
+ *
+ * A full TLS handshake sends the server's certificate chain and runs a key exchange, which on a
+ * 1 MHz HaLow link costs seconds of airtime on every reconnect. This transport keeps the session
+ * negotiated by the last full handshake (a session ticket, or the session ID if the broker does
+ * not issue tickets) and offers it on the next connect, so the broker can resume it with an
+ * abbreviated handshake. The session is cached in RAM, RTC memory or NVS depending on
+ * configuration, so it can also survive deep sleep or a power cycle.
+ *
+ * The broker is authenticated either by certificate or, with ECDHE-PSK, by a pre-shared key,
+ * which skips certificates even on a full handshake. Every handshake is timed and its size
+ * counted, see @ref mqtt_tls_get_stats.
+ *
+ * Only TLS 1.2 is negotiated, since that is the version whose session resumption is supported
+ * by both mbedtls and mosquitto.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_transport.h"
+
+/** Handshake statistics. */
+struct mqtt_tls_stats
+{
+    /** Full handshakes completed. */
+    uint32_t full;
+    /** Handshakes that resumed a cached session. */
+    uint32_t resumed;
+    /** Connection attempts that failed, in TCP or in the handshake. */
+    uint32_t failed;
+    /** Total time spent in full handshakes, in microseconds. */
+    uint64_t full_us;
+    /** Total time spent in resumed handshakes, in microseconds. */
+    uint64_t resumed_us;
+    /** Time of the last TCP connect, in microseconds. */
+    int64_t last_tcp_us;
+    /** Time of the last handshake, in microseconds. */
+    int64_t last_handshake_us;
+    /** Bytes sent during the last handshake. */
+    size_t last_tx_bytes;
+    /** Bytes received during the last handshake. */
+    size_t last_rx_bytes;
+};
+
+/**
+ * Create the TLS transport.
+ *
+ * Assign the result to @c network.transport of the @c esp_mqtt_client_config_t, with an
+ * @c mqtts:// broker URI. The client takes ownership and destroys the transport with itself.
+ * There is a single session cache per application, so only one transport should be created.
+ *
+ * @return Transport handle.
+ */
+esp_transport_handle_t mqtt_tls_transport_create(void);
+
+/**
+ * Get the handshake statistics.
+ *
+ * @param[out] stats Statistics since boot.
+ */
+void mqtt_tls_get_stats(struct mqtt_tls_stats *stats);
+
+/**
+ * Forget the cached session, so the next connect does a full handshake.
+ */
+void mqtt_tls_session_clear(void);
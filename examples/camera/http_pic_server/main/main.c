@@ -27,6 +27,7 @@ static bool auto_jpeg_support =
 static const char *TAG = "pic server";
 
 esp_err_t start_pic_server(void);
+esp_err_t start_pic_stream(void);
 
 static esp_err_t init_camera(uint32_t xclk_freq_hz, pixformat_t pixel_format,
                              framesize_t frame_size, uint8_t fb_count)
@@ -68,6 +69,10 @@ static esp_err_t init_camera(uint32_t xclk_freq_hz, pixformat_t pixel_format,
 
     // initialize the camera
     esp_err_t ret = esp_camera_init(&camera_config);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
 
     sensor_t *s = esp_camera_sensor_get();
     s->set_vflip(s, 1); // flip it back
@@ -92,7 +97,7 @@ static esp_err_t init_camera(uint32_t xclk_freq_hz, pixformat_t pixel_format,
 
     camera_sensor_info_t *s_info = esp_camera_sensor_get_info(&(s->id));
 
-    if (ESP_OK == ret && PIXFORMAT_JPEG == pixel_format && s_info->support_jpeg == true)
+    if (PIXFORMAT_JPEG == pixel_format && s_info->support_jpeg == true)
     {
         auto_jpeg_support = true;
     }
@@ -112,9 +117,22 @@ void app_main()
      * frequency. Similarly, when you need a smaller resolution image, please use a smaller xclk
      * clock frequency, otherwise the warning `EV-EOF-OVF` may be triggered.
      */
+#if CONFIG_IMAGE_JPEG_FORMAT
+    /* Prefer the sensor's own JPEG encoder, which costs no CPU. The driver refuses JPEG for sensors
+     * without one, in which case capture YUV and encode it in software. */
+    init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_VGA, 2);
+    if (!auto_jpeg_support)
+    {
+        ESP_LOGI(TAG, "Sensor has no JPEG output, encoding frames in software");
+        esp_camera_deinit();
+        TEST_ESP_OK(init_camera(20000000, PIXFORMAT_YUV422, FRAMESIZE_VGA, 2));
+    }
+#else
     TEST_ESP_OK(init_camera(20000000, PIXFORMAT_YUV422, FRAMESIZE_VGA, 2));
+#endif
 
     TEST_ESP_OK(start_pic_server());
+    TEST_ESP_OK(start_pic_stream());
 
     ESP_LOGI(TAG, "Begin capture frame");
 }
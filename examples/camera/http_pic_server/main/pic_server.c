@@ -4,26 +4,248 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
+#include "camera_encode_pool.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "img_converters.h"
 #include "sdkconfig.h"
 
+/* Size of the chunks a picture encoded in software is sent in while encoding, a few TCP segments */
+#define PIC_CHUNK_SIZE 4096
+
+#define PIC_MAX_FRAME_AGE_US (CONFIG_PIC_MAX_FRAME_AGE_MS * 1000LL)
+#define PIC_CACHE_US (CONFIG_PIC_CACHE_MS * 1000LL)
+
+/* The cached snapshot and the one being captured to replace it */
+#define PIC_SNAPSHOT_BUFFERS 2
+
+#define PIC_STATUS_NOT_MODIFIED "304 Not Modified"
+
+/** Encoded picture, shared by the requests it is served to. */
+struct pic_snapshot
+{
+    /** Sequence number, counting every snapshot captured from 1, used as the ETag. */
+    uint32_t seq;
+    /** Capture time from the camera driver, in microseconds on the esp_timer clock. */
+    int64_t timestamp_us;
+    /** Encoded picture from snapshot_pool, NULL while the slot is free. */
+    uint8_t *buf;
+    size_t len;
+    /** References held, protected by snapshot_refs_lock. */
+    uint32_t refs;
+};
+
+/** Picture being encoded into a snapshot and sent. */
+struct pic_writer
+{
+    httpd_req_t *req;
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    /** Bytes sent so far. */
+    size_t sent;
+    /** Time the first bytes were sent, in microseconds. */
+    int64_t first_us;
+    esp_err_t res;
+};
+
 static httpd_handle_t pic_httpd = NULL;
 
+static camera_encode_pool_handle_t snapshot_pool = NULL;
+static struct pic_snapshot snapshots[PIC_SNAPSHOT_BUFFERS];
+/* Held while a snapshot is captured, so concurrent requests wait for it rather than capture too */
+static SemaphoreHandle_t snapshot_lock = NULL;
+static portMUX_TYPE snapshot_refs_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Most recent snapshot, holding a reference, protected by snapshot_refs_lock */
+static struct pic_snapshot *cached = NULL;
+/* Protected by snapshot_lock */
+static uint32_t snapshot_seq = 0;
+
 static const char *TAG = "pic_s";
 
-/* Handler to download a file kept on the server */
-static esp_err_t pic_get_handler(httpd_req_t *req)
+/**
+ * Take a free snapshot slot and a buffer for it.
+ *
+ * @return The snapshot, with one reference, or NULL if every slot is in use.
+ */
+static struct pic_snapshot *pic_snapshot_new(void)
+{
+    struct pic_snapshot *snapshot = NULL;
+
+    taskENTER_CRITICAL(&snapshot_refs_lock);
+    for (int i = 0; i < PIC_SNAPSHOT_BUFFERS; i++)
+    {
+        if (snapshots[i].refs == 0)
+        {
+            snapshot = &snapshots[i];
+            snapshot->refs = 1;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&snapshot_refs_lock);
+
+    if (snapshot != NULL)
+    {
+        /* There is a buffer for every slot */
+        snapshot->buf = camera_encode_pool_acquire(snapshot_pool);
+        assert(snapshot->buf != NULL);
+        snapshot->len = 0;
+    }
+    return snapshot;
+}
+
+static void pic_snapshot_release(struct pic_snapshot *snapshot)
+{
+    taskENTER_CRITICAL(&snapshot_refs_lock);
+    assert(snapshot->refs > 0);
+    bool last = --snapshot->refs == 0;
+    taskEXIT_CRITICAL(&snapshot_refs_lock);
+
+    if (last)
+    {
+        camera_encode_pool_release(snapshot_pool, snapshot->buf);
+        snapshot->buf = NULL;
+    }
+}
+
+/**
+ * Take a reference to the cached snapshot if it was captured less than CONFIG_PIC_CACHE_MS ago.
+ *
+ * @param[out] age_us Age of the snapshot returned, in microseconds.
+ * @return The snapshot, or NULL if there is none fresh enough.
+ */
+static struct pic_snapshot *pic_snapshot_cached(int64_t *age_us)
+{
+    struct pic_snapshot *snapshot = NULL;
+
+    taskENTER_CRITICAL(&snapshot_refs_lock);
+    if (cached != NULL)
+    {
+        *age_us = esp_timer_get_time() - cached->timestamp_us;
+        if (*age_us < PIC_CACHE_US)
+        {
+            snapshot = cached;
+            snapshot->refs++;
+        }
+    }
+    taskEXIT_CRITICAL(&snapshot_refs_lock);
+
+    return snapshot;
+}
+
+/**
+ * Make a snapshot the cached one, for the requests that follow.
+ *
+ * @param[in] snapshot Snapshot, which the cache takes a reference to.
+ */
+static void pic_snapshot_publish(struct pic_snapshot *snapshot)
+{
+    taskENTER_CRITICAL(&snapshot_refs_lock);
+    struct pic_snapshot *previous = cached;
+    cached = snapshot;
+    snapshot->refs++;
+    taskEXIT_CRITICAL(&snapshot_refs_lock);
+
+    if (previous != NULL)
+    {
+        pic_snapshot_release(previous);
+    }
+}
+
+/* Send the part of the picture written since the last call */
+static esp_err_t pic_writer_send(struct pic_writer *writer)
+{
+    if (writer->sent == 0)
+    {
+        writer->first_us = esp_timer_get_time();
+    }
+    writer->res = httpd_resp_send_chunk(writer->req, (const char *)writer->buf + writer->sent,
+                                        writer->len - writer->sent);
+    writer->sent = writer->len;
+    return writer->res;
+}
+
+#if CONFIG_IMAGE_JPEG_FORMAT
+/* frame2jpg_cb output callback, appending to the snapshot and sending every full chunk */
+static size_t pic_write(void *arg, size_t index, const void *data, size_t len)
+{
+    struct pic_writer *writer = arg;
+
+    if (len > writer->size - writer->len)
+    {
+        /* Stops the encoder */
+        return 0;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+
+    if (writer->len - writer->sent >= PIC_CHUNK_SIZE && pic_writer_send(writer) != ESP_OK)
+    {
+        return 0;
+    }
+    return len;
+}
+#endif
+
+/**
+ * Age of a frame, from the camera driver's timestamp, which is taken on the esp_timer clock.
+ *
+ * @param[in] frame Frame.
+ * @return Age in microseconds.
+ */
+static int64_t pic_frame_age_us(const camera_fb_t *frame)
+{
+    int64_t timestamp_us = frame->timestamp.tv_sec * 1000000LL + frame->timestamp.tv_usec;
+    return esp_timer_get_time() - timestamp_us;
+}
+
+/**
+ * Get a frame captured no more than CONFIG_PIC_MAX_FRAME_AGE_MS ago.
+ *
+ * The driver hands out the last frame it completed, which may have been waiting in its buffer since
+ * long before the request. Such a frame is discarded and the next one taken, which the driver is
+ * already capturing. A recent frame is used straight away, saving the wait for the next one.
+ *
+ * @param[out] age_us Age of the frame returned, in microseconds.
+ * @param[out] discarded Whether a stale frame was discarded.
+ * @return The frame, or NULL if capture failed.
+ */
+static camera_fb_t *pic_frame_get(int64_t *age_us, bool *discarded)
 {
-    camera_fb_t *frame = NULL;
-    esp_err_t res = ESP_OK;
-    size_t image_data_buf_len = 0;
-    uint8_t *image_data_buf = NULL;
+    camera_fb_t *frame = esp_camera_fb_get();
+    *discarded = false;
 
+    if (frame != NULL && pic_frame_age_us(frame) > PIC_MAX_FRAME_AGE_US)
+    {
+        esp_camera_fb_return(frame);
+        frame = esp_camera_fb_get();
+        *discarded = true;
+    }
+
+    *age_us = frame != NULL ? pic_frame_age_us(frame) : 0;
+    return frame;
+}
+
+/**
+ * Set the headers common to every picture served.
+ *
+ * @param[in] req Request.
+ * @param[in] etag ETag of the snapshot, kept until the response is sent.
+ */
+static void pic_set_headers(httpd_req_t *req, const char *etag)
+{
 #if CONFIG_IMAGE_JPEG_FORMAT
     httpd_resp_set_type(req, "image/jpeg");
     httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
@@ -32,58 +254,173 @@ static esp_err_t pic_get_handler(httpd_req_t *req)
     httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.bmp");
 #endif
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    /* Browsers may keep the picture but must check with If-None-Match before showing it again */
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", etag);
+}
 
-    esp_camera_fb_return(esp_camera_fb_get());
-    frame = esp_camera_fb_get();
+/**
+ * Serve the cached snapshot, or 304 Not Modified if the client already has it.
+ *
+ * @param[in] req Request.
+ * @param[in] snapshot Cached snapshot.
+ * @param[in] age_us Age of the snapshot in microseconds.
+ * @return ESP_OK, or an error if sending failed.
+ */
+static esp_err_t pic_send_cached(httpd_req_t *req, const struct pic_snapshot *snapshot,
+                                 int64_t age_us)
+{
+    char etag[16];
+    char if_none_match[16];
+    char age_ms[16];
+
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)snapshot->seq);
+    snprintf(age_ms, sizeof(age_ms), "%lld", age_us / 1000);
+    pic_set_headers(req, etag);
+    httpd_resp_set_hdr(req, "X-Frame-Age-Ms", age_ms);
+    httpd_resp_set_hdr(req, "X-Cache", "hit");
+
+    bool not_modified =
+        httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match))
+            == ESP_OK
+        && strcmp(if_none_match, etag) == 0;
 
-    if (frame)
+    ESP_LOGI(TAG, "pic %lu from cache, len %d, age %lld ms%s", (unsigned long)snapshot->seq,
+             snapshot->len, age_us / 1000, not_modified ? ", not modified" : "");
+    if (not_modified)
     {
+        httpd_resp_set_status(req, PIC_STATUS_NOT_MODIFIED);
+        return httpd_resp_send(req, NULL, 0);
+    }
+    return httpd_resp_send(req, (const char *)snapshot->buf, snapshot->len);
+}
+
+/**
+ * Capture, encode and send a new snapshot, and cache it for the requests that follow.
+ *
+ * Pictures encoded in software are sent in chunks as they are encoded, so the first bytes leave
+ * before the encode is done.
+ *
+ * @param[in] req Request.
+ * @return ESP_OK, or an error if capture, encoding or sending failed.
+ */
+static esp_err_t pic_send_new(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    int64_t age_us;
+    bool discarded;
+    camera_fb_t *frame = pic_frame_get(&age_us, &discarded);
+    int64_t captured = esp_timer_get_time();
+
+    if (!frame)
+    {
+        return ESP_FAIL;
+    }
+
+    struct pic_snapshot *snapshot = pic_snapshot_new();
+    if (snapshot == NULL)
+    {
+        /* Only when requests are served in parallel and two still send older snapshots */
+        esp_camera_fb_return(frame);
+        return ESP_ERR_NO_MEM;
+    }
+    snapshot->seq = ++snapshot_seq;
+    snapshot->timestamp_us = frame->timestamp.tv_sec * 1000000LL + frame->timestamp.tv_usec;
+
+    /* For clients measuring the capture, such as tools/mjpeg_bench */
+    char etag[16];
+    char capture_ms[16];
+    char age_ms[16];
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)snapshot->seq);
+    snprintf(capture_ms, sizeof(capture_ms), "%lld", (captured - start) / 1000);
+    snprintf(age_ms, sizeof(age_ms), "%lld", age_us / 1000);
+    pic_set_headers(req, etag);
+    httpd_resp_set_hdr(req, "X-Capture-Ms", capture_ms);
+    httpd_resp_set_hdr(req, "X-Frame-Age-Ms", age_ms);
+    httpd_resp_set_hdr(req, "X-Frame-Discarded", discarded ? "1" : "0");
+    httpd_resp_set_hdr(req, "X-Cache", "miss");
+
+    struct pic_writer writer = {
+        .req = req,
+        .buf = snapshot->buf,
+        .size = camera_encode_pool_buffer_size(snapshot_pool),
+        .res = ESP_OK,
+    };
+    bool encoded;
+
 #if CONFIG_IMAGE_JPEG_FORMAT
-        if (frame->format == PIXFORMAT_JPEG)
-        {
-            image_data_buf = frame->buf;
-            image_data_buf_len = frame->len;
-        }
-        else if (!frame2jpg(frame, 60, &image_data_buf, &image_data_buf_len))
-        {
-            ESP_LOGE(TAG, "JPEG compression failed");
-            res = ESP_FAIL;
-        }
-#elif CONFIG_IMAGE_BMP_FORMAT
-        if (frame2bmp(frame, &image_data_buf, &image_data_buf_len) != true)
-        {
-            res = ESP_FAIL;
-        }
-#endif
+    if (frame->format == PIXFORMAT_JPEG)
+    {
+        encoded = camera_encode_pool_jpeg(frame, 60, writer.buf, writer.size, &writer.len);
     }
     else
     {
-        res = ESP_FAIL;
+        /* Sent in chunks by pic_write as it is encoded */
+        encoded = frame2jpg_cb(frame, 60, pic_write, &writer);
     }
+#elif CONFIG_IMAGE_BMP_FORMAT
+    encoded = camera_encode_pool_bmp(frame, writer.buf, writer.size, &writer.len);
+#endif
+    esp_camera_fb_return(frame);
 
-    if (res == ESP_OK)
+    if (encoded)
     {
-        res = httpd_resp_send_chunk(req, (const char *)image_data_buf, image_data_buf_len);
-#if CONFIG_IMAGE_JPEG_FORMAT
-        if (frame->format != PIXFORMAT_JPEG)
+        snapshot->len = writer.len;
+        pic_snapshot_publish(snapshot);
+        if (writer.res == ESP_OK && writer.len > writer.sent)
         {
-            free(image_data_buf);
-            image_data_buf = NULL;
+            pic_writer_send(&writer);
         }
-#elif CONFIG_IMAGE_BMP_FORMAT
-        free(image_data_buf);
-        image_data_buf = NULL;
-#endif
-        esp_camera_fb_return(frame);
-        ESP_LOGI(TAG, "pic len %d", image_data_buf_len);
+    }
+    else if (writer.res == ESP_OK)
+    {
+        ESP_LOGE(TAG, "Encoding failed");
+        writer.res = ESP_FAIL;
+    }
+    pic_snapshot_release(snapshot);
+
+    if (writer.res != ESP_OK)
+    {
+        return writer.res;
+    }
+
+    ESP_LOGI(TAG,
+             "pic %lu len %d, capture %lld ms (frame age %lld ms%s), first byte %lld ms, total "
+             "%lld ms",
+             (unsigned long)snapshot_seq, writer.len, (captured - start) / 1000, age_us / 1000,
+             discarded ? ", stale one discarded" : "", (writer.first_us - start) / 1000,
+             (esp_timer_get_time() - start) / 1000);
+
+    /* Respond with an empty chunk to signal HTTP response completion */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* Handler to download a file kept on the server */
+static esp_err_t pic_get_handler(httpd_req_t *req)
+{
+    int64_t age_us;
+    esp_err_t res;
+
+    /* A request arriving while another captures waits for it and is then served its snapshot. */
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    struct pic_snapshot *snapshot = pic_snapshot_cached(&age_us);
+    if (snapshot != NULL)
+    {
+        xSemaphoreGive(snapshot_lock);
+        res = pic_send_cached(req, snapshot, age_us);
+        pic_snapshot_release(snapshot);
     }
     else
+    {
+        res = pic_send_new(req);
+        xSemaphoreGive(snapshot_lock);
+    }
+
+    if (res != ESP_OK)
     {
         ESP_LOGW(TAG, "exit pic server");
         return ESP_FAIL;
     }
-    /* Respond with an empty chunk to signal HTTP response completion */
-    httpd_resp_send_chunk(req, NULL, 0);
     return ESP_OK;
 }
 
@@ -95,6 +432,20 @@ esp_err_t start_pic_server()
     httpd_uri_t pic_uri = {
         .uri = "/pic", .method = HTTP_GET, .handler = pic_get_handler, .user_ctx = NULL};
 
+    /* Allocated once, for the frame size the camera was started with */
+    framesize_t framesize = esp_camera_sensor_get()->status.framesize;
+#if CONFIG_IMAGE_JPEG_FORMAT
+    size_t snapshot_size = camera_encode_pool_jpeg_size(framesize);
+#elif CONFIG_IMAGE_BMP_FORMAT
+    size_t snapshot_size = camera_encode_pool_bmp_size(framesize);
+#endif
+    snapshot_lock = xSemaphoreCreateMutex();
+    assert(snapshot_lock != NULL);
+    if (camera_encode_pool_create(PIC_SNAPSHOT_BUFFERS, snapshot_size, &snapshot_pool) != ESP_OK)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
     ESP_LOGI(TAG, "Starting pic server on port: '%d'", config.server_port);
     if (httpd_start(&pic_httpd, &config) == ESP_OK)
     {
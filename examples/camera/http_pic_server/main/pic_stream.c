@@ -0,0 +1,432 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * MJPEG stream served as multipart/x-mixed-replace on /stream.
+ *
+ * Frames come from the camera pipeline, which captures and encodes them at no more than
+ * CONFIG_PIC_STREAM_MAX_FPS, but only while a viewer is connected. The most recent one is kept,
+ * and a viewer always sends the most recent frame it has not sent yet. Frames captured while it is
+ * still sending the previous one are skipped for that viewer rather than queued, so a slow link
+ * lowers its frame rate instead of its latency and never holds up the capture.
+ *
+ * The handler hands each viewer to a task of its own with httpd_req_async_handler_begin(), so up
+ * to CONFIG_PIC_STREAM_MAX_VIEWERS viewers are served at once, each at the rate of its own link.
+ * The stream still runs on its own server, on CONFIG_PIC_STREAM_PORT, so that its open
+ * connections do not take the sockets /pic needs.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "camera_pipeline.h"
+#include "camera_rate_control.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#define STREAM_BOUNDARY "halowframe"
+#define STREAM_CONTENT_TYPE "multipart/x-mixed-replace;boundary=" STREAM_BOUNDARY
+/* Every part starts with the CRLF ending the previous one; before the first it is preamble. */
+#define STREAM_PART_FORMAT                                                                         \
+    "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"              \
+    "X-Frame-Seq: %lu\r\nX-Timestamp: %lld.%06ld\r\n\r\n"
+
+#define STREAM_JPEG_QUALITY 60
+#define STREAM_FRAME_PERIOD_MS (1000 / CONFIG_PIC_STREAM_MAX_FPS)
+/* How long a viewer waits without a new frame before giving up on the camera. */
+#define STREAM_FRAME_TIMEOUT_MS 10000
+#define STREAM_SEND_TIMEOUT_S 5
+/* Lowest JPEG quality the rate controller goes down to before lowering the frame size */
+#define STREAM_MIN_QUALITY 10
+/* Each viewer is served by a task of its own, at the priority of the server's task */
+#define STREAM_VIEWER_STACK_SIZE 4096
+#define STREAM_VIEWER_PRIORITY 5
+
+/** Per viewer statistics, logged when it disconnects. */
+struct stream_client_stats
+{
+    uint32_t frames;
+    uint32_t skipped;
+    uint64_t bytes;
+    int64_t capture_us;
+    int64_t encode_us;
+    int64_t send_us;
+};
+
+/** A connected viewer. */
+struct stream_viewer
+{
+    bool used;
+    /* Request handed over by the server, to send the stream on */
+    httpd_req_t *req;
+    /* Task serving the viewer, woken for every new frame. NULL until it has started. */
+    TaskHandle_t task;
+};
+
+static httpd_handle_t stream_httpd = NULL;
+static SemaphoreHandle_t stream_lock = NULL;
+
+/* Protected by stream_lock */
+static struct camera_frame *latest = NULL;
+static uint32_t viewers = 0;
+static struct stream_viewer viewer_slots[CONFIG_PIC_STREAM_MAX_VIEWERS];
+#if CONFIG_PIC_STREAM_RATE_CONTROL
+/* Frame most recently sent to a viewer, not yet reported to the rate controller */
+static struct
+{
+    uint32_t seq;
+    size_t len;
+    int64_t send_us;
+} rate_pending;
+#endif
+
+static const char *TAG = "pic_stream";
+
+/**
+ * Pipeline send callback, keeping the frame as the most recent one and waking the viewers.
+ *
+ * @param[in] frame Encoded frame.
+ * @param[in] arg Unused.
+ */
+static void stream_frame_ready(struct camera_frame *frame, void *arg)
+{
+    camera_frame_ref(frame);
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    struct camera_frame *previous = latest;
+    /* Frames still in the pipeline when the last viewer left are not kept. */
+    if (viewers > 0)
+    {
+        latest = frame;
+    }
+    else
+    {
+        latest = NULL;
+        previous = frame;
+    }
+    /* A viewer leaves its slot before its task ends, so every task notified here exists */
+    for (int i = 0; i < CONFIG_PIC_STREAM_MAX_VIEWERS; i++)
+    {
+        if (viewer_slots[i].used && viewer_slots[i].task != NULL)
+        {
+            xTaskNotifyGive(viewer_slots[i].task);
+        }
+    }
+    xSemaphoreGive(stream_lock);
+
+    camera_frame_release(previous);
+}
+
+/**
+ * Take a reference to the most recent frame if it is newer than @p last_seq, waiting for one if
+ * it is not. Called from a viewer's task.
+ *
+ * @param[in] last_seq Sequence number of the last frame sent, 0 for none.
+ * @return The frame, or NULL if none was captured within STREAM_FRAME_TIMEOUT_MS.
+ */
+static struct camera_frame *stream_frame_next(uint32_t last_seq)
+{
+    int64_t deadline = esp_timer_get_time() + STREAM_FRAME_TIMEOUT_MS * 1000LL;
+
+    for (;;)
+    {
+        xSemaphoreTake(stream_lock, portMAX_DELAY);
+        struct camera_frame *frame = latest;
+        if (frame != NULL && frame->seq != last_seq)
+        {
+            camera_frame_ref(frame);
+        }
+        else
+        {
+            frame = NULL;
+        }
+        xSemaphoreGive(stream_lock);
+
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if (frame != NULL || remaining_us <= 0)
+        {
+            return frame;
+        }
+
+        /* The pipeline notifies every viewer after replacing the frame, so a frame that arrived
+         * between the check above and this wait is not missed. */
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(remaining_us / 1000) + 1);
+    }
+}
+
+#if CONFIG_PIC_STREAM_RATE_CONTROL
+/**
+ * Record the time a viewer took to send a frame, reporting every frame to the rate controller once,
+ * with the time of its slowest viewer.
+ *
+ * A frame is reported once a viewer has sent a newer one. A viewer still sending an older frame by
+ * then is on a slower link, so its time counts towards the frame not yet reported.
+ *
+ * @param[in] frame Frame sent.
+ * @param[in] send_us Time it took to send, in microseconds.
+ */
+static void stream_rate_sent(const struct camera_frame *frame, int64_t send_us)
+{
+    bool report = false;
+    size_t report_len = 0;
+    int64_t report_us = 0;
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    if (frame->seq > rate_pending.seq)
+    {
+        report = rate_pending.seq != 0;
+        report_len = rate_pending.len;
+        report_us = rate_pending.send_us;
+        rate_pending.seq = frame->seq;
+        rate_pending.len = frame->len;
+        rate_pending.send_us = send_us;
+    }
+    else if (send_us > rate_pending.send_us)
+    {
+        rate_pending.send_us = send_us;
+    }
+    xSemaphoreGive(stream_lock);
+
+    if (report)
+    {
+        camera_rate_control_frame_sent(report_len, report_us);
+    }
+}
+#endif
+
+/**
+ * Take a slot for a new viewer, resuming the capture for the first one.
+ *
+ * @return The slot, or NULL if CONFIG_PIC_STREAM_MAX_VIEWERS are already connected.
+ */
+static struct stream_viewer *stream_viewer_add(void)
+{
+    struct stream_viewer *viewer = NULL;
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_PIC_STREAM_MAX_VIEWERS && viewer == NULL; i++)
+    {
+        if (!viewer_slots[i].used)
+        {
+            viewer = &viewer_slots[i];
+            *viewer = (struct stream_viewer){.used = true};
+        }
+    }
+    bool first = viewer != NULL && viewers++ == 0;
+    xSemaphoreGive(stream_lock);
+
+    if (first)
+    {
+        camera_pipeline_set_paused(false);
+    }
+    return viewer;
+}
+
+/**
+ * Free a viewer's slot, pausing the capture when the last one leaves.
+ *
+ * @param[in] viewer Slot taken by @ref stream_viewer_add.
+ */
+static void stream_viewer_remove(struct stream_viewer *viewer)
+{
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    struct camera_frame *stale = NULL;
+    *viewer = (struct stream_viewer){0};
+    bool last = --viewers == 0;
+    if (last)
+    {
+        stale = latest;
+        latest = NULL;
+#if CONFIG_PIC_STREAM_RATE_CONTROL
+        rate_pending.seq = 0;
+#endif
+    }
+    xSemaphoreGive(stream_lock);
+
+    if (last)
+    {
+        camera_pipeline_set_paused(true);
+        camera_frame_release(stale);
+    }
+}
+
+/**
+ * Task sending the stream to one viewer until it disconnects.
+ *
+ * @param[in] arg The viewer's slot.
+ */
+static void stream_viewer_task(void *arg)
+{
+    struct stream_viewer *viewer = arg;
+    httpd_req_t *req = viewer->req;
+    char part[160];
+    struct stream_client_stats stats = {0};
+    uint32_t last_seq = 0;
+    esp_err_t res = ESP_OK;
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    viewer->task = xTaskGetCurrentTaskHandle();
+    xSemaphoreGive(stream_lock);
+
+    httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    ESP_LOGI(TAG, "Stream started");
+    int64_t start = esp_timer_get_time();
+
+    while (res == ESP_OK)
+    {
+        struct camera_frame *frame = stream_frame_next(last_seq);
+        if (frame == NULL)
+        {
+            ESP_LOGW(TAG, "No frame for %d ms, ending stream", STREAM_FRAME_TIMEOUT_MS);
+            res = ESP_FAIL;
+            break;
+        }
+
+        if (last_seq != 0)
+        {
+            stats.skipped += frame->seq - last_seq - 1;
+        }
+        last_seq = frame->seq;
+
+        int64_t send_start = esp_timer_get_time();
+        int len = snprintf(part, sizeof(part), STREAM_PART_FORMAT, (unsigned)frame->len,
+                           (unsigned long)frame->seq, (long long)frame->timestamp.tv_sec,
+                           (long)frame->timestamp.tv_usec);
+        res = httpd_resp_send_chunk(req, part, len);
+        if (res == ESP_OK)
+        {
+            res = httpd_resp_send_chunk(req, (const char *)frame->buf, frame->len);
+        }
+        if (res == ESP_OK)
+        {
+            int64_t send_us = esp_timer_get_time() - send_start;
+            stats.frames++;
+            stats.bytes += frame->len;
+            stats.capture_us += frame->capture_us;
+            stats.encode_us += frame->encode_us;
+            stats.send_us += send_us;
+#if CONFIG_PIC_STREAM_RATE_CONTROL
+            stream_rate_sent(frame, send_us);
+#endif
+        }
+        camera_frame_release(frame);
+    }
+
+    stream_viewer_remove(viewer);
+
+    int64_t elapsed_ms = (esp_timer_get_time() - start) / 1000;
+    ESP_LOGI(TAG,
+             "Stream ended after %lld ms: %lu frames (%.1f fps), %lu skipped, %llu kB/s, "
+             "capture %lld ms, encode %lld ms, send %lld ms per frame",
+             elapsed_ms, (unsigned long)stats.frames,
+             elapsed_ms ? stats.frames * 1000.0 / elapsed_ms : 0.0, (unsigned long)stats.skipped,
+             elapsed_ms ? stats.bytes / elapsed_ms : 0,
+             stats.frames ? stats.capture_us / stats.frames / 1000 : 0,
+             stats.frames ? stats.encode_us / stats.frames / 1000 : 0,
+             stats.frames ? stats.send_us / stats.frames / 1000 : 0);
+
+    /* The viewer has gone, so there is no response left to complete; this closes the request. */
+    httpd_req_async_handler_complete(req);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t stream_get_handler(httpd_req_t *req)
+{
+    struct stream_viewer *viewer = stream_viewer_add();
+    if (viewer == NULL)
+    {
+        ESP_LOGW(TAG, "%d viewers already connected, refusing another",
+                 CONFIG_PIC_STREAM_MAX_VIEWERS);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "10");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    /* The server's task returns to accept other viewers while the viewer's task streams */
+    if (httpd_req_async_handler_begin(req, &viewer->req) != ESP_OK)
+    {
+        stream_viewer_remove(viewer);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+        return ESP_FAIL;
+    }
+
+    if (xTaskCreate(stream_viewer_task, "stream_viewer", STREAM_VIEWER_STACK_SIZE, viewer,
+                    STREAM_VIEWER_PRIORITY, NULL)
+        != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create a viewer task");
+        httpd_req_t *async_req = viewer->req;
+        stream_viewer_remove(viewer);
+        httpd_resp_send_err(async_req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+        httpd_req_async_handler_complete(async_req);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t start_pic_stream(void)
+{
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_PIC_STREAM_PORT;
+    /* Must differ from the /pic server's control port. */
+    config.ctrl_port = config.ctrl_port + 1;
+    config.stack_size = 4096;
+    config.send_wait_timeout = STREAM_SEND_TIMEOUT_S;
+    /* A socket for each viewer, and one to refuse viewers beyond the limit on */
+    config.max_open_sockets = CONFIG_PIC_STREAM_MAX_VIEWERS + 1;
+
+    httpd_uri_t stream_uri = {
+        .uri = "/stream", .method = HTTP_GET, .handler = stream_get_handler, .user_ctx = NULL};
+
+    const struct camera_pipeline_config pipeline_config = {
+        .format = CAMERA_PIPELINE_JPEG,
+        .interval_ms = STREAM_FRAME_PERIOD_MS,
+        .quality = STREAM_JPEG_QUALITY,
+        .paused = true,
+        .send = stream_frame_ready,
+    };
+
+    stream_lock = xSemaphoreCreateMutex();
+    assert(stream_lock != NULL);
+
+    if (camera_pipeline_start(&pipeline_config) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+#if CONFIG_PIC_STREAM_RATE_CONTROL
+    /* Each frame should be sent within the frame period, so the viewer keeps up with the camera. */
+    const struct camera_rate_control_config rate_config = {
+        .target_frame_ms = STREAM_FRAME_PERIOD_MS,
+        .min_quality = STREAM_MIN_QUALITY,
+        .max_quality = STREAM_JPEG_QUALITY,
+        .min_framesize = FRAMESIZE_QQVGA,
+        .max_framesize = esp_camera_sensor_get()->status.framesize,
+    };
+    ESP_ERROR_CHECK(camera_rate_control_start(&rate_config));
+#endif
+
+    ESP_LOGI(TAG, "Starting stream server on port: '%d', at most %d fps", config.server_port,
+             CONFIG_PIC_STREAM_MAX_FPS);
+    if (httpd_start(&stream_httpd, &config) == ESP_OK)
+    {
+        httpd_register_uri_handler(stream_httpd, &stream_uri);
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
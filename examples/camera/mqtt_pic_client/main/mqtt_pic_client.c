@@ -18,9 +18,19 @@
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "nvs.h"
 
+#include "cJSON.h"
+#include "camera_motion.h"
+#include "camera_pipeline.h"
+#include "camera_rate_control.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
+#include "mqtt_metrics.h"
+#include "mqtt_outbox.h"
+#include "mqtt_tls.h"
 
 static const char *TAG = "MQTT_EXAMPLE";
 
@@ -35,88 +45,609 @@ static void log_error_if_nonzero(const char *message, int error_code)
 // Adjust topic name as needed
 #define CAMERA_TOPIC CONFIG_CAMERA_IMAGE_TOPIC
 
+// Topic publish latency and delivery metrics are reported on
+#define DIAGNOSTICS_TOPIC CONFIG_CAMERA_DIAGNOSTICS_TOPIC
+
+// Topic configuration commands are received on
+#define COMMAND_TOPIC CONFIG_CAMERA_COMMAND_TOPIC
+
 // Adjust publish interval (in milliseconds)
 #define PUBLISH_INTERVAL_MS 5000
 
+// JPEG quality (1-100) frames are converted with, until changed by command
+#define JPEG_QUALITY 60
+
+// Lowest JPEG quality the rate controller goes down to before lowering the frame size
+#define RATE_CONTROL_MIN_QUALITY 10
+
+// Publish interval limits (in milliseconds) accepted by command
+#define COMMAND_INTERVAL_MIN_MS 100
+#define COMMAND_INTERVAL_MAX_MS 3600000
+
+// NVS namespace and key the settings changed by command are kept under
+#define SETTINGS_NVS_NAMESPACE "camera"
+#define SETTINGS_NVS_KEY "settings"
+
+/** Settings that can be changed at runtime over the command topic, kept in NVS. */
+struct camera_settings
+{
+    /** Time between frames in milliseconds. */
+    uint32_t interval_ms;
+    /** JPEG quality, 1 (smallest) to 100 (best). */
+    uint8_t quality;
+    /** Frame size, a framesize_t. */
+    uint8_t framesize;
+};
+
+/** Current settings, protected by @ref settings_lock. */
+static struct camera_settings settings = {
+    .interval_ms = PUBLISH_INTERVAL_MS,
+    .quality = JPEG_QUALITY,
+};
+
+/** Protects @ref settings, which is written by the MQTT task and read by the publish task. */
+static portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** Largest frame size, the one the camera was started with, as its buffers are sized for it. */
+static framesize_t max_framesize;
+
+/** Frame size names accepted in commands. */
+static const struct
+{
+    const char *name;
+    framesize_t size;
+} framesizes[] = {
+    {"QQVGA", FRAMESIZE_QQVGA}, {"QVGA", FRAMESIZE_QVGA}, {"CIF", FRAMESIZE_CIF},
+    {"VGA", FRAMESIZE_VGA},     {"SVGA", FRAMESIZE_SVGA}, {"XGA", FRAMESIZE_XGA},
+    {"HD", FRAMESIZE_HD},       {"SXGA", FRAMESIZE_SXGA}, {"UXGA", FRAMESIZE_UXGA},
+};
+
 /**
- * @brief Task to capture a picture from the camera and publish it to MQTT.
+ * @brief Apply the settings to the camera sensor and the capture pipeline.
  *
- * @param pvParameters pointer to the MQTT client handle passed in from the creator of the task.
+ * The quality is also passed to sensors that encode JPEG themselves, where 0 is best and 63 worst.
+ * With the rate controller the quality and frame size are the highest it may choose.
+ *
+ * @param current Settings to apply.
  */
-static void camera_publish_task(void *pvParameters)
+static void camera_settings_apply(const struct camera_settings *current)
 {
-    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)pvParameters;
+#if CONFIG_CAMERA_RATE_CONTROL
+    camera_rate_control_set_limits(current->quality, (framesize_t)current->framesize);
+#else
+    sensor_t *s = esp_camera_sensor_get();
+
+    if (s->status.framesize != current->framesize
+        && s->set_framesize(s, (framesize_t)current->framesize) != 0)
+    {
+        ESP_LOGW(TAG, "Failed to set frame size %u", current->framesize);
+    }
 
-    esp_err_t res = ESP_OK;
-    while (1)
+    if (s->pixformat == PIXFORMAT_JPEG)
     {
-        size_t image_data_buf_len = 0;
-        uint8_t *image_data_buf = NULL;
-        // Get frame buffer from camera
-        camera_fb_t *frame = esp_camera_fb_get();
-        if (!frame)
+        s->set_quality(s, (100 - current->quality) * 63 / 100);
+    }
+
+    camera_pipeline_set_quality(current->quality);
+#endif
+    camera_pipeline_set_interval(current->interval_ms);
+}
+
+/**
+ * @brief Load the settings kept in NVS and apply them.
+ *
+ * Without stored settings the frame size the camera was started with is kept.
+ */
+static void camera_settings_load(void)
+{
+    struct camera_settings stored;
+    size_t len = sizeof(stored);
+    nvs_handle_t handle;
+
+    max_framesize = esp_camera_sensor_get()->status.framesize;
+    settings.framesize = max_framesize;
+
+    if (nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        if (nvs_get_blob(handle, SETTINGS_NVS_KEY, &stored, &len) == ESP_OK
+            && len == sizeof(stored) && stored.framesize <= max_framesize)
         {
-            ESP_LOGE(TAG, "Camera capture failed");
-            // Optionally delay to avoid spamming if camera is not ready
-            vTaskDelay(pdMS_TO_TICKS(PUBLISH_INTERVAL_MS));
-            continue;
+            ESP_LOGI(TAG, "Settings from NVS: interval %lu ms, quality %u, frame size %u",
+                     stored.interval_ms, stored.quality, stored.framesize);
+            settings = stored;
         }
+        nvs_close(handle);
+    }
 
-        if (frame)
-        {
-#if CONFIG_IMAGE_JPEG_FORMAT
-            if (frame->format == PIXFORMAT_JPEG)
-            {
-                image_data_buf = frame->buf;
-                image_data_buf_len = frame->len;
-            }
-            else if (!frame2jpg(frame, 60, &image_data_buf, &image_data_buf_len))
-            {
-                ESP_LOGE(TAG, "JPEG compression failed");
-                res = ESP_FAIL;
-            }
-#elif CONFIG_IMAGE_BMP_FORMAT
-            if (frame2bmp(frame, &image_data_buf, &image_data_buf_len) != true)
-            {
-                res = ESP_FAIL;
-            }
+#if CONFIG_CAMERA_RATE_CONTROL
+    const struct camera_rate_control_config rate_config = {
+        .target_frame_ms = CONFIG_CAMERA_RATE_CONTROL_FRAME_MS,
+        .budget_bytes_per_s = CONFIG_CAMERA_RATE_CONTROL_BUDGET_KBPS * 1000 / 8,
+        .min_quality = settings.quality < RATE_CONTROL_MIN_QUALITY ? settings.quality
+                                                                    : RATE_CONTROL_MIN_QUALITY,
+        .max_quality = settings.quality,
+        .min_framesize = FRAMESIZE_QQVGA,
+        .max_framesize = (framesize_t)settings.framesize,
+    };
+    ESP_ERROR_CHECK(camera_rate_control_start(&rate_config));
 #endif
+    camera_settings_apply(&settings);
+}
+
+/**
+ * @brief Apply a configuration command and keep the new settings in NVS.
+ *
+ * The command is a JSON object with any of "interval_ms", "quality" (1-100) and "framesize"
+ * (e.g. "QVGA"). Invalid values are logged and skipped.
+ *
+ * @param data Command payload.
+ * @param len Length of @p data in bytes.
+ */
+static void camera_command_apply(const char *data, int len)
+{
+    struct camera_settings next;
+    const cJSON *item;
+
+    cJSON *root = cJSON_ParseWithLength(data, len);
+    if (!cJSON_IsObject(root))
+    {
+        ESP_LOGW(TAG, "Ignoring malformed command: %.*s", len, data);
+        cJSON_Delete(root);
+        return;
+    }
+
+    taskENTER_CRITICAL(&settings_lock);
+    next = settings;
+    taskEXIT_CRITICAL(&settings_lock);
+
+    item = cJSON_GetObjectItem(root, "interval_ms");
+    if (cJSON_IsNumber(item) && item->valuedouble >= COMMAND_INTERVAL_MIN_MS
+        && item->valuedouble <= COMMAND_INTERVAL_MAX_MS)
+    {
+        next.interval_ms = item->valuedouble;
+    }
+    else if (item != NULL)
+    {
+        ESP_LOGW(TAG, "interval_ms must be between %d and %d", COMMAND_INTERVAL_MIN_MS,
+                 COMMAND_INTERVAL_MAX_MS);
+    }
+
+    item = cJSON_GetObjectItem(root, "quality");
+    if (cJSON_IsNumber(item) && item->valuedouble >= 1 && item->valuedouble <= 100)
+    {
+        next.quality = item->valuedouble;
+    }
+    else if (item != NULL)
+    {
+        ESP_LOGW(TAG, "quality must be between 1 and 100");
+    }
+
+    item = cJSON_GetObjectItem(root, "framesize");
+    if (item != NULL)
+    {
+        size_t i = 0;
+        while (i < sizeof(framesizes) / sizeof(framesizes[0])
+               && !(cJSON_IsString(item) && strcmp(item->valuestring, framesizes[i].name) == 0))
+        {
+            i++;
+        }
+
+        if (i == sizeof(framesizes) / sizeof(framesizes[0]) || framesizes[i].size > max_framesize)
+        {
+            ESP_LOGW(TAG, "Unknown frame size, or larger than the camera was started with");
         }
         else
         {
-            res = ESP_FAIL;
+            next.framesize = framesizes[i].size;
         }
+    }
+
+    cJSON_Delete(root);
+
+    ESP_LOGI(TAG, "Settings by command: interval %lu ms, quality %u, frame size %u",
+             next.interval_ms, next.quality, next.framesize);
+    camera_settings_apply(&next);
+
+    taskENTER_CRITICAL(&settings_lock);
+    settings = next;
+    taskEXIT_CRITICAL(&settings_lock);
 
-        if (res == ESP_OK)
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, SETTINGS_NVS_KEY, &next, sizeof(next));
+        if (err == ESP_OK)
         {
-            // Publish the raw image buffer directly over MQTT.
-            // NOTE: Large images can cause issues depending on your MQTT broker limits.
-            int msg_id = esp_mqtt_client_publish(client, CAMERA_TOPIC, (const char *)image_data_buf,
-                                                 image_data_buf_len, 0, 0);
-            ESP_LOGI(TAG, "Published camera frame, topic=%s, msg_id=%d, size=%u bytes",
-                     CAMERA_TOPIC, msg_id, frame->len);
-
-#if CONFIG_IMAGE_JPEG_FORMAT
-            if (frame->format != PIXFORMAT_JPEG)
-            {
-                free(image_data_buf);
-                image_data_buf = NULL;
-            }
-#elif CONFIG_IMAGE_BMP_FORMAT
-            free(image_data_buf);
-            image_data_buf = NULL;
-#endif
-            // Return the frame buffer back to the driver for reuse
-            esp_camera_fb_return(frame);
+            err = nvs_commit(handle);
         }
-        else
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store settings: %s", esp_err_to_name(err));
+    }
+}
+
+#if CONFIG_CAMERA_CHUNKED_PUBLISH
+// Topic frames are published on in chunks, and topic missing chunks are asked for again on
+#define CHUNK_TOPIC CAMERA_TOPIC "/chunk"
+#define CHUNK_RESEND_TOPIC CHUNK_TOPIC "/resend"
+
+// Chunk message header, all big endian: frame sequence number (u32), chunk index (u16), chunk
+// count (u16, 0 if not known when sent), flags (u8), header length (u8), reserved (u16), capture
+// time in milliseconds since boot (u32) and CRC-32 of the payload (u32)
+#define CHUNK_HEADER_LEN 20
+#define CHUNK_FLAG_LAST (1 << 0)
+#define CHUNK_FLAG_RETRANSMIT (1 << 1)
+
+#define CHUNK_SIZE CONFIG_CAMERA_PIPELINE_CHUNK_SIZE
+
+#if CONFIG_CAMERA_CHUNK_QOS1
+#define CHUNK_QOS 1
+#else
+#define CHUNK_QOS 0
+#endif
+
+static void put_be16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+    put_be16(p, value >> 16);
+    put_be16(p + 2, value);
+}
+
+/**
+ * @brief Publish one chunk of a frame with its header.
+ *
+ * @param client MQTT client handle.
+ * @param message Buffer of CHUNK_HEADER_LEN + CHUNK_SIZE bytes the message is built in.
+ * @param frame Frame the chunk belongs to.
+ * @param index Chunk index.
+ * @param count Number of chunks in the frame, 0 if not known yet.
+ * @param data Chunk of the encoded image.
+ * @param len Length of @p data, at most CHUNK_SIZE.
+ * @param flags CHUNK_FLAG_ bits.
+ * @return true if the chunk was published, or queued in the outbox.
+ */
+static bool chunk_publish(esp_mqtt_client_handle_t client, uint8_t *message,
+                          const struct camera_frame *frame, uint16_t index, uint16_t count,
+                          const uint8_t *data, size_t len, uint8_t flags)
+{
+    put_be32(message, frame->seq);
+    put_be16(message + 4, index);
+    put_be16(message + 6, count);
+    message[8] = flags;
+    message[9] = CHUNK_HEADER_LEN;
+    put_be16(message + 10, 0);
+    put_be32(message + 12, frame->timestamp.tv_sec * 1000 + frame->timestamp.tv_usec / 1000);
+    put_be32(message + 16, esp_rom_crc32_le(0, data, len));
+    memcpy(message + CHUNK_HEADER_LEN, data, len);
+
+#if CONFIG_MQTT_OUTBOX
+    return mqtt_outbox_publish(CHUNK_TOPIC, message, CHUNK_HEADER_LEN + len, false) == ESP_OK;
+#else
+    return mqtt_metrics_publish(client, CHUNK_TOPIC, (const char *)message,
+                                CHUNK_HEADER_LEN + len, CHUNK_QOS, 0)
+           >= 0;
+#endif
+}
+
+/**
+ * @brief Log a frame published in chunks and report it to the rate controller.
+ *
+ * @param frame Frame published.
+ * @param chunks Chunks published.
+ * @param send_us Time spent publishing them, in microseconds.
+ */
+static void chunk_frame_published(const struct camera_frame *frame, uint16_t chunks,
+                                  int64_t send_us)
+{
+#if CONFIG_CAMERA_RATE_CONTROL
+    camera_rate_control_frame_sent(frame->len, send_us);
+#endif
+    ESP_LOGI(TAG,
+             "Published camera frame %lu in chunks, topic=%s, chunks=%u, size=%u bytes, "
+             "capture %lld ms, encode %lld ms, publish %lld ms",
+             (unsigned long)frame->seq, CHUNK_TOPIC, chunks, frame->len,
+             frame->capture_us / 1000, frame->encode_us / 1000, send_us / 1000);
+}
+
+#if CONFIG_CAMERA_CHUNK_RETRANSMIT
+/** Last frame published, kept for retransmissions until the next, protected by resend_lock. */
+static struct camera_frame *resend_frame;
+static portMUX_TYPE resend_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Pipeline send callback publishing an encoded frame in chunks and keeping it.
+ *
+ * The frame is kept even if publishing stopped part way, so a subscriber can ask for the rest.
+ *
+ * @param frame Encoded frame.
+ * @param arg MQTT client handle.
+ */
+static void camera_chunk_frame_publish(struct camera_frame *frame, void *arg)
+{
+    // Only called from the pipeline's send task
+    static uint8_t message[CHUNK_HEADER_LEN + CHUNK_SIZE];
+    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
+    uint16_t count = (frame->len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint16_t index = 0;
+
+    int64_t start = esp_timer_get_time();
+    while (index < count)
+    {
+        size_t offset = (size_t)index * CHUNK_SIZE;
+        size_t len = frame->len - offset < CHUNK_SIZE ? frame->len - offset : CHUNK_SIZE;
+        if (!chunk_publish(client, message, frame, index, count, frame->buf + offset, len,
+                           index + 1 == count ? CHUNK_FLAG_LAST : 0))
+        {
+            break;
+        }
+        index++;
+    }
+    int64_t send_us = esp_timer_get_time() - start;
+
+    camera_frame_ref(frame);
+    taskENTER_CRITICAL(&resend_lock);
+    struct camera_frame *previous = resend_frame;
+    resend_frame = frame;
+    taskEXIT_CRITICAL(&resend_lock);
+    camera_frame_release(previous);
+
+    if (index < count)
+    {
+        ESP_LOGW(TAG, "Stopped publishing camera frame %lu at chunk %u of %u",
+                 (unsigned long)frame->seq, index, count);
+        return;
+    }
+    chunk_frame_published(frame, count, send_us);
+}
+
+/**
+ * @brief Publish again the chunks of the last frame a subscriber asks for.
+ *
+ * The request is a JSON object with the "frame" sequence number and the "chunks" indexes
+ * missing, e.g. {"frame": 42, "chunks": [3, 4]}. Only the last frame is kept.
+ *
+ * @param client MQTT client handle.
+ * @param data Request payload.
+ * @param len Length of @p data in bytes.
+ */
+static void camera_chunk_resend(esp_mqtt_client_handle_t client, const char *data, int len)
+{
+    // Only called from the MQTT task
+    static uint8_t message[CHUNK_HEADER_LEN + CHUNK_SIZE];
+
+    cJSON *root = cJSON_ParseWithLength(data, len);
+    const cJSON *seq = cJSON_GetObjectItem(root, "frame");
+    const cJSON *chunks = cJSON_GetObjectItem(root, "chunks");
+    if (!cJSON_IsNumber(seq) || !cJSON_IsArray(chunks))
+    {
+        ESP_LOGW(TAG, "Ignoring malformed resend request: %.*s", len, data);
+        cJSON_Delete(root);
+        return;
+    }
+
+    taskENTER_CRITICAL(&resend_lock);
+    struct camera_frame *frame = resend_frame;
+    if (frame != NULL && frame->seq == (uint32_t)seq->valuedouble)
+    {
+        camera_frame_ref(frame);
+    }
+    else
+    {
+        frame = NULL;
+    }
+    taskEXIT_CRITICAL(&resend_lock);
+
+    if (frame == NULL)
+    {
+        ESP_LOGW(TAG, "Camera frame %lu is no longer kept to resend",
+                 (unsigned long)seq->valuedouble);
+        cJSON_Delete(root);
+        return;
+    }
+
+    uint16_t count = (frame->len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    unsigned resent = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, chunks)
+    {
+        if (!cJSON_IsNumber(item) || item->valuedouble < 0 || item->valuedouble >= count)
         {
+            continue;
+        }
 
-            ESP_LOGW(TAG, "Failed to capture image");
+        uint16_t index = item->valuedouble;
+        size_t offset = (size_t)index * CHUNK_SIZE;
+        size_t chunk_len = frame->len - offset < CHUNK_SIZE ? frame->len - offset : CHUNK_SIZE;
+        uint8_t flags = CHUNK_FLAG_RETRANSMIT | (index + 1 == count ? CHUNK_FLAG_LAST : 0);
+        if (!chunk_publish(client, message, frame, index, count, frame->buf + offset, chunk_len,
+                           flags))
+        {
+            break;
         }
-        // Wait until next publish interval
-        vTaskDelay(pdMS_TO_TICKS(PUBLISH_INTERVAL_MS));
+        resent++;
+    }
+
+    ESP_LOGI(TAG, "Resent %u chunks of camera frame %lu", resent, (unsigned long)frame->seq);
+    camera_frame_release(frame);
+    cJSON_Delete(root);
+}
+#else
+/**
+ * @brief Pipeline stream callback publishing each chunk of a frame as its own message.
+ *
+ * MQTT needs the length of a message before its payload, which is not known for a frame encoded
+ * while it is sent, so every chunk is a message of its own with a header to reassemble the frame.
+ * Such frames are published with a chunk count of 0, their last chunk flagged.
+ *
+ * @param frame Frame the chunk belongs to.
+ * @param data Chunk of the encoded image.
+ * @param len Length of @p data.
+ * @param last Whether this is the last chunk of the frame.
+ * @param arg MQTT client handle.
+ * @return true to carry on with the frame, false to abandon it.
+ */
+static bool camera_chunk_publish(const struct camera_frame *frame, const uint8_t *data, size_t len,
+                                 bool last, void *arg)
+{
+    // Only called from the pipeline's send task, one chunk at a time
+    static uint8_t message[CHUNK_HEADER_LEN + CHUNK_SIZE];
+    static uint32_t seq;
+    static uint16_t index;
+    static int64_t send_us;
+
+    if (frame->seq != seq)
+    {
+        seq = frame->seq;
+        index = 0;
+        send_us = 0;
+    }
+
+    // Frames encoded before they are sent have their length, and so their chunk count
+    uint16_t count = frame->buf != NULL ? (frame->len + CHUNK_SIZE - 1) / CHUNK_SIZE : 0;
+
+    int64_t start = esp_timer_get_time();
+    bool ok = chunk_publish((esp_mqtt_client_handle_t)arg, message, frame, index, count, data, len,
+                            last ? CHUNK_FLAG_LAST : 0);
+    send_us += esp_timer_get_time() - start;
+    index++;
+
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Abandoning camera frame %lu at chunk %u", (unsigned long)seq, index - 1);
+    }
+    else if (last)
+    {
+        chunk_frame_published(frame, index, send_us);
+    }
+    return ok;
+}
+#endif
+#else
+/**
+ * @brief Pipeline send callback publishing each encoded frame to MQTT.
+ *
+ * @param frame Encoded frame, released by the pipeline on return.
+ * @param arg MQTT client handle.
+ */
+static void camera_frame_publish(struct camera_frame *frame, void *arg)
+{
+    // Publish the raw image buffer directly over MQTT.
+    // NOTE: Large images can cause issues depending on your MQTT broker limits.
+#if CONFIG_MQTT_OUTBOX
+    // The frame is copied into the outbox and delivered at QoS 1 once the link allows
+    esp_err_t err = mqtt_outbox_publish(CAMERA_TOPIC, frame->buf, frame->len, false);
+    ESP_LOGI(TAG,
+             "Queued camera frame, topic=%s, err=%s, size=%u bytes, capture %lld ms, "
+             "encode %lld ms",
+             CAMERA_TOPIC, esp_err_to_name(err), frame->len, frame->capture_us / 1000,
+             frame->encode_us / 1000);
+#else
+    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
+    int64_t start = esp_timer_get_time();
+    int msg_id = mqtt_metrics_publish(client, CAMERA_TOPIC, (const char *)frame->buf, frame->len,
+                                      0, 0);
+    int64_t publish_us = esp_timer_get_time() - start;
+#if CONFIG_CAMERA_RATE_CONTROL
+    if (msg_id >= 0)
+    {
+        camera_rate_control_frame_sent(frame->len, publish_us);
+    }
+#endif
+    ESP_LOGI(TAG,
+             "Published camera frame, topic=%s, msg_id=%d, size=%u bytes, capture %lld "
+             "ms, encode %lld ms, publish %lld ms",
+             CAMERA_TOPIC, msg_id, frame->len, frame->capture_us / 1000,
+             frame->encode_us / 1000, publish_us / 1000);
+#endif
+}
+#endif
+
+#if CONFIG_CAMERA_MOTION_GATE
+// The background moves half way to each frame, so an object that left stops counting as motion
+// after a frame or two
+#define MOTION_BACKGROUND_SHIFT 1
+
+static camera_motion_handle_t motion;
+
+/**
+ * @brief Pipeline filter passing only frames with motion, and a keyframe now and then.
+ *
+ * @param fb Camera frame buffer of the frame.
+ * @param frame Frame, not encoded yet.
+ * @param arg MQTT client handle (unused).
+ * @return true to publish the frame.
+ */
+static bool camera_motion_filter(const camera_fb_t *fb, const struct camera_frame *frame, void *arg)
+{
+    struct camera_motion_result result;
+    bool publish = camera_motion_check(motion, fb, &result);
+
+    if (publish)
+    {
+        ESP_LOGI(TAG, "Frame %lu: %s, %lu of %lu blocks changed, check %lld ms",
+                 (unsigned long)frame->seq,
+                 result.motion ? "motion" : (result.keyframe ? "keyframe" : "not checked"),
+                 (unsigned long)result.changed, (unsigned long)result.blocks,
+                 result.check_us / 1000);
+    }
+    else
+    {
+        ESP_LOGD(TAG, "Frame %lu: no motion, %lu of %lu blocks changed",
+                 (unsigned long)frame->seq, (unsigned long)result.changed,
+                 (unsigned long)result.blocks);
     }
+    return publish;
+}
+#endif
+
+/**
+ * @brief Start capturing, encoding and publishing frames with the current settings.
+ *
+ * @param client MQTT client to publish with.
+ */
+static void camera_pipeline_begin(esp_mqtt_client_handle_t client)
+{
+    struct camera_pipeline_config config = {
+#if CONFIG_IMAGE_BMP_FORMAT
+        .format = CAMERA_PIPELINE_BMP,
+#else
+        .format = CAMERA_PIPELINE_JPEG,
+#endif
+#if CONFIG_CAMERA_CHUNK_RETRANSMIT
+        .send = camera_chunk_frame_publish,
+#elif CONFIG_CAMERA_CHUNKED_PUBLISH
+        .stream = camera_chunk_publish,
+#else
+        .send = camera_frame_publish,
+#endif
+        .arg = client,
+    };
+
+#if CONFIG_CAMERA_MOTION_GATE
+    const struct camera_motion_config motion_config = {
+        .block_threshold = CONFIG_CAMERA_MOTION_THRESHOLD,
+        .area_percent = CONFIG_CAMERA_MOTION_AREA_PERCENT,
+        .keyframe_interval_ms = CONFIG_CAMERA_MOTION_KEYFRAME_S * 1000,
+        .background_shift = MOTION_BACKGROUND_SHIFT,
+    };
+    ESP_ERROR_CHECK(camera_motion_create(&motion_config, max_framesize, &motion));
+    config.filter = camera_motion_filter;
+#endif
+
+    taskENTER_CRITICAL(&settings_lock);
+    config.interval_ms = settings.interval_ms;
+    config.quality = settings.quality;
+    taskEXIT_CRITICAL(&settings_lock);
+
+    ESP_ERROR_CHECK(camera_pipeline_start(&config));
 }
 
 /*
@@ -140,12 +671,20 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        // ===> START the camera publish task (if not already started)
-        static bool s_task_started = false;
-        if (!s_task_started)
+        // At QoS 1 so that, with a persistent session, commands sent while offline are kept
+        int msg_id = esp_mqtt_client_subscribe(client, COMMAND_TOPIC, 1);
+        ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", COMMAND_TOPIC, msg_id);
+#if CONFIG_CAMERA_CHUNK_RETRANSMIT
+        // Requests are only worth answering while the frame is kept, so nothing is kept offline
+        msg_id = esp_mqtt_client_subscribe(client, CHUNK_RESEND_TOPIC, 0);
+        ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", CHUNK_RESEND_TOPIC, msg_id);
+#endif
+        // ===> START the camera pipeline (if not already started)
+        static bool s_pipeline_started = false;
+        if (!s_pipeline_started)
         {
-            s_task_started = true;
-            xTaskCreate(camera_publish_task, "camera_publish_task", 4096, (void *)client, 5, NULL);
+            s_pipeline_started = true;
+            camera_pipeline_begin(client);
         }
         break;
     case MQTT_EVENT_DISCONNECTED:
@@ -165,6 +704,20 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
+        if (event->topic_len == strlen(COMMAND_TOPIC)
+            && strncmp(event->topic, COMMAND_TOPIC, event->topic_len) == 0
+            && event->data_len == event->total_data_len)
+        {
+            camera_command_apply(event->data, event->data_len);
+        }
+#if CONFIG_CAMERA_CHUNK_RETRANSMIT
+        else if (event->topic_len == strlen(CHUNK_RESEND_TOPIC)
+                 && strncmp(event->topic, CHUNK_RESEND_TOPIC, event->topic_len) == 0
+                 && event->data_len == event->total_data_len)
+        {
+            camera_chunk_resend(client, event->data, event->data_len);
+        }
+#endif
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -187,15 +740,28 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
 void mqtt_app_start(void)
 {
+    camera_settings_load();
+
     esp_mqtt_client_config_t mqtt_cfg = {
         .broker.address.uri = CONFIG_BROKER_URL,
         .credentials.username = CONFIG_BROKER_USERNAME,
         .credentials.authentication.password = CONFIG_BROKER_PASSWORD,
+#if CONFIG_MQTT_OUTBOX_PERSISTENT_SESSION
+        .session.disable_clean_session = true,
+#endif
     };
+#if CONFIG_MQTT_TLS
+    mqtt_cfg.network.transport = mqtt_tls_transport_create();
+#endif
 
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example
      * mqtt_event_handler */
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    mqtt_metrics_init(client);
+#if CONFIG_MQTT_OUTBOX
+    mqtt_outbox_init(client);
+#endif
+    mqtt_metrics_start_reporting(DIAGNOSTICS_TOPIC);
     esp_mqtt_client_start(client);
 }
@@ -1,8 +1,22 @@
-#include "sensor.h"
-#include "driver/i2c_master.h"
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
 #include <assert.h>
-#include <esp_log.h>
-#include <sht4x.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "driver/i2c_master.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "sensor.h"
 
 #define TAG "sensor"
 
@@ -12,52 +26,430 @@
 /** GPIO number for I2C master data (SDA) line, defined via Kconfig: CONFIG_I2C_MASTER_SDA_IO */
 #define I2C_MASTER_SDA_IO CONFIG_I2C_MASTER_SDA_IO
 
-/** Handle for the I2C master bus */
-static i2c_master_bus_handle_t bus_handle;
+/** I2C clock frequency in Hz. */
+#define I2C_MASTER_FREQ_HZ 100000
+
+/**
+ * Depth of the I2C transaction queue. A non-zero depth makes transactions asynchronous: they are
+ * queued and complete in the background, reporting back through the done callback. Deep enough to
+ * queue one transaction for every sensor at once.
+ */
+#define I2C_TRANS_QUEUE_DEPTH SENSOR_MAX_DEVICES
+
+/** Time in milliseconds to wait for a device to acknowledge its address when probing. */
+#define I2C_PROBE_TIMEOUT_MS 50
+
+/** Time in milliseconds @ref sensor_get waits beyond the trigger lead for the results. */
+#define SENSOR_WAIT_MARGIN_MS 100
+
+/** Known sensor drivers, probed in order. */
+static const struct sensor_driver *const drivers[] = {
+    &sht4x_driver,
+    &bh1750_driver,
+};
+
+/** Measurement state. */
+enum sensor_state
+{
+    SENSOR_STATE_IDLE,       /**< No measurement in progress */
+    SENSOR_STATE_CONVERTING, /**< Measurement commands sent, waiting for the conversion time */
+    SENSOR_STATE_READING,    /**< Reading the results */
+    SENSOR_STATE_READY,      /**< Results read, waiting to be collected */
+};
+
+/** A sensor found on the bus. */
+struct sensor_device
+{
+    /** Driver of the sensor. */
+    const struct sensor_driver *driver;
+    /** I2C address of the sensor. */
+    uint16_t address;
+    /** I2C device handle. */
+    i2c_master_dev_handle_t dev;
+    /** Set by the I2C ISR if a transaction of the current measurement failed. */
+    atomic_bool failed;
+    /** Raw measurement result. Asynchronous transactions need their buffers to remain valid. */
+    uint8_t result[SENSOR_DRIVER_MAX_RESULT_LEN];
+    /** First of the sensor's entries in the values table. */
+    struct sensor_value *values;
+};
+
+/** Bus manager state. */
+static struct
+{
+    /** Handle for the I2C master bus. */
+    i2c_master_bus_handle_t bus;
+    /** Sensors found on the bus. */
+    struct sensor_device devices[SENSOR_MAX_DEVICES];
+    /** Number of entries in @c devices. */
+    size_t num_devices;
+    /** Values measured by all sensors. */
+    struct sensor_value values[SENSOR_MAX_VALUES];
+    /** Number of entries in @c values. */
+    size_t num_values;
+    /** Slowest conversion time of the sensors found, in microseconds. */
+    uint32_t conversion_us;
+    /** One-shot timer reading the results once the conversion time and its margin have elapsed. */
+    esp_timer_handle_t conversion_timer;
+    /** Given when the results of every sensor have been read or have failed. */
+    SemaphoreHandle_t done;
+    /** Measurement state, changed from the caller's task, the timer task and the I2C ISR. */
+    _Atomic enum sensor_state state;
+    /** Number of reads of the current measurement still in progress. */
+    atomic_int reads_pending;
+    /** Time the current measurement was triggered. */
+    int64_t trigger_us;
+    /** Time the results of the current measurement had all been read. */
+    int64_t ready_us;
+    /** Measurement timing. */
+    struct sensor_timing timing;
+} bus = {};
+
+/** Protects @c bus.timing. */
+static portMUX_TYPE timing_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * I2C transaction done callback, called from the ISR.
+ *
+ * @param[in] dev I2C device handle (unused)
+ * @param[in] event_data Result of the transaction
+ * @param[in] arg The @c struct sensor_device the transaction was for
+ * @return Whether a higher priority task was woken
+ */
+static bool IRAM_ATTR i2c_trans_done(i2c_master_dev_handle_t dev,
+                                     const i2c_master_event_data_t *event_data, void *arg)
+{
+    struct sensor_device *device = arg;
+    BaseType_t woken = pdFALSE;
+
+    if (event_data->event != I2C_EVENT_DONE)
+    {
+        atomic_store(&device->failed, true);
+    }
+
+    /* Measurement commands need no handling, the conversion timer reads the results */
+    if (atomic_load(&bus.state) != SENSOR_STATE_READING)
+    {
+        return false;
+    }
+
+    if (atomic_fetch_sub(&bus.reads_pending, 1) == 1)
+    {
+        bus.ready_us = esp_timer_get_time();
+        atomic_store(&bus.state, SENSOR_STATE_READY);
+        xSemaphoreGiveFromISR(bus.done, &woken);
+    }
+
+    return woken == pdTRUE;
+}
+
+/**
+ * Conversion timer callback that starts reading the results of every sensor.
+ *
+ * @param[in] arg User data passed to the timer (unused)
+ */
+static void conversion_timer_callback(void *arg)
+{
+    atomic_store(&bus.reads_pending, bus.num_devices);
+    atomic_store(&bus.state, SENSOR_STATE_READING);
+
+    for (size_t i = 0; i < bus.num_devices; i++)
+    {
+        struct sensor_device *device = &bus.devices[i];
+
+        esp_err_t err =
+            i2c_master_receive(device->dev, device->result, device->driver->result_len, -1);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to queue %s read: %s", device->driver->name,
+                     esp_err_to_name(err));
+            atomic_store(&device->failed, true);
+
+            /* Count the read as done; this may complete the measurement */
+            if (atomic_fetch_sub(&bus.reads_pending, 1) == 1)
+            {
+                bus.ready_us = esp_timer_get_time();
+                atomic_store(&bus.state, SENSOR_STATE_READY);
+                xSemaphoreGive(bus.done);
+            }
+        }
+    }
+}
+
+/**
+ * Probe an address and register the sensor if one answers.
+ *
+ * @param[in] driver Driver of the sensor expected at @p address.
+ * @param[in] address I2C address to probe.
+ */
+static void sensor_probe(const struct sensor_driver *driver, uint16_t address)
+{
+    if (i2c_master_probe(bus.bus, address, I2C_PROBE_TIMEOUT_MS) != ESP_OK)
+    {
+        return;
+    }
+
+    if (bus.num_devices == SENSOR_MAX_DEVICES)
+    {
+        ESP_LOGW(TAG, "Ignoring %s at 0x%02x, too many sensors", driver->name, address);
+        return;
+    }
+
+    struct sensor_device *device = &bus.devices[bus.num_devices];
+    device->driver = driver;
+    device->address = address;
+
+    i2c_device_config_t dev_cfg = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = address,
+        .scl_speed_hz = I2C_MASTER_FREQ_HZ,
+    };
+
+    ESP_ERROR_CHECK(i2c_master_bus_add_device(bus.bus, &dev_cfg, &device->dev));
+
+    const i2c_master_event_callbacks_t cbs = {.on_trans_done = i2c_trans_done};
+    ESP_ERROR_CHECK(i2c_master_register_event_callbacks(device->dev, &cbs, device));
+
+    if (driver->init != NULL)
+    {
+        esp_err_t err = driver->init(bus.bus, device->dev);
+        if (err != ESP_OK || atomic_exchange(&device->failed, false))
+        {
+            ESP_LOGE(TAG, "Failed to initialize %s at 0x%02x: %s", driver->name, address,
+                     esp_err_to_name(err));
+            ESP_ERROR_CHECK(i2c_master_bus_rm_device(device->dev));
+            return;
+        }
+    }
+
+    /* The first sensor of a kind keeps the plain channel names */
+    bool first = true;
+    for (size_t i = 0; i < bus.num_devices; i++)
+    {
+        first &= bus.devices[i].driver != driver;
+    }
+
+    device->values = &bus.values[bus.num_values];
+    for (size_t i = 0; i < driver->num_channels; i++)
+    {
+        struct sensor_value *value = &bus.values[bus.num_values++];
+        const char *name = driver->channels[i].name;
+
+        value->channel = &driver->channels[i];
+        if (first)
+        {
+            snprintf(value->name, sizeof(value->name), "%s", name);
+        }
+        else
+        {
+            snprintf(value->name, sizeof(value->name), "%s_%02x", name, address);
+        }
+    }
+
+    if (driver->conversion_us > bus.conversion_us)
+    {
+        bus.conversion_us = driver->conversion_us;
+    }
 
-/** Handle for the SHT4x temperature and humidity sensor device */
-static sht4x_handle_t sht4x_dev_hdl = NULL;
+    bus.num_devices++;
+    ESP_LOGI(TAG, "Found %s at 0x%02x", driver->name, address);
+}
 
 void sensor_init(void)
 {
+    /* This shall only ever be initialised once. */
+    assert(bus.bus == NULL);
+
     i2c_master_bus_config_t i2c_mst_config = {
         .clk_source = I2C_CLK_SRC_DEFAULT,
         .i2c_port = -1,
         .scl_io_num = I2C_MASTER_SCL_IO,
         .sda_io_num = I2C_MASTER_SDA_IO,
         .glitch_ignore_cnt = 7,
+        .trans_queue_depth = I2C_TRANS_QUEUE_DEPTH,
         .flags.enable_internal_pullup = true,
     };
 
-    ESP_ERROR_CHECK(i2c_new_master_bus(&i2c_mst_config, &bus_handle));
+    ESP_ERROR_CHECK(i2c_new_master_bus(&i2c_mst_config, &bus.bus));
+
+    bus.done = xSemaphoreCreateBinary();
+    assert(bus.done != NULL);
 
-    sht4x_config_t dev_cfg = I2C_SHT4X_CONFIG_DEFAULT;
-    esp_err_t err = sht4x_init(bus_handle, &dev_cfg, &sht4x_dev_hdl);
-    if (err != ESP_OK || sht4x_dev_hdl == NULL)
+    const esp_timer_create_args_t timer_args = {.callback = &conversion_timer_callback,
+                                                .name = "sensor_conversion"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &bus.conversion_timer));
+
+    for (size_t i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++)
     {
-        ESP_LOGE(TAG, "Failed to initialize SHT4X device: %s", esp_err_to_name(err));
-        assert(false);
+        for (size_t j = 0; j < drivers[i]->num_addresses; j++)
+        {
+            sensor_probe(drivers[i], drivers[i]->addresses[j]);
+        }
     }
 
-    ESP_LOGI(TAG, "SHT4X sensor initialized successfully");
+    if (bus.num_devices == 0)
+    {
+        ESP_LOGW(TAG, "No sensors found on the I2C bus");
+        return;
+    }
+
+    ESP_LOGI(TAG, "%zu sensors with %zu values, slowest conversion %lu us", bus.num_devices,
+             bus.num_values, bus.conversion_us);
+}
+
+size_t sensor_get_values(struct sensor_value **values)
+{
+    *values = bus.values;
+
+    return bus.num_values;
+}
+
+uint32_t sensor_trigger_lead_ms(void)
+{
+    return (bus.conversion_us + 999) / 1000 + SENSOR_CONVERSION_MARGIN_MS + SENSOR_READ_MARGIN_MS;
 }
 
-struct sensor_data sensor_get(void)
+void sensor_trigger(void)
 {
-    struct sensor_data data = {0};
+    enum sensor_state state = atomic_load(&bus.state);
 
-    if (sht4x_dev_hdl == NULL)
+    if (bus.num_devices == 0)
     {
-        ESP_LOGE(TAG, "SHT4X device not initialized");
-        return data;
+        return;
     }
 
-    esp_err_t err =
-        sht4x_get_measurement(sht4x_dev_hdl, &data.temperature_c, &data.humidity_percent);
-    if (err != ESP_OK)
+    do
     {
-        ESP_LOGE(TAG, "Failed to read SHT4X sensor: %s", esp_err_to_name(err));
+        if (state == SENSOR_STATE_CONVERTING || state == SENSOR_STATE_READING)
+        {
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&bus.state, &state, SENSOR_STATE_CONVERTING));
+
+    /* Discard the results of an earlier measurement that were never collected */
+    xSemaphoreTake(bus.done, 0);
+
+    bus.trigger_us = esp_timer_get_time();
+
+    /* Queue every command back to back so all sensors convert at the same time */
+    for (size_t i = 0; i < bus.num_devices; i++)
+    {
+        struct sensor_device *device = &bus.devices[i];
+
+        atomic_store(&device->failed, false);
+        esp_err_t err = i2c_master_transmit(device->dev, device->driver->measure_cmd,
+                                            device->driver->measure_cmd_len, -1);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to queue %s measurement: %s", device->driver->name,
+                     esp_err_to_name(err));
+            atomic_store(&device->failed, true);
+        }
     }
 
-    return data;
+    /* The timer runs from queueing the commands, so allow for their transmission as well */
+    ESP_ERROR_CHECK(esp_timer_start_once(bus.conversion_timer,
+                                         bus.conversion_us + SENSOR_CONVERSION_MARGIN_MS * 1000));
+}
+
+esp_err_t sensor_get(void)
+{
+    esp_err_t ret = ESP_OK;
+    int64_t start_us = esp_timer_get_time();
+
+    if (bus.num_devices == 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    /* Without a trigger ahead of time, e.g. for the first update, measure now */
+    if (atomic_load(&bus.state) == SENSOR_STATE_IDLE)
+    {
+        ESP_LOGD(TAG, "No measurement in progress, triggering one");
+        sensor_trigger();
+    }
+
+    TickType_t timeout = pdMS_TO_TICKS(sensor_trigger_lead_ms() + SENSOR_WAIT_MARGIN_MS);
+    bool ready = xSemaphoreTake(bus.done, timeout) == pdTRUE;
+
+    if (ready)
+    {
+        /* If a trigger has already started the next measurement, leave it running; the result
+         * buffers are not written again until its conversion time has elapsed */
+        enum sensor_state expected = SENSOR_STATE_READY;
+        atomic_compare_exchange_strong(&bus.state, &expected, SENSOR_STATE_IDLE);
+    }
+    else
+    {
+        /* Late results are ignored as the state is no longer reading, and the next trigger
+         * starts over */
+        ESP_LOGE(TAG, "Timed out waiting for sensors");
+        atomic_store(&bus.state, SENSOR_STATE_IDLE);
+        ret = ESP_ERR_TIMEOUT;
+    }
+
+    for (size_t i = 0; i < bus.num_devices; i++)
+    {
+        struct sensor_device *device = &bus.devices[i];
+        const struct sensor_driver *driver = device->driver;
+        float values[SENSOR_DRIVER_MAX_VALUES];
+        esp_err_t err = ESP_ERR_TIMEOUT;
+
+        if (ready)
+        {
+            err = atomic_load(&device->failed) ? ESP_FAIL : driver->convert(device->result, values);
+        }
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to read %s at 0x%02x: %s", driver->name, device->address,
+                     esp_err_to_name(err));
+            ret = err;
+        }
+
+        for (size_t j = 0; j < driver->num_channels; j++)
+        {
+            device->values[j].valid = (err == ESP_OK);
+            if (err == ESP_OK)
+            {
+                device->values[j].value = values[j];
+            }
+        }
+    }
+
+    int64_t wait_us = esp_timer_get_time() - start_us;
+
+    taskENTER_CRITICAL(&timing_lock);
+    if (ret == ESP_OK)
+    {
+        bus.timing.measurements++;
+        bus.timing.conversion_us = bus.ready_us - bus.trigger_us;
+        if (bus.timing.conversion_us > bus.timing.conversion_max_us)
+        {
+            bus.timing.conversion_max_us = bus.timing.conversion_us;
+        }
+    }
+    else
+    {
+        bus.timing.errors++;
+    }
+    bus.timing.wait_us = wait_us;
+    if (wait_us > bus.timing.wait_max_us)
+    {
+        bus.timing.wait_max_us = wait_us;
+    }
+    taskEXIT_CRITICAL(&timing_lock);
+
+    ESP_LOGD(TAG, "Measured %zu sensors in %lld us, waited %lld us", bus.num_devices,
+             bus.ready_us - bus.trigger_us, wait_us);
+
+    return ret;
+}
+
+void sensor_get_timing(struct sensor_timing *timing)
+{
+    taskENTER_CRITICAL(&timing_lock);
+    *timing = bus.timing;
+    taskEXIT_CRITICAL(&timing_lock);
 }
@@ -6,25 +6,115 @@
  */
 #pragma once
 
-/** Sensor reading structure for temperature and humidity. */
-struct sensor_data
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensor_driver.h"
+
+/** Largest number of sensors on the bus. */
+#define SENSOR_MAX_DEVICES 4
+
+/** Largest number of values measured by all sensors together. */
+#define SENSOR_MAX_VALUES (SENSOR_MAX_DEVICES * SENSOR_DRIVER_MAX_VALUES)
+
+/**
+ * Time in milliseconds added to the slowest conversion before the results are read. The
+ * measurement commands are only queued when a measurement is triggered, so this covers their
+ * transmission on the bus and the timer latency.
+ */
+#define SENSOR_CONVERSION_MARGIN_MS 5
+
+/**
+ * Time in milliseconds allowed for reading the results, added to the conversion time and its
+ * margin to get the time between triggering a measurement and collecting it.
+ */
+#define SENSOR_READ_MARGIN_MS 5
+
+/** A value measured by a sensor on the bus. */
+struct sensor_value
 {
-    float temperature_c;    /**< Temperature in Celsius */
-    float humidity_percent; /**< Relative humidity in percentage */
+    /**
+     * Unique key of the value. The channel name for the first sensor of a kind, with the address
+     * appended for any further ones, e.g. "temperature" and "temperature_45".
+     */
+    char name[24];
+    /** Description of the value. */
+    const struct sensor_channel *channel;
+    /** Value of the last measurement. */
+    float value;
+    /** Whether the last measurement succeeded. */
+    bool valid;
+};
+
+/** Timing of the measurements, all times in microseconds. */
+struct sensor_timing
+{
+    /** Measurements of the whole bus collected successfully. */
+    uint32_t measurements;
+    /** Measurements where a sensor failed on the bus, timed out or had a bad CRC. */
+    uint32_t errors;
+    /** Time from triggering the measurement until the results of every sensor had been read. */
+    int64_t conversion_us;
+    /** Largest @c conversion_us. */
+    int64_t conversion_max_us;
+    /** Time @ref sensor_get spent waiting for the results, i.e. blocking its caller. */
+    int64_t wait_us;
+    /** Largest @c wait_us. */
+    int64_t wait_max_us;
 };
 
 /**
  * Initialize the environmental sensor subsystem.
  *
- * This function configures the I2C bus and sets up the sensor.
+ * This function configures the I2C bus, probes the addresses of every known sensor driver and
+ * registers the sensors found.
  *
  * @warning This can only be called once.
  */
 void sensor_init(void);
 
 /**
- * Read temperature and humidity data from the sensor.
+ * Get the values measured by the sensors found on the bus.
+ *
+ * @param[out] values Values, valid for the lifetime of the application. Updated by
+ *                    @ref sensor_get.
+ * @return Number of entries in @p values.
+ */
+size_t sensor_get_values(struct sensor_value **values);
+
+/**
+ * Get the time between triggering a measurement and collecting it.
+ *
+ * @return Time in milliseconds to call @ref sensor_trigger ahead of @ref sensor_get.
+ */
+uint32_t sensor_trigger_lead_ms(void);
+
+/**
+ * Start a measurement on every sensor without waiting for it.
+ *
+ * The measurement commands of all sensors are queued on the I2C bus back to back, so the sensors
+ * convert concurrently. The results are read once the slowest conversion time and a margin for
+ * sending the commands have elapsed, all without blocking the caller. Does nothing if a
+ * measurement is already in progress. Call this @ref sensor_trigger_lead_ms before
+ * @ref sensor_get.
+ */
+void sensor_trigger(void);
+
+/**
+ * Collect the results of the last triggered measurement into the values.
+ *
+ * Returns straight away if the measurement has completed. Otherwise waits for it, triggering one
+ * first if none is in progress.
+ *
+ * @return ESP_OK if every sensor was read, otherwise the values of the failed sensors are marked
+ *         invalid.
+ */
+esp_err_t sensor_get(void);
+
+/**
+ * Get the timing of the measurements.
  *
- * @return @c struct sensor_data containing the current measurement.
+ * @param[out] timing Timing of the last measurement and the largest seen so far.
  */
-struct sensor_data sensor_get(void);
+void sensor_get_timing(struct sensor_timing *timing);
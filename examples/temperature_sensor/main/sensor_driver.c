@@ -0,0 +1,236 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sensor_driver.h"
+
+/** Soft reset command. */
+#define SHT4X_CMD_SOFT_RESET 0x94
+
+/** Time in milliseconds the sensor needs after a soft reset. */
+#define SHT4X_RESET_TIME_MS 1
+
+#if CONFIG_SHT4X_PRECISION_HIGH
+/** Measure T & RH with high precision (high repeatability). */
+#define SHT4X_CMD_MEASURE 0xFD
+/** Maximum measurement duration at high precision in microseconds. */
+#define SHT4X_CONVERSION_US 8300
+#elif CONFIG_SHT4X_PRECISION_MEDIUM
+/** Measure T & RH with medium precision (medium repeatability). */
+#define SHT4X_CMD_MEASURE 0xF6
+/** Maximum measurement duration at medium precision in microseconds. */
+#define SHT4X_CONVERSION_US 4500
+#else
+/** Measure T & RH with lowest precision (low repeatability). */
+#define SHT4X_CMD_MEASURE 0xE0
+/** Maximum measurement duration at low precision in microseconds. */
+#define SHT4X_CONVERSION_US 1600
+#endif
+
+/** Power on command. */
+#define BH1750_CMD_POWER_ON 0x01
+
+/** One time high resolution measurement, 1 lx resolution. The sensor powers down afterwards. */
+#define BH1750_CMD_ONE_TIME_H_RES 0x20
+
+/** Maximum high resolution measurement duration in microseconds. */
+#define BH1750_CONVERSION_US 180000
+
+/** Counts per lux at the default measurement time. */
+#define BH1750_COUNTS_PER_LUX 1.2f
+
+/**
+ * Write a command synchronously.
+ *
+ * The bus is used asynchronously, so wait for the command to complete before returning.
+ *
+ * @param[in] bus I2C bus handle.
+ * @param[in] dev I2C device handle.
+ * @param[in] cmd Command byte. Must remain valid until the transaction completes.
+ * @return ESP_OK on success, otherwise an error from the I2C driver.
+ */
+static esp_err_t write_cmd(i2c_master_bus_handle_t bus, i2c_master_dev_handle_t dev,
+                           const uint8_t *cmd)
+{
+    esp_err_t err = i2c_master_transmit(dev, cmd, 1, -1);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    return i2c_master_bus_wait_all_done(bus, -1);
+}
+
+/**
+ * Calculate the CRC-8 of a word as used by Sensirion sensors (polynomial 0x31, init 0xFF).
+ *
+ * @param[in] data Two data bytes.
+ * @return CRC of @p data.
+ */
+static uint8_t sht4x_crc(const uint8_t *data)
+{
+    uint8_t crc = 0xFF;
+
+    for (int i = 0; i < 2; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * Soft reset the SHT4x.
+ *
+ * @param[in] bus I2C bus handle.
+ * @param[in] dev I2C device handle.
+ * @return ESP_OK on success, otherwise an error from the I2C driver.
+ */
+static esp_err_t sht4x_init(i2c_master_bus_handle_t bus, i2c_master_dev_handle_t dev)
+{
+    static const uint8_t cmd = SHT4X_CMD_SOFT_RESET;
+
+    esp_err_t err = write_cmd(bus, dev, &cmd);
+    vTaskDelay(pdMS_TO_TICKS(SHT4X_RESET_TIME_MS));
+
+    return err;
+}
+
+/**
+ * Convert and check an SHT4x measurement result.
+ *
+ * @param[in] result Temperature and humidity words, each followed by a CRC.
+ * @param[out] values Temperature in Celsius and relative humidity in percent.
+ * @return ESP_OK on success, ESP_ERR_INVALID_CRC if either word is corrupt.
+ */
+static esp_err_t sht4x_convert(const uint8_t *result, float *values)
+{
+    if (sht4x_crc(&result[0]) != result[2] || sht4x_crc(&result[3]) != result[5])
+    {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    uint16_t t_ticks = (result[0] << 8) | result[1];
+    uint16_t rh_ticks = (result[3] << 8) | result[4];
+
+    values[0] = -45.0f + 175.0f * t_ticks / 65535.0f;
+    values[1] = -6.0f + 125.0f * rh_ticks / 65535.0f;
+
+    /* The formula can give values slightly outside the physical range */
+    if (values[1] < 0.0f)
+    {
+        values[1] = 0.0f;
+    }
+    else if (values[1] > 100.0f)
+    {
+        values[1] = 100.0f;
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * Power on the BH1750.
+ *
+ * @param[in] bus I2C bus handle.
+ * @param[in] dev I2C device handle.
+ * @return ESP_OK on success, otherwise an error from the I2C driver.
+ */
+static esp_err_t bh1750_init(i2c_master_bus_handle_t bus, i2c_master_dev_handle_t dev)
+{
+    static const uint8_t cmd = BH1750_CMD_POWER_ON;
+
+    return write_cmd(bus, dev, &cmd);
+}
+
+/**
+ * Convert a BH1750 measurement result.
+ *
+ * @param[in] result Illuminance count, big endian.
+ * @param[out] values Illuminance in lux.
+ * @return ESP_OK
+ */
+static esp_err_t bh1750_convert(const uint8_t *result, float *values)
+{
+    values[0] = ((result[0] << 8) | result[1]) / BH1750_COUNTS_PER_LUX;
+
+    return ESP_OK;
+}
+
+/** SHT40/SHT41/SHT45 addresses, depending on the part number. */
+static const uint16_t sht4x_addresses[] = {0x44, 0x45, 0x46};
+
+/** Values measured by the SHT4x. */
+static const struct sensor_channel sht4x_channels[] = {
+    {
+        .name = "temperature",
+        .device_class = "temperature",
+        .unit = "°C",
+        .precision = 2,
+        .deadband = 0.1f,
+    },
+    {
+        .name = "humidity",
+        .device_class = "humidity",
+        .unit = "%",
+        .precision = 2,
+        .deadband = 0.5f,
+    },
+};
+
+/** SHT4x measurement command. */
+static const uint8_t sht4x_measure_cmd[] = {SHT4X_CMD_MEASURE};
+
+const struct sensor_driver sht4x_driver = {
+    .name = "SHT4x",
+    .addresses = sht4x_addresses,
+    .num_addresses = sizeof(sht4x_addresses) / sizeof(sht4x_addresses[0]),
+    .channels = sht4x_channels,
+    .num_channels = sizeof(sht4x_channels) / sizeof(sht4x_channels[0]),
+    .init = sht4x_init,
+    .measure_cmd = sht4x_measure_cmd,
+    .measure_cmd_len = sizeof(sht4x_measure_cmd),
+    .conversion_us = SHT4X_CONVERSION_US,
+    .result_len = 6,
+    .convert = sht4x_convert,
+};
+
+/** BH1750 addresses with the ADDR pin low and high. */
+static const uint16_t bh1750_addresses[] = {0x23, 0x5C};
+
+/** Values measured by the BH1750. */
+static const struct sensor_channel bh1750_channels[] = {
+    {
+        .name = "illuminance",
+        .device_class = "illuminance",
+        .unit = "lx",
+        .precision = 0,
+        .deadband = 10.0f,
+    },
+};
+
+/** BH1750 measurement command. */
+static const uint8_t bh1750_measure_cmd[] = {BH1750_CMD_ONE_TIME_H_RES};
+
+const struct sensor_driver bh1750_driver = {
+    .name = "BH1750",
+    .addresses = bh1750_addresses,
+    .num_addresses = sizeof(bh1750_addresses) / sizeof(bh1750_addresses[0]),
+    .channels = bh1750_channels,
+    .num_channels = sizeof(bh1750_channels) / sizeof(bh1750_channels[0]),
+    .init = bh1750_init,
+    .measure_cmd = bh1750_measure_cmd,
+    .measure_cmd_len = sizeof(bh1750_measure_cmd),
+    .conversion_us = BH1750_CONVERSION_US,
+    .result_len = 2,
+    .convert = bh1750_convert,
+};
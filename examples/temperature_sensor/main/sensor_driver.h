@@ -0,0 +1,86 @@
+/*
+ * Copyright 2025 Robert Carey
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/i2c_master.h"
+#include "esp_err.h"
+
+/** Largest number of values a single sensor measures. */
+#define SENSOR_DRIVER_MAX_VALUES 2
+
+/** Largest measurement result read from a sensor in bytes. */
+#define SENSOR_DRIVER_MAX_RESULT_LEN 6
+
+/** Description of a value measured by a sensor. */
+struct sensor_channel
+{
+    /** Key of the value, e.g. "temperature". */
+    const char *name;
+    /** Home Assistant device class, or NULL to omit. */
+    const char *device_class;
+    /** Unit of measurement, or NULL to omit. */
+    const char *unit;
+    /** Number of decimal places published. */
+    uint8_t precision;
+    /** Change that is worth reporting, in @c unit. */
+    float deadband;
+};
+
+/**
+ * Driver for an I2C sensor that measures on command.
+ *
+ * A measurement is taken by writing @c measure_cmd, waiting @c conversion_us and then reading
+ * @c result_len bytes, which @c convert turns into values. This lets the bus manager run the
+ * measurements of all sensors on the bus concurrently.
+ */
+struct sensor_driver
+{
+    /** Name of the sensor, for logging. */
+    const char *name;
+    /** Addresses the sensor may be found at. */
+    const uint16_t *addresses;
+    /** Number of entries in @c addresses. */
+    size_t num_addresses;
+    /** Values measured by the sensor. */
+    const struct sensor_channel *channels;
+    /** Number of entries in @c channels, at most @ref SENSOR_DRIVER_MAX_VALUES. */
+    size_t num_channels;
+    /**
+     * Optional callback to prepare the sensor once after it has been found, may be NULL. Called
+     * before any measurement is queued, so it may block.
+     *
+     * @param[in] bus I2C bus handle.
+     * @param[in] dev I2C device handle.
+     * @return ESP_OK on success, otherwise the sensor is not used.
+     */
+    esp_err_t (*init)(i2c_master_bus_handle_t bus, i2c_master_dev_handle_t dev);
+    /** Command starting a measurement. */
+    const uint8_t *measure_cmd;
+    /** Length of @c measure_cmd in bytes. */
+    size_t measure_cmd_len;
+    /** Longest time a measurement takes in microseconds. */
+    uint32_t conversion_us;
+    /** Length of the measurement result in bytes, at most @ref SENSOR_DRIVER_MAX_RESULT_LEN. */
+    size_t result_len;
+    /**
+     * Convert a measurement result.
+     *
+     * @param[in] result Raw result, @c result_len bytes.
+     * @param[out] values One value per channel.
+     * @return ESP_OK on success, ESP_ERR_INVALID_CRC if the result is corrupt.
+     */
+    esp_err_t (*convert)(const uint8_t *result, float *values);
+};
+
+/** Sensirion SHT4x temperature and humidity sensor. */
+extern const struct sensor_driver sht4x_driver;
+
+/** Rohm BH1750 ambient light sensor. */
+extern const struct sensor_driver bh1750_driver;
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Republish CBOR encoded sensor state as JSON for Home Assistant.
+
+Devices built with CONFIG_STATE_ENCODING_CBOR publish their state as a CBOR map with small
+integer keys on `<device_id>/state/cbor`, and a retained key list on `<device_id>/state/keys`.
+This bridge subscribes to both, decodes each state message and republishes it as JSON on
+`<device_id>/state`, which is the state topic announced in the device's discovery message.
+"""
+
+import argparse
+import json
+import logging
+import struct
+
+import paho.mqtt.client as mqtt
+
+LOG = logging.getLogger("cbor_bridge")
+
+CBOR_TOPIC_SUFFIX = "/state/cbor"
+KEYS_TOPIC_SUFFIX = "/state/keys"
+STATE_TOPIC_SUFFIX = "/state"
+
+
+class CborDecodeError(ValueError):
+    pass
+
+
+def _decode_item(data, offset):
+    """Decode a single CBOR item, returning (value, next offset)."""
+    if offset >= len(data):
+        raise CborDecodeError("unexpected end of data")
+
+    initial = data[offset]
+    major = initial >> 5
+    info = initial & 0x1F
+    offset += 1
+
+    if major == 7:
+        if info == 20:
+            return False, offset
+        if info == 21:
+            return True, offset
+        if info == 22:
+            return None, offset
+        if info == 25:
+            return struct.unpack_from(">e", data, offset)[0], offset + 2
+        if info == 26:
+            return struct.unpack_from(">f", data, offset)[0], offset + 4
+        if info == 27:
+            return struct.unpack_from(">d", data, offset)[0], offset + 8
+        raise CborDecodeError(f"unsupported simple value {info}")
+
+    if info < 24:
+        arg = info
+    elif info in (24, 25, 26, 27):
+        size = 1 << (info - 24)
+        if offset + size > len(data):
+            raise CborDecodeError("unexpected end of data")
+        arg = int.from_bytes(data[offset : offset + size], "big")
+        offset += size
+    else:
+        raise CborDecodeError(f"unsupported additional information {info}")
+
+    if major == 0:
+        return arg, offset
+    if major == 1:
+        return -1 - arg, offset
+    if major in (2, 3):
+        if offset + arg > len(data):
+            raise CborDecodeError("unexpected end of data")
+        value = bytes(data[offset : offset + arg])
+        return (value if major == 2 else value.decode("utf-8")), offset + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, offset = _decode_item(data, offset)
+            items.append(item)
+        return items, offset
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, offset = _decode_item(data, offset)
+            items[key], offset = _decode_item(data, offset)
+        return items, offset
+
+    raise CborDecodeError(f"unsupported major type {major}")
+
+
+def cbor_decode(data):
+    """Decode a complete CBOR message."""
+    value, offset = _decode_item(data, 0)
+    if offset != len(data):
+        raise CborDecodeError(f"{len(data) - offset} trailing bytes")
+    return value
+
+
+def state_to_json(state, keys):
+    """Convert a decoded CBOR state map into the JSON state dictionary."""
+    result = {}
+    for index, raw in state.items():
+        if not isinstance(index, int) or index >= len(keys):
+            LOG.warning("Unknown key %r, skipping", index)
+            continue
+        name = keys[index]["n"]
+        precision = keys[index].get("p", 0)
+        result[name] = raw / 10**precision if precision else raw
+    return result
+
+
+class Bridge:
+    def __init__(self, client, prefix):
+        self.client = client
+        self.prefix = prefix
+        self.keys = {}
+
+    def on_connect(self, client, userdata, flags, rc, *args):
+        LOG.info("Connected to broker (rc=%s)", rc)
+        client.subscribe(self.prefix + "+" + CBOR_TOPIC_SUFFIX)
+        client.subscribe(self.prefix + "+" + KEYS_TOPIC_SUFFIX)
+
+    def on_message(self, client, userdata, msg):
+        if msg.topic.endswith(KEYS_TOPIC_SUFFIX):
+            device = msg.topic[: -len(KEYS_TOPIC_SUFFIX)]
+            self.keys[device] = json.loads(msg.payload)
+            LOG.info("%s: keys %s", device, [k["n"] for k in self.keys[device]])
+            return
+
+        device = msg.topic[: -len(CBOR_TOPIC_SUFFIX)]
+        keys = self.keys.get(device)
+        if keys is None:
+            LOG.warning("%s: no key list received yet, dropping state", device)
+            return
+
+        try:
+            state = cbor_decode(msg.payload)
+        except (CborDecodeError, struct.error, UnicodeDecodeError) as e:
+            LOG.warning("%s: failed to decode %s: %s", device, msg.payload.hex(), e)
+            return
+
+        payload = json.dumps(state_to_json(state, keys), separators=(",", ":"))
+        client.publish(device + STATE_TOPIC_SUFFIX, payload)
+        LOG.debug("%s: %d bytes CBOR -> %s", device, len(msg.payload), payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="localhost", help="MQTT broker host")
+    parser.add_argument("--port", type=int, default=1883, help="MQTT broker port")
+    parser.add_argument("--username", help="MQTT username")
+    parser.add_argument("--password", help="MQTT password")
+    parser.add_argument("--prefix", default="", help="Topic prefix in front of the device ID")
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every message")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+
+    bridge = Bridge(client, args.prefix)
+    client.on_connect = bridge.on_connect
+    client.on_message = bridge.on_message
+
+    client.connect(args.host, args.port)
+    client.loop_forever()
+
+
+if __name__ == "__main__":
+    main()
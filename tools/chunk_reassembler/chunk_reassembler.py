@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Reassemble camera frames published in chunks and report their loss and latency.
+
+mqtt_pic_client built with CONFIG_CAMERA_CHUNKED_PUBLISH publishes each frame as a series of
+messages on `<image topic>/chunk`. This tool subscribes to them, checks the CRC of every chunk,
+writes each complete frame to a file and, for a client built with CONFIG_CAMERA_CHUNK_RETRANSMIT,
+asks for the chunks it missed on `<image topic>/chunk/resend`.
+"""
+
+import argparse
+import collections
+import json
+import logging
+import os
+import struct
+import threading
+import time
+import zlib
+
+import paho.mqtt.client as mqtt
+
+LOG = logging.getLogger("chunk_reassembler")
+
+# Frame sequence number, chunk index, chunk count (0 if not known when sent), flags, header length,
+# reserved, capture time in ms since the device booted and CRC-32 of the payload, big endian
+HEADER = struct.Struct(">IHHBBHII")
+FLAG_LAST = 1 << 0
+FLAG_RETRANSMIT = 1 << 1
+
+# Completed frames remembered, so that late duplicates of their chunks are not taken for new frames
+DONE_HISTORY = 64
+
+
+def _percentile(values, pct):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+class Frame:
+    def __init__(self, seq, capture_ms, now):
+        self.seq = seq
+        self.capture_ms = capture_ms
+        self.count = None
+        self.chunks = {}
+        self.first_rx = now
+        self.deadline = now
+        self.requests = 0
+
+    def missing(self):
+        """Indexes missing, below the highest received if the count is not known."""
+        end = self.count if self.count is not None else max(self.chunks) + 1
+        return [index for index in range(end) if index not in self.chunks]
+
+
+class Stats:
+    def __init__(self):
+        self.complete = 0
+        self.lost = 0
+        self.recovered = 0
+        self.chunks = 0
+        self.crc_errors = 0
+        self.malformed = 0
+        self.duplicates = 0
+        self.resent = 0
+        self.requests = 0
+        self.transfer_ms = []
+        # Completion time on the host minus capture time on the device, per frame
+        self.offsets = []
+
+    def line(self):
+        frames = self.complete + self.lost
+        offsets = self.offsets
+        base = min(offsets) if offsets else 0
+        delays = [(offset - base) * 1000 for offset in offsets]
+        return (
+            f"frames {self.complete} complete, {self.lost} lost "
+            f"({self.lost * 100 / frames if frames else 0:.1f}%), {self.recovered} recovered; "
+            f"chunks {self.chunks}, {self.crc_errors} CRC errors, {self.malformed} malformed, "
+            f"{self.duplicates} duplicates, {self.resent} resent after {self.requests} requests; "
+            f"transfer p50 {_percentile(self.transfer_ms, 50):.0f} ms "
+            f"p95 {_percentile(self.transfer_ms, 95):.0f} ms; "
+            f"delay p50 +{_percentile(delays, 50):.0f} ms p95 +{_percentile(delays, 95):.0f} ms"
+        )
+
+
+class Reassembler:
+    def __init__(self, client, args):
+        self.client = client
+        self.args = args
+        self.chunk_topic = args.topic + "/chunk"
+        self.resend_topic = self.chunk_topic + "/resend"
+        self.lock = threading.Lock()
+        self.frames = {}
+        self.done = collections.deque(maxlen=DONE_HISTORY)
+        self.stats = Stats()
+
+    def on_connect(self, client, userdata, flags, rc, *args):
+        LOG.info("Connected, reassembling %s", self.chunk_topic)
+        client.subscribe(self.chunk_topic, qos=self.args.qos)
+
+    def on_message(self, client, userdata, msg):
+        with self.lock:
+            self.receive(msg.payload, time.monotonic(), time.time())
+
+    def receive(self, payload, now, wall):
+        if len(payload) < HEADER.size:
+            self.stats.malformed += 1
+            return
+        seq, index, count, flags, header_len, _, capture_ms, crc = HEADER.unpack_from(payload)
+        if header_len < HEADER.size or header_len > len(payload):
+            self.stats.malformed += 1
+            return
+
+        data = payload[header_len:]
+        self.stats.chunks += 1
+        if zlib.crc32(data) != crc:
+            self.stats.crc_errors += 1
+            LOG.warning("Frame %d chunk %d: CRC mismatch", seq, index)
+            return
+        if flags & FLAG_RETRANSMIT:
+            self.stats.resent += 1
+
+        if seq in self.done:
+            self.stats.duplicates += 1
+            return
+
+        frame = self.frames.get(seq)
+        if frame is None:
+            frame = self.frames[seq] = Frame(seq, capture_ms, now)
+            # The device keeps only its last frame for retransmission, so ask for what is missing
+            # from older frames straight away.
+            for older in self.frames.values():
+                if older.seq < seq:
+                    older.deadline = min(older.deadline, now)
+
+        if index in frame.chunks:
+            self.stats.duplicates += 1
+            return
+        frame.chunks[index] = data
+        frame.deadline = max(frame.deadline, now + self.args.timeout)
+        if count:
+            frame.count = count
+        elif flags & FLAG_LAST:
+            frame.count = index + 1
+
+        if frame.count is not None and len(frame.chunks) == frame.count:
+            self.complete(frame, now, wall)
+
+    def complete(self, frame, now, wall):
+        del self.frames[frame.seq]
+        self.done.append(frame.seq)
+
+        image = b"".join(frame.chunks[index] for index in range(frame.count))
+        self.stats.complete += 1
+        if frame.requests:
+            self.stats.recovered += 1
+        transfer_ms = (now - frame.first_rx) * 1000
+        self.stats.transfer_ms.append(transfer_ms)
+        self.stats.offsets.append(wall - frame.capture_ms / 1000)
+
+        if self.args.output:
+            ext = "jpg" if image[:2] == b"\xff\xd8" else "bmp" if image[:2] == b"BM" else "bin"
+            with open(os.path.join(self.args.output, f"{frame.seq:010d}.{ext}"), "wb") as f:
+                f.write(image)
+        LOG.debug(
+            "Frame %d: %d bytes in %d chunks, %.0f ms, %d requests",
+            frame.seq,
+            len(image),
+            frame.count,
+            transfer_ms,
+            frame.requests,
+        )
+
+    def tick(self):
+        """Ask again for the chunks of stalled frames, or give them up."""
+        now = time.monotonic()
+        with self.lock:
+            for frame in list(self.frames.values()):
+                if now < frame.deadline:
+                    continue
+
+                missing = frame.missing()
+                if self.args.resend and missing and frame.requests < self.args.retries:
+                    request = json.dumps({"frame": frame.seq, "chunks": missing})
+                    self.client.publish(self.resend_topic, request)
+                    frame.requests += 1
+                    frame.deadline = now + self.args.timeout
+                    self.stats.requests += 1
+                    LOG.debug("Frame %d: asked for %d chunks again", frame.seq, len(missing))
+                    continue
+
+                del self.frames[frame.seq]
+                self.done.append(frame.seq)
+                self.stats.lost += 1
+                LOG.info(
+                    "Frame %d lost: %d chunks of %s received",
+                    frame.seq,
+                    len(frame.chunks),
+                    frame.count if frame.count is not None else "?",
+                )
+
+    def report(self):
+        with self.lock:
+            print(self.stats.line(), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="localhost", help="MQTT broker host")
+    parser.add_argument("--port", type=int, default=1883, help="MQTT broker port")
+    parser.add_argument("--username", help="MQTT username")
+    parser.add_argument("--password", help="MQTT password")
+    parser.add_argument("--topic", default="camera/image", help="Image topic of the device")
+    parser.add_argument("--output", help="Directory to write complete frames to")
+    parser.add_argument("--qos", type=int, choices=(0, 1), default=0, help="Subscription QoS")
+    parser.add_argument(
+        "--resend",
+        action="store_true",
+        help="Ask for missing chunks, for devices built with CONFIG_CAMERA_CHUNK_RETRANSMIT",
+    )
+    parser.add_argument(
+        "--timeout", type=float, default=2, help="Seconds without a chunk before a frame stalls"
+    )
+    parser.add_argument(
+        "--retries", type=int, default=3, help="Requests per frame before giving up on it"
+    )
+    parser.add_argument("--report", type=float, default=60, help="Seconds between reports")
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every frame")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+    if args.output:
+        os.makedirs(args.output, exist_ok=True)
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+
+    reassembler = Reassembler(client, args)
+    client.on_connect = reassembler.on_connect
+    client.on_message = reassembler.on_message
+    client.connect(args.host, args.port)
+    client.loop_start()
+
+    next_report = time.monotonic() + args.report
+    try:
+        while True:
+            time.sleep(0.1)
+            reassembler.tick()
+            if time.monotonic() >= next_report:
+                reassembler.report()
+                next_report += args.report
+    except KeyboardInterrupt:
+        pass
+    finally:
+        client.loop_stop()
+        reassembler.report()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Compare polling /pic against the /stream MJPEG endpoint of the http_pic_server example.
+
+`poll` requests /pic back to back, as a viewer refreshing a snapshot would, and times each request
+from sending it to receiving the last byte. `stream` reads multipart/x-mixed-replace frames from
+/stream, using the X-Frame-Seq header to count the frames skipped for this viewer and X-Timestamp,
+the capture time on the device, to measure how late frames arrive relative to the earliest one.
+`compare` runs both for the same duration and prints them side by side.
+
+For /pic the device's own capture time, the age of the frame it used and whether it discarded a
+stale one are read from its X-Capture-Ms, X-Frame-Age-Ms and X-Frame-Discarded headers and
+summarized below the table, with how many pictures were served from the device's snapshot cache
+(X-Cache) and, with --revalidate, how many requests returned 304 Not Modified.
+"""
+
+import argparse
+import http.client
+import logging
+import statistics
+import time
+import urllib.parse
+
+LOG = logging.getLogger("mjpeg_bench")
+
+
+class Result:
+    def __init__(self, name):
+        self.name = name
+        self.frames = 0
+        self.bytes = 0
+        self.elapsed = 0.0
+        self.latencies_ms = []
+        self.intervals_ms = []
+        self.skipped = 0
+        self.errors = 0
+        self.capture_ms = []
+        self.frame_age_ms = []
+        self.discarded = 0
+        self.cache_hits = 0
+        self.not_modified = 0
+
+    def row(self):
+        fps = self.frames / self.elapsed if self.elapsed else 0.0
+        kbps = self.bytes * 8 / 1000 / self.elapsed if self.elapsed else 0.0
+        return (
+            f"{self.name:<8} {self.frames:>7} {fps:>6.2f} {kbps:>8.0f} "
+            f"{_percentile(self.intervals_ms, 50):>8.0f} {_percentile(self.intervals_ms, 95):>8.0f} "
+            f"{_percentile(self.latencies_ms, 50):>8.0f} {_percentile(self.latencies_ms, 95):>8.0f} "
+            f"{self.skipped:>7} {self.errors:>6}"
+        )
+
+
+    def capture_row(self):
+        if not self.capture_ms and not self.cache_hits:
+            return None
+        return (
+            f"{self.name}: device capture p50 {_percentile(self.capture_ms, 50):.0f} ms, "
+            f"p95 {_percentile(self.capture_ms, 95):.0f} ms; frame age p50 "
+            f"{_percentile(self.frame_age_ms, 50):.0f} ms, p95 "
+            f"{_percentile(self.frame_age_ms, 95):.0f} ms; {self.discarded} of "
+            f"{len(self.capture_ms)} stale frames discarded; {self.cache_hits} cache hits, "
+            f"{self.not_modified} not modified"
+        )
+
+
+HEADER = (
+    f"{'mode':<8} {'frames':>7} {'fps':>6} {'kbit/s':>8} "
+    f"{'int p50':>8} {'int p95':>8} {'lat p50':>8} {'lat p95':>8} {'skipped':>7} {'errors':>6}"
+)
+
+
+def _percentile(values, pct):
+    if not values:
+        return 0.0
+    if len(values) == 1:
+        return values[0]
+    return statistics.quantiles(values, n=100, method="inclusive")[pct - 1]
+
+
+def _connect(url, port):
+    parts = urllib.parse.urlsplit(url if "//" in url else "http://" + url)
+    return http.client.HTTPConnection(parts.hostname, port or parts.port or 80, timeout=10)
+
+
+def poll(args):
+    result = Result("poll")
+    conn = _connect(args.url, args.port)
+    start = time.monotonic()
+    last = None
+    etag = None
+
+    while time.monotonic() - start < args.duration:
+        sent = time.monotonic()
+        headers = {"If-None-Match": etag} if args.revalidate and etag else {}
+        try:
+            conn.request("GET", "/pic", headers=headers)
+            response = conn.getresponse()
+            body = response.read()
+        except (OSError, http.client.HTTPException) as e:
+            LOG.warning("/pic failed: %s", e)
+            result.errors += 1
+            conn.close()
+            conn = _connect(args.url, args.port)
+            continue
+
+        done = time.monotonic()
+        if response.status == 304:
+            result.not_modified += 1
+            result.cache_hits += 1
+            continue
+        if response.status != 200:
+            LOG.warning("/pic returned %d", response.status)
+            result.errors += 1
+            continue
+        etag = response.getheader("ETag")
+
+        result.frames += 1
+        result.bytes += len(body)
+        result.latencies_ms.append((done - sent) * 1000)
+        if response.getheader("X-Cache") == "hit":
+            result.cache_hits += 1
+        elif response.getheader("X-Capture-Ms") is not None:
+            result.capture_ms.append(float(response.getheader("X-Capture-Ms")))
+            result.frame_age_ms.append(float(response.getheader("X-Frame-Age-Ms", 0)))
+            result.discarded += response.getheader("X-Frame-Discarded") == "1"
+        if last is not None:
+            result.intervals_ms.append((done - last) * 1000)
+        last = done
+        LOG.debug("/pic %d bytes in %.0f ms", len(body), (done - sent) * 1000)
+
+    result.elapsed = time.monotonic() - start
+    conn.close()
+    return result
+
+
+def _read_part_headers(response):
+    headers = {}
+    while True:
+        line = response.fp.readline()
+        if not line:
+            raise EOFError("stream closed")
+        line = line.strip()
+        if not line:
+            if headers:
+                return headers
+            continue  # CRLF ending the previous part
+        if line.startswith(b"--"):
+            continue  # boundary
+        name, _, value = line.decode("latin-1").partition(":")
+        headers[name.strip().lower()] = value.strip()
+
+
+def stream(args):
+    result = Result("stream")
+    conn = _connect(args.url, args.stream_port)
+    conn.request("GET", "/stream")
+    response = conn.getresponse()
+    if response.status != 200:
+        raise SystemExit(f"/stream returned {response.status}")
+
+    start = time.monotonic()
+    last = None
+    last_seq = None
+    # Smallest arrival time minus capture time seen, which is the clock offset plus the fastest
+    # delivery. Latency is reported relative to it, as the clocks are not synchronized.
+    offsets = []
+
+    while time.monotonic() - start < args.duration:
+        try:
+            headers = _read_part_headers(response)
+            body = response.fp.read(int(headers["content-length"]))
+        except (OSError, EOFError, KeyError, ValueError) as e:
+            LOG.warning("/stream failed: %s", e)
+            result.errors += 1
+            break
+
+        done = time.monotonic()
+        result.frames += 1
+        result.bytes += len(body)
+        if last is not None:
+            result.intervals_ms.append((done - last) * 1000)
+        last = done
+
+        seq = int(headers.get("x-frame-seq", 0))
+        if last_seq is not None and seq > last_seq:
+            result.skipped += seq - last_seq - 1
+        last_seq = seq
+
+        if "x-timestamp" in headers:
+            offsets.append(done - float(headers["x-timestamp"]))
+        LOG.debug("/stream frame %d, %d bytes", seq, len(body))
+
+    result.elapsed = time.monotonic() - start
+    if offsets:
+        base = min(offsets)
+        result.latencies_ms = [(offset - base) * 1000 for offset in offsets]
+    conn.close()
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every frame")
+    parser.add_argument("mode", choices=("poll", "stream", "compare"))
+    parser.add_argument("url", help="Address of the camera, e.g. http://192.168.1.2")
+    parser.add_argument("--port", type=int, help="Port of /pic (default from the URL or 80)")
+    parser.add_argument("--stream-port", type=int, default=81, help="Port of /stream")
+    parser.add_argument("--duration", type=float, default=30, help="Seconds to run each mode")
+    parser.add_argument(
+        "--revalidate",
+        action="store_true",
+        help="Send the last ETag in If-None-Match when polling /pic, as a browser would",
+    )
+
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    results = []
+    if args.mode in ("poll", "compare"):
+        results.append(poll(args))
+    if args.mode in ("stream", "compare"):
+        results.append(stream(args))
+
+    print(HEADER)
+    for result in results:
+        print(result.row())
+    for result in results:
+        if result.capture_row():
+            print(result.capture_row())
+
+
+if __name__ == "__main__":
+    main()
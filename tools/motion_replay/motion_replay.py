@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Replay recorded camera frames through the motion detector to choose its settings.
+
+mqtt_pic_client built with CONFIG_CAMERA_MOTION_GATE publishes a frame only when enough of it
+differs from a background model of the scene, or when a keyframe interval expires. `record` saves
+the frames a client publishes, best built without the gate so that every frame is kept, and
+`replay` runs them through a port of the device's detector (components/camera_pipeline/
+camera_motion_model.c) for each threshold given, reporting how many frames and bytes it would have
+published. `export` saves frames reduced to their cells, as the detector sees them, and `check`
+runs such frames through the port and compares it with the results pinned by the C host test
+(components/camera_pipeline/host_test).
+"""
+
+import argparse
+import csv
+import logging
+import os
+import time
+
+import paho.mqtt.client as mqtt
+from PIL import Image
+
+LOG = logging.getLogger("motion_replay")
+
+# As in camera_motion_model.h
+CELL_SIZE = 8
+BLOCK_CELLS = 4
+BLOCK_LEN = BLOCK_CELLS * BLOCK_CELLS
+BLOCK_PIXELS = CELL_SIZE * BLOCK_CELLS
+
+
+def frame_cells(path):
+    """Return a frame reduced to the 8 bit luma of every cell that is part of a whole block."""
+    with Image.open(path) as img:
+        width, height = img.size
+        cols, rows = width // BLOCK_PIXELS, height // BLOCK_PIXELS
+        cells_x, cells_y = cols * BLOCK_CELLS, rows * BLOCK_CELLS
+
+        # JPEG is decoded at an eighth of the size from the DC coefficients, as on the device.
+        # Other formats, and JPEG the decoder cannot scale, are averaged over the cells.
+        img.draft("L", (width // CELL_SIZE, height // CELL_SIZE))
+        img = img.convert("L")
+        if img.size[0] < width:
+            return img.crop((0, 0, cells_x, cells_y))
+        return img.crop((0, 0, cells_x * CELL_SIZE, cells_y * CELL_SIZE)).reduce(CELL_SIZE)
+
+
+def cell_blocks(img):
+    """Return (cols, rows, cells) of a frame of one pixel per cell: the 7 bit luma of every cell,
+    block by block, as camera_motion_grid_put() lays them out."""
+    cells_x, cells_y = img.size
+    cols, rows = cells_x // BLOCK_CELLS, cells_y // BLOCK_CELLS
+    cells_x, cells_y = cols * BLOCK_CELLS, rows * BLOCK_CELLS
+    pixels = img.convert("L").crop((0, 0, cells_x, cells_y)).tobytes()
+
+    cells = [0] * (cols * rows * BLOCK_LEN)
+    for cy in range(cells_y):
+        for cx in range(cells_x):
+            block = (cy // BLOCK_CELLS) * cols + cx // BLOCK_CELLS
+            cell = (cy % BLOCK_CELLS) * BLOCK_CELLS + cx % BLOCK_CELLS
+            cells[block * BLOCK_LEN + cell] = pixels[cy * cells_x + cx] >> 1
+    return cols, rows, cells
+
+
+def frame_blocks(path):
+    """Return (cols, rows, cells) of a frame: the 7 bit luma of every cell, block by block."""
+    return cell_blocks(frame_cells(path))
+
+
+class Detector:
+    """Port of camera_motion_model_check()."""
+
+    def __init__(self, threshold, area_percent, keyframe_s, background_shift):
+        self.threshold = threshold
+        self.area_percent = area_percent
+        self.keyframe_s = keyframe_s
+        self.background_shift = background_shift
+        self.size = None
+        self.bg = None
+        self.last_pass = None
+        self.published = 0
+        self.motion = 0
+        self.keyframes = 0
+        self.bytes = 0
+        # SAD of each block in the last frame compared, empty if it reset the background
+        self.sad = []
+
+    def check(self, cols, rows, cells, t):
+        """Return (publish, motion, keyframe, changed blocks) for a frame taken at t seconds."""
+        motion = False
+        keyframe = False
+        changed = 0
+        self.sad = []
+
+        if self.size != (cols, rows):
+            self.size = (cols, rows)
+            self.bg = list(cells)
+            keyframe = True
+        else:
+            # A block's SAD over its 16 cells of 7 bit luma is 8 times its average difference
+            limit = self.threshold * (BLOCK_LEN // 2)
+            for start in range(0, len(cells), BLOCK_LEN):
+                sad = sum(
+                    abs(cells[i] - self.bg[i]) for i in range(start, start + BLOCK_LEN)
+                )
+                self.sad.append(sad)
+                changed += sad > limit
+
+            blocks = cols * rows
+            motion = changed > 0 and changed * 100 >= self.area_percent * blocks
+            keyframe = (
+                not motion and self.keyframe_s > 0 and t - self.last_pass >= self.keyframe_s
+            )
+
+            for i, value in enumerate(cells):
+                diff = value - self.bg[i]
+                step = int(diff / (1 << self.background_shift))
+                if step == 0 and diff != 0:
+                    step = 1 if diff > 0 else -1
+                self.bg[i] += step
+
+        publish = motion or keyframe
+        if publish:
+            self.last_pass = t
+        return publish, motion, keyframe, changed
+
+
+def _frame_time(name, index, interval):
+    """Capture time of a frame: its name if recorded by this tool, otherwise from its index."""
+    stem = os.path.splitext(name)[0]
+    return int(stem) / 1000 if stem.isdigit() else index * interval
+
+
+def _frame_names(directory):
+    return sorted(
+        name
+        for name in os.listdir(directory)
+        if os.path.splitext(name)[1].lower() in (".jpg", ".jpeg", ".png", ".bmp", ".pgm")
+    )
+
+
+def record(args):
+    os.makedirs(args.directory, exist_ok=True)
+
+    def on_connect(client, userdata, flags, rc, *extra):
+        LOG.info("Connected, recording %s to %s", args.topic, args.directory)
+        client.subscribe(args.topic)
+
+    def on_message(client, userdata, msg):
+        name = "%013d.jpg" % int(time.time() * 1000)
+        with open(os.path.join(args.directory, name), "wb") as f:
+            f.write(msg.payload)
+        LOG.debug("%s: %d bytes", name, len(msg.payload))
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    client.loop_forever()
+
+
+def replay(args):
+    names = _frame_names(args.directory)
+    if not names:
+        raise SystemExit(f"No frames in {args.directory}")
+
+    detectors = [
+        Detector(threshold, args.area, args.keyframe, args.shift) for threshold in args.threshold
+    ]
+    total_bytes = 0
+    check_s = 0.0
+    start = _frame_time(names[0], 0, args.interval)
+
+    for index, name in enumerate(names):
+        path = os.path.join(args.directory, name)
+        size = os.path.getsize(path)
+        total_bytes += size
+        t = _frame_time(name, index, args.interval) - start
+
+        began = time.perf_counter()
+        cols, rows, cells = frame_blocks(path)
+        check_s += time.perf_counter() - began
+
+        for detector in detectors:
+            publish, motion, keyframe, changed = detector.check(cols, rows, cells, t)
+            if publish:
+                detector.published += 1
+                detector.motion += motion
+                detector.keyframes += keyframe
+                detector.bytes += size
+            LOG.debug(
+                "%s threshold %d: %s, %d of %d blocks changed",
+                name,
+                detector.threshold,
+                "motion" if motion else "keyframe" if keyframe else "skipped",
+                changed,
+                cols * rows,
+            )
+
+    print(
+        f"{len(names)} frames, {total_bytes / 1e6:.2f} MB over {t / 60:.1f} min, "
+        f"area {args.area}%, keyframe {args.keyframe} s, "
+        f"{check_s * 1000 / len(names):.1f} ms per frame to reduce on this host"
+    )
+    print("threshold published  motion keyframes      MB  of all")
+    for detector in detectors:
+        print(
+            f"{detector.threshold:9d} {detector.published:9d} {detector.motion:7d} "
+            f"{detector.keyframes:9d} {detector.bytes / 1e6:7.2f} "
+            f"{detector.bytes * 100 / total_bytes:6.1f}%"
+        )
+
+
+def export(args):
+    os.makedirs(args.output, exist_ok=True)
+    for name in _frame_names(args.directory):
+        out = os.path.splitext(name)[0] + ".pgm"
+        frame_cells(os.path.join(args.directory, name)).save(os.path.join(args.output, out))
+        LOG.debug("%s -> %s", name, out)
+
+
+def check(args):
+    """Compare the port with the results the C host test pinned in expected.csv."""
+    with open(os.path.join(args.directory, "expected.csv"), newline="") as f:
+        frames = [row for row in csv.reader(f) if row and not row[0].startswith("#")]
+
+    config = frames.pop(0)
+    assert config[0] == "config", "expected.csv must start with its config line"
+    threshold, area, keyframe_ms, shift = (int(value) for value in config[1:5])
+    detector = Detector(threshold, area, keyframe_ms / 1000, shift)
+
+    mismatches = 0
+    for name, time_ms, *pinned in frames:
+        cols, rows, cells = cell_blocks(Image.open(os.path.join(args.directory, name)))
+        publish, motion, keyframe, changed = detector.check(cols, rows, cells, int(time_ms) / 1000)
+        got = [str(int(publish)), str(int(motion)), str(int(keyframe)), str(changed),
+               " ".join(str(sad) for sad in detector.sad)]
+        if got != pinned:
+            mismatches += 1
+            LOG.error("%s: port %s, C %s", name, got[:4], pinned[:4])
+            if got[4] != pinned[4]:
+                LOG.error("%s: SAD differs", name)
+
+    print(f"{len(frames)} frames, {mismatches} differ from the C detector")
+    if mismatches:
+        raise SystemExit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every frame")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    rec = commands.add_parser("record", help="Save the frames published on a topic")
+    rec.add_argument("directory", help="Directory to save the frames in")
+    rec.add_argument("--host", default="localhost", help="MQTT broker host")
+    rec.add_argument("--port", type=int, default=1883, help="MQTT broker port")
+    rec.add_argument("--username", help="MQTT username")
+    rec.add_argument("--password", help="MQTT password")
+    rec.add_argument("--topic", default="camera/image", help="Image topic")
+
+    rep = commands.add_parser("replay", help="Run saved frames through the detector")
+    rep.add_argument("directory", help="Directory of frames, replayed in name order")
+    rep.add_argument(
+        "--threshold",
+        type=lambda value: [int(t) for t in value.split(",")],
+        default=[12],
+        help="Block change thresholds to compare, comma separated (default 12)",
+    )
+    rep.add_argument("--area", type=int, default=2, help="Changed area for motion, in percent")
+    rep.add_argument("--keyframe", type=float, default=300, help="Keyframe interval in seconds")
+    rep.add_argument(
+        "--shift", type=int, default=1, help="Background shift, as MOTION_BACKGROUND_SHIFT"
+    )
+    rep.add_argument(
+        "--interval",
+        type=float,
+        default=5,
+        help="Seconds between frames whose names are not capture times in milliseconds",
+    )
+
+    exp = commands.add_parser("export", help="Save frames reduced to one pixel per cell")
+    exp.add_argument("directory", help="Directory of frames")
+    exp.add_argument("output", help="Directory to save the reduced frames in, as PGM")
+
+    chk = commands.add_parser("check", help="Compare the port with the C detector's results")
+    chk.add_argument("directory", help="Directory of reduced frames with an expected.csv")
+
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    {"record": record, "replay": replay, "export": export, "check": check}[args.command](args)
+
+
+if __name__ == "__main__":
+    main()
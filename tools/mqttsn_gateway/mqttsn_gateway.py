@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Minimal MQTT-SN gateway for testing devices built with CONFIG_DEVICE_TRANSPORT_MQTTSN.
+
+Implements the subset of MQTT-SN v1.2 used by the ha_device component: CONNECT, REGISTER, PUBLISH
+at QoS 0 and -1, PINGREQ and DISCONNECT, including sleeping clients. Published messages are
+forwarded to an MQTT broker if one is given, otherwise they are only logged. Packets exchanged with
+each client are counted so the cost of a report can be compared with plain MQTT.
+"""
+
+import argparse
+import logging
+import socket
+import struct
+import time
+
+LOG = logging.getLogger("mqttsn_gateway")
+
+CONNECT = 0x04
+CONNACK = 0x05
+REGISTER = 0x0A
+REGACK = 0x0B
+PUBLISH = 0x0C
+PUBACK = 0x0D
+PINGREQ = 0x16
+PINGRESP = 0x17
+DISCONNECT = 0x18
+
+FLAG_RETAIN = 0x10
+FLAG_CLEAN_SESSION = 0x04
+QOS_MASK = 0x60
+QOS_NEG1 = 0x60
+TOPIC_TYPE_MASK = 0x03
+TOPIC_NORMAL = 0
+TOPIC_PREDEFINED = 1
+TOPIC_SHORT = 2
+
+RC_ACCEPTED = 0x00
+RC_INVALID_TOPIC = 0x02
+
+STATE_ACTIVE = "active"
+STATE_ASLEEP = "asleep"
+STATE_DISCONNECTED = "disconnected"
+
+
+def packet(msg_type, body=b""):
+    """Build a packet with the one or three byte length header."""
+    if len(body) + 2 <= 255:
+        return bytes([len(body) + 2, msg_type]) + body
+    return struct.pack(">BHB", 1, len(body) + 4, msg_type) + body
+
+
+def parse(data):
+    """Split a datagram into (message type, body), or None if malformed."""
+    if len(data) >= 4 and data[0] == 0x01:
+        length, msg_type = struct.unpack_from(">HB", data, 1)
+        header_len = 4
+    elif len(data) >= 2:
+        length, msg_type = data[0], data[1]
+        header_len = 2
+    else:
+        return None
+    if length != len(data):
+        return None
+    return msg_type, data[header_len:]
+
+
+class Session:
+    def __init__(self, client_id):
+        self.client_id = client_id
+        self.state = STATE_DISCONNECTED
+        self.topics = {}
+        self.rx_packets = 0
+        self.tx_packets = 0
+        self.reports = 0
+        self.report_rx = 0
+        self.report_tx = 0
+        self.expires = None
+
+
+class Gateway:
+    def __init__(self, sock, predefined, forward):
+        self.sock = sock
+        self.predefined = predefined
+        self.forward = forward
+        self.sessions = {}
+        self.addresses = {}
+        self.next_topic_id = 1
+
+    def send(self, addr, session, msg_type, body=b""):
+        self.sock.sendto(packet(msg_type, body), addr)
+        if session is not None:
+            session.tx_packets += 1
+
+    def topic_id_for(self, name):
+        for topic_id, topic in self.predefined.items():
+            if topic == name:
+                return topic_id
+        while self.next_topic_id in self.predefined:
+            self.next_topic_id += 1
+        topic_id = self.next_topic_id
+        self.next_topic_id += 1
+        return topic_id
+
+    def handle(self, data, addr):
+        parsed = parse(data)
+        if parsed is None:
+            LOG.warning("%s: malformed packet %s", addr, data.hex())
+            return
+        msg_type, body = parsed
+        session = self.addresses.get(addr)
+
+        if session is not None and session.expires is not None and time.time() > session.expires:
+            LOG.info("%s: session expired", session.client_id)
+            session.state = STATE_DISCONNECTED
+            session.topics.clear()
+            session.expires = None
+
+        if session is not None and msg_type != CONNECT:
+            session.rx_packets += 1
+
+        if msg_type == CONNECT:
+            self.on_connect(addr, body)
+        elif msg_type == PUBLISH:
+            self.on_publish(addr, session, body)
+        elif session is None:
+            LOG.warning("%s: packet type 0x%02x from unknown client", addr, msg_type)
+        elif msg_type == REGISTER:
+            self.on_register(addr, session, body)
+        elif msg_type == PINGREQ:
+            self.send(addr, session, PINGRESP)
+        elif msg_type == DISCONNECT:
+            self.on_disconnect(addr, session, body)
+        else:
+            LOG.warning("%s: unsupported packet type 0x%02x", session.client_id, msg_type)
+
+    def on_connect(self, addr, body):
+        flags, _, keepalive = struct.unpack_from(">BBH", body)
+        client_id = body[4:].decode("utf-8", "replace")
+        session = self.sessions.setdefault(client_id, Session(client_id))
+        self.addresses[addr] = session
+        session.rx_packets += 1
+
+        if flags & FLAG_CLEAN_SESSION or session.state == STATE_DISCONNECTED:
+            session.topics.clear()
+            resumed = False
+        else:
+            resumed = True
+
+        session.state = STATE_ACTIVE
+        session.expires = None
+        LOG.info("%s: connected from %s:%d, keepalive %ds%s", client_id, *addr, keepalive,
+                 ", session resumed" if resumed else "")
+        self.send(addr, session, CONNACK, bytes([RC_ACCEPTED]))
+
+    def on_register(self, addr, session, body):
+        _, msg_id = struct.unpack_from(">HH", body)
+        name = body[4:].decode("utf-8")
+        topic_id = self.topic_id_for(name)
+        session.topics[topic_id] = name
+        LOG.info("%s: registered %s as %d", session.client_id, name, topic_id)
+        self.send(addr, session, REGACK, struct.pack(">HHB", topic_id, msg_id, RC_ACCEPTED))
+
+    def on_publish(self, addr, session, body):
+        flags, topic_id, msg_id = struct.unpack_from(">BHH", body)
+        payload = body[5:]
+        qos_neg1 = (flags & QOS_MASK) == QOS_NEG1
+        topic_type = flags & TOPIC_TYPE_MASK
+
+        if topic_type == TOPIC_PREDEFINED:
+            topic = self.predefined.get(topic_id)
+        elif topic_type == TOPIC_SHORT:
+            topic = struct.pack(">H", topic_id).decode("ascii", "replace")
+        elif session is not None and session.state == STATE_ACTIVE:
+            topic = session.topics.get(topic_id)
+        else:
+            topic = None
+
+        if topic is None:
+            LOG.warning("%s: publish to unknown topic ID %d", addr, topic_id)
+            # Tell the client to register again, e.g. after this gateway restarted and accepted
+            # its resumed session without the topics (MQTT-SN v1.2 section 6.8)
+            if not qos_neg1:
+                self.send(addr, session, PUBACK, struct.pack(">HHB", topic_id, msg_id,
+                                                              RC_INVALID_TOPIC))
+            return
+
+        if session is None and qos_neg1:
+            LOG.info("%s:%d: QoS -1 publish to %s (%d bytes)", *addr, topic, len(payload))
+        else:
+            session.reports += 1
+            LOG.info("%s: publish to %s (%d bytes), %d packets since last report (%d rx, %d tx)",
+                     session.client_id, topic, len(payload),
+                     session.rx_packets - session.report_rx + session.tx_packets - session.report_tx,
+                     session.rx_packets - session.report_rx, session.tx_packets - session.report_tx)
+            session.report_rx = session.rx_packets
+            session.report_tx = session.tx_packets
+
+        if self.forward is not None:
+            self.forward.publish(topic, payload, retain=bool(flags & FLAG_RETAIN))
+
+    def on_disconnect(self, addr, session, body):
+        if len(body) >= 2:
+            (duration,) = struct.unpack_from(">H", body)
+            session.state = STATE_ASLEEP
+            session.expires = time.time() + duration
+            LOG.info("%s: asleep for up to %ds", session.client_id, duration)
+        else:
+            session.state = STATE_DISCONNECTED
+            session.topics.clear()
+            LOG.info("%s: disconnected", session.client_id)
+        self.send(addr, session, DISCONNECT)
+
+    def log_stats(self):
+        for session in self.sessions.values():
+            LOG.info("%s: %d packets received, %d sent, %d publishes", session.client_id,
+                     session.rx_packets, session.tx_packets, session.reports)
+
+
+def parse_predefined(values):
+    predefined = {}
+    for value in values:
+        topic_id, _, topic = value.partition("=")
+        if not topic:
+            raise argparse.ArgumentTypeError(f"expected ID=TOPIC, got {value!r}")
+        predefined[int(topic_id)] = topic
+    return predefined
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--bind", default="0.0.0.0", help="Address to listen on")
+    parser.add_argument("--port", type=int, default=1883, help="UDP port to listen on")
+    parser.add_argument("--predefined", action="append", default=[], metavar="ID=TOPIC",
+                        help="Predefined topic ID, may be given more than once")
+    parser.add_argument("--broker", help="MQTT broker to forward to, messages are only logged "
+                        "if not given")
+    parser.add_argument("--broker-port", type=int, default=1883, help="MQTT broker port")
+    parser.add_argument("--username", help="MQTT username")
+    parser.add_argument("--password", help="MQTT password")
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every packet")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    forward = None
+    if args.broker:
+        import paho.mqtt.client as mqtt
+
+        forward = mqtt.Client()
+        if args.username:
+            forward.username_pw_set(args.username, args.password)
+        forward.connect(args.broker, args.broker_port)
+        forward.loop_start()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.bind, args.port))
+    gateway = Gateway(sock, parse_predefined(args.predefined), forward)
+    LOG.info("Listening on %s:%d", args.bind, args.port)
+
+    try:
+        while True:
+            data, addr = sock.recvfrom(65535)
+            LOG.debug("%s:%d: %s", *addr, data.hex())
+            gateway.handle(data, addr)
+    except KeyboardInterrupt:
+        gateway.log_stats()
+
+
+if __name__ == "__main__":
+    main()
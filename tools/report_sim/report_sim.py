@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Simulate a fleet of ha_device sensors reporting over a shared HaLow channel.
+
+Every device reconnects when the access point or broker restarts and then reports on a fixed
+interval with a little clock drift. Reports that overlap in time on the channel are counted as
+collisions. The simulation is run with the schedule used before staggering (fixed reconnect delay,
+first report straight after connecting) and with the staggered schedule of the report_schedule
+module (jittered reconnect backoff, first report delayed by a per-device phase offset), and the
+results are printed side by side.
+
+The phase and backoff calculations mirror components/ha_device/report_schedule.c.
+"""
+
+import argparse
+import bisect
+import random
+
+MASK32 = 0xFFFFFFFF
+FNV_OFFSET_BASIS = 2166136261
+FNV_PRIME = 16777619
+BACKOFF_SHIFT_MAX = 32
+
+# Default esp-mqtt reconnect delay, used by the synchronized schedule
+MQTT_RECONNECT_TIMEOUT_MS = 10000
+
+
+def phase_ms(device_id, salt, window_ms):
+    """Mirror of report_schedule_phase_ms()."""
+    if window_ms == 0:
+        return 0
+
+    h = FNV_OFFSET_BASIS
+    for c in device_id.encode():
+        h = ((h ^ c) * FNV_PRIME) & MASK32
+    for i in range(4):
+        h = ((h ^ ((salt >> (8 * i)) & 0xFF)) * FNV_PRIME) & MASK32
+
+    h ^= h >> 16
+    h = (h * 0x7FEB352D) & MASK32
+    h ^= h >> 15
+
+    return h % window_ms
+
+
+def backoff_ms(min_ms, max_ms, attempt, rand):
+    """Mirror of report_schedule_backoff_ms()."""
+    ceiling = min(min_ms << min(attempt + 1, BACKOFF_SHIFT_MAX), max_ms)
+    if ceiling <= min_ms:
+        return min_ms
+    return min_ms + rand % (ceiling - min_ms + 1)
+
+
+class Device:
+    """One simulated device."""
+
+    def __init__(self, device_id, drift_ppm):
+        self.device_id = device_id
+        self.drift = 1 + drift_ppm / 1e6
+        self.salt = 0
+        self.storm_start_ms = None
+        self.storm_count = 0
+
+
+def connect_time_ms(args, rng, down_ms, up_ms, staggered):
+    """Time the device connects after losing its connection at down_ms, with service back at up_ms.
+
+    The first connection after power up (down_ms is None) is made straight away.
+    """
+    if down_ms is None:
+        return rng.uniform(0, args.connect_jitter)
+
+    t = down_ms
+    attempt = 0
+    while True:
+        if staggered:
+            t += backoff_ms(args.backoff_min, args.backoff_max, attempt, rng.getrandbits(32))
+        else:
+            t += MQTT_RECONNECT_TIMEOUT_MS
+        # Connect attempts contend for the channel too; model the handshake as a short random delay
+        t += rng.uniform(0, args.connect_jitter)
+        if t >= up_ms:
+            return t
+        attempt += 1
+
+
+def first_report_ms(args, rng, dev, connected_ms, staggered):
+    """Time of the first report after connecting, updating the device's storm state."""
+    if not staggered:
+        return connected_ms
+
+    if dev.storm_start_ms is None or connected_ms - dev.storm_start_ms > args.storm_window:
+        dev.storm_start_ms = connected_ms
+        dev.storm_count = 0
+
+    dev.storm_count += 1
+    if dev.storm_count >= args.storm_count:
+        dev.salt = rng.getrandbits(32)
+        dev.storm_count = 0
+
+    window = min(args.interval, args.stagger_window)
+    return connected_ms + phase_ms(dev.device_id, dev.salt, window)
+
+
+def simulate(args, seed, staggered):
+    """Run the simulation, returning (reports, collided reports, peak connects per second).
+
+    Peak connects per second excludes the power up, where every schedule connects at once.
+    """
+    rng = random.Random(seed)
+    base_mac = 0x24DCC3000000
+    devices = [
+        Device("%012X" % (base_mac + i), rng.uniform(-args.drift, args.drift))
+        for i in range(args.devices)
+    ]
+
+    restarts = sorted(args.restart) if args.restart else []
+    duration_ms = args.duration * 1000
+    tx_start = []
+    connects = []
+
+    for dev in devices:
+        # Every device powers up together at 0, as after a site power cut
+        down_ms, up_ms = None, 0
+        pending = list(restarts)
+
+        while down_ms is None or down_ms < duration_ms:
+            connected = connect_time_ms(args, rng, down_ms, up_ms, staggered)
+            if down_ms is not None:
+                connects.append(connected)
+            t = first_report_ms(args, rng, dev, connected, staggered)
+
+            next_down = pending.pop(0) * 1000 if pending else duration_ms
+            while t < next_down and t < duration_ms:
+                tx_start.append(t)
+                t += args.interval * dev.drift
+
+            down_ms, up_ms = next_down, next_down + args.outage * 1000
+
+    tx_start.sort()
+    collided = 0
+    for i, t in enumerate(tx_start):
+        prev_overlap = i > 0 and t - tx_start[i - 1] < args.airtime
+        next_overlap = i + 1 < len(tx_start) and tx_start[i + 1] - t < args.airtime
+        if prev_overlap or next_overlap:
+            collided += 1
+
+    connects.sort()
+    peak = 0
+    for i, t in enumerate(connects):
+        peak = max(peak, bisect.bisect_left(connects, t + 1000) - i)
+
+    return len(tx_start), collided, peak
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--devices", type=int, default=50, help="number of devices")
+    parser.add_argument("--interval", type=int, default=60000, help="update interval in ms")
+    parser.add_argument("--airtime", type=float, default=5, help="airtime per report in ms")
+    parser.add_argument("--duration", type=int, default=3600, help="simulated time in s")
+    parser.add_argument("--drift", type=float, default=20, help="clock drift in +/- ppm")
+    parser.add_argument("--restart", type=int, action="append",
+                        help="time in s of an access point or broker restart, may be repeated")
+    parser.add_argument("--outage", type=int, default=30, help="restart outage in s")
+    parser.add_argument("--connect-jitter", type=float, default=50,
+                        help="random connect handshake delay in ms")
+    parser.add_argument("--stagger-window", type=int, default=30000,
+                        help="CONFIG_STAGGER_WINDOW_MS")
+    parser.add_argument("--storm-count", type=int, default=3, help="CONFIG_RECONNECT_STORM_COUNT")
+    parser.add_argument("--storm-window", type=int, default=300000,
+                        help="CONFIG_RECONNECT_STORM_WINDOW_MS")
+    parser.add_argument("--backoff-min", type=int, default=1000,
+                        help="CONFIG_RECONNECT_BACKOFF_MIN_MS")
+    parser.add_argument("--backoff-max", type=int, default=60000,
+                        help="CONFIG_RECONNECT_BACKOFF_MAX_MS")
+    parser.add_argument("--runs", type=int, default=20,
+                        help="number of runs with different seeds to average over")
+    parser.add_argument("--seed", type=int, default=1, help="random seed of the first run")
+    args = parser.parse_args()
+
+    # A single pair of devices that happen to share a phase collides on every interval until the
+    # next restart, so individual runs vary a lot; report the totals over several seeds
+    print("%-13s %9s %9s %10s %18s" % ("schedule", "reports", "collided", "rate",
+                                       "peak connects/s"))
+    for name, staggered in (("synchronized", False), ("staggered", True)):
+        reports, collided, peak = 0, 0, 0
+        for seed in range(args.seed, args.seed + args.runs):
+            run = simulate(args, seed, staggered)
+            reports += run[0]
+            collided += run[1]
+            peak = max(peak, run[2])
+        rate = collided / reports if reports else 0
+        print("%-13s %9d %9d %9.2f%% %18d" % (name, reports, collided, rate * 100, peak))
+
+
+if __name__ == "__main__":
+    main()
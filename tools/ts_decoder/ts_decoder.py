@@ -0,0 +1,394 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Robert Carey
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""
+Decode and benchmark the compressed time-series batches published by ha_device.
+
+Devices built with CONFIG_AGGREGATION_BATCH publish the samples of each aggregation window on
+`<device_id>/state/batch`, as a CBOR array of the device uptime in milliseconds and a map of sensor
+name to `[count, series]`. Each series is encoded by components/ha_device/ts_codec.c, which this
+tool mirrors: delta-of-delta timestamps and zigzag varint or XOR float values.
+
+`subscribe` decodes the batches as they arrive, printing the samples and optionally recording them
+as CSV traces. `bench` encodes recorded traces both ways and compares their size against JSON.
+"""
+
+import argparse
+import csv
+import json
+import logging
+import math
+import os
+import struct
+import time
+
+LOG = logging.getLogger("ts_decoder")
+
+BATCH_TOPIC_SUFFIX = "/state/batch"
+
+VALUES_VARINT = 0
+VALUES_XOR = 1
+
+VALUES_NAMES = {VALUES_VARINT: "varint", VALUES_XOR: "xor"}
+
+
+class DecodeError(ValueError):
+    pass
+
+
+def _decode_cbor_item(data, offset):
+    """Decode a single CBOR item, returning (value, next offset)."""
+    if offset >= len(data):
+        raise DecodeError("unexpected end of data")
+
+    major = data[offset] >> 5
+    info = data[offset] & 0x1F
+    offset += 1
+
+    if info < 24:
+        arg = info
+    elif info in (24, 25, 26, 27):
+        size = 1 << (info - 24)
+        if offset + size > len(data):
+            raise DecodeError("unexpected end of data")
+        arg = int.from_bytes(data[offset : offset + size], "big")
+        offset += size
+    else:
+        raise DecodeError(f"unsupported additional information {info}")
+
+    if major == 0:
+        return arg, offset
+    if major == 1:
+        return -1 - arg, offset
+    if major in (2, 3):
+        if offset + arg > len(data):
+            raise DecodeError("unexpected end of data")
+        value = bytes(data[offset : offset + arg])
+        return (value if major == 2 else value.decode("utf-8")), offset + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, offset = _decode_cbor_item(data, offset)
+            items.append(item)
+        return items, offset
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, offset = _decode_cbor_item(data, offset)
+            items[key], offset = _decode_cbor_item(data, offset)
+        return items, offset
+
+    raise DecodeError(f"unsupported major type {major}")
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def bits(self, n):
+        value = 0
+        for _ in range(n):
+            if self.pos >= len(self.data) * 8:
+                raise DecodeError("unexpected end of series")
+            bit = (self.data[self.pos // 8] >> (7 - self.pos % 8)) & 1
+            value = (value << 1) | bit
+            self.pos += 1
+        return value
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.bits(8)
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+
+class BitWriter:
+    def __init__(self):
+        self.data = bytearray()
+        self.pos = 0
+
+    def bits(self, value, n):
+        for i in range(n - 1, -1, -1):
+            if self.pos % 8 == 0:
+                self.data.append(0)
+            if (value >> i) & 1:
+                self.data[-1] |= 0x80 >> (self.pos % 8)
+            self.pos += 1
+
+    def varint(self, value):
+        while value >= 0x80:
+            self.bits((value & 0x7F) | 0x80, 8)
+            value >>= 7
+        self.bits(value, 8)
+
+    def zigzag(self, value):
+        self.varint((value << 1) ^ (value >> 63))
+
+
+def _float_bits(value):
+    return struct.unpack("<I", struct.pack("<f", value))[0]
+
+
+def _bits_float(bits):
+    return struct.unpack("<f", struct.pack("<I", bits))[0]
+
+
+def _round_half_away(value):
+    """Round like llroundf, halfway cases away from zero."""
+    return int(math.copysign(math.floor(abs(value) + 0.5), value))
+
+
+def encode_series(samples, values, precision):
+    """Encode (timestamp ms, value) samples the way ts_encoder_add does."""
+    writer = BitWriter()
+    writer.bits((values << 4) | precision, 8)
+
+    prev_ts = prev_delta = prev_scaled = prev_bits = 0
+    prev_leading = prev_trailing = None
+
+    for i, (ts, value) in enumerate(samples):
+        if i == 0:
+            writer.varint(ts)
+        else:
+            delta = ts - prev_ts
+            writer.zigzag(delta - prev_delta)
+            prev_delta = delta
+        prev_ts = ts
+
+        if values == VALUES_VARINT:
+            scaled = _round_half_away(value * 10**precision)
+            writer.zigzag(scaled - prev_scaled)
+            prev_scaled = scaled
+            continue
+
+        bits = _float_bits(value)
+        xor = bits ^ prev_bits
+        prev_bits = bits
+        if i == 0:
+            writer.bits(bits, 32)
+        elif xor == 0:
+            writer.bits(0, 1)
+        else:
+            leading = 32 - xor.bit_length()
+            trailing = (xor & -xor).bit_length() - 1
+            if prev_leading is not None and leading >= prev_leading and trailing >= prev_trailing:
+                writer.bits(0x2, 2)
+                writer.bits(xor >> prev_trailing, 32 - prev_leading - prev_trailing)
+            else:
+                length = 32 - leading - trailing
+                writer.bits(0x3, 2)
+                writer.bits(leading, 5)
+                writer.bits(length - 1, 5)
+                writer.bits(xor >> trailing, length)
+                prev_leading, prev_trailing = leading, trailing
+
+    return bytes(writer.data)
+
+
+def decode_series(data, count):
+    """Decode a series, returning a list of (timestamp ms, value)."""
+    reader = BitReader(data)
+    header = reader.bits(8)
+    values = header >> 4
+    precision = header & 0x0F
+    if values not in VALUES_NAMES:
+        raise DecodeError(f"unknown value encoding {values}")
+
+    samples = []
+    ts = delta = scaled = bits = 0
+    leading = trailing = None
+
+    for i in range(count):
+        if i == 0:
+            ts = reader.varint()
+        else:
+            delta += reader.zigzag()
+            ts += delta
+
+        if values == VALUES_VARINT:
+            scaled += reader.zigzag()
+            value = scaled / 10**precision if precision else scaled
+        else:
+            if i == 0:
+                bits = reader.bits(32)
+            elif reader.bits(1):
+                if reader.bits(1):
+                    leading = reader.bits(5)
+                    length = reader.bits(5) + 1
+                    trailing = 32 - leading - length
+                elif leading is None:
+                    raise DecodeError("XOR window reused before being set")
+                bits ^= reader.bits(32 - leading - trailing) << trailing
+            value = _bits_float(bits)
+
+        samples.append((ts, value))
+
+    return samples
+
+
+def decode_batch(payload):
+    """Decode a batch message, returning (uptime ms, {name: samples})."""
+    batch, offset = _decode_cbor_item(payload, 0)
+    if offset != len(payload):
+        raise DecodeError(f"{len(payload) - offset} trailing bytes")
+    if not isinstance(batch, list) or len(batch) != 2 or not isinstance(batch[1], dict):
+        raise DecodeError("not a batch message")
+
+    uptime_ms, series = batch
+    return uptime_ms, {name: decode_series(data, count) for name, (count, data) in series.items()}
+
+
+class Recorder:
+    def __init__(self, prefix, csv_dir):
+        self.prefix = prefix
+        self.csv_dir = csv_dir
+
+    def on_connect(self, client, userdata, flags, rc, *args):
+        LOG.info("Connected to broker (rc=%s)", rc)
+        client.subscribe(self.prefix + "+" + BATCH_TOPIC_SUFFIX)
+
+    def on_message(self, client, userdata, msg):
+        device = msg.topic[len(self.prefix) : -len(BATCH_TOPIC_SUFFIX)]
+        received_ms = time.time() * 1000
+
+        try:
+            uptime_ms, series = decode_batch(msg.payload)
+        except (DecodeError, UnicodeDecodeError, TypeError, ValueError) as e:
+            LOG.warning("%s: failed to decode %s: %s", device, msg.payload.hex(), e)
+            return
+
+        total = sum(len(samples) for samples in series.values())
+        LOG.info("%s: %d bytes, %d samples", device, len(msg.payload), total)
+
+        for name, samples in series.items():
+            for ts, value in samples:
+                # Sample times are device uptime, so place them relative to when the batch arrived
+                wall_ms = received_ms - (uptime_ms - ts)
+                LOG.debug("%s %s %.3f %.7g", device, name, wall_ms / 1000, value)
+
+            if self.csv_dir:
+                path = os.path.join(self.csv_dir, f"{device}_{name}.csv")
+                new = not os.path.exists(path)
+                with open(path, "a", newline="") as f:
+                    writer = csv.writer(f)
+                    if new:
+                        writer.writerow(["time_ms", "value"])
+                    writer.writerows(samples)
+
+
+def subscribe(args):
+    import paho.mqtt.client as mqtt
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+
+    if args.csv:
+        os.makedirs(args.csv, exist_ok=True)
+
+    recorder = Recorder(args.prefix, args.csv)
+    client.on_connect = recorder.on_connect
+    client.on_message = recorder.on_message
+
+    client.connect(args.host, args.port)
+    client.loop_forever()
+
+
+def read_trace(path):
+    samples = []
+    with open(path, newline="") as f:
+        for row in csv.reader(f):
+            try:
+                samples.append((int(float(row[0])), float(row[1])))
+            except (IndexError, ValueError):
+                continue  # header or blank line
+    return samples
+
+
+def json_size(samples, precision):
+    """Size of the samples sent as a JSON array of [time, value] pairs."""
+    pairs = [[ts, round(value, precision) if precision else round(value)] for ts, value in samples]
+    return len(json.dumps(pairs, separators=(",", ":")))
+
+
+def bench(args):
+    print(
+        f"{'trace':<28} {'samples':>7} {'json':>7} {'raw':>7} "
+        f"{'codec':>6} {'bytes':>7} {'b/smp':>6} {'ratio':>6} {'host us/smp':>11}"
+    )
+
+    for path in args.traces:
+        samples = read_trace(path)
+        if not samples:
+            LOG.warning("%s: no samples", path)
+            continue
+
+        # Each series is one window, as published by the device
+        windows = [samples[i : i + args.window] for i in range(0, len(samples), args.window)]
+        json_bytes = sum(json_size(window, args.precision) for window in windows)
+        # 8 byte timestamp and 4 byte float per sample
+        raw_bytes = 12 * len(samples)
+        name = os.path.basename(path)
+
+        for values in (VALUES_VARINT, VALUES_XOR):
+            start = time.perf_counter()
+            encoded = [encode_series(window, values, args.precision) for window in windows]
+            elapsed_us = (time.perf_counter() - start) * 1e6
+
+            for window, data in zip(windows, encoded):
+                decoded = decode_series(data, len(window))
+                tolerance = 0.5 / 10**args.precision if values == VALUES_VARINT else 1e-6
+                for (ts, value), (dts, dvalue) in zip(window, decoded):
+                    close = math.isclose(value, dvalue, abs_tol=tolerance, rel_tol=1e-6)
+                    if ts != dts or not close:
+                        raise SystemExit(f"{path}: round trip mismatch at {ts}")
+
+            size = sum(len(data) for data in encoded)
+            print(
+                f"{name:<28} {len(samples):>7} {json_bytes:>7} {raw_bytes:>7} "
+                f"{VALUES_NAMES[values]:>6} {size:>7} {size / len(samples):>6.2f} "
+                f"{json_bytes / size:>6.1f} {elapsed_us / len(samples):>11.1f}"
+            )
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("-v", "--verbose", action="store_true", help="Log every sample")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    sub = commands.add_parser("subscribe", help="Decode batches published by devices")
+    sub.add_argument("--host", default="localhost", help="MQTT broker host")
+    sub.add_argument("--port", type=int, default=1883, help="MQTT broker port")
+    sub.add_argument("--username", help="MQTT username")
+    sub.add_argument("--password", help="MQTT password")
+    sub.add_argument("--prefix", default="", help="Topic prefix in front of the device ID")
+    sub.add_argument("--csv", metavar="DIR", help="Append the samples to <device>_<sensor>.csv")
+
+    sub = commands.add_parser("bench", help="Compare encodings over recorded traces")
+    sub.add_argument("traces", nargs="+", help="CSV files of time_ms,value")
+    sub.add_argument("--precision", type=int, default=2, help="Decimal places kept by varint")
+    sub.add_argument("--window", type=int, default=60, help="Samples per encoded series")
+
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    if args.command == "subscribe":
+        subscribe(args)
+    else:
+        bench(args)
+
+
+if __name__ == "__main__":
+    main()